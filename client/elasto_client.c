@@ -116,11 +116,15 @@ cli_args_usage(const char *progname,
 "-s publish_settings:	Azure PublishSettings file\n"
 "-K access_key:		Azure storage account access key\n"
 "-k iam_creds:		Amazon IAM credentials file\n"
+"-r region:		Amazon S3 region, signs requests with SigV4\n"
+"-q query_auth:		Azure SAS token or S3 pre-signed query string, "
+"used with -u\n"
 "-d log_level:		Log debug messages (default: 0)\n"
 "-i			Insecure, use HTTP where possible "
 "(default: HTTPS only)\n"
 "-h history:		CLI history file (default: ~/.elasto_history)\n"
 "-u URI:\t		REST Server URI (default: derived from credentials)"
+"\n			e.g. s3://host[:port] for an S3 compatible store"
 "\n\n",
 			progname);
 	}
@@ -219,7 +223,7 @@ err_out:
 }
 
 /**
- * Parse REST URI in the form proto://server
+ * Parse REST URI in the form proto://[server]
  */
 struct cli_uri_mapping {
 	char *uri_long;
@@ -234,51 +238,86 @@ struct cli_uri_mapping {
 
 static int
 cli_uri_parse(const char *uri,
-	      enum elasto_ftype *type)
+	      enum elasto_ftype *type,
+	      char **_server)
 {
 	int i;
+	const char *s = NULL;
+	size_t len;
+	char *server = NULL;
 
-	if (type == NULL) {
+	if ((type == NULL) || (_server == NULL)) {
 		return -EINVAL;
 	}
 
 	for (i = 0; i < ARRAY_SIZE(cli_uri_mapping); i++) {
-		if ((strcmp(uri, cli_uri_mapping[i].uri_long) == 0)
-		 || (strcmp(uri, cli_uri_mapping[i].uri_short) == 0)) {
-			*type = cli_uri_mapping[i].type;
-			return 0;
+		const char *l = cli_uri_mapping[i].uri_long;
+		const char *sh = cli_uri_mapping[i].uri_short;
+
+		if (strncmp(uri, l, strlen(l)) == 0) {
+			s = uri + strlen(l);
+			break;
+		} else if (strncmp(uri, sh, strlen(sh)) == 0) {
+			s = uri + strlen(sh);
+			break;
 		}
 	}
+	if (s == NULL) {
+		dbg(0, "invalid URI string: %s\n", uri);
+		return -EINVAL;
+	}
 
-	dbg(0, "invalid URI string: %s\n", uri);
-	return -EINVAL;
+	/* server portion is optional, trailing '/' ignored */
+	len = strcspn(s, "/");
+	if (s[len + strspn(s + len, "/")] != '\0') {
+		dbg(0, "unexpected path in URI string: %s\n", uri);
+		return -EINVAL;
+	}
+	if (len > 0) {
+		server = strndup(s, len);
+		if (server == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	*type = cli_uri_mapping[i].type;
+	*_server = server;
+	return 0;
 }
 
 static int
 cli_auth_args_validate(enum elasto_ftype type,
 		       char *az_ps_file,
 		       char *az_access_key,
-		       char *s3_creds_file)
+		       char *s3_creds_file,
+		       char *s3_region,
+		       char *s3_endpoint,
+		       char *query_auth)
 {
 	switch (type) {
 	case ELASTO_FILE_ABB:
 	case ELASTO_FILE_APB:
 	case ELASTO_FILE_AFS:
-		if (((az_ps_file == NULL) && (az_access_key == NULL))
-		 || ((az_ps_file != NULL) && (az_access_key != NULL))) {
-			dbg(0, "either a PublishSettings file or an access key "
-			       "is required for Azure access\n");
+		if ((az_ps_file != NULL) + (az_access_key != NULL)
+					+ (query_auth != NULL) != 1) {
+			dbg(0, "either a PublishSettings file, access key or "
+			       "SAS token is required for Azure access\n");
 			return -EINVAL;
 		}
-		if (s3_creds_file != NULL) {
-			dbg(0, "S3 credentials incorrectly provided for "
-			       "Azure access\n");
+		if ((s3_creds_file != NULL) || (s3_region != NULL)) {
+			dbg(0, "S3 credentials or region incorrectly provided "
+			       "for Azure access\n");
+			return -EINVAL;
+		}
+		if (s3_endpoint != NULL) {
+			dbg(0, "URI server is only supported for S3 access\n");
 			return -EINVAL;
 		}
 		break;
 	case ELASTO_FILE_S3:
-		if (s3_creds_file == NULL) {
-			dbg(0, "S3 credentials required for Amazon access\n");
+		if ((s3_creds_file == NULL) == (query_auth == NULL)) {
+			dbg(0, "either S3 credentials or a pre-signed query "
+			       "string is required for Amazon access\n");
 			return -EINVAL;
 		}
 		if ((az_ps_file != NULL) || (az_access_key != NULL)) {
@@ -303,8 +342,12 @@ cli_args_free(struct cli_args *cli_args)
 	 || (cli_args->auth.type == ELASTO_FILE_AFS)) {
 		free(cli_args->auth.az.ps_path);
 		free(cli_args->auth.az.access_key);
+		free(cli_args->auth.az.sas_token);
 	} else if (cli_args->auth.type == ELASTO_FILE_S3) {
 		free(cli_args->auth.s3.creds_path);
+		free(cli_args->auth.s3.region);
+		free(cli_args->auth.s3.presign_query);
+		free(cli_args->auth.s3.endpoint);
 	}
 	free(cli_args->history_file);
 	free(cli_args->cwd);
@@ -325,6 +368,9 @@ cli_args_parse(int argc,
 	char *az_ps_file = NULL;
 	char *az_access_key = NULL;
 	char *s3_creds_file = NULL;
+	char *s3_region = NULL;
+	char *s3_endpoint = NULL;
+	char *query_auth = NULL;
 	char *history_file = NULL;
 	char *uri = NULL;
 	char *progname = strdup(argv[0]);
@@ -343,7 +389,7 @@ cli_args_parse(int argc,
 	/* show help for all backends by default */
 	cli_args->flags = CLI_FL_AZ | CLI_FL_AFS | CLI_FL_S3;
 
-	while ((opt = getopt(argc, argv, "s:K:k:d:?ih:u:")) != -1) {
+	while ((opt = getopt(argc, argv, "s:K:k:r:q:d:?ih:u:")) != -1) {
 		uint32_t debug_level;
 		switch (opt) {
 		case 's':
@@ -367,6 +413,20 @@ cli_args_parse(int argc,
 				goto err_out;
 			}
 			break;
+		case 'r':
+			s3_region = strdup(optarg);
+			if (s3_region == NULL) {
+				ret = -ENOMEM;
+				goto err_out;
+			}
+			break;
+		case 'q':
+			query_auth = strdup(optarg);
+			if (query_auth == NULL) {
+				ret = -ENOMEM;
+				goto err_out;
+			}
+			break;
 		case 'd':
 			debug_level = (uint32_t)strtol(optarg, NULL, 10);
 			dbg_level_set(debug_level);
@@ -400,8 +460,9 @@ cli_args_parse(int argc,
 	}
 
 	if (uri != NULL) {
-		/* parse only provider portion of the URI. TODO parse host */
-		ret = cli_uri_parse(uri, &cli_args->auth.type);
+		ret = cli_uri_parse(uri, &cli_args->auth.type, &s3_endpoint);
+		free(uri);
+		uri = NULL;
 		if (ret < 0) {
 			goto err_out;
 		}
@@ -421,7 +482,8 @@ cli_args_parse(int argc,
 	}
 
 	ret = cli_auth_args_validate(cli_args->auth.type, az_ps_file,
-				     az_access_key, s3_creds_file);
+				     az_access_key, s3_creds_file, s3_region,
+				     s3_endpoint, query_auth);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -430,15 +492,20 @@ cli_args_parse(int argc,
 	 || (cli_args->auth.type == ELASTO_FILE_APB)) {
 		cli_args->auth.az.ps_path = az_ps_file;
 		cli_args->auth.az.access_key = az_access_key;
+		cli_args->auth.az.sas_token = query_auth;
 		/* don't show S3 or AFS usage strings */
 		cli_args->flags &= ~(CLI_FL_S3 | CLI_FL_AFS);
 	} else if (cli_args->auth.type == ELASTO_FILE_AFS) {
 		cli_args->auth.az.ps_path = az_ps_file;
 		cli_args->auth.az.access_key = az_access_key;
+		cli_args->auth.az.sas_token = query_auth;
 		/* don't show S3 or Azure Blob usage strings */
 		cli_args->flags &= ~(CLI_FL_S3 | CLI_FL_AZ);
 	} else if (cli_args->auth.type == ELASTO_FILE_S3) {
 		cli_args->auth.s3.creds_path = s3_creds_file;
+		cli_args->auth.s3.region = s3_region;
+		cli_args->auth.s3.presign_query = query_auth;
+		cli_args->auth.s3.endpoint = s3_endpoint;
 		/* don't show Azure usage strings */
 		cli_args->flags &= ~(CLI_FL_AZ | CLI_FL_AFS);
 	} else {
@@ -475,6 +542,10 @@ err_out:
 	free(az_ps_file);
 	free(az_access_key);
 	free(s3_creds_file);
+	free(s3_region);
+	free(s3_endpoint);
+	free(query_auth);
+	free(uri);
 	free(history_file);
 	free(cwd);
 	free(progname);
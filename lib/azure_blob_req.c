@@ -258,6 +258,9 @@ az_rsp_ctnr_list_free(struct az_rsp_ctnr_list *ctnr_list_rsp)
 	}
 }
 
+static int
+az_rsp_ctnr_list_stream(struct op *op);
+
 int
 az_req_ctnr_list(const struct az_blob_path *path,
 		 struct op **_op)
@@ -297,9 +300,17 @@ az_req_ctnr_list(const struct az_blob_path *path,
 	/* the connection layer must sign this request before sending */
 	op->req_sign = az_req_sign;
 
+	op->rsp_stream = az_rsp_ctnr_list_stream;
+	ret = op->rsp_stream(op);
+	if (ret < 0) {
+		goto err_hdrs_free;
+	}
+
 	*_op = op;
 	return 0;
 
+err_hdrs_free:
+	op_hdrs_free(&op->req.hdrs);
 err_url_free:
 	free(op->url_path);
 	free(op->url_host);
@@ -311,6 +322,25 @@ err_out:
 	return ret;
 }
 
+/*
+ * Stream containers to @ctnr_cb as they're parsed, instead of accumulating
+ * them on the az_rsp_ctnr_list. Must be called before @op is sent.
+ */
+int
+az_req_ctnr_list_cb_set(struct op *op,
+			az_ctnr_list_cb_t ctnr_cb,
+			void *cb_priv)
+{
+	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
+
+	if (op->opcode != AOP_CONTAINER_LIST) {
+		return -EINVAL;
+	}
+	ebo->rsp.ctnr_list.ctnr_cb = ctnr_cb;
+	ebo->rsp.ctnr_list.cb_priv = cb_priv;
+	return 0;
+}
+
 static int
 az_rsp_iter_lease_status_process(struct xml_doc *xdoc,
 				 const char *path,
@@ -325,6 +355,34 @@ az_rsp_iter_lease_status_process(struct xml_doc *xdoc,
 	return az_rsp_lease_status(val, lease_status);
 }
 
+/*
+ * Container element closed, all values are available. Hand it to the caller
+ * instead of keeping it on the list.
+ */
+static int
+az_rsp_ctnr_iter_end(struct xml_doc *xdoc,
+		     const char *path,
+		     const char *val,
+		     void *cb_data)
+{
+	int ret;
+	struct az_rsp_ctnr_list *ctnr_list_rsp =
+					(struct az_rsp_ctnr_list *)cb_data;
+	struct azure_ctnr *ctnr;
+
+	/* containers don't nest, so the one closing is the last added */
+	ctnr = list_tail(&ctnr_list_rsp->ctnrs, struct azure_ctnr, list);
+	assert(ctnr != NULL);
+	list_del(&ctnr->list);
+	ctnr_list_rsp->num_ctnrs--;
+
+	ret = ctnr_list_rsp->ctnr_cb(ctnr, ctnr_list_rsp->cb_priv);
+	free(ctnr->name);
+	free(ctnr);
+
+	return ret;
+}
+
 static int
 az_rsp_ctnr_iter_process(struct xml_doc *xdoc,
 			 const char *path,
@@ -365,6 +423,15 @@ az_rsp_ctnr_iter_process(struct xml_doc *xdoc,
 		goto err_ctnr_free;
 	}
 
+	if (ctnr_list_rsp->ctnr_cb != NULL) {
+		ret = exml_scope_end_cb_want(xdoc, az_rsp_ctnr_iter_end,
+					     ctnr_list_rsp);
+		if (ret < 0) {
+			goto err_ctnr_free;
+		}
+	}
+
+	/* freed via rsp_free if parsing fails before the callback */
 	list_add_tail(&ctnr_list_rsp->ctnrs, &ctnr->list);
 	ctnr_list_rsp->num_ctnrs++;
 
@@ -376,26 +443,30 @@ err_out:
 	return ret;
 }
 
+/*
+ * Containers are processed as the response body arrives, so the list wants
+ * must be in place before the request is sent.
+ */
 static int
-az_rsp_ctnr_list_process(struct op *op,
-			 struct az_rsp_ctnr_list *ctnr_list_rsp)
+az_rsp_ctnr_list_stream(struct op *op)
 {
 	int ret;
 	struct xml_doc *xdoc;
-	struct azure_ctnr *ctnr;
-	struct azure_ctnr *ctnr_n;
+	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
+	struct az_rsp_ctnr_list *ctnr_list_rsp = &ebo->rsp.ctnr_list;
 
 	assert(op->opcode == AOP_CONTAINER_LIST);
-	assert(op->rsp.data->type == ELASTO_DATA_IOV);
 
-	ret = exml_slurp((const char *)op->rsp.data->iov.buf,
-			 op->rsp.data->off, &xdoc);
+	ret = op_rsp_xml_stream(op, &xdoc);
 	if (ret < 0) {
 		goto err_out;
 	}
 
 	list_head_init(&ctnr_list_rsp->ctnrs);
 
+	/*
+	 * Returns up to 5000 records (maxresults default),
+	 */
 	ret = exml_path_cb_want(xdoc,
 				"/EnumerationResults/Containers/Container",
 				false, az_rsp_ctnr_iter_process, ctnr_list_rsp,
@@ -404,25 +475,11 @@ az_rsp_ctnr_list_process(struct op *op,
 		goto err_xdoc_free;
 	}
 
-	/*
-	 * Returns up to 5000 records (maxresults default),
-	 */
-	ret = exml_parse(xdoc);
-	if (ret < 0) {
-		/* need to walk list in case cb fired */
-		goto err_ctnrs_free;
-	}
-
-	exml_free(xdoc);
 	return 0;
 
-err_ctnrs_free:
-	list_for_each_safe(&ctnr_list_rsp->ctnrs, ctnr, ctnr_n, list) {
-		free(ctnr->name);
-		free(ctnr);
-	}
 err_xdoc_free:
 	exml_free(xdoc);
+	op->rsp.xdoc = NULL;
 err_out:
 	return ret;
 }
@@ -870,6 +927,9 @@ az_rsp_blob_list_free(struct az_rsp_blob_list *blob_list_rsp)
 	}
 }
 
+static int
+az_rsp_blob_list_stream(struct op *op);
+
 int
 az_req_blob_list(const struct az_blob_path *path,
 		 struct op **_op)
@@ -909,9 +969,17 @@ az_req_blob_list(const struct az_blob_path *path,
 	/* the connection layer must sign this request before sending */
 	op->req_sign = az_req_sign;
 
+	op->rsp_stream = az_rsp_blob_list_stream;
+	ret = op->rsp_stream(op);
+	if (ret < 0) {
+		goto err_hdrs_free;
+	}
+
 	*_op = op;
 	return 0;
 
+err_hdrs_free:
+	op_hdrs_free(&op->req.hdrs);
 err_url_free:
 	free(op->url_path);
 	free(op->url_host);
@@ -923,6 +991,25 @@ err_out:
 	return ret;
 }
 
+/*
+ * Stream blobs to @blob_cb as they're parsed, instead of accumulating them on
+ * the az_rsp_blob_list. Must be called before @op is sent.
+ */
+int
+az_req_blob_list_cb_set(struct op *op,
+			az_blob_list_cb_t blob_cb,
+			void *cb_priv)
+{
+	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
+
+	if (op->opcode != AOP_BLOB_LIST) {
+		return -EINVAL;
+	}
+	ebo->rsp.blob_list.blob_cb = blob_cb;
+	ebo->rsp.blob_list.cb_priv = cb_priv;
+	return 0;
+}
+
 static int
 az_rsp_blob_iter_type_process(struct xml_doc *xdoc,
 			      const char *path,
@@ -938,6 +1025,34 @@ az_rsp_blob_iter_type_process(struct xml_doc *xdoc,
 	return 0;
 }
 
+/*
+ * Blob element closed, all values are available. Hand it to the caller
+ * instead of keeping it on the list.
+ */
+static int
+az_rsp_blob_iter_end(struct xml_doc *xdoc,
+		     const char *path,
+		     const char *val,
+		     void *cb_data)
+{
+	int ret;
+	struct az_rsp_blob_list *blob_list_rsp
+				= (struct az_rsp_blob_list *)cb_data;
+	struct azure_blob *blob;
+
+	/* blobs don't nest, so the one closing is the last added */
+	blob = list_tail(&blob_list_rsp->blobs, struct azure_blob, list);
+	assert(blob != NULL);
+	list_del(&blob->list);
+	blob_list_rsp->num_blobs--;
+
+	ret = blob_list_rsp->blob_cb(blob, blob_list_rsp->cb_priv);
+	free(blob->name);
+	free(blob);
+
+	return ret;
+}
+
 /*
  * process a single blob list iteration at @iter, return -ENOENT if no such
  * iteration exists
@@ -994,6 +1109,15 @@ az_rsp_blob_iter_process(struct xml_doc *xdoc,
 		goto err_blob_free;
 	}
 
+	if (blob_list_rsp->blob_cb != NULL) {
+		ret = exml_scope_end_cb_want(xdoc, az_rsp_blob_iter_end,
+					     blob_list_rsp);
+		if (ret < 0) {
+			goto err_blob_free;
+		}
+	}
+
+	/* freed via rsp_free if parsing fails before the callback */
 	list_add_tail(&blob_list_rsp->blobs, &blob->list);
 	blob_list_rsp->num_blobs++;
 
@@ -1005,20 +1129,21 @@ err_out:
 	return ret;
 }
 
+/*
+ * Blobs are processed as the response body arrives, so the list wants must
+ * be in place before the request is sent.
+ */
 static int
-az_rsp_blob_list_process(struct op *op,
-			 struct az_rsp_blob_list *blob_list_rsp)
+az_rsp_blob_list_stream(struct op *op)
 {
 	int ret;
 	struct xml_doc *xdoc;
-	struct azure_blob *blob;
-	struct azure_blob *blob_n;
+	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
+	struct az_rsp_blob_list *blob_list_rsp = &ebo->rsp.blob_list;
 
 	assert(op->opcode == AOP_BLOB_LIST);
-	assert(op->rsp.data->type == ELASTO_DATA_IOV);
 
-	ret = exml_slurp((const char *)op->rsp.data->iov.buf,
-			 op->rsp.data->off, &xdoc);
+	ret = op_rsp_xml_stream(op, &xdoc);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -1032,21 +1157,11 @@ az_rsp_blob_list_process(struct op *op,
 		goto err_xdoc_free;
 	}
 
-	ret = exml_parse(xdoc);
-	if (ret < 0) {
-		goto err_blobs_free;
-	}
-
-	exml_free(xdoc);
 	return 0;
 
-err_blobs_free:
-	list_for_each_safe(&blob_list_rsp->blobs, blob, blob_n, list) {
-		free(blob->name);
-		free(blob);
-	}
 err_xdoc_free:
 	exml_free(xdoc);
+	op->rsp.xdoc = NULL;
 err_out:
 	return ret;
 }
@@ -1195,6 +1310,10 @@ az_req_blob_get_hdr_fill(struct az_req_blob_get *blob_get_req,
 		if (ret < 0) {
 			goto err_hdrs_free;
 		}
+		ret = az_req_range_md5_hdr_fill(op, blob_get_req->len);
+		if (ret < 0) {
+			goto err_hdrs_free;
+		}
 	}
 
 	if (strcmp(blob_get_req->type, BLOB_TYPE_PAGE) == 0) {
@@ -1393,6 +1512,7 @@ az_req_page_put(const struct az_blob_path *path,
 		page_put_req->clear_data = false;
 		op->req.data = src_data;
 		/* TODO add a foreign flag so @req.data is not freed with @op */
+		op->req_content_md5 = true;
 	}
 
 	op->method = REQ_METHOD_PUT;
@@ -1493,6 +1613,7 @@ az_req_block_put(const struct az_blob_path *path,
 
 	op->req.data = data;
 	/* TODO add a foreign flag so @req.data is not freed with @op */
+	op->req_content_md5 = true;
 
 	ret = base64_html_encode(blk_id, strlen(blk_id), &b64_blk_id);
 	if (ret < 0) {
@@ -1538,54 +1659,24 @@ err_out:
 	return ret;
 }
 
-#define AZ_REQ_BLK_LIST_PUT_PFX \
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>" \
-		"<BlockList>"
-/*
- * Prior to encoding, the blockid string must be less than or equal to 64 bytes
- * in size.
- */
-#define AZ_REQ_BLK_LIST_PUT_ENT_MAXLEN ((64 * 4 / 3 + 4) \
-					+ (2 * sizeof("</Uncommitted>")))
-#define AZ_REQ_BLK_LIST_PUT_SFX "</BlockList>"
-
 static int
-az_req_block_list_put_body_fill(uint64_t num_blks,
-				struct list_head *blks,
-				struct elasto_data **req_data_out)
+az_req_block_list_put_xml_write(struct list_head *blks,
+				struct xml_writer *xw)
 {
 	int ret;
 	struct azure_block *blk;
-	char *xml_data;
-	uint64_t buf_remain;
-	struct elasto_data *req_data;
-
-	buf_remain = sizeof(AZ_REQ_BLK_LIST_PUT_PFX)
-				+ (num_blks * AZ_REQ_BLK_LIST_PUT_ENT_MAXLEN)
-				+ sizeof(AZ_REQ_BLK_LIST_PUT_SFX);
-	dbg(4, "allocating block list XML buffer len: %" PRIu64 "\n",
-	    buf_remain);
 
-	ret = elasto_data_iov_new(NULL, buf_remain, true, &req_data);
+	ret = exml_decl_write(xw);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto err_out;
+		return ret;
 	}
-
-	xml_data = (char *)req_data->iov.buf;
-	ret = snprintf(xml_data, buf_remain, AZ_REQ_BLK_LIST_PUT_PFX);
-	if ((ret < 0) || (ret >= buf_remain)) {
-		dbg(0, "failed to fill blks-put prefix\n");
-		ret = -E2BIG;
-		goto err_buf_free;
+	ret = exml_el_open(xw, "BlockList");
+	if (ret < 0) {
+		return ret;
 	}
 
-	xml_data += ret;
-	buf_remain -= ret;
-
 	list_for_each(blks, blk, list) {
 		const char *state;
-		char *b64_id;
 
 		switch(blk->state) {
 		case BLOCK_STATE_COMMITED:
@@ -1598,43 +1689,74 @@ az_req_block_list_put_body_fill(uint64_t num_blks,
 			state = "Latest";
 			break;
 		default:
-			ret = -EINVAL;
-			goto err_buf_free;
+			return -EINVAL;
 			break;
 		}
-		ret = base64_encode(blk->id, strlen(blk->id), &b64_id);
+		/*
+		 * Prior to encoding, the blockid string must be less than or
+		 * equal to 64 bytes in size.
+		 */
+		ret = exml_base64_write(xw, state, blk->id, strlen(blk->id));
 		if (ret < 0) {
-			ret = -ENOMEM;
-			goto err_buf_free;
+			return ret;
 		}
-		ret = snprintf(xml_data, buf_remain,
-			       "<%s>%s</%s>", state, b64_id, state);
-		free(b64_id);
-		if ((ret < 0) || (ret >= buf_remain)) {
-			dbg(0, "failed to fill blks-put entry\n");
-			ret = -E2BIG;
-			goto err_buf_free;
-		}
-
-		xml_data += ret;
-		buf_remain -= ret;
 	}
 
-	ret = snprintf(xml_data, buf_remain, AZ_REQ_BLK_LIST_PUT_SFX);
-	if ((ret < 0) || (ret >= buf_remain)) {
-		dbg(0, "failed to fill blks-put suffix\n");
-		ret = -E2BIG;
-		goto err_buf_free;
+	return exml_el_close(xw, "BlockList");
+}
+
+/*
+ * The block list is serialized twice: first to determine the exact body
+ * length, then into a single buffer of that size.
+ */
+static int
+az_req_block_list_put_body_fill(uint64_t num_blks,
+				struct list_head *blks,
+				struct elasto_data **req_data_out)
+{
+	int ret;
+	uint64_t xml_len;
+	struct xml_writer *xw;
+	struct elasto_data *req_data;
+
+	ret = exml_writer_buf_new(NULL, 0, &xw);
+	if (ret < 0) {
+		goto err_out;
 	}
+	ret = az_req_block_list_put_xml_write(blks, xw);
+	if (ret == 0) {
+		ret = exml_writer_finish(xw, &xml_len);
+	}
+	exml_writer_free(xw);
+	if (ret < 0) {
+		dbg(0, "failed to size block list XML\n");
+		goto err_out;
+	}
+	dbg(4, "allocating %" PRIu64 " block list XML buffer len: %" PRIu64
+	    "\n", num_blks, xml_len);
 
-	xml_data += ret;
-	buf_remain -= ret;
+	ret = elasto_data_iov_new(NULL, xml_len, true, &req_data);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
 
-	/* truncate buffer to what was written */
-	req_data->len = req_data->len - buf_remain;
+	ret = exml_writer_buf_new(req_data->iov.buf, xml_len, &xw);
+	if (ret < 0) {
+		goto err_buf_free;
+	}
+	ret = az_req_block_list_put_xml_write(blks, xw);
+	if (ret == 0) {
+		ret = exml_writer_finish(xw, NULL);
+	}
+	exml_writer_free(xw);
+	if (ret < 0) {
+		dbg(0, "failed to fill block list XML\n");
+		goto err_buf_free;
+	}
 
-	dbg(4, "sending put block list req data: %s\n",
-	    (char *)req_data->iov.buf);
+	dbg(4, "sending put block list req data: %.*s\n",
+	    (int)xml_len, (char *)req_data->iov.buf);
 	*req_data_out = req_data;
 
 	return 0;
@@ -1651,6 +1773,7 @@ int
 az_req_block_list_put(const struct az_blob_path *path,
 		      uint64_t num_blks,
 		      struct list_head *blks,
+		      const char *if_match,
 		      struct op **_op)
 {
 	int ret;
@@ -1685,6 +1808,14 @@ az_req_block_list_put(const struct az_blob_path *path,
 		goto err_url_free;
 	}
 
+	if (if_match != NULL) {
+		/* fail with 412 if the blob has since been modified */
+		ret = op_req_hdr_add(op, "If-Match", if_match);
+		if (ret < 0) {
+			goto err_hdrs_free;
+		}
+	}
+
 	ret = az_req_block_list_put_body_fill(num_blks, blks, &op->req.data);
 	if (ret < 0) {
 		goto err_hdrs_free;
@@ -1714,6 +1845,7 @@ az_rsp_block_list_get_free(struct az_rsp_block_list_get *blk_list_get_rsp)
 	struct azure_block *blk;
 	struct azure_block *blk_n;
 
+	free(blk_list_get_rsp->etag);
 	if (blk_list_get_rsp->num_blks == 0) {
 		return;
 	}
@@ -1846,10 +1978,23 @@ az_rsp_block_list_get_process(struct op *op,
 	assert(op->opcode == AOP_BLOCK_LIST_GET);
 	assert(op->rsp.data->type == ELASTO_DATA_IOV);
 
+	/* both are omitted for a blob with only uncommitted blocks */
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "ETag",
+				&blk_list_get_rsp->etag);
+	if ((ret < 0) && (ret != -ENOENT)) {
+		goto err_out;
+	}
+
+	ret = op_hdr_u64_val_lookup(&op->rsp.hdrs, "x-ms-blob-content-length",
+				    &blk_list_get_rsp->blob_len);
+	if ((ret < 0) && (ret != -ENOENT)) {
+		goto err_etag_free;
+	}
+
 	ret = exml_slurp((const char *)op->rsp.data->iov.buf,
 			 op->rsp.data->off, &xdoc);
 	if (ret < 0) {
-		goto err_out;
+		goto err_etag_free;
 	}
 
 	list_head_init(&blk_list_get_rsp->blks);
@@ -1878,6 +2023,9 @@ err_blks_free:
 	}
 err_xdoc_free:
 	exml_free(xdoc);
+err_etag_free:
+	free(blk_list_get_rsp->etag);
+	blk_list_get_rsp->etag = NULL;
 err_out:
 	return ret;
 }
@@ -2053,6 +2201,7 @@ az_rsp_blob_prop_get_free(struct az_rsp_blob_prop_get *blob_prop_get_rsp)
 {
 	free(blob_prop_get_rsp->cp_id);
 	free(blob_prop_get_rsp->content_type);
+	free(blob_prop_get_rsp->etag);
 }
 
 int
@@ -2121,6 +2270,12 @@ az_rsp_blob_prop_get_process(struct op *op,
 		goto err_out;
 	}
 
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "ETag",
+				&blob_prop_get_rsp->etag);
+	if ((ret < 0) && (ret != -ENOENT)) {
+		goto err_out;
+	}
+
 	ret = op_hdr_val_lookup(&op->rsp.hdrs,
 				"x-ms-blob-type",
 				&hdr_val);
@@ -2751,6 +2906,49 @@ err_out:
 	return ret;
 }
 
+static void
+az_rsp_blob_cp_free(struct az_rsp_blob_cp *blob_cp_rsp)
+{
+	free(blob_cp_rsp->cp_id);
+}
+
+static int
+az_rsp_blob_cp_process(struct op *op,
+		       struct az_rsp_blob_cp *blob_cp_rsp)
+{
+	int ret;
+	char *hdr_val;
+
+	assert(op->opcode == AOP_BLOB_CP);
+
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "x-ms-copy-id",
+				&blob_cp_rsp->cp_id);
+	if (ret < 0) {
+		/* mandatory header, error if not present */
+		goto err_out;
+	}
+
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "x-ms-copy-status",
+				&hdr_val);
+	if (ret < 0) {
+		goto err_cid_free;
+	}
+
+	ret = az_rsp_cp_status_map(hdr_val, &blob_cp_rsp->cp_status);
+	free(hdr_val);
+	if (ret < 0) {
+		goto err_cid_free;
+	}
+
+	return 0;
+
+err_cid_free:
+	free(blob_cp_rsp->cp_id);
+	blob_cp_rsp->cp_id = NULL;
+err_out:
+	return ret;
+}
+
 static void
 az_blob_req_free(struct op *op)
 {
@@ -2820,6 +3018,9 @@ az_blob_rsp_free(struct op *op)
 	case AOP_PAGE_RANGES_GET:
 		az_rsp_page_ranges_get_free(&ebo->rsp.page_ranges_get);
 		break;
+	case AOP_BLOB_CP:
+		az_rsp_blob_cp_free(&ebo->rsp.blob_cp);
+		break;
 	case AOP_CONTAINER_CREATE:
 	case AOP_CONTAINER_DEL:
 	case AOP_CONTAINER_PROP_GET:
@@ -2829,7 +3030,6 @@ az_blob_rsp_free(struct op *op)
 	case AOP_BLOCK_PUT:
 	case AOP_BLOCK_LIST_PUT:
 	case AOP_BLOB_DEL:
-	case AOP_BLOB_CP:
 	case AOP_BLOB_PROP_SET:
 		/* nothing to do */
 		break;
@@ -2858,18 +3058,12 @@ az_blob_rsp_process(struct op *op)
 	}
 
 	switch (op->opcode) {
-	case AOP_CONTAINER_LIST:
-		ret = az_rsp_ctnr_list_process(op, &ebo->rsp.ctnr_list);
-		break;
 	case AOP_CONTAINER_PROP_GET:
 		ret = az_rsp_ctnr_prop_get_process(op, &ebo->rsp.ctnr_prop_get);
 		break;
 	case AOP_CONTAINER_LEASE:
 		ret = az_rsp_ctnr_lease_process(op, &ebo->rsp.ctnr_lease);
 		break;
-	case AOP_BLOB_LIST:
-		ret = az_rsp_blob_list_process(op, &ebo->rsp.blob_list);
-		break;
 	case AOP_BLOCK_LIST_GET:
 		ret = az_rsp_block_list_get_process(op,
 						    &ebo->rsp.block_list_get);
@@ -2884,6 +3078,14 @@ az_blob_rsp_process(struct op *op)
 		ret = az_rsp_page_ranges_get_process(op,
 						     &ebo->rsp.page_ranges_get);
 		break;
+	case AOP_BLOB_CP:
+		ret = az_rsp_blob_cp_process(op, &ebo->rsp.blob_cp);
+		break;
+	case AOP_CONTAINER_LIST:
+	case AOP_BLOB_LIST:
+		/* parsed by the conn layer as the response arrived */
+		ret = 0;
+		break;
 	case AOP_CONTAINER_CREATE:
 	case AOP_CONTAINER_DEL:
 	case AOP_BLOB_PUT:
@@ -2892,7 +3094,6 @@ az_blob_rsp_process(struct op *op)
 	case AOP_BLOCK_PUT:
 	case AOP_BLOCK_LIST_PUT:
 	case AOP_BLOB_DEL:
-	case AOP_BLOB_CP:
 	case AOP_BLOB_PROP_SET:
 		/* nothing to do */
 		ret = 0;
@@ -2960,3 +3161,10 @@ az_rsp_page_ranges_get(struct op *op)
 	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
 	return &ebo->rsp.page_ranges_get;
 }
+
+struct az_rsp_blob_cp *
+az_rsp_blob_cp(struct op *op)
+{
+	struct az_blob_ebo *ebo = container_of(op, struct az_blob_ebo, op);
+	return &ebo->rsp.blob_cp;
+}
@@ -62,10 +62,19 @@ struct azure_ctnr {
 	enum az_lease_status lease_status;
 };
 
-/* @ctnrs: struct azure_ctnr list */
+typedef int (*az_ctnr_list_cb_t)(struct azure_ctnr *ctnr,
+				 void *cb_priv);
+
+/*
+ * @ctnrs: struct azure_ctnr list
+ * @ctnr_cb: if set, each container is passed to the callback as it's parsed,
+ *	     rather than being added to @ctnrs.
+ */
 struct az_rsp_ctnr_list {
 	int num_ctnrs;
 	struct list_head ctnrs;
+	az_ctnr_list_cb_t ctnr_cb;
+	void *cb_priv;
 };
 
 struct az_rsp_ctnr_prop_get {
@@ -96,10 +105,19 @@ struct azure_blob {
 	enum az_lease_status lease_status;
 };
 
-/* @blobs: struct azure_blob list */
+typedef int (*az_blob_list_cb_t)(struct azure_blob *blob,
+				 void *cb_priv);
+
+/*
+ * @blobs: struct azure_blob list
+ * @blob_cb: if set, each blob is passed to the callback as it's parsed,
+ *	     rather than being added to @blobs.
+ */
 struct az_rsp_blob_list {
 	int num_blobs;
 	struct list_head blobs;
+	az_blob_list_cb_t blob_cb;
+	void *cb_priv;
 };
 
 /*
@@ -170,14 +188,23 @@ struct azure_block {
 struct az_rsp_block_list_get {
 	int num_blks;
 	struct list_head blks;
+	/* only returned if the blob has committed blocks */
+	char *etag;
+	uint64_t blob_len;
 };
 
 struct az_req_blob_cp {
 	struct az_blob_path src_path;
 };
 
+struct az_rsp_blob_cp {
+	char *cp_id;
+	enum az_cp_status cp_status;
+};
+
 struct az_rsp_blob_prop_get {
 	time_t last_mod;
+	char *etag;
 	bool is_page;
 	uint64_t len;
 	char *content_type;
@@ -262,6 +289,7 @@ struct az_blob_rsp {
 		struct az_rsp_blob_prop_get blob_prop_get;
 		struct az_rsp_blob_lease blob_lease;
 		struct az_rsp_page_ranges_get page_ranges_get;
+		struct az_rsp_blob_cp blob_cp;
 		/*
 		 * No response specific data handled yet:
 		 * struct az_rsp_ctnr_create ctnr_create;
@@ -271,7 +299,6 @@ struct az_blob_rsp {
 		 * struct az_rsp_page_put page_put;
 		 * struct az_rsp_block_put block_put;
 		 * struct az_rsp_blob_del blob_del;
-		 * struct az_rsp_blob_cp blob_cp;
 		 */
 	};
 };
@@ -284,6 +311,11 @@ int
 az_req_ctnr_list(const struct az_blob_path *path,
 		 struct op **_op);
 
+int
+az_req_ctnr_list_cb_set(struct op *op,
+			az_ctnr_list_cb_t ctnr_cb,
+			void *cb_priv);
+
 int
 az_req_ctnr_create(const struct az_blob_path *path,
 		   struct op **_op);
@@ -308,6 +340,11 @@ int
 az_req_blob_list(const struct az_blob_path *path,
 		 struct op **_op);
 
+int
+az_req_blob_list_cb_set(struct op *op,
+			az_blob_list_cb_t blob_cb,
+			void *cb_priv);
+
 int
 az_req_blob_put(const struct az_blob_path *path,
 		struct elasto_data *data,
@@ -339,6 +376,7 @@ int
 az_req_block_list_put(const struct az_blob_path *path,
 		      uint64_t num_blks,
 		      struct list_head *blks,
+		      const char *if_match,
 		      struct op **_op);
 
 int
@@ -401,4 +439,7 @@ az_rsp_blob_lease_get(struct op *op);
 
 struct az_rsp_page_ranges_get *
 az_rsp_page_ranges_get(struct op *op);
+
+struct az_rsp_blob_cp *
+az_rsp_blob_cp(struct op *op);
 #endif /* ifdef _AZURE_BLOB_REQ_H_ */
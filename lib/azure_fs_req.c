@@ -609,6 +609,9 @@ az_fs_rsp_dirs_files_list_free(struct az_fs_rsp_dirs_files_list *dirs_files_list
 	}
 }
 
+static int
+az_fs_rsp_dirs_files_list_stream(struct op *op);
+
 int
 az_fs_req_dirs_files_list(const struct az_fs_path *path,
 			  struct op **_op)
@@ -649,8 +652,16 @@ az_fs_req_dirs_files_list(const struct az_fs_path *path,
 
 	op->req_sign = az_req_sign;
 
+	op->rsp_stream = az_fs_rsp_dirs_files_list_stream;
+	ret = op->rsp_stream(op);
+	if (ret < 0) {
+		goto err_hdrs_free;
+	}
+
 	*_op = op;
 	return 0;
+err_hdrs_free:
+	op_hdrs_free(&op->req.hdrs);
 err_url_free:
 	free(op->url_path);
 	free(op->url_host);
@@ -662,6 +673,52 @@ err_out:
 	return ret;
 }
 
+/*
+ * Stream entries to @ent_cb as they're parsed, instead of accumulating them
+ * on the az_fs_rsp_dirs_files_list. Must be called before @op is sent.
+ */
+int
+az_fs_req_dirs_files_list_cb_set(struct op *op,
+				 az_fs_dirs_files_list_cb_t ent_cb,
+				 void *cb_priv)
+{
+	struct az_fs_ebo *ebo = container_of(op, struct az_fs_ebo, op);
+
+	if (op->opcode != AOP_FS_DIRS_FILES_LIST) {
+		return -EINVAL;
+	}
+	ebo->rsp.dirs_files_list.ent_cb = ent_cb;
+	ebo->rsp.dirs_files_list.cb_priv = cb_priv;
+	return 0;
+}
+
+/*
+ * File or Directory element closed, all values are available. Hand the entry
+ * to the caller instead of keeping it on the list.
+ */
+static int
+az_fs_rsp_ent_iter_end(struct xml_doc *xdoc,
+		       const char *path,
+		       const char *val,
+		       void *cb_data)
+{
+	int ret;
+	struct az_fs_rsp_dirs_files_list *dirs_files_list_rsp
+				= (struct az_fs_rsp_dirs_files_list *)cb_data;
+	struct az_fs_ent *ent;
+
+	/* entries don't nest, so the one closing is the last added */
+	ent = list_tail(&dirs_files_list_rsp->ents, struct az_fs_ent, list);
+	assert(ent != NULL);
+	list_del(&ent->list);
+	dirs_files_list_rsp->num_ents--;
+
+	ret = dirs_files_list_rsp->ent_cb(ent, dirs_files_list_rsp->cb_priv);
+	az_fs_ent_free(&ent);
+
+	return ret;
+}
+
 static int
 az_fs_rsp_ent_file_iter_process(struct xml_doc *xdoc,
 				const char *path,
@@ -701,6 +758,15 @@ az_fs_rsp_ent_file_iter_process(struct xml_doc *xdoc,
 		goto err_ent_free;
 	}
 
+	if (dirs_files_list_rsp->ent_cb != NULL) {
+		ret = exml_scope_end_cb_want(xdoc, az_fs_rsp_ent_iter_end,
+					     dirs_files_list_rsp);
+		if (ret < 0) {
+			goto err_ent_free;
+		}
+	}
+
+	/* freed via rsp_free if parsing fails before the callback */
 	list_add_tail(&dirs_files_list_rsp->ents, &ent->list);
 	dirs_files_list_rsp->num_ents++;
 
@@ -745,6 +811,15 @@ az_fs_rsp_ent_dir_iter_process(struct xml_doc *xdoc,
 		goto err_ent_free;
 	}
 
+	if (dirs_files_list_rsp->ent_cb != NULL) {
+		ret = exml_scope_end_cb_want(xdoc, az_fs_rsp_ent_iter_end,
+					     dirs_files_list_rsp);
+		if (ret < 0) {
+			goto err_ent_free;
+		}
+	}
+
+	/* freed via rsp_free if parsing fails before the callback */
 	list_add_tail(&dirs_files_list_rsp->ents, &ent->list);
 	dirs_files_list_rsp->num_ents++;
 
@@ -756,25 +831,22 @@ err_out:
 	return ret;
 }
 
+/*
+ * Entries are processed as the response body arrives, so the list wants must
+ * be in place before the request is sent.
+ */
 static int
-az_fs_rsp_dirs_files_list_process(struct op *op,
-			struct az_fs_rsp_dirs_files_list *dirs_files_list_rsp)
+az_fs_rsp_dirs_files_list_stream(struct op *op)
 {
 	int ret;
 	struct xml_doc *xdoc;
-	struct az_fs_ent *ent;
-	struct az_fs_ent *ent_n;
+	struct az_fs_ebo *ebo = container_of(op, struct az_fs_ebo, op);
+	struct az_fs_rsp_dirs_files_list *dirs_files_list_rsp
+						= &ebo->rsp.dirs_files_list;
 
 	assert(op->opcode == AOP_FS_DIRS_FILES_LIST);
 
-	if ((op->rsp.data == NULL) || (op->rsp.data->type != ELASTO_DATA_IOV)) {
-		dbg(1, "invalid data buffer in 0x%x response\n", op->opcode);
-		ret = -EIO;
-		goto err_out;
-	}
-
-	ret = exml_slurp((const char *)op->rsp.data->iov.buf,
-			 op->rsp.data->off, &xdoc);
+	ret = op_rsp_xml_stream(op, &xdoc);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -798,21 +870,11 @@ az_fs_rsp_dirs_files_list_process(struct op *op,
 		goto err_xdoc_free;
 	}
 
-	ret = exml_parse(xdoc);
-	if (ret < 0) {
-		/* need to walk list in case cb fired */
-		goto err_ents_free;
-	}
-
-	exml_free(xdoc);
 	return 0;
 
-err_ents_free:
-	list_for_each_safe(&dirs_files_list_rsp->ents, ent, ent_n, list) {
-		az_fs_ent_free(&ent);
-	}
 err_xdoc_free:
 	exml_free(xdoc);
+	op->rsp.xdoc = NULL;
 err_out:
 	return ret;
 }
@@ -1169,6 +1231,10 @@ az_fs_req_file_get_hdr_fill(struct az_fs_req_file_get *file_get_req,
 		if (ret < 0) {
 			goto err_hdrs_free;
 		}
+		ret = az_req_range_md5_hdr_fill(op, file_get_req->len);
+		if (ret < 0) {
+			goto err_hdrs_free;
+		}
 	}
 
 	return 0;
@@ -1344,6 +1410,7 @@ az_fs_req_file_put(const struct az_fs_path *path,
 		file_put_req->clear_data = false;
 		op->req.data = src_data;
 		/* TODO add a foreign flag so @req.data is not freed with @op */
+		op->req_content_md5 = true;
 	}
 
 	op->method = REQ_METHOD_PUT;
@@ -1589,6 +1656,7 @@ az_fs_rsp_file_prop_get_free(struct az_fs_rsp_file_prop_get *file_prop_get_rsp)
 {
 	free(file_prop_get_rsp->content_type);
 	free(file_prop_get_rsp->cp_id);
+	free(file_prop_get_rsp->etag);
 }
 
 static int
@@ -1643,6 +1711,15 @@ az_fs_rsp_file_prop_get_process(struct op *op,
 		file_prop_get_rsp->relevant |= AZ_FS_FILE_PROP_CP_STATUS;
 	}
 
+	ret = op_hdr_val_lookup(&op->rsp.hdrs,
+				"ETag",
+				&file_prop_get_rsp->etag);
+	if ((ret < 0) && (ret != -ENOENT)) {
+		goto err_cid_free;
+	} else if (ret == 0) {
+		file_prop_get_rsp->relevant |= AZ_FS_FILE_PROP_ETAG;
+	}
+
 	return 0;
 
 err_cid_free:
@@ -2094,10 +2171,6 @@ az_fs_rsp_process(struct op *op)
 		ret = az_fs_rsp_share_prop_get_process(op,
 						      &ebo->rsp.share_prop_get);
 		break;
-	case AOP_FS_DIRS_FILES_LIST:
-		ret = az_fs_rsp_dirs_files_list_process(op,
-						&ebo->rsp.dirs_files_list);
-		break;
 	case AOP_FS_DIR_PROP_GET:
 		ret = az_fs_rsp_dir_prop_get_process(op,
 						     &ebo->rsp.dir_prop_get);
@@ -2113,6 +2186,10 @@ az_fs_rsp_process(struct op *op)
 		ret = az_fs_rsp_file_ranges_list_process(op,
 						&ebo->rsp.file_ranges_list);
 		break;
+	case AOP_FS_DIRS_FILES_LIST:
+		/* parsed by the conn layer as the response arrived */
+		ret = 0;
+		break;
 	case AOP_FS_SHARE_CREATE:
 	case AOP_FS_SHARE_DEL:
 	case AOP_FS_DIR_CREATE:
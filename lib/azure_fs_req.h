@@ -66,9 +66,19 @@ struct az_fs_ent {
 	};
 };
 
+typedef int (*az_fs_dirs_files_list_cb_t)(struct az_fs_ent *ent,
+					  void *cb_priv);
+
+/*
+ * @ents: struct az_fs_ent list
+ * @ent_cb: if set, each entry is passed to the callback as it's parsed,
+ *	    rather than being added to @ents.
+ */
 struct az_fs_rsp_dirs_files_list {
 	int num_ents;
 	struct list_head ents;
+	az_fs_dirs_files_list_cb_t ent_cb;
+	void *cb_priv;
 };
 
 struct az_fs_rsp_dir_prop_get {
@@ -110,6 +120,7 @@ enum az_fs_file_prop {
 	AZ_FS_FILE_PROP_CTYPE		= 0x02,
 	AZ_FS_FILE_PROP_CP_ID		= 0x04,
 	AZ_FS_FILE_PROP_CP_STATUS	= 0x08,
+	AZ_FS_FILE_PROP_ETAG		= 0x10,
 };
 
 /* @relevant reflects which values were actually supplied in the response */
@@ -119,6 +130,7 @@ struct az_fs_rsp_file_prop_get {
 	char *content_type;
 	char *cp_id;
 	enum az_cp_status cp_status;
+	char *etag;
 };
 
 /* @relevant reflects which values should be supplied in the request */
@@ -226,6 +238,11 @@ int
 az_fs_req_dirs_files_list(const struct az_fs_path *path,
 			  struct op **_op);
 
+int
+az_fs_req_dirs_files_list_cb_set(struct op *op,
+				 az_fs_dirs_files_list_cb_t ent_cb,
+				 void *cb_priv);
+
 struct az_fs_rsp_dirs_files_list *
 az_fs_rsp_dirs_files_list(struct op *op);
 
@@ -38,21 +38,20 @@
 
 int
 az_req_sign(const char *acc,
-	    const uint8_t *key,
-	    int key_len,
+	    struct sign_key *skey,
 	    struct op *op)
 {
 	int ret;
 	char *sig_str;
 	char *hdr_str;
 
-	if (key == NULL) {
+	if (skey == NULL) {
 		dbg(0, "key missing in sign callback\n");
 		return -EINVAL;
 	}
 
-	ret = sign_gen_shared_azure(acc, key, key_len,
-				  op, &op->sig_src, &sig_str);
+	ret = sign_gen_shared_azure(acc, skey,
+				  op, &sig_str);
 	if (ret < 0) {
 		dbg(0, "Azure signing failed: %s\n",
 		    strerror(-ret));
@@ -132,6 +131,29 @@ err_out:
 	return ret;
 }
 
+/*
+ * Request a Content-MD5 for a ranged GET, which is then checked by the conn
+ * layer as the body arrives. Larger ranges are left unchecked.
+ */
+int
+az_req_range_md5_hdr_fill(struct op *op,
+			  uint64_t range_len)
+{
+	int ret;
+
+	if ((range_len == 0) || (range_len > AZ_RANGE_MD5_MAX)) {
+		return 0;
+	}
+
+	ret = op_req_hdr_add(op, "x-ms-range-get-content-md5", "true");
+	if (ret < 0) {
+		return ret;
+	}
+	op->rsp_content_md5 = true;
+
+	return 0;
+}
+
 static const struct {
 	const char *status_str;
 	enum az_cp_status status;
@@ -16,14 +16,20 @@
 
 int
 az_req_sign(const char *acc,
-	    const uint8_t *key,
-	    int key_len,
+	    struct sign_key *skey,
 	    struct op *op);
 
 int
 az_req_common_hdr_fill(struct op *op,
 		       bool mgmt);
 
+/* services only return a range Content-MD5 for ranges up to 4MB */
+#define AZ_RANGE_MD5_MAX (4 * 1024 * 1024)
+
+int
+az_req_range_md5_hdr_fill(struct op *op,
+			  uint64_t range_len);
+
 /* copy status is common across blob and AFS */
 enum az_cp_status {
 	AOP_CP_STATUS_PENDING,
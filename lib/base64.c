@@ -34,40 +34,411 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "base64.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BASE64_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 static const char base64_chars[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+#define B64_INV 0xff
+
+/* reverse lookup: character -> 6-bit value, or B64_INV */
+static const unsigned char base64_vals[256] = {
+	[0 ... 255] = B64_INV,
+	['A'] = 0, ['B'] = 1, ['C'] = 2, ['D'] = 3, ['E'] = 4, ['F'] = 5,
+	['G'] = 6, ['H'] = 7, ['I'] = 8, ['J'] = 9, ['K'] = 10, ['L'] = 11,
+	['M'] = 12, ['N'] = 13, ['O'] = 14, ['P'] = 15, ['Q'] = 16,
+	['R'] = 17, ['S'] = 18, ['T'] = 19, ['U'] = 20, ['V'] = 21,
+	['W'] = 22, ['X'] = 23, ['Y'] = 24, ['Z'] = 25,
+	['a'] = 26, ['b'] = 27, ['c'] = 28, ['d'] = 29, ['e'] = 30,
+	['f'] = 31, ['g'] = 32, ['h'] = 33, ['i'] = 34, ['j'] = 35,
+	['k'] = 36, ['l'] = 37, ['m'] = 38, ['n'] = 39, ['o'] = 40,
+	['p'] = 41, ['q'] = 42, ['r'] = 43, ['s'] = 44, ['t'] = 45,
+	['u'] = 46, ['v'] = 47, ['w'] = 48, ['x'] = 49, ['y'] = 50,
+	['z'] = 51,
+	['0'] = 52, ['1'] = 53, ['2'] = 54, ['3'] = 55, ['4'] = 56,
+	['5'] = 57, ['6'] = 58, ['7'] = 59, ['8'] = 60, ['9'] = 61,
+	['+'] = 62, ['/'] = 63,
+};
+
+/*
+ * Vectorised block handlers. Each processes as many whole blocks as it can
+ * from the front of the input and returns the number of input bytes
+ * consumed, leaving the tail (and, on decode, anything containing padding or
+ * invalid characters) to the scalar code.
+ */
+struct base64_ops {
+	size_t (*enc_blocks)(const unsigned char *in, size_t len, char *out);
+	size_t (*dec_blocks)(const char *in, size_t len, unsigned char *out);
+};
+
+static size_t
+base64_enc_blocks_none(const unsigned char *in, size_t len, char *out)
+{
+	return 0;
+}
+
+static size_t
+base64_dec_blocks_none(const char *in, size_t len, unsigned char *out)
+{
+	return 0;
+}
+
+#ifdef BASE64_X86_SIMD
+/*
+ * Encode and decode use the pshufb based translation described by Wojciech
+ * Muła and Daniel Lemire in "Faster Base64 Encoding and Decoding using AVX2
+ * Instructions". SSSE3 handles 12 input bytes per iteration, AVX2 handles 24.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_enc_translate_ssse3(__m128i in)
+{
+	const __m128i shuf = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					   7, 6, 8, 7, 10, 9, 11, 10);
+	const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52,
+						'0' - 52, '0' - 52, '0' - 52,
+						'0' - 52, '0' - 52, '0' - 52,
+						'0' - 52, '0' - 52, '0' - 52,
+						'+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i t0;
+	__m128i t1;
+	__m128i idx;
+	__m128i res;
+
+	/* split each 3 byte group into four 6-bit indices */
+	in = _mm_shuffle_epi8(in, shuf);
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t0 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t1 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t1 = _mm_mullo_epi16(t1, _mm_set1_epi32(0x01000010));
+	idx = _mm_or_si128(t0, t1);
+
+	/* map index ranges to the ASCII offset for that range */
+	res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+	res = _mm_or_si128(res,
+		_mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+			      _mm_set1_epi8(13)));
+	res = _mm_shuffle_epi8(shift_lut, res);
+	return _mm_add_epi8(res, idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t
+base64_enc_blocks_ssse3(const unsigned char *in, size_t len, char *out)
+{
+	size_t done = 0;
+
+	/* 16 byte loads for 12 bytes of input */
+	while (len - done >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+		_mm_storeu_si128((__m128i *)out, base64_enc_translate_ssse3(v));
+		out += 16;
+		done += 12;
+	}
+	return done;
+}
+
+/*
+ * Returns the 6-bit values for @in, or sets @invalid non-zero if any of the
+ * sixteen characters fall outside the base64 alphabet (including '=').
+ */
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_dec_translate_ssse3(__m128i in, int *invalid)
+{
+	const __m128i shift_lut = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71,
+						0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_lut = _mm_setr_epi8(0xa8, 0xf8, 0xf8, 0xf8,
+					       0xf8, 0xf8, 0xf8, 0xf8,
+					       0xf8, 0xf8, 0xf0, 0x54,
+					       0x50, 0x50, 0x50, 0x54);
+	const __m128i bitpos_lut = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08,
+						 0x10, 0x20, 0x40, 0x80,
+						 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	__m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), nib);
+	__m128i lo = _mm_and_si128(in, nib);
+	__m128i bits;
+	__m128i is_slash;
+	__m128i shift;
+
+	bits = _mm_and_si128(_mm_shuffle_epi8(mask_lut, lo),
+			     _mm_shuffle_epi8(bitpos_lut, hi));
+	*invalid = _mm_movemask_epi8(_mm_cmpeq_epi8(bits,
+						    _mm_setzero_si128()));
+
+	/* '/' shares a high nibble with '+' but needs a different shift */
+	is_slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	shift = _mm_or_si128(_mm_and_si128(is_slash, _mm_set1_epi8(16)),
+			     _mm_andnot_si128(is_slash,
+					      _mm_shuffle_epi8(shift_lut, hi)));
+	return _mm_add_epi8(in, shift);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+base64_dec_pack_ssse3(__m128i vals)
+{
+	vals = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+	vals = _mm_madd_epi16(vals, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(vals, _mm_setr_epi8(2, 1, 0, 6, 5, 4,
+						    10, 9, 8, 14, 13, 12,
+						    -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static size_t
+base64_dec_blocks_ssse3(const char *in, size_t len, unsigned char *out)
+{
+	size_t done = 0;
+	uint8_t tmp[16];
+
+	while (len - done >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+		int invalid;
+
+		v = base64_dec_translate_ssse3(v, &invalid);
+		if (invalid != 0) {
+			break;
+		}
+		/* output may be exactly sized, so only 12 bytes go out */
+		_mm_storeu_si128((__m128i *)tmp, base64_dec_pack_ssse3(v));
+		memcpy(out, tmp, 12);
+		out += 12;
+		done += 16;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t
+base64_enc_blocks_avx2(const unsigned char *in, size_t len, char *out)
+{
+	const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+					      7, 6, 8, 7, 10, 9, 11, 10,
+					      1, 0, 2, 1, 4, 3, 5, 4,
+					      7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '+' - 62, '/' - 63, 'A', 0, 0,
+						   'a' - 26, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '0' - 52, '0' - 52, '0' - 52,
+						   '+' - 62, '/' - 63, 'A', 0, 0);
+	size_t done = 0;
+
+	/* second lane load spans bytes 12-27 */
+	while (len - done >= 28) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(in + done));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(in + done + 12));
+		__m256i v;
+		__m256i t0;
+		__m256i t1;
+		__m256i idx;
+		__m256i res;
+
+		v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+		t0 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t1 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+		t1 = _mm256_mullo_epi16(t1, _mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t0, t1);
+
+		res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		res = _mm256_or_si256(res,
+			_mm256_and_si256(_mm256_cmpgt_epi8(
+						_mm256_set1_epi8(26), idx),
+					 _mm256_set1_epi8(13)));
+		res = _mm256_shuffle_epi8(shift_lut, res);
+		_mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(res, idx));
+		out += 32;
+		done += 24;
+	}
+	return done;
+}
+
+__attribute__((target("avx2")))
+static size_t
+base64_dec_blocks_avx2(const char *in, size_t len, unsigned char *out)
+{
+	const __m256i shift_lut = _mm256_setr_epi8(0, 0, 19, 4, -65, -65,
+						   -71, -71,
+						   0, 0, 0, 0, 0, 0, 0, 0,
+						   0, 0, 19, 4, -65, -65,
+						   -71, -71,
+						   0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_lut = _mm256_setr_epi8(0xa8, 0xf8, 0xf8, 0xf8,
+						  0xf8, 0xf8, 0xf8, 0xf8,
+						  0xf8, 0xf8, 0xf0, 0x54,
+						  0x50, 0x50, 0x50, 0x54,
+						  0xa8, 0xf8, 0xf8, 0xf8,
+						  0xf8, 0xf8, 0xf8, 0xf8,
+						  0xf8, 0xf8, 0xf0, 0x54,
+						  0x50, 0x50, 0x50, 0x54);
+	const __m256i bitpos_lut = _mm256_setr_epi8(0x01, 0x02, 0x04, 0x08,
+						    0x10, 0x20, 0x40, 0x80,
+						    0, 0, 0, 0, 0, 0, 0, 0,
+						    0x01, 0x02, 0x04, 0x08,
+						    0x10, 0x20, 0x40, 0x80,
+						    0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack_shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4,
+						   10, 9, 8, 14, 13, 12,
+						   -1, -1, -1, -1,
+						   2, 1, 0, 6, 5, 4,
+						   10, 9, 8, 14, 13, 12,
+						   -1, -1, -1, -1);
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	size_t done = 0;
+	uint8_t tmp[32];
+
+	while (len - done >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + done));
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), nib);
+		__m256i lo = _mm256_and_si256(v, nib);
+		__m256i bits;
+		__m256i is_slash;
+		__m256i shift;
+
+		bits = _mm256_and_si256(_mm256_shuffle_epi8(mask_lut, lo),
+					_mm256_shuffle_epi8(bitpos_lut, hi));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits,
+					_mm256_setzero_si256())) != 0) {
+			break;
+		}
+		is_slash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+		shift = _mm256_blendv_epi8(_mm256_shuffle_epi8(shift_lut, hi),
+					   _mm256_set1_epi8(16), is_slash);
+		v = _mm256_add_epi8(v, shift);
+
+		v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+		v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+		v = _mm256_shuffle_epi8(v, pack_shuf);
+		/* gather the 12 bytes from each lane */
+		v = _mm256_permutevar8x32_epi32(v,
+				_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((__m256i *)tmp, v);
+		memcpy(out, tmp, 24);
+		out += 24;
+		done += 32;
+	}
+	return done;
+}
+#endif	/* BASE64_X86_SIMD */
+
+static struct base64_ops base64_ops = {
+	.enc_blocks = base64_enc_blocks_none,
+	.dec_blocks = base64_dec_blocks_none,
+};
+static pthread_once_t base64_ops_once = PTHREAD_ONCE_INIT;
+
 static int
-pos(char c)
+base64_impl_ops_get(enum base64_impl impl,
+		    struct base64_ops *ops)
 {
-    const char *p;
-    for (p = base64_chars; *p; p++)
-	if (*p == c)
-	    return p - base64_chars;
-    return -1;
+	switch (impl) {
+	case BASE64_IMPL_SCALAR:
+		ops->enc_blocks = base64_enc_blocks_none;
+		ops->dec_blocks = base64_dec_blocks_none;
+		return 0;
+#ifdef BASE64_X86_SIMD
+	case BASE64_IMPL_SSSE3:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("ssse3")) {
+			break;
+		}
+		ops->enc_blocks = base64_enc_blocks_ssse3;
+		ops->dec_blocks = base64_dec_blocks_ssse3;
+		return 0;
+	case BASE64_IMPL_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2")) {
+			break;
+		}
+		ops->enc_blocks = base64_enc_blocks_avx2;
+		ops->dec_blocks = base64_dec_blocks_avx2;
+		return 0;
+#endif
+	case BASE64_IMPL_AUTO:
+		if (base64_impl_ops_get(BASE64_IMPL_AVX2, ops) == 0) {
+			return 0;
+		}
+		if (base64_impl_ops_get(BASE64_IMPL_SSSE3, ops) == 0) {
+			return 0;
+		}
+		return base64_impl_ops_get(BASE64_IMPL_SCALAR, ops);
+	default:
+		break;
+	}
+	return -ENOTSUP;
+}
+
+static void
+base64_ops_init(void)
+{
+	base64_impl_ops_get(BASE64_IMPL_AUTO, &base64_ops);
 }
 
+static const struct base64_ops *
+base64_ops_get(void)
+{
+	pthread_once(&base64_ops_once, base64_ops_init);
+	return &base64_ops;
+}
+
+/*
+ * Force a specific implementation, mainly for testing. Not safe to call while
+ * other threads are encoding or decoding.
+ */
+int
+base64_impl_set(enum base64_impl impl)
+{
+	struct base64_ops ops;
+	int ret;
+
+	/* ensure a later first use doesn't clobber the choice */
+	base64_ops_get();
+
+	ret = base64_impl_ops_get(impl, &ops);
+	if (ret < 0) {
+		return ret;
+	}
+	base64_ops = ops;
+	return 0;
+}
+
+/*
+ * Encode into a caller provided buffer, which must have room for at least
+ * BASE64_ENCODE_LEN(size) bytes. The output is not nul terminated.
+ * Returns the number of bytes written.
+ */
 ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
-base64_encode(const void *data, int size, char **str)
+base64_encode_buf(const void *data, int size, char *out)
 {
-    char *s, *p;
+    char *p;
     int i;
     int c;
     const unsigned char *q;
+    size_t done;
 
-    if (size > INT_MAX/4 || size < 0) {
-	*str = NULL;
+    if (size > INT_MAX/4 || size < 0)
 	return -1;
-    }
 
-    p = s = (char *) malloc(size * 4 / 3 + 4);
-    if (p == NULL) {
-        *str = NULL;
-	return -1;
-    }
-    q = (const unsigned char *) data;
+    done = base64_ops_get()->enc_blocks(data, size, out);
+    p = out + (done / 3) * 4;
+    q = (const unsigned char *) data + done;
+    size -= done;
 
     for (i = 0; i < size;) {
 	c = q[i++];
@@ -89,9 +460,29 @@ base64_encode(const void *data, int size, char **str)
 	    p[2] = '=';
 	p += 4;
     }
-    *p = 0;
+    return (int) (p - out);
+}
+
+ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
+base64_encode(const void *data, int size, char **str)
+{
+    char *s;
+    int len;
+
+    if (size > INT_MAX/4 || size < 0) {
+	*str = NULL;
+	return -1;
+    }
+
+    s = (char *) malloc(size * 4 / 3 + 4);
+    if (s == NULL) {
+        *str = NULL;
+	return -1;
+    }
+    len = base64_encode_buf(data, size, s);
+    s[len] = 0;
     *str = s;
-    return (int) strlen(s);
+    return len;
 }
 
 /*
@@ -158,41 +549,39 @@ base64_html_encode(const void *data, int size, char **str)
 	return new_len;
 }
 
-#define DECODE_ERROR 0xffffffff
-
-static unsigned int
-token_decode(const char *token)
-{
-    int i;
-    unsigned int val = 0;
-    int marker = 0;
-    if (strlen(token) < 4)
-	return DECODE_ERROR;
-    for (i = 0; i < 4; i++) {
-	val *= 64;
-	if (token[i] == '=')
-	    marker++;
-	else if (marker > 0)
-	    return DECODE_ERROR;
-	else
-	    val += pos(token[i]);
-    }
-    if (marker > 2)
-	return DECODE_ERROR;
-    return (marker << 24) | val;
-}
-
+/*
+ * Decode whole four character tokens until the first character that can't
+ * start one. Characters outside the alphabet within a token, padding followed
+ * by data, or more than two padding characters are treated as errors.
+ */
 ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
 base64_decode(const char *str, void *data)
 {
-    const char *p;
+    const unsigned char *p;
     unsigned char *q;
+    size_t done;
 
-    q = data;
-    for (p = str; *p && (*p == '=' || strchr(base64_chars, *p)); p += 4) {
-	unsigned int val = token_decode(p);
-	unsigned int marker = (val >> 24) & 0xff;
-	if (val == DECODE_ERROR)
+    done = base64_ops_get()->dec_blocks(str, strlen(str), data);
+    p = (const unsigned char *) str + done;
+    q = (unsigned char *) data + (done / 4) * 3;
+
+    for (; *p && (*p == '=' || base64_vals[*p] != B64_INV); p += 4) {
+	unsigned int val = 0;
+	int marker = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+	    if (p[i] == '\0')
+		return -1;
+	    val <<= 6;
+	    if (p[i] == '=')
+		marker++;
+	    else if (marker > 0 || base64_vals[p[i]] == B64_INV)
+		return -1;
+	    else
+		val |= base64_vals[p[i]];
+	}
+	if (marker > 2)
 	    return -1;
 	*q++ = (val >> 16) & 0xff;
 	if (marker < 2)
@@ -202,4 +591,3 @@ base64_decode(const char *str, void *data)
     }
     return q - (unsigned char *) data;
 }
-
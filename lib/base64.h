@@ -46,6 +46,27 @@
 #endif
 #endif
 
+/* encoded length of @size bytes, excluding any nul terminator */
+#define BASE64_ENCODE_LEN(size) ((((size) + 2) / 3) * 4)
+
+/*
+ * Encode and decode use SSSE3 or AVX2 when the CPU supports them, chosen on
+ * first use. base64_impl_set() overrides the choice, returning -ENOTSUP if
+ * the requested implementation isn't available.
+ */
+enum base64_impl {
+	BASE64_IMPL_AUTO = 0,
+	BASE64_IMPL_SCALAR,
+	BASE64_IMPL_SSSE3,
+	BASE64_IMPL_AVX2,
+};
+
+int
+base64_impl_set(enum base64_impl impl);
+
+ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
+base64_encode_buf(const void *, int, char *);
+
 ROKEN_LIB_FUNCTION int ROKEN_LIB_CALL
 base64_encode(const void *, int, char **);
 
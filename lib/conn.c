@@ -23,9 +23,11 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <openssl/evp.h>
 
 #include <event2/bufferevent_ssl.h>
 #include <event2/bufferevent.h>
@@ -39,11 +41,17 @@
 #include "dbg.h"
 #include "base64.h"
 #include "data.h"
+#include "exml.h"
 #include "op.h"
 #include "sign.h"
 #include "util.h"
 #include "conn.h"
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
 /* convert base64 encoded key to binary and store in @econn */
 int
 elasto_conn_sign_setkey(struct elasto_conn *econn,
@@ -56,6 +64,8 @@ elasto_conn_sign_setkey(struct elasto_conn *econn,
 	assert(econn->type == CONN_TYPE_AZURE);
 
 	if (econn->sign.key_len > 0) {
+		sign_key_free(econn->sign.skey);
+		econn->sign.skey = NULL;
 		free(econn->sign.key);
 		free(econn->sign.account);
 		econn->sign.key_len = 0;
@@ -78,6 +88,12 @@ elasto_conn_sign_setkey(struct elasto_conn *econn,
 		goto err_acc_free;
 	}
 	econn->sign.key_len = ret;
+
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, econn->sign.key,
+			    econn->sign.key_len, &econn->sign.skey);
+	if (ret < 0) {
+		goto err_acc_free;
+	}
 	dbg(1, "set account %s signing key: %s\n", account, key_b64);
 
 	return 0;
@@ -91,6 +107,87 @@ err_out:
 	return ret;
 }
 
+/*
+ * Authenticate requests via Azure SAS or S3 pre-signed query parameters,
+ * which are appended to each request URL. Requests aren't signed when set.
+ */
+int
+elasto_conn_sign_setquery(struct elasto_conn *econn,
+			  const char *query_auth)
+{
+	char *q;
+
+	/* tolerate a leading '?', as given with SAS URLs */
+	if (*query_auth == '?') {
+		query_auth++;
+	}
+	if (*query_auth == '\0') {
+		return -EINVAL;
+	}
+
+	q = strdup(query_auth);
+	if (q == NULL) {
+		return -ENOMEM;
+	}
+	free(econn->sign.query_auth);
+	econn->sign.query_auth = q;
+	dbg(1, "using query string request authentication\n");
+
+	return 0;
+}
+
+/*
+ * S3 pre-signed query parameters are only valid for the single request
+ * method and path that they were generated for. Restrict @econn accordingly,
+ * so that other requests fail locally with -EACCES instead of a 403.
+ */
+int
+elasto_conn_sign_setquery_scope(struct elasto_conn *econn,
+				enum op_req_method method,
+				const char *url_path)
+{
+	char *p;
+
+	if ((econn->sign.query_auth == NULL) || (url_path == NULL)) {
+		return -EINVAL;
+	}
+
+	p = strdup(url_path);
+	if (p == NULL) {
+		return -ENOMEM;
+	}
+	free(econn->sign.query_path);
+	econn->sign.query_path = p;
+	econn->sign.query_method = method;
+	dbg(3, "query string authentication limited to %s %s\n",
+	    op_method_str(method), url_path);
+
+	return 0;
+}
+
+static int
+elasto_conn_sign_query_dup(const struct elasto_conn *econn_orig,
+			   struct elasto_conn *econn)
+{
+	int ret;
+
+	ret = elasto_conn_sign_setquery(econn, econn_orig->sign.query_auth);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (econn_orig->sign.query_path != NULL) {
+		ret = elasto_conn_sign_setquery_scope(econn,
+						econn_orig->sign.query_method,
+						econn_orig->sign.query_path);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * @cb_nbytes is the number of bytes provided by this callback, clen is the
  * number of bytes expected across all callbacks, but may not be known.
@@ -136,6 +233,11 @@ ev_write_alloc_std(struct op *op,
 	int ret;
 	uint64_t rem;
 
+	if (op->rsp.xdoc != NULL) {
+		/* parsed on arrival, nothing to buffer */
+		return 0;
+	}
+
 	dbg(9, "allocating buffer for %" PRIu64 " bytes\n", cb_nbytes);
 	if (op->rsp.data == NULL) {
 		uint64_t sz = (op->rsp.clen_recvd ? op->rsp.clen : cb_nbytes);
@@ -173,6 +275,14 @@ ev_write_alloc_std(struct op *op,
 		}
 		/* FIXME check for space on !op->rsp.clen_recvd */
 		break;
+	case ELASTO_DATA_IOVEC:
+		if (op->rsp.clen_recvd && (op->rsp.clen > op->rsp.data->len)) {
+			dbg(0, "rsp iovec not large enough - len=%" PRIu64
+			       ", received clen=%" PRIu64 "\n",
+			       op->rsp.data->len, op->rsp.clen);
+			return -E2BIG;
+		}
+		break;
 	case ELASTO_DATA_CB:
 		/*
 		 * cb_in_buf allocation is handled in the write handler, as we
@@ -219,6 +329,84 @@ ev_write_err(struct op *op,
 	return 0;
 }
 
+/* response digest is calculated as data arrives, avoiding a second pass */
+static int
+ev_write_md5_update(struct op *op,
+		    const uint8_t *buf,
+		    uint64_t len)
+{
+	int ret;
+
+	if (!op->rsp_content_md5) {
+		return 0;
+	}
+
+	if (op->rsp.md5_ctx == NULL) {
+		op->rsp.md5_ctx = EVP_MD_CTX_new();
+		if (op->rsp.md5_ctx == NULL) {
+			return -ENOMEM;
+		}
+		ret = EVP_DigestInit_ex(op->rsp.md5_ctx, EVP_md5(), NULL);
+		if (ret != 1) {
+			return -EINVAL;
+		}
+	}
+
+	ret = EVP_DigestUpdate(op->rsp.md5_ctx, buf, len);
+	if (ret != 1) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* scatter received data directly into the response iovec segments */
+static int
+ev_write_iovec(struct op *op,
+	       struct evbuffer *ev_in_buf,
+	       uint64_t write_off,
+	       uint64_t num_bytes)
+{
+	int ret;
+	int i;
+	int iovcnt;
+	struct iovec *iovs;
+
+	if (write_off + num_bytes > op->rsp.data->len) {
+		dbg(0, "fatal: write iovec exceeded, "
+		       "len %" PRIu64 " off %" PRIu64 " io_sz %" PRIu64
+		       "\n", op->rsp.data->len, write_off, num_bytes);
+		return -E2BIG;
+	}
+
+	ret = elasto_data_iovec_slice(op->rsp.data, write_off, num_bytes,
+				      &iovs, &iovcnt);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		ret = evbuffer_remove(ev_in_buf, iovs[i].iov_base,
+				      iovs[i].iov_len);
+		/* no tolerance for partial IO */
+		if ((ret < 0) || (ret != iovs[i].iov_len)) {
+			dbg(0, "unable to remove %" PRIu64 " bytes from "
+			       "buffer\n", (uint64_t)iovs[i].iov_len);
+			ret = -EIO;
+			goto err_iovs_free;
+		}
+		ret = ev_write_md5_update(op, iovs[i].iov_base,
+					  iovs[i].iov_len);
+		if (ret < 0) {
+			goto err_iovs_free;
+		}
+	}
+	ret = 0;
+err_iovs_free:
+	free(iovs);
+	return ret;
+}
+
 static int
 ev_write_std(struct op *op,
 	     struct evbuffer *ev_in_buf,
@@ -250,6 +438,18 @@ ev_write_std(struct op *op,
 			    num_bytes);
 			return -EIO;
 		}
+		ret = ev_write_md5_update(op,
+					  op->rsp.data->iov.buf + write_off,
+					  num_bytes);
+		if (ret < 0) {
+			return ret;
+		}
+		break;
+	case ELASTO_DATA_IOVEC:
+		ret = ev_write_iovec(op, ev_in_buf, write_off, num_bytes);
+		if (ret < 0) {
+			return ret;
+		}
 		break;
 	case ELASTO_DATA_CB:
 		if (op->rsp.data->cb.in_cb == NULL) {
@@ -273,6 +473,13 @@ ev_write_std(struct op *op,
 			return -EIO;
 		}
 
+		/* digest before ownership is passed to in_cb */
+		ret = ev_write_md5_update(op, cb_in_buf, num_bytes);
+		if (ret < 0) {
+			free(cb_in_buf);
+			return ret;
+		}
+
 		/* in_cb is responsible for freeing cb_in_buf on success */
 		ret = op->rsp.data->cb.in_cb(write_off, num_bytes, cb_in_buf,
 					     num_bytes, op->rsp.data->cb.priv);
@@ -292,6 +499,67 @@ ev_write_std(struct op *op,
 	return 0;
 }
 
+/*
+ * feed received data straight from the evbuffer into the op's xml parser,
+ * avoiding a copy into a response buffer.
+ */
+static int
+ev_write_xml(struct op *op,
+	     struct evbuffer *ev_in_buf,
+	     uint64_t num_bytes)
+{
+	int ret;
+	int i;
+	int n_vec;
+	struct evbuffer_iovec *vec;
+
+	dbg(9, "parsing %" PRIu64 " bytes xml data\n", num_bytes);
+
+	n_vec = evbuffer_peek(ev_in_buf, num_bytes, NULL, NULL, 0);
+	if (n_vec <= 0) {
+		return -EIO;
+	}
+	vec = malloc(sizeof(*vec) * n_vec);
+	if (vec == NULL) {
+		return -ENOMEM;
+	}
+	n_vec = evbuffer_peek(ev_in_buf, num_bytes, NULL, vec, n_vec);
+
+	/* finder callbacks may now fire, so the op can't be resent */
+	op->rsp.xdoc_fed = true;
+	for (i = 0; i < n_vec; i++) {
+		size_t len = vec[i].iov_len;
+
+		if (len > num_bytes) {
+			/* last extent may extend beyond what was requested */
+			len = num_bytes;
+		}
+		ret = ev_write_md5_update(op, vec[i].iov_base, len);
+		if (ret < 0) {
+			goto err_vec_free;
+		}
+		ret = exml_parse_chunk(op->rsp.xdoc, vec[i].iov_base, len);
+		if (ret < 0) {
+			dbg(0, "failed to parse xml response chunk\n");
+			goto err_vec_free;
+		}
+		num_bytes -= len;
+	}
+	free(vec);
+	assert(num_bytes == 0);
+
+	ret = evbuffer_drain(ev_in_buf, evbuffer_get_length(ev_in_buf));
+	if (ret < 0) {
+		return -EIO;
+	}
+
+	return 0;
+
+err_vec_free:
+	free(vec);
+	return ret;
+}
+
 static void
 conn_op_cancel(struct op *op)
 {
@@ -357,6 +625,8 @@ ev_write_cb(struct evhttp_request *ev_req,
 
 	if (op->rsp.is_error) {
 		ret = ev_write_err(op, ev_in_buf, num_bytes);
+	} else if (op->rsp.xdoc != NULL) {
+		ret = ev_write_xml(op, ev_in_buf, num_bytes);
 	} else {
 		ret = ev_write_std(op, ev_in_buf, num_bytes);
 	}
@@ -482,55 +752,86 @@ ev_err_cb(enum evhttp_request_error ev_req_error,
 	}
 }
 
+/*
+ * Release details for an out_cb buffer referenced by a libevent output buffer.
+ * Self-contained, so the cleanup callback doesn't depend on the request data
+ * struct, which may already be gone by the time libevent drops the chain.
+ */
+struct elasto_conn_out_ref {
+	uint8_t *buf;
+	void (*out_free_cb)(uint8_t *out_buf,
+			    void *priv);
+	void *priv;
+};
+
+/* @extra is the elasto_conn_out_ref allocated for the buffer */
 static void
 elasto_read_evbuffer_cleanup_cb(const void *data,
 				size_t datalen,
 				void *extra)
 {
-	uint8_t *out_buf = extra;
-	dbg(4, "freeing read data %p following cleanup callback\n", out_buf);
-	free(out_buf);
+	struct elasto_conn_out_ref *out_ref = extra;
+
+	dbg(4, "releasing read data %p following cleanup callback\n", data);
+	if (out_ref->out_free_cb != NULL) {
+		out_ref->out_free_cb(out_ref->buf, out_ref->priv);
+	} else {
+		free(out_ref->buf);
+	}
+	free(out_ref);
+}
+
+/* request body bytes, retrieved prior to signing and attached afterwards */
+struct conn_body {
+	uint8_t *buf;
+	uint64_t len;
+	/* out_cb buffer source, released by libevent once sent */
+	struct elasto_data *owner;
+	/* ELASTO_DATA_IOVEC segments, used instead of @buf */
+	struct iovec *iovs;
+	int iovcnt;
+};
+
+static void
+elasto_conn_body_put(struct conn_body *body)
+{
+	if (body->owner != NULL) {
+		elasto_data_cb_out_buf_put(body->owner, body->buf);
+	}
+	free(body->iovs);
+	memset(body, 0, sizeof(*body));
 }
 
 static int
-elasto_conn_send_prepare_read_data(struct evhttp_request *ev_req,
-				   struct elasto_data *req_data,
-				   uint64_t *_content_len)
+elasto_conn_send_prepare_body_get(struct elasto_data *req_data,
+				  struct conn_body *body)
 {
 	int ret;
-	struct evbuffer *ev_out_buf;
 	uint64_t read_off;
 	uint64_t num_bytes;
-	uint64_t content_len = (req_data ? req_data->len : 0);
 
-	if (content_len == 0) {
+	memset(body, 0, sizeof(*body));
+	if ((req_data == NULL) || (req_data->len == 0)) {
 		/* NULL or empty request buffer */
-		goto done;
+		return 0;
 	}
 
 	if ((req_data->type != ELASTO_DATA_IOV)
-	 && (req_data->type != ELASTO_DATA_CB)) {
-		ret = -EINVAL;	/* unsupported */
-		goto err_out;
-	}
-
-	ev_out_buf = evhttp_request_get_output_buffer(ev_req);
-	if (ev_out_buf == NULL) {
-		ret = -ENOENT;
-		goto err_out;
+	 && (req_data->type != ELASTO_DATA_CB)
+	 && (req_data->type != ELASTO_DATA_IOVEC)) {
+		return -EINVAL;	/* unsupported */
 	}
 
 	read_off = req_data->off;
 	num_bytes = req_data->len - req_data->off;
 
 	if (req_data->type == ELASTO_DATA_IOV) {
-		ret = evbuffer_add(ev_out_buf,
-				   (void *)(req_data->iov.buf + read_off),
-				   num_bytes);
+		body->buf = req_data->iov.buf + read_off;
+	} else if (req_data->type == ELASTO_DATA_IOVEC) {
+		ret = elasto_data_iovec_slice(req_data, read_off, num_bytes,
+					      &body->iovs, &body->iovcnt);
 		if (ret < 0) {
-			dbg(0, "failed to add iov output buffer\n");
-			ret = -EFAULT;
-			goto err_out;
+			return ret;
 		}
 	} else if (req_data->type == ELASTO_DATA_CB) {
 		uint8_t *out_buf = NULL;
@@ -547,41 +848,340 @@ elasto_conn_send_prepare_read_data(struct evhttp_request *ev_req,
 		if (ret < 0) {
 			dbg(0, "data out_cb returned an error (%d), ending "
 			       "xfer\n", ret);
-			ret = -EIO;
-			goto err_out;
+			return -EIO;
 		} else if (out_buf == NULL) {
-			ret = -EINVAL;
-			goto err_out;
+			return -EINVAL;
 		} else if (buf_len < num_bytes) {
 			dbg(0, "out_cb didn't provide enough data: needed %"
 			       PRIu64 " got %" PRIu64 "\n", num_bytes, buf_len);
 			/* conn layer now owns buf, so must cleanup */
-			free(out_buf);
-			ret = -EINVAL;
-			goto err_out;
+			elasto_data_cb_out_buf_put(req_data, out_buf);
+			return -EINVAL;
+		}
+		body->buf = out_buf;
+		body->owner = req_data;
+	}
+	body->len = num_bytes;
+	req_data->off += num_bytes;
+
+	return 0;
+}
+
+/*
+ * Reference @iov, within the out_cb buffer of @body. Ownership of the buffer
+ * is passed to libevent on success, and released once @iov has been sent.
+ */
+static int
+elasto_conn_out_ref_add(struct evbuffer *ev_out_buf,
+			struct conn_body *body,
+			const struct iovec *iov)
+{
+	int ret;
+	struct elasto_conn_out_ref *out_ref;
+
+	out_ref = malloc(sizeof(*out_ref));
+	if (out_ref == NULL) {
+		return -ENOMEM;
+	}
+	out_ref->buf = body->buf;
+	out_ref->out_free_cb = body->owner->cb.out_free_cb;
+	out_ref->priv = body->owner->cb.priv;
+
+	/* avoid a memcpy, libevent calls cleanup when sent */
+	ret = evbuffer_add_reference(ev_out_buf, iov->iov_base, iov->iov_len,
+				     elasto_read_evbuffer_cleanup_cb,
+				     out_ref);
+	if (ret < 0) {
+		dbg(0, "failed to add iov output buffer reference\n");
+		free(out_ref);
+		return -EFAULT;
+	}
+	dbg(4, "added out_cb read data %p\n", body->buf);
+	body->owner = NULL;
+
+	return 0;
+}
+
+/* ownership of an out_cb buffer is passed to libevent on success */
+static int
+elasto_conn_send_prepare_body_attach(struct evhttp_request *ev_req,
+				     struct conn_body *body)
+{
+	int ret;
+	struct evbuffer *ev_out_buf;
+	struct iovec iov;
+
+	if (body->len == 0) {
+		return 0;
+	}
+
+	ev_out_buf = evhttp_request_get_output_buffer(ev_req);
+	if (ev_out_buf == NULL) {
+		return -ENOENT;
+	}
+
+	if (body->iovs != NULL) {
+		int i;
+
+		/* segments are foreign, and outlive the request */
+		for (i = 0; i < body->iovcnt; i++) {
+			ret = evbuffer_add_reference(ev_out_buf,
+						     body->iovs[i].iov_base,
+						     body->iovs[i].iov_len,
+						     NULL, NULL);
+			if (ret < 0) {
+				dbg(0, "failed to add iovec output reference\n");
+				return -EFAULT;
+			}
 		}
-		/* avoid a memcpy, libevent calls cleanup when sent */
-		ret = evbuffer_add_reference(ev_out_buf, (const void *)out_buf,
-					     num_bytes,
-					     elasto_read_evbuffer_cleanup_cb,
-					     out_buf);
+		return 0;
+	}
+
+	if (body->owner == NULL) {
+		ret = evbuffer_add(ev_out_buf, (void *)body->buf, body->len);
 		if (ret < 0) {
-			dbg(0, "failed to add iov output buffer reference\n");
-			free(out_buf);
-			ret = -EFAULT;
-			goto err_out;
+			dbg(0, "failed to add iov output buffer\n");
+			return -EFAULT;
 		}
-		dbg(4, "added out_cb read data %p\n", out_buf);
+		return 0;
+	}
+
+	iov.iov_base = body->buf;
+	iov.iov_len = body->len;
+	return elasto_conn_out_ref_add(ev_out_buf, body, &iov);
+}
+
+/* describe @len bytes of @body at @off via @iovs, of @body->iovcnt or 1 */
+static void
+elasto_conn_body_slice(const struct conn_body *body,
+		       uint64_t off,
+		       uint64_t len,
+		       struct iovec *iovs,
+		       int *_n)
+{
+	uint64_t seg_off = 0;
+	int n = 0;
+	int i;
+
+	if (body->iovs == NULL) {
+		iovs[0].iov_base = body->buf + off;
+		iovs[0].iov_len = len;
+		*_n = (len > 0 ? 1 : 0);
+		return;
+	}
+
+	for (i = 0; (i < body->iovcnt) && (len > 0); i++) {
+		uint64_t seg_len = body->iovs[i].iov_len;
+		uint64_t this_off;
+		uint64_t this_len;
+
+		if (seg_off + seg_len <= off) {
+			seg_off += seg_len;
+			continue;
+		}
+		this_off = (off > seg_off ? off - seg_off : 0);
+		this_len = MIN(seg_len - this_off, len);
+		iovs[n].iov_base = (uint8_t *)body->iovs[i].iov_base + this_off;
+		iovs[n].iov_len = this_len;
+		n++;
+		len -= this_len;
+		seg_off += seg_len;
+	}
+	assert(len == 0);
+	*_n = n;
+}
+
+/*
+ * Send the body as framed chunks, each signed by the op's enc_chunk callback
+ * as it's queued. Chunks are added like an unencoded body, so no encoded copy
+ * of the payload is made, and an out_cb buffer is only retrieved once.
+ */
+static int
+elasto_conn_send_prepare_body_enc_attach(struct op *op,
+					 struct evhttp_request *ev_req,
+					 struct conn_body *body)
+{
+	int ret;
+	struct evbuffer *ev_out_buf;
+	struct iovec *iovs;
+	int n;
+	int i;
+	uint64_t off = 0;
+	uint64_t chunk_len;
+	char hdr[OP_ENC_CHUNK_HDR_MAX];
+
+	assert(op->req.enc_chunk_size > 0);
+	ev_out_buf = evhttp_request_get_output_buffer(ev_req);
+	if (ev_out_buf == NULL) {
+		return -ENOENT;
 	}
-	req_data->off += num_bytes;
 
-done:
-	*_content_len = content_len;
+	iovs = malloc(sizeof(*iovs) * (body->iovs ? body->iovcnt : 1));
+	if (iovs == NULL) {
+		return -ENOMEM;
+	}
+
+	do {
+		chunk_len = MIN(op->req.enc_chunk_size, body->len - off);
+		elasto_conn_body_slice(body, off, chunk_len, iovs, &n);
+
+		ret = op->req.enc_chunk(op, iovs, n, chunk_len,
+					hdr, sizeof(hdr));
+		if (ret < 0) {
+			dbg(0, "failed to encode request body chunk\n");
+			goto err_iovs_free;
+		}
+		ret = evbuffer_add(ev_out_buf, hdr, ret);
+		if (ret < 0) {
+			ret = -EFAULT;
+			goto err_iovs_free;
+		}
+
+		for (i = 0; i < n; i++) {
+			if ((body->owner != NULL)
+			 && (off + chunk_len == body->len) && (i == n - 1)) {
+				/* last reference releases the out_cb buffer */
+				ret = elasto_conn_out_ref_add(ev_out_buf, body,
+							      &iovs[i]);
+			} else if ((body->owner == NULL) && (body->iovs == NULL)) {
+				ret = evbuffer_add(ev_out_buf, iovs[i].iov_base,
+						   iovs[i].iov_len);
+			} else {
+				ret = evbuffer_add_reference(ev_out_buf,
+							     iovs[i].iov_base,
+							     iovs[i].iov_len,
+							     NULL, NULL);
+			}
+			if (ret < 0) {
+				dbg(0, "failed to add chunk output buffer\n");
+				ret = -EFAULT;
+				goto err_iovs_free;
+			}
+		}
+
+		ret = evbuffer_add(ev_out_buf, "\r\n", 2);
+		if (ret < 0) {
+			ret = -EFAULT;
+			goto err_iovs_free;
+		}
+		off += chunk_len;
+	} while (chunk_len > 0);
 	ret = 0;
-err_out:
+
+err_iovs_free:
+	free(iovs);
+	return ret;
+}
+
+/*
+ * Content-MD5 is calculated over the body while it's still cache hot from
+ * the out_cb or caller. OpenSSL dispatches to an arch optimised MD5.
+ */
+static int
+elasto_conn_send_prepare_md5(struct op *op,
+			     const struct conn_body *body)
+{
+	int ret;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	char *md_b64;
+
+	if (body->iovs != NULL) {
+		EVP_MD_CTX *md_ctx;
+		int i;
+
+		md_ctx = EVP_MD_CTX_new();
+		if (md_ctx == NULL) {
+			return -ENOMEM;
+		}
+		ret = EVP_DigestInit_ex(md_ctx, EVP_md5(), NULL);
+		for (i = 0; (ret == 1) && (i < body->iovcnt); i++) {
+			ret = EVP_DigestUpdate(md_ctx, body->iovs[i].iov_base,
+					       body->iovs[i].iov_len);
+		}
+		if (ret == 1) {
+			ret = EVP_DigestFinal_ex(md_ctx, md, &md_len);
+		}
+		EVP_MD_CTX_free(md_ctx);
+	} else {
+		ret = EVP_Digest(body->buf, body->len, md, &md_len, EVP_md5(),
+				 NULL);
+	}
+	if (ret != 1) {
+		return -EINVAL;
+	}
+
+	ret = base64_encode(md, md_len, &md_b64);
+	if (ret < 0) {
+		return -ENOMEM;
+	}
+
+	/* may be left over from a previous send */
+	op_req_hdr_del(op, "Content-MD5");
+	ret = op_req_hdr_add(op, "Content-MD5", md_b64);
+	free(md_b64);
+
+	return ret;
+}
+
+/*
+ * Check the MD5 digest of the received body against the response Content-MD5
+ * header, if one was provided.
+ */
+static int
+elasto_conn_rsp_md5_verify(struct op *op)
+{
+	int ret;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	char *md_b64;
+	char *rsp_md5;
+
+	if ((op->rsp.md5_ctx == NULL) || op->rsp.is_error) {
+		return 0;
+	}
+
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "Content-MD5", &rsp_md5);
+	if (ret == -ENOENT) {
+		dbg(3, "no Content-MD5 with response, skipping check\n");
+		return 0;
+	} else if (ret < 0) {
+		return ret;
+	}
+
+	ret = EVP_DigestFinal_ex(op->rsp.md5_ctx, md, &md_len);
+	if (ret != 1) {
+		ret = -EINVAL;
+		goto err_rsp_md5_free;
+	}
+
+	ret = base64_encode(md, md_len, &md_b64);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		goto err_rsp_md5_free;
+	}
+
+	if (strcmp(md_b64, rsp_md5) != 0) {
+		dbg(0, "response Content-MD5 mismatch: got %s, calculated "
+		       "%s\n", rsp_md5, md_b64);
+		ret = -EIO;
+	} else {
+		dbg(4, "response Content-MD5 %s verified\n", md_b64);
+		ret = 0;
+	}
+	free(md_b64);
+err_rsp_md5_free:
+	free(rsp_md5);
 	return ret;
 }
 
+static void
+elasto_conn_rsp_md5_free(struct op *op)
+{
+	EVP_MD_CTX_free(op->rsp.md5_ctx);
+	op->rsp.md5_ctx = NULL;
+}
+
 static void
 ev_done_cb(struct evhttp_request *ev_req,
 	   void *data)
@@ -649,10 +1249,27 @@ elasto_conn_send_prepare(struct elasto_conn *econn,
 	struct evkeyvalq *ev_out_hdrs;
 	uint64_t content_len = 0;
 	char *clen_str;
-
-	ret = asprintf(&url, "http%s://%s%s",
-		       (econn->insecure_http ? "" : "s"),
-		       econn->hostname, op->url_path);
+	struct conn_body body;
+
+	if ((econn->sign.query_path != NULL)
+	 && ((op->method != econn->sign.query_method)
+	  || (strcmp(op->url_path, econn->sign.query_path) != 0))) {
+		dbg(0, "%s %s request not covered by pre-signed query\n",
+		    op_method_str(op->method), op->url_path);
+		return -EACCES;
+	}
+
+	if (econn->sign.query_auth != NULL) {
+		ret = asprintf(&url, "http%s://%s%s%c%s",
+			       (econn->insecure_http ? "" : "s"),
+			       econn->hostname, op->url_path,
+			       (strchr(op->url_path, '?') ? '&' : '?'),
+			       econn->sign.query_auth);
+	} else {
+		ret = asprintf(&url, "http%s://%s%s",
+			       (econn->insecure_http ? "" : "s"),
+			       econn->hostname, op->url_path);
+	}
 	if (ret < 0) {
 		return -ENOMEM;
 	}
@@ -672,24 +1289,15 @@ elasto_conn_send_prepare(struct elasto_conn *econn,
 	evhttp_request_set_error_cb(ev_req, ev_err_cb);
 
 
+	memset(&body, 0, sizeof(body));
 	if (op->method == REQ_METHOD_GET) {
 		ev_req_type = EVHTTP_REQ_GET;
 	} else if (op->method == REQ_METHOD_PUT) {
 		ev_req_type = EVHTTP_REQ_PUT;
-		ret = elasto_conn_send_prepare_read_data(ev_req, op->req.data,
-							 &content_len);
-		if (ret < 0) {
-			dbg(0, "failed to attach read data\n");
-			goto err_ev_req_free;
-		}
+		content_len = (op->req.data ? op->req.data->len : 0);
 	} else if (op->method == REQ_METHOD_POST) {
 		ev_req_type = EVHTTP_REQ_POST;
-		ret = elasto_conn_send_prepare_read_data(ev_req, op->req.data,
-							 &content_len);
-		if (ret < 0) {
-			dbg(0, "failed to attach read data\n");
-			goto err_ev_req_free;
-		}
+		content_len = (op->req.data ? op->req.data->len : 0);
 	} else if (op->method == REQ_METHOD_HEAD) {
 		ev_req_type = EVHTTP_REQ_HEAD;
 		/* No body component with HEAD requests */
@@ -713,14 +1321,56 @@ elasto_conn_send_prepare(struct elasto_conn *econn,
 		goto err_ev_req_free;
 	}
 
-	if (op->req_sign != NULL) {
-		ret = op->req_sign(econn->sign.account, econn->sign.key,
-				   econn->sign.key_len, op);
+	if ((ev_req_type == EVHTTP_REQ_PUT)
+	 || (ev_req_type == EVHTTP_REQ_POST)) {
+		if ((op->req.data != NULL) && op->req.data_sent) {
+			/* retry or redirect, the body was consumed last time */
+			op->req.data->off = op->req.data_off;
+		} else if (op->req.data != NULL) {
+			op->req.data_off = op->req.data->off;
+			op->req.data_sent = true;
+		}
+		ret = elasto_conn_send_prepare_body_get(op->req.data, &body);
 		if (ret < 0) {
+			dbg(0, "failed to get read data\n");
 			goto err_ev_req_free;
 		}
 	}
 
+	/* Content-MD5 needs to be present during signing */
+	if (op->req_content_md5 && (body.len > 0)) {
+		ret = elasto_conn_send_prepare_md5(op, &body);
+		if (ret < 0) {
+			goto err_body_put;
+		}
+	}
+
+	/*
+	 * Signing may replace Content-Length and provide a transfer encoded
+	 * body (S3 aws-chunked), so the body is only attached afterwards.
+	 */
+	if ((op->req_sign != NULL) && (econn->sign.query_auth == NULL)) {
+		ret = op->req_sign(econn->sign.account, econn->sign.skey, op);
+		if (ret < 0) {
+			goto err_body_put;
+		}
+		op->signed_hdr = true;
+	}
+
+	if (op->req.enc_chunk != NULL) {
+		ret = elasto_conn_send_prepare_body_enc_attach(op, ev_req,
+							       &body);
+	} else {
+		ret = elasto_conn_send_prepare_body_attach(ev_req, &body);
+	}
+	if (ret < 0) {
+		dbg(0, "failed to attach read data\n");
+		goto err_body_put;
+	}
+
+	/* response digest state is per send */
+	elasto_conn_rsp_md5_free(op);
+
 	ev_out_hdrs = evhttp_request_get_output_headers(ev_req);
 	if (ev_out_hdrs == NULL) {
 		ret = -ENOENT;
@@ -759,6 +1409,8 @@ elasto_conn_send_prepare(struct elasto_conn *econn,
 
 	return 0;
 
+err_body_put:
+	elasto_conn_body_put(&body);
 err_ev_req_free:
 	evhttp_request_free(ev_req);
 err_url_free:
@@ -836,6 +1488,46 @@ err_out:
 	return ret;
 }
 
+/*
+ * @hostname may carry an explicit port, as used by S3 compatible stores.
+ * @_host is allocated, and @_port left untouched if none is given.
+ */
+static int
+elasto_conn_host_port_split(const char *hostname,
+			    char **_host,
+			    int *_port)
+{
+	const char *p;
+	char *end;
+	long port;
+	char *host;
+
+	p = strrchr(hostname, ':');
+	if (p == NULL) {
+		host = strdup(hostname);
+		if (host == NULL) {
+			return -ENOMEM;
+		}
+		*_host = host;
+		return 0;
+	}
+
+	port = strtol(p + 1, &end, 10);
+	if ((p == hostname) || (*end != '\0') || (port <= 0)
+	 || (port > 65535)) {
+		dbg(0, "invalid host:port string: %s\n", hostname);
+		return -EINVAL;
+	}
+
+	host = strndup(hostname, p - hostname);
+	if (host == NULL) {
+		return -ENOMEM;
+	}
+	*_host = host;
+	*_port = port;
+	return 0;
+}
+
 static int
 elasto_conn_ev_connect(struct elasto_conn *econn)
 {
@@ -845,13 +1537,19 @@ elasto_conn_ev_connect(struct elasto_conn *econn)
 	struct ssl_ctx_st *ssl_ctx;
 	struct ssl_st *ssl;
 	int port;
+	char *host;
 
 	if ((econn->hostname == NULL) || (econn->ev_base == NULL)) {
 	       return -EINVAL;
 	}
 
+	port = (econn->insecure_http ? 80 : 443);
+	ret = elasto_conn_host_port_split(econn->hostname, &host, &port);
+	if (ret < 0) {
+		return ret;
+	}
+
 	if (econn->insecure_http) {
-		port = 80;
 		ev_bev = bufferevent_socket_new(econn->ev_base, -1,
 						BEV_OPT_CLOSE_ON_FREE);
 		if (ev_bev == NULL) {
@@ -860,14 +1558,13 @@ elasto_conn_ev_connect(struct elasto_conn *econn)
 		}
 		dbg(1, "Using HTTP instead of HTTPS\n");
 	} else {
-		port = 443;
 		ret = elasto_conn_ev_ssl_init(econn, &ssl_ctx, &ssl);
 		if (ret < 0) {
 			goto err_out;
 		}
 
 		/* set hostname for Server Name Indication (SNI) */
-		SSL_set_tlsext_host_name(ssl, econn->hostname);
+		SSL_set_tlsext_host_name(ssl, host);
 
 		ev_bev = bufferevent_openssl_socket_new(econn->ev_base,
 						    -1, ssl,
@@ -887,14 +1584,15 @@ elasto_conn_ev_connect(struct elasto_conn *econn)
 	ev_conn = evhttp_connection_base_bufferevent_new(econn->ev_base,
 							 NULL,
 							 ev_bev,
-							 econn->hostname,
+							 host,
 							 port);
 	if (ev_conn == NULL) {
 		dbg(0, "failed to resolve/connect to %s:%d\n",
-		    econn->hostname, port);
+		    host, port);
 		ret = -EBADF;
 		goto err_bev_free;
 	}
+	free(host);
 
 	evhttp_connection_set_closecb(ev_conn, ev_conn_close_cb, econn);
 	/* 30s timeout */
@@ -914,6 +1612,7 @@ err_ssl_free:
 		SSL_CTX_free(ssl_ctx);
 	}
 err_out:
+	free(host);
 	return ret;
 }
 
@@ -951,6 +1650,7 @@ elasto_conn_redirect(struct elasto_conn *econn_orig,
 
 	ret = elasto_conn_init_s3(econn_orig->sign.account,
 				  (const char *)econn_orig->sign.key,
+				  econn_orig->sign.region,
 				  econn_orig->insecure_http, host_redirect,
 				  &econn_redirect);
 	if (ret < 0) {
@@ -959,6 +1659,14 @@ elasto_conn_redirect(struct elasto_conn *econn_orig,
 		goto err_out;
 	}
 
+	if (econn_orig->sign.query_auth != NULL) {
+		ret = elasto_conn_sign_query_dup(econn_orig, econn_redirect);
+		if (ret < 0) {
+			elasto_conn_free(econn_redirect);
+			goto err_out;
+		}
+	}
+
 	dbg(3, "connected to %s for op redirect\n", host_redirect);
 	*_econn_redirect = econn_redirect;
 	ret = 0;
@@ -966,6 +1674,34 @@ err_out:
 	return ret;
 }
 
+/*
+ * libevent holds request body references in the connection's output buffer
+ * until they're written. A response may arrive before the whole body has been
+ * sent, in which case the remainder would otherwise linger beyond the lifetime
+ * of the request's data. Drop it immediately, firing the cleanup callbacks, and
+ * reset the connection, as the HTTP stream is out of sync.
+ */
+static void
+elasto_conn_out_unsent_drop(struct elasto_conn *econn)
+{
+	struct evbuffer *ev_out_buf;
+	size_t len;
+
+	if (econn->ev_bev == NULL) {
+		return;
+	}
+
+	ev_out_buf = bufferevent_get_output(econn->ev_bev);
+	len = evbuffer_get_length(ev_out_buf);
+	if (len == 0) {
+		return;
+	}
+
+	dbg(1, "dropping %zu unsent request bytes and disconnecting\n", len);
+	evbuffer_drain(ev_out_buf, len);
+	elasto_conn_ev_disconnect(econn);
+}
+
 int
 elasto_conn_op_txrx(struct elasto_conn *econn,
 		    struct op *op)
@@ -1027,6 +1763,8 @@ elasto_conn_op_txrx(struct elasto_conn *econn,
 			evhttp_request_free(op->req.ev_http);
 			op->req.ev_http = NULL;
 		}
+		/* request data must not be referenced once we return */
+		elasto_conn_out_unsent_drop(op->econn);
 		op->econn = NULL;
 		free(url);
 
@@ -1036,6 +1774,12 @@ elasto_conn_op_txrx(struct elasto_conn *econn,
 			econn_redirect = NULL;
 		}
 
+		ret = elasto_conn_rsp_md5_verify(op);
+		elasto_conn_rsp_md5_free(op);
+		if (ret < 0) {
+			goto err_out;
+		}
+
 		ret = op_rsp_process(op);
 		if (ret == -EAGAIN) {
 			/* response is a redirect, resend via new conn */
@@ -1070,10 +1814,12 @@ elasto_conn_op_txrx(struct elasto_conn *econn,
 	return 0;
 
 err_preped_free:
+	elasto_conn_rsp_md5_free(op);
 	if (op->req.ev_http != NULL) {
 		evhttp_request_free(op->req.ev_http);
 		op->req.ev_http = NULL;
 	}
+	elasto_conn_out_unsent_drop(op->econn);
 	free(url);
 err_op_unassoc:
 	op->econn = NULL;
@@ -1163,10 +1909,48 @@ err_out:
 	return ret;
 }
 
-/* signing keys are set immediately for S3 */
+/* cleaned up via elasto_conn_free() on failure */
+static int
+elasto_conn_s3_setkey(struct elasto_conn *econn,
+		      const char *id,
+		      const char *secret,
+		      const char *region)
+{
+	econn->sign.key = (uint8_t *)strdup(secret);
+	if (econn->sign.key == NULL) {
+		return -ENOMEM;
+	}
+	econn->sign.key_len = strlen(secret);
+
+	econn->sign.account = strdup(id);
+	if (econn->sign.account == NULL) {
+		return -ENOMEM;
+	}
+
+	if (region != NULL) {
+		econn->sign.region = strdup(region);
+		if (econn->sign.region == NULL) {
+			return -ENOMEM;
+		}
+		return sign_key_init_s3_v4(econn->sign.key,
+					   econn->sign.key_len,
+					   region, "s3", &econn->sign.skey);
+	}
+
+	return sign_key_init(SIGN_KEY_HMAC_SHA1, econn->sign.key,
+			     econn->sign.key_len, &econn->sign.skey);
+}
+
+/*
+ * signing keys are set immediately for S3. Requests are signed with SigV4 if
+ * @region is provided, otherwise with the legacy SigV2 scheme.
+ * @id and @secret may be NULL if elasto_conn_sign_setquery() is to be used
+ * for pre-signed requests.
+ */
 int
 elasto_conn_init_s3(const char *id,
 		    const char *secret,
+		    const char *region,
 		    bool insecure_http,
 		    const char *host,
 		    struct elasto_conn **econn_out)
@@ -1179,17 +1963,12 @@ elasto_conn_init_s3(const char *id,
 		goto err_out;
 	}
 	econn->type = CONN_TYPE_S3;
-	econn->sign.key = (uint8_t *)strdup(secret);
-	if (econn->sign.key == NULL) {
-		ret = -ENOMEM;
-		goto err_conn_free;
-	}
-	econn->sign.key_len = strlen(secret);
 
-	econn->sign.account = strdup(id);
-	if (econn->sign.account == NULL) {
-		ret = -ENOMEM;
-		goto err_conn_free;
+	if (secret != NULL) {
+		ret = elasto_conn_s3_setkey(econn, id, secret, region);
+		if (ret < 0) {
+			goto err_conn_free;
+		}
 	}
 
 	ret = elasto_conn_ev_connect(econn);
@@ -1208,6 +1987,83 @@ err_out:
 	return ret;
 }
 
+/* Azure signing key is stored decoded, so can't go via sign_setkey() */
+static int
+elasto_conn_az_key_dup(const struct elasto_conn *econn_orig,
+		       struct elasto_conn *econn)
+{
+	econn->sign.key = malloc(econn_orig->sign.key_len);
+	if (econn->sign.key == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(econn->sign.key, econn_orig->sign.key,
+	       econn_orig->sign.key_len);
+	econn->sign.key_len = econn_orig->sign.key_len;
+
+	econn->sign.account = strdup(econn_orig->sign.account);
+	if (econn->sign.account == NULL) {
+		return -ENOMEM;
+	}
+
+	return sign_key_init(SIGN_KEY_HMAC_SHA256, econn->sign.key,
+			     econn->sign.key_len, &econn->sign.skey);
+}
+
+/*
+ * Open a new connection to the same host as @econn_orig, carrying the same
+ * credentials. Used to issue requests in parallel, as a connection can only
+ * have one request in flight.
+ */
+int
+elasto_conn_dup(const struct elasto_conn *econn_orig,
+		struct elasto_conn **_econn)
+{
+	int ret;
+	struct elasto_conn *econn;
+
+	if (econn_orig->type == CONN_TYPE_S3) {
+		ret = elasto_conn_init_s3(econn_orig->sign.account,
+					  (const char *)econn_orig->sign.key,
+					  econn_orig->sign.region,
+					  econn_orig->insecure_http,
+					  econn_orig->hostname, &econn);
+		if (ret < 0) {
+			goto err_out;
+		}
+	} else {
+		ret = elasto_conn_init_az(econn_orig->pem_file,
+					  econn_orig->insecure_http,
+					  econn_orig->hostname, &econn);
+		if (ret < 0) {
+			goto err_out;
+		}
+
+		if (econn_orig->sign.key_len > 0) {
+			ret = elasto_conn_az_key_dup(econn_orig, econn);
+			if (ret < 0) {
+				goto err_conn_free;
+			}
+		}
+	}
+
+	if (econn_orig->sign.query_auth != NULL) {
+		ret = elasto_conn_sign_query_dup(econn_orig, econn);
+		if (ret < 0) {
+			goto err_conn_free;
+		}
+	}
+
+	dbg(3, "opened duplicate connection to %s\n", econn->hostname);
+	*_econn = econn;
+
+	return 0;
+
+err_conn_free:
+	elasto_conn_free(econn);
+err_out:
+	return ret;
+}
+
 void
 elasto_conn_free(struct elasto_conn *econn)
 {
@@ -1217,9 +2073,13 @@ elasto_conn_free(struct elasto_conn *econn)
 	elasto_conn_ev_disconnect(econn);
 	event_base_free(econn->ev_base);
 	if (econn->sign.key_len > 0) {
+		sign_key_free(econn->sign.skey);
 		free(econn->sign.key);
 		free(econn->sign.account);
+		free(econn->sign.region);
 	}
+	free(econn->sign.query_auth);
+	free(econn->sign.query_path);
 	free(econn->pem_file);
 	free(econn->hostname);
 	free(econn);
@@ -1273,6 +2133,7 @@ void
 elasto_conn_subsys_deinit(void)
 {
 	sign_deinit();
+	exml_subsys_deinit();
 	EVP_cleanup();
 	ERR_free_strings();
 }
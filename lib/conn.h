@@ -21,6 +21,7 @@ enum elasto_conn_type {
 
 struct ssl_ctx_st;
 struct ssl_st;
+struct sign_key;
 
 struct elasto_conn {
 	enum elasto_conn_type type;
@@ -36,6 +37,12 @@ struct elasto_conn {
 		char *account;
 		uint8_t *key;
 		uint64_t key_len;
+		struct sign_key *skey;	/* precomputed HMAC state for key */
+		char *region;	/* S3 SigV4 only */
+		char *query_auth;	/* SAS / pre-signed, replaces signing */
+		/* if set, @query_auth only covers this method and path */
+		enum op_req_method query_method;
+		char *query_path;
 	} sign;
 };
 
@@ -44,6 +51,15 @@ elasto_conn_sign_setkey(struct elasto_conn *econn,
 		       const char *account,
 		       const char *key_b64);
 
+int
+elasto_conn_sign_setquery(struct elasto_conn *econn,
+			  const char *query_auth);
+
+int
+elasto_conn_sign_setquery_scope(struct elasto_conn *econn,
+				enum op_req_method method,
+				const char *url_path);
+
 int
 elasto_conn_op_txrx(struct elasto_conn *econn,
 		    struct op *op);
@@ -57,10 +73,15 @@ elasto_conn_init_az(const char *pem_file,
 int
 elasto_conn_init_s3(const char *id,
 		    const char *secret,
+		    const char *region,
 		    bool insecure_http,
 		    const char *host,
 		    struct elasto_conn **econn);
 
+int
+elasto_conn_dup(const struct elasto_conn *econn_orig,
+		struct elasto_conn **_econn);
+
 void
 elasto_conn_free(struct elasto_conn *econn);
 
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #include "ccan/list/list.h"
 #include "dbg.h"
@@ -38,6 +39,8 @@ elasto_data_free(struct elasto_data *data)
 		return;
 	if ((data->type == ELASTO_DATA_IOV) && (!data->iov.foreign_buf)) {
 		free(data->iov.buf);
+	} else if (data->type == ELASTO_DATA_IOVEC) {
+		free(data->iovec.iovs);
 	}
 	free(data);
 }
@@ -165,3 +168,238 @@ elasto_data_cb_new(uint64_t out_len,
 
 	return 0;
 }
+
+/* takes ownership of the @iovs array */
+static int
+elasto_data_iovec_new_steal(struct iovec *iovs,
+			    int iovcnt,
+			    struct elasto_data **_data)
+{
+	struct elasto_data *data;
+	uint64_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((iovs[i].iov_len > 0) && (iovs[i].iov_base == NULL)) {
+			return -EINVAL;
+		}
+		len += iovs[i].iov_len;
+	}
+
+	data = malloc(sizeof(*data));
+	if (data == NULL) {
+		return -ENOMEM;
+	}
+	memset(data, 0, sizeof(*data));
+
+	data->type = ELASTO_DATA_IOVEC;
+	data->iovec.iovs = iovs;
+	data->iovec.iovcnt = iovcnt;
+	data->len = len;
+	data->off = 0;
+	*_data = data;
+
+	return 0;
+}
+
+int
+elasto_data_iovec_new(const struct iovec *iovs,
+		      int iovcnt,
+		      struct elasto_data **_data)
+{
+	struct iovec *iovs_copy;
+	int ret;
+
+	if ((iovcnt < 0) || ((iovcnt > 0) && (iovs == NULL))) {
+		return -EINVAL;
+	}
+
+	iovs_copy = malloc(sizeof(*iovs_copy) * (iovcnt ? iovcnt : 1));
+	if (iovs_copy == NULL) {
+		return -ENOMEM;
+	}
+	if (iovcnt > 0) {
+		memcpy(iovs_copy, iovs, sizeof(*iovs_copy) * iovcnt);
+	}
+
+	ret = elasto_data_iovec_new_steal(iovs_copy, iovcnt, _data);
+	if (ret < 0) {
+		free(iovs_copy);
+		return ret;
+	}
+
+	return 0;
+}
+
+int
+elasto_data_iovec_slice(struct elasto_data *data,
+			uint64_t off,
+			uint64_t len,
+			struct iovec **_iovs,
+			int *_iovcnt)
+{
+	struct iovec *iovs;
+	uint64_t seg_off = 0;
+	int first = -1;
+	int n = 0;
+	int i;
+
+	if (data->type != ELASTO_DATA_IOVEC) {
+		dbg(0, "invalid data type %d\n", data->type);
+		return -EINVAL;
+	}
+
+	if ((off > data->len) || (len > data->len - off)) {
+		dbg(0, "slice %" PRIu64 "@%" PRIu64 " exceeds iovec len %"
+		    PRIu64 "\n", len, off, data->len);
+		return -EINVAL;
+	}
+
+	/* count segments overlapping the range */
+	for (i = 0; (i < data->iovec.iovcnt) && (seg_off < off + len); i++) {
+		uint64_t seg_end = seg_off + data->iovec.iovs[i].iov_len;
+
+		if (seg_end > off) {
+			if (first < 0) {
+				first = i;
+			}
+			n++;
+		}
+		seg_off = seg_end;
+	}
+
+	iovs = malloc(sizeof(*iovs) * (n ? n : 1));
+	if (iovs == NULL) {
+		return -ENOMEM;
+	}
+
+	seg_off = 0;
+	for (i = 0; i < first; i++) {
+		seg_off += data->iovec.iovs[i].iov_len;
+	}
+	for (i = 0; i < n; i++) {
+		struct iovec *seg = &data->iovec.iovs[first + i];
+		uint64_t skip = 0;
+		uint64_t seg_len = seg->iov_len;
+
+		if (off > seg_off) {
+			skip = off - seg_off;
+		}
+		seg_len -= skip;
+		if (seg_off + seg->iov_len > off + len) {
+			seg_len -= (seg_off + seg->iov_len) - (off + len);
+		}
+		iovs[i].iov_base = (uint8_t *)seg->iov_base + skip;
+		iovs[i].iov_len = seg_len;
+		seg_off += seg->iov_len;
+	}
+
+	*_iovs = iovs;
+	*_iovcnt = n;
+	return 0;
+}
+
+int
+elasto_data_iovec_slice_new(struct elasto_data *src_data,
+			    uint64_t off,
+			    uint64_t len,
+			    struct elasto_data **_data)
+{
+	struct iovec *iovs;
+	int iovcnt;
+	int ret;
+
+	ret = elasto_data_iovec_slice(src_data, off, len, &iovs, &iovcnt);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = elasto_data_iovec_new_steal(iovs, iovcnt, _data);
+	if (ret < 0) {
+		free(iovs);
+		return ret;
+	}
+
+	return 0;
+}
+
+int
+elasto_data_iovec_copy_out(struct elasto_data *data,
+			   uint64_t off,
+			   uint64_t len,
+			   uint8_t *buf)
+{
+	struct iovec *iovs;
+	int iovcnt;
+	int ret;
+	int i;
+
+	ret = elasto_data_iovec_slice(data, off, len, &iovs, &iovcnt);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf, iovs[i].iov_base, iovs[i].iov_len);
+		buf += iovs[i].iov_len;
+	}
+	free(iovs);
+
+	return 0;
+}
+
+int
+elasto_data_iovec_copy_in(struct elasto_data *data,
+			  uint64_t off,
+			  uint64_t len,
+			  const uint8_t *buf)
+{
+	struct iovec *iovs;
+	int iovcnt;
+	int ret;
+	int i;
+
+	ret = elasto_data_iovec_slice(data, off, len, &iovs, &iovcnt);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(iovs[i].iov_base, buf, iovs[i].iov_len);
+		buf += iovs[i].iov_len;
+	}
+	free(iovs);
+
+	return 0;
+}
+
+int
+elasto_data_cb_out_free_set(struct elasto_data *data,
+			    void (*out_free_cb)(uint8_t *out_buf,
+						void *priv))
+{
+	if (data->type != ELASTO_DATA_CB) {
+		dbg(0, "invalid data type %d\n", data->type);
+		return -EINVAL;
+	}
+
+	data->cb.out_free_cb = out_free_cb;
+	return 0;
+}
+
+void
+elasto_data_cb_out_buf_put(struct elasto_data *data,
+			   uint8_t *out_buf)
+{
+	assert(data->type == ELASTO_DATA_CB);
+
+	if (out_buf == NULL) {
+		return;
+	}
+
+	if (data->cb.out_free_cb != NULL) {
+		data->cb.out_free_cb(out_buf, data->cb.priv);
+	} else {
+		free(out_buf);
+	}
+}
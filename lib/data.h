@@ -18,10 +18,13 @@
 extern "C" {
 #endif
 
+struct iovec;
+
 enum elasto_data_type {
 	ELASTO_DATA_NONE = 0,
 	ELASTO_DATA_IOV,
 	ELASTO_DATA_CB,
+	ELASTO_DATA_IOVEC,
 };
 
 struct elasto_data {
@@ -46,7 +49,18 @@ struct elasto_data {
 				     uint8_t *in_buf,
 				     uint64_t buf_len,
 				     void *priv);
+			/* releases @out_cb buffers, free() is used if NULL */
+			void (*out_free_cb)(uint8_t *out_buf,
+					    void *priv);
 		} cb;
+		struct {
+			/*
+			 * @iovs segments total @len bytes. The array is freed
+			 * with the data struct, segment buffers are foreign.
+			 */
+			struct iovec *iovs;
+			int iovcnt;
+		} iovec;
 	};
 };
 
@@ -77,8 +91,8 @@ elasto_data_iov_grow(struct elasto_data *data,
  *
  * @out_len:	Amount of data to send.
  * @out_cb:	Called when a request needs data to send. Following callback,
- *		@out_buf is owned by the caller, and will be freed after use.
- *		TODO: should add an @out_free callback?
+ *		@out_buf is owned by the caller, and will be freed after use,
+ *		unless an out_free_cb is set via elasto_data_cb_out_free_set().
  * @in_len:	Amount of data to retrieve.
  * @in_cb:	Called when a response has non-error data to write. @stream_off
  *		is the total number of bytes into the response data. @in_buf is
@@ -103,6 +117,110 @@ elasto_data_cb_new(uint64_t out_len,
 		   void *cb_priv,
 		   struct elasto_data **_data);
 
+/**
+ * elasto_data_iovec_new - initialise a scatter-gather data struct
+ *
+ * @iovs:	Array of foreign buffer segments, copied into @_data.
+ * @iovcnt:	Number of entries in @iovs.
+ * @_data:	Data struct allocated and returned on success.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_iovec_new(const struct iovec *iovs,
+		      int iovcnt,
+		      struct elasto_data **_data);
+
+/**
+ * elasto_data_iovec_slice - map a range of a scatter-gather data struct
+ *
+ * @data:	Scatter-gather data struct.
+ * @off:	Offset into the @data stream.
+ * @len:	Length of the range, which must not extend beyond @data->len.
+ * @_iovs:	Allocated array of segments covering the range, to be freed by
+ *		the caller. Segment buffers point into those of @data.
+ * @_iovcnt:	Number of entries in @_iovs.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_iovec_slice(struct elasto_data *data,
+			uint64_t off,
+			uint64_t len,
+			struct iovec **_iovs,
+			int *_iovcnt);
+
+/**
+ * elasto_data_iovec_slice_new - new scatter-gather data struct for a range
+ *
+ * @src_data:	Scatter-gather data struct to take segments from.
+ * @off:	Offset into the @src_data stream.
+ * @len:	Length of the range.
+ * @_data:	Data struct allocated and returned on success. Must not outlive
+ *		the @src_data segment buffers.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_iovec_slice_new(struct elasto_data *src_data,
+			    uint64_t off,
+			    uint64_t len,
+			    struct elasto_data **_data);
+
+/**
+ * elasto_data_iovec_copy_out - gather a range into a contiguous buffer
+ *
+ * @data:	Scatter-gather data struct.
+ * @off:	Offset into the @data stream.
+ * @len:	Number of bytes to copy.
+ * @buf:	Destination buffer of at least @len bytes.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_iovec_copy_out(struct elasto_data *data,
+			   uint64_t off,
+			   uint64_t len,
+			   uint8_t *buf);
+
+/**
+ * elasto_data_iovec_copy_in - scatter a contiguous buffer into a range
+ *
+ * @data:	Scatter-gather data struct.
+ * @off:	Offset into the @data stream.
+ * @len:	Number of bytes to copy.
+ * @buf:	Source buffer of at least @len bytes.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_iovec_copy_in(struct elasto_data *data,
+			  uint64_t off,
+			  uint64_t len,
+			  const uint8_t *buf);
+
+/**
+ * elasto_data_cb_out_free_set - set a release callback for out_cb buffers
+ *
+ * @data:	Callback data struct.
+ * @out_free_cb: Called with the @out_buf and @cb_priv once the consumer is
+ *		done with a buffer provided by @out_cb, in place of free().
+ *		This allows @out_cb to lend buffers that it continues to own,
+ *		in which case @out_free_cb may do nothing. Buffers can be held
+ *		until the request carrying them is complete, so @cb_priv must
+ *		remain valid until @data is freed.
+ * @return:	0 on success, -errno on failure.
+ */
+int
+elasto_data_cb_out_free_set(struct elasto_data *data,
+			    void (*out_free_cb)(uint8_t *out_buf,
+						void *priv));
+
+/**
+ * elasto_data_cb_out_buf_put - release a buffer obtained from @data's out_cb
+ *
+ * @data:	Callback data struct which provided @out_buf.
+ * @out_buf:	Buffer to release. May be NULL.
+ */
+void
+elasto_data_cb_out_buf_put(struct elasto_data *data,
+			   uint8_t *out_buf);
+
 #ifdef  __cplusplus
 }
 #endif
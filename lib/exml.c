@@ -17,9 +17,10 @@
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
-#include <search.h>
 #include <inttypes.h>
 #include <time.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <expat.h>
 
@@ -40,12 +41,40 @@ enum xml_val_type {
 	XML_VAL_PATH_CB,
 };
 
+/* compiled xpath component, @name is NULL for a wildcard */
+struct xml_xpath_comp {
+	char *name;
+	int index;	/* -1 if any leaf index matches */
+};
+
+/*
+ * xpath expressions are compiled once, and cached for reuse across all
+ * subsequent documents. Relative paths are matched against the element in
+ * scope when the finder was added.
+ */
+struct xml_xpath {
+	struct xml_xpath *hnext;
+	char *expr;
+	bool relative;
+	int num_comps;
+	struct xml_xpath_comp *comps;
+	char *attr;
+	uint32_t hash;	/* last component name hash, for finder dispatch */
+};
+
 struct xml_finder {
 	struct list_node list;
-	char *search_path;
-	char *found_el_path;
-	bool path_wildcard;
-	char *search_attr;
+	const struct xml_xpath *xp;
+	bool xp_owned;	/* not cached, freed with finder */
+	int scope_depth;
+	uint64_t scope_serial;
+	/* next relative finder added under the same scope element */
+	struct xml_finder *scope_next;
+	int match_depth;
+	bool matched;
+	/* element awaiting value, if found */
+	int found_depth;
+	uint64_t found_serial;
 	bool required;
 	enum xml_val_type type;
 	uint32_t handled;
@@ -65,15 +94,57 @@ struct xml_finder {
 	bool *_present;
 };
 
-struct xml_el {
-	char *path;
-	int leaf_index;
-	int max_leaf_index;
+/*
+ * Transient per-document allocations are carved out of arena chunks, and
+ * released in LIFO order as elements are closed.
+ */
+#define EXML_ARENA_CHUNK_SIZE 4096
+struct xml_arena_chunk {
+	struct xml_arena_chunk *prev;
+	size_t size;
+	size_t used;
+	char buf[];
+};
+
+struct xml_arena_mark {
+	struct xml_arena_chunk *chunk;
+	size_t used;
+};
+
+/* sibling counter, for assignment of element leaf indices */
+struct xml_el_sibling {
+	struct xml_el_sibling *next;
+	uint32_t hash;
+	int count;
+	char name[];
+};
+
+/* callback on close of an open element, see exml_scope_end_cb_want() */
+struct xml_el_end_cb {
+	struct xml_el_end_cb *next;
+	exml_want_cb_t fn;
+	void *data;
+};
+
+/* open element state, indexed by depth */
+struct xml_el_frame {
+	uint64_t serial;	/* unique for each element in the document */
+	size_t path_len;	/* el_path length prior to this element */
+	struct xml_arena_mark mark;
+	struct xml_el_sibling *children;
+	struct xml_finder *scoped;	/* relative finders for this element */
+	struct xml_el_end_cb *end_cbs;
 };
 
+#define EXML_FINDER_TBL_SIZE 64
+#define EXML_WILDCARD_HASH 0
+
 /*
  * finders have the following state during parsing:
- * not found: path not encountered, on the finders list.
+ * not found: path not encountered, in the finder_tbl bucket for the depth and
+ *	      name of the element that it matches.
+ * expired: relative path scope element closed without path being
+ *	    encountered, on the finders_expired list.
  * found await val: path encountered, awaiting value callback on
  *		    finders_val_wait list.
  * found: path encountered, value callback handled if needed. On the
@@ -84,176 +155,119 @@ struct xml_doc {
 	const char *buf;
 	uint64_t buf_len;
 	int num_finders;
-	struct list_head finders;
+	int num_wildcard_finders;
+	struct list_head finder_tbl[EXML_FINDER_TBL_SIZE];
+	struct list_head finders_expired;
 	struct list_head finders_val_wait;
 	struct list_head founders;
 	bool parsing;
+	/* path of the current element, with leaf indices, e.g. /a[0]/b[2]/ */
 	char *el_path;
+	size_t el_path_len;
+	size_t el_path_alloced;
 	int parse_ret;
-	void *root_el;
+	/* depth of el_path, root "/" at zero */
+	int depth;
+	struct xml_el_frame *frames;
+	int frames_alloced;
+	uint64_t next_serial;
+	struct xml_arena_chunk *arena;
+	struct xml_arena_chunk *arena_spare;
+	/* character data may be split across multiple data callbacks */
+	char *val_buf;
+	size_t val_len;
+	size_t val_alloced;
 };
 
 static void
-exml_el_free(void *_el)
-{
-	struct xml_el *el = (struct xml_el *)_el;
-
-	free(el->path);
-	free(el);
-}
+exml_el_start_cb(void *priv_data,
+		const char *elem,
+		const char **atts);
 
 static void
-exml_el_print(const void *_el, const VISIT which, const int depth)
-{
-	struct xml_el *el = *(struct xml_el **)_el;
-
-	switch (which) {
-	case preorder:
-		break;
-	case postorder:
-		dbg(6, "branch depth: %d: %s\n", depth, el->path);
-		break;
-	case endorder:
-		break;
-	case leaf:
-		dbg(6, "leaf depth: %d: %s\n", depth, el->path);
-		break;
-	}
-}
+exml_el_end_cb(void *priv_data,
+	      const char *elem);
 
 /*
- * Compare two tree elements.
- http://en.wikipedia.org/wiki/Binary_tree#Encoding_general_trees_as_binary_trees
+ * Compiled xpaths are shared by all documents, so can't be freed while any
+ * document is live. @num_docs tracks them for exml_subsys_deinit().
  */
-static int
-exml_el_cmp(const void *a, const void *b)
-{
-	int ret;
-	struct xml_el *el_a = (struct xml_el *)a;
-	struct xml_el *el_b = (struct xml_el *)b;
-	char *path_a;
-	char *path_b;
-	char *ta;
-	char *tb;
-	char *sa;
-	char *sb;
-
-	dbg(4, "comparing \"%s with \"%s\"\n", el_a->path, el_b->path);
-	path_a = strdup(el_a->path);
-	assert(path_a != NULL);
-	path_b = strdup(el_b->path);
-	assert(path_b != NULL);
-
-	/* find path divergence */
-	for (ta = strtok_r(path_a, "/", &sa), tb = strtok_r(path_b, "/", &sb);
-	     ((ta != NULL) && (tb != NULL)) && (strcmp(ta, tb) == 0);
-	     ta = strtok_r(NULL, "/", &sa), tb = strtok_r(NULL, "/", &sb)) {
-		dbg(6, "match with component %s\n", ta);
-	}
-
-	if ((ta == NULL) && (tb == NULL)) {
-		dbg(4, "\"%s\" and \"%s\" are identical\n",
-		    el_a->path, el_b->path);
-		ret = 0;
-		goto out;
-	} else if ((ta == NULL) && (tb != NULL)) {
-		dbg(4, "\"%s\" is a parent of \"%s\"\n",
-		    el_a->path, el_b->path);
-		ret = 1;
-		goto out;
-	} else if ((tb == NULL) && (ta != NULL)) {
-		dbg(4, "\"%s\" is nested under \"%s\"\n",
-		    el_a->path, el_b->path);
-		ret = -1;
-		goto out;
-	}
-
-	dbg(4, "paths diverge at %s and %s\n", ta, tb);
-	ret = strcmp(ta, tb);
-out:
-	free(path_a);
-	free(path_b);
-	return ret;
-}
+#define EXML_XPATH_CACHE_SIZE 128
+#define EXML_XPATH_CACHE_MAX 1024
+static struct {
+	pthread_mutex_t lock;
+	int num_xps;
+	int num_docs;
+	struct xml_xpath *tbl[EXML_XPATH_CACHE_SIZE];
+} exml_xpath_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-/*
- * Add a new element to the xdoc tree, and assign a leaf index based on how
- * many existing elements are found under the same path.
- */
 static int
-exml_el_encounter(struct xml_doc *xdoc,
-		  const char *path,
-		  char **path_with_leaf_index)
+exml_doc_new(const char *buf,
+	     uint64_t buf_len,
+	     struct xml_doc **xdoc_out)
 {
 	int ret;
-	struct xml_el *el;
-	struct xml_el *el_new;
-	void *_el_new;
-	char *term;
-	size_t index_buflen;
-
-	el = malloc(sizeof(*el));
-	if (el == NULL) {
+	int i;
+	struct xml_doc *xdoc;
+
+	xdoc = malloc(sizeof(*xdoc));
+	if (xdoc == NULL) {
 		ret = -ENOMEM;
 		goto err_out;
 	}
-	memset(el, 0, sizeof(*el));
-
-	/* need to accommodate for the added leaf index suffix */
-	index_buflen = sizeof("[99999]");
-	el->path = malloc(strlen(path) + index_buflen);
-	if (el->path == NULL) {
-		ret = -ENOMEM;
-		goto err_el_free;
+	memset(xdoc, 0, sizeof(*xdoc));
+	for (i = 0; i < EXML_FINDER_TBL_SIZE; i++) {
+		list_head_init(&xdoc->finder_tbl[i]);
 	}
-	strcpy(el->path, path);
-	assert(strlen(el->path) >= 1);
-	term = el->path + strlen(el->path) - 1;
-	assert(*term == '/');
+	list_head_init(&xdoc->finders_expired);
+	list_head_init(&xdoc->finders_val_wait);
+	list_head_init(&xdoc->founders);
 
-	/* no leaf index suffix for the root node */
-	if (strlen(el->path) != 1) {
-		/* search for first leaf index, may find existing */
-		strcpy(term, "[0]/");
+	xdoc->frames_alloced = 16;
+	xdoc->frames = malloc(sizeof(*xdoc->frames) * xdoc->frames_alloced);
+	if (xdoc->frames == NULL) {
+		ret = -ENOMEM;
+		goto err_doc_free;
 	}
+	/* root element "/" at depth zero */
+	memset(&xdoc->frames[0], 0, sizeof(xdoc->frames[0]));
+	xdoc->frames[0].serial = xdoc->next_serial++;
 
-	_el_new = tsearch((void *)el, &xdoc->root_el, exml_el_cmp);
-	if (_el_new == NULL) {
-		dbg(0, "failed to add new tree element\n");
-		ret = -EFAULT;
-		goto err_path_free;
-	}
-	el_new = *(struct xml_el **)_el_new;
-	if (el_new != el) {
-		/* existing elements return the first index */
-		assert(el_new->leaf_index == 0);
-		el->leaf_index = ++el_new->max_leaf_index;
-		dbg(4, "collision at [0], new index suffix [%d]\n",
-		    el->leaf_index);
-		ret = snprintf(term, index_buflen, "[%d]/", el->leaf_index);
-		if ((ret < 0) || (ret >= index_buflen)) {
-			dbg(0, "failed to append index suffix\n");
-			ret = -EINVAL;
-			goto err_path_free;
-		}
-		_el_new = tsearch((void *)el, &xdoc->root_el, exml_el_cmp);
-		el_new = *(struct xml_el **)_el_new;
-		assert(el_new == el);
+	xdoc->el_path_alloced = 256;
+	xdoc->el_path = malloc(xdoc->el_path_alloced);
+	if (xdoc->el_path == NULL) {
+		ret = -ENOMEM;
+		goto err_frames_free;
 	}
-	dbg(4, "added tree node: %s\n", el->path);
+	strcpy(xdoc->el_path, "/");
+	xdoc->el_path_len = 1;
 
-	*path_with_leaf_index = strdup(el->path);
-	if (*path_with_leaf_index == NULL) {
+	xdoc->parser = XML_ParserCreate(NULL);
+	if (xdoc->parser == NULL) {
 		ret = -ENOMEM;
 		goto err_path_free;
 	}
+	XML_SetElementHandler(xdoc->parser, exml_el_start_cb, exml_el_end_cb);
+	XML_SetUserData(xdoc->parser, xdoc);
 
-	return 0;
+	xdoc->buf = buf;
+	xdoc->buf_len = buf_len;
+
+	pthread_mutex_lock(&exml_xpath_cache.lock);
+	exml_xpath_cache.num_docs++;
+	pthread_mutex_unlock(&exml_xpath_cache.lock);
+
+	*xdoc_out = xdoc;
 
+	return 0;
 err_path_free:
-	free(el->path);
-err_el_free:
-	free(el);
+	free(xdoc->el_path);
+err_frames_free:
+	free(xdoc->frames);
+err_doc_free:
+	free(xdoc);
 err_out:
 	return ret;
 }
@@ -264,43 +278,36 @@ exml_slurp(const char *buf,
 	  struct xml_doc **xdoc_out)
 {
 	int ret;
-	struct xml_doc *xdoc;
 
 	dbg(10, "slurping %" PRIu64 " bytes data: %*s\n",
 	    buf_len, (int)buf_len, (const char *)buf);
 
-	xdoc = malloc(sizeof(*xdoc));
-	if (xdoc == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
+	ret = exml_doc_new(buf, buf_len, xdoc_out);
+	if (ret < 0) {
+		dbg(0, "failed to slurp xml\n");
+		return ret;
 	}
-	memset(xdoc, 0, sizeof(*xdoc));
-	list_head_init(&xdoc->finders);
-	list_head_init(&xdoc->finders_val_wait);
-	list_head_init(&xdoc->founders);
 
-	xdoc->parser = XML_ParserCreate(NULL);
-	if (xdoc->parser == NULL) {
-		ret = -ENOMEM;
-		goto err_doc_free;
-	}
-	xdoc->buf = buf;
-	xdoc->buf_len = buf_len;
-	ret = exml_el_encounter(xdoc, "/", &xdoc->el_path);
+	return 0;
+}
+
+/*
+ * Allocate an xdoc without any XML data. Data is subsequently fed in via
+ * exml_parse_chunk() as it arrives, with exml_parse_finish() called once the
+ * end of the document has been reached.
+ */
+int
+exml_stream_new(struct xml_doc **xdoc_out)
+{
+	int ret;
+
+	ret = exml_doc_new(NULL, 0, xdoc_out);
 	if (ret < 0) {
-		goto err_parser_free;
+		dbg(0, "failed to allocate xml stream\n");
+		return ret;
 	}
 
-	*xdoc_out = xdoc;
-
 	return 0;
-err_parser_free:
-	XML_ParserFree(xdoc->parser);
-err_doc_free:
-	free(xdoc);
-err_out:
-	dbg(0, "failed to slurp xml\n");
-	return ret;
 }
 
 /* free a stashed value */
@@ -318,11 +325,11 @@ exml_finder_val_free(struct xml_finder *finder)
 
 /*
  * stash the obtained finder value in the type specific destination.
- * free the value buffer on success.
+ * @got is only duplicated if retained as a string value.
  */
 static int
 exml_finder_val_stash(struct xml_doc *xdoc,
-		     char *got,
+		     const char *got,
 		     struct xml_finder *finder)
 {
 	char *sval_end;
@@ -331,8 +338,10 @@ exml_finder_val_stash(struct xml_doc *xdoc,
 
 	switch (finder->type) {
 	case XML_VAL_STR:
-		*finder->ret_val.str = got;
-		got = NULL;
+		*finder->ret_val.str = strdup(got);
+		if (*finder->ret_val.str == NULL) {
+			return -ENOMEM;
+		}
 		break;
 	case XML_VAL_I32:
 		*finder->ret_val.i32 = strtol(got, &sval_end, 10);
@@ -422,7 +431,6 @@ exml_finder_val_stash(struct xml_doc *xdoc,
 	if (finder->_present != NULL) {
 		*finder->_present = true;
 	}
-	free(got);
 	return 0;
 }
 
@@ -432,50 +440,76 @@ exml_el_data_cb(void *priv_data,
 		int len)
 {
 	struct xml_doc *xdoc = priv_data;
+
+	if (xdoc->val_len + len >= xdoc->val_alloced) {
+		size_t sz = (xdoc->val_alloced ? xdoc->val_alloced * 2 : 64);
+		char *buf;
+
+		while (xdoc->val_len + len >= sz) {
+			sz *= 2;
+		}
+		buf = realloc(xdoc->val_buf, sz);
+		if (buf == NULL) {
+			XML_StopParser(xdoc->parser, XML_FALSE);
+			xdoc->parse_ret = -ENOMEM;
+			return;
+		}
+		xdoc->val_buf = buf;
+		xdoc->val_alloced = sz;
+	}
+	memcpy(xdoc->val_buf + xdoc->val_len, content, len);
+	xdoc->val_len += len;
+}
+
+/*
+ * Stash the value accumulated by exml_el_data_cb() for any finders waiting on
+ * the current element. Called on element end, as expat may split character
+ * data at entity references or input chunk boundaries.
+ */
+static int
+exml_el_val_wait_handle(struct xml_doc *xdoc)
+{
 	struct xml_finder *finder;
 	struct xml_finder *finder_n;
-	char *got;
 	int ret;
 
+	if (xdoc->val_len > 0) {
+		/* data cb always leaves room for the terminator */
+		xdoc->val_buf[xdoc->val_len] = '\0';
+	}
+
 	/* walk list in case there's more than one finder for this path */
 	list_for_each_safe(&xdoc->finders_val_wait, finder, finder_n, list) {
-		if (strcmp(finder->found_el_path, xdoc->el_path) != 0) {
-			dbg(3, "ignoring unmatched finder awaiting value %s\n",
-			    finder->found_el_path);
+		if ((finder->found_depth != xdoc->depth)
+		 || (finder->found_serial
+				!= xdoc->frames[xdoc->depth].serial)) {
+			dbg(3, "ignoring finder awaiting value at other el\n");
 			continue;
 		}
-		if (len == 0) {
-			/* we shouldn't have got a callback */
-			dbg(0, "empty value at %s\n", xdoc->el_path);
-		}
-		got = strndup(content, len);
-		if (got == NULL) {
-			XML_StopParser(xdoc->parser, XML_FALSE);
-			xdoc->parse_ret = -ENOMEM;
-			return;
+		if (xdoc->val_len == 0) {
+			dbg(2, "empty value at %s\n", xdoc->el_path);
+			continue;
 		}
 
 		assert(finder->handled == 0);
-		ret = exml_finder_val_stash(xdoc, got, finder);
+		ret = exml_finder_val_stash(xdoc, xdoc->val_buf, finder);
 		if (ret < 0) {
-			XML_StopParser(xdoc->parser, XML_FALSE);
-			xdoc->parse_ret = ret;
-			return;
+			return ret;
 		}
 		finder->handled++;
 		list_del(&finder->list);
 		list_add_tail(&xdoc->founders, &finder->list);
 	}
 
+	return 0;
 }
 
 static int
 exml_el_attr_search(const char **atts,
-		   char *search_attr,
-		   char **_attr_val)
+		   const char *search_attr,
+		   const char **_attr_val)
 {
 	const char *s;
-	char *attr_val;
 	/* no char handler, only interested in attr */
 	for (s = *atts; s != NULL; s = *(++atts)) {
 		if (strcmp(s, search_attr) != 0) {
@@ -496,86 +530,101 @@ exml_el_attr_search(const char **atts,
 			dbg(1, "empty attribute value for %s\n", search_attr);
 			continue;
 		}
-		attr_val = strdup(s);
-		if (attr_val == NULL) {
-			return -ENOMEM;
-		}
-		*_attr_val = attr_val;
+		*_attr_val = s;
 		return 0;
 	}
 	dbg(2, "attr [%s] not found\n", search_attr);
 	return -ENOENT;
 }
 
-static int
-exml_el_finder_path_cmp(const char *search_path,
-			const char *el_path,
-			bool wildcard,
-			bool *_matched)
+/* FNV-1a, over @len bytes of @name */
+static uint32_t
+exml_name_hash(const char *name,
+	       size_t len)
 {
-	char *spath;
-	char *epath;
-	char *stok;
-	char *etok;
-	char *ss;
-	char *es;
-
-	dbg(3, "comparing search_path \"%s\" with el_path \"%s\"\n",
-	    search_path, el_path);
-
-	spath = strdup(search_path);
-	assert(spath != NULL);
-	epath = strdup(el_path);
-	assert(epath != NULL);
-
-	for (stok = strtok_r(spath, "/", &ss), etok = strtok_r(epath, "/", &es);
-	     ((stok != NULL) && (etok != NULL));
-	     stok = strtok_r(NULL, "/", &ss), etok = strtok_r(NULL, "/", &es)) {
-		char *sep;
-		int scmp;
-		if (!strcmp(stok, etok)) {
-			dbg(5, "%s: direct match\n", stok);
-			continue;
-		}
-		if (wildcard && !strcmp(stok, "*")) {
-			dbg(5, "%s<->%s: wildcard match\n", stok, etok);
-			continue;
-		}
+	uint32_t hash = 2166136261U;
+	size_t i;
 
-		sep = strchr(stok, '[');
-		if (sep != NULL) {
-			dbg(5, "%s<->%s: index in non-matching search token\n",
-			    stok, etok);
-			*_matched = false;
-			goto out;
-		}
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619U;
+	}
+	/* reserved for wildcards */
+	return (hash == EXML_WILDCARD_HASH ? 1 : hash);
+}
+
+static struct list_head *
+exml_finder_tbl_bucket(struct xml_doc *xdoc,
+		       uint32_t hash,
+		       int depth)
+{
+	return &xdoc->finder_tbl[(hash + (uint32_t)depth * 31)
+						% EXML_FINDER_TBL_SIZE];
+}
 
-		sep = strchr(etok, '[');
+/*
+ * Compare compiled xpath components with the trailing components of
+ * @el_path, after skipping the first @skip components. Element path
+ * components always carry a leaf index suffix, e.g. /parent[0]/child[3]/
+ */
+static bool
+exml_xpath_el_match(const struct xml_xpath *xp,
+		    const char *el_path,
+		    int skip)
+{
+	const char *p = el_path;
+	int i;
+
+	assert(*p == '/');
+	p++;
+	for (i = 0; i < skip; i++) {
+		p = strchr(p, '/');
+		assert(p != NULL);
+		p++;
+	}
+
+	for (i = 0; i < xp->num_comps; i++) {
+		const struct xml_xpath_comp *comp = &xp->comps[i];
+		const char *sep;
+		char *end;
+		long index;
+
+		sep = strchr(p, '[');
 		assert(sep != NULL);	/* element path must have index */
-		*sep = '\0';
-		scmp = strcmp(stok, etok);
-		*sep = '[';
-		/* no index, search just needs to match */
-		if (scmp == 0) {
-			dbg(5, "%s<->%s: match without index\n", stok, etok);
-			continue;
+		if ((comp->name != NULL)
+		 && ((strlen(comp->name) != (size_t)(sep - p))
+		  || (strncmp(comp->name, p, sep - p) != 0))) {
+			dbg(5, "%s: no match at %s\n", xp->expr, p);
+			return false;
 		}
-		dbg(5, "%s<->%s: no match\n", stok, etok);
-		*_matched = false;
-		goto out;
+		index = strtol(sep + 1, &end, 10);
+		assert(*end == ']');
+		if ((comp->index >= 0) && (comp->index != index)) {
+			dbg(5, "%s: index mismatch at %s\n", xp->expr, p);
+			return false;
+		}
+		p = end + 2;	/* skip "]/" */
 	}
 
-	if ((stok == NULL) && (etok == NULL)) {
-		dbg(3, "%s<->%s full match\n", search_path, el_path);
-		*_matched = true;
-	} else {
-		dbg(5, "%s<->%s no match\n", search_path, el_path);
-		*_matched = false;
+	if (*p != '\0') {
+		return false;
 	}
-out:
-	free(spath);
-	free(epath);
-	return 0;
+
+	dbg(3, "%s<->%s full match\n", xp->expr, el_path);
+	return true;
+}
+
+/*
+ * Relative finders can only match while the element that was in scope when
+ * the finder was added remains open.
+ */
+static bool
+exml_finder_scope_open(struct xml_doc *xdoc,
+		       struct xml_finder *finder)
+{
+	return ((finder->scope_depth <= xdoc->depth)
+		&& (xdoc->frames[finder->scope_depth].serial
+						== finder->scope_serial));
 }
 
 static int
@@ -584,20 +633,16 @@ exml_el_path_found_handle(struct xml_doc *xdoc,
 			  const char **atts)
 {
 	int ret;
-	char *attr_val = NULL;
+	const char *attr_val = NULL;
 
-	finder->found_el_path = strdup(xdoc->el_path);
-	if (finder->found_el_path == NULL) {
-		return -ENOMEM;
-	}
 	if (finder->type == XML_VAL_PATH_CB) {
 		/* no character handler, callback at path */
-		ret = finder->ret_val.cb.fn(xdoc, finder->found_el_path, NULL,
+		ret = finder->ret_val.cb.fn(xdoc, xdoc->el_path, NULL,
 					    finder->ret_val.cb.data);
 		if (ret < 0) {
 			dbg(0, "xml path (%s) callback failed\n",
 			    xdoc->el_path);
-			goto err_found_path_free;
+			return ret;
 		}
 		assert(finder->handled == 0);
 		finder->handled++;
@@ -606,66 +651,71 @@ exml_el_path_found_handle(struct xml_doc *xdoc,
 		}
 		list_del(&finder->list);
 		xdoc->num_finders--;
+		finder->matched = true;
 		list_add_tail(&xdoc->founders, &finder->list);
 		/* cb must add another finder entry if still interested */
 		return 0;
-	} else if (finder->search_attr != NULL) {
-		ret = exml_el_attr_search(atts, finder->search_attr, &attr_val);
+	} else if (finder->xp->attr != NULL) {
+		ret = exml_el_attr_search(atts, finder->xp->attr, &attr_val);
 		if ((ret < 0) && (ret != -ENOENT)) {
-			goto err_found_path_free;
+			return ret;
 		} else if (ret == -ENOENT) {
-			ret = 0;	/* ignore */
-			goto err_found_path_free;
+			return 0;	/* ignore */
 		}
 
 		assert(finder->handled == 0);
 		ret = exml_finder_val_stash(xdoc, attr_val, finder);
 		if (ret < 0) {
-			goto err_attr_val_free;
+			return ret;
 		}
 		finder->handled++;
 		list_del(&finder->list);
 		xdoc->num_finders--;
+		finder->matched = true;
 		list_add_tail(&xdoc->founders, &finder->list);
 		return 0;
 	}
 
 	/*
-	 * enable data callback to stash value
+	 * enable data callback to collect value, stashed on element end
 	 */
+	finder->found_depth = xdoc->depth;
+	finder->found_serial = xdoc->frames[xdoc->depth].serial;
+	xdoc->val_len = 0;
 	XML_SetCharacterDataHandler(xdoc->parser, exml_el_data_cb);
 	list_del(&finder->list);
 	xdoc->num_finders--;
+	finder->matched = true;
 	list_add_tail(&xdoc->finders_val_wait, &finder->list);
 	return 0;
-
-err_attr_val_free:
-	free(attr_val);
-err_found_path_free:
-	free(finder->found_el_path);
-	finder->found_el_path = NULL;
-	return ret;
 }
 
 static int
-exml_el_finders_search(struct xml_doc *xdoc,
-		       const char *el_path,
-		       const char **atts)
+exml_el_finders_bucket_search(struct xml_doc *xdoc,
+			      struct list_head *bucket,
+			      const char *el_path,
+			      const char **atts)
 {
 	struct xml_finder *finder;
 	struct xml_finder *finder_n;
 
-	list_for_each_safe(&xdoc->finders, finder, finder_n, list) {
-		bool match;
+	list_for_each_safe(bucket, finder, finder_n, list) {
 		int ret;
-		ret = exml_el_finder_path_cmp(finder->search_path, el_path,
-					      finder->path_wildcard, &match);
-		if (ret < 0) {
-			dbg(0, "finder comparison failed\n");
-			return ret;
+
+		if (finder->match_depth != xdoc->depth) {
+			continue;	/* hash collision */
+		}
+
+		if (finder->xp->relative
+		 && !exml_finder_scope_open(xdoc, finder)) {
+			/* can't match anymore, get it out of the way */
+			list_del(&finder->list);
+			list_add_tail(&xdoc->finders_expired, &finder->list);
+			continue;
 		}
 
-		if (!match) {
+		if (!exml_xpath_el_match(finder->xp, el_path,
+				(finder->xp->relative ? finder->scope_depth : 0))) {
 			continue;
 		}
 
@@ -679,156 +729,487 @@ exml_el_finders_search(struct xml_doc *xdoc,
 	return 0;
 }
 
-static void
-exml_el_start_cb(void *priv_data,
-		const char *elem,
-		const char **atts)
+/*
+ * Only finders in the table bucket for the element name and depth (plus
+ * trailing wildcards) need to be checked against @el_path.
+ */
+static int
+exml_el_finders_search(struct xml_doc *xdoc,
+		       const char *elem,
+		       const char *el_path,
+		       const char **atts)
 {
-	struct xml_doc *xdoc = priv_data;
-	char *new_path;
 	int ret;
+	struct list_head *bucket;
 
-	/* disable data cb here, as previous value may have been empty */
-	if (!list_empty(&xdoc->finders_val_wait)) {
-		dbg(2, "finders awaiting value at start cb\n");
+	bucket = exml_finder_tbl_bucket(xdoc,
+					exml_name_hash(elem, strlen(elem)),
+					xdoc->depth);
+	ret = exml_el_finders_bucket_search(xdoc, bucket, el_path, atts);
+	if (ret < 0) {
+		return ret;
 	}
-	XML_SetCharacterDataHandler(xdoc->parser, NULL);
 
-	ret = asprintf(&new_path, "%s%s/", xdoc->el_path, elem);
-	if (ret == -1) {
-		XML_StopParser(xdoc->parser, XML_FALSE);
-		xdoc->parse_ret = -ENOMEM;
-		return;
+	if (xdoc->num_wildcard_finders == 0) {
+		return 0;
 	}
-	dbg(3, "el path changing from (%s) to (%s)\n", xdoc->el_path, new_path);
 
-	free(xdoc->el_path);
-	ret = exml_el_encounter(xdoc, new_path, &xdoc->el_path);
-	free(new_path);
-	if (ret < 0) {
-		XML_StopParser(xdoc->parser, XML_FALSE);
-		xdoc->parse_ret = ret;
-		return;
-	}
+	bucket = exml_finder_tbl_bucket(xdoc, EXML_WILDCARD_HASH,
+					xdoc->depth);
+	return exml_el_finders_bucket_search(xdoc, bucket, el_path, atts);
+}
 
-	ret = exml_el_finders_search(xdoc, xdoc->el_path, atts);
-	if (ret < 0) {
-		XML_StopParser(xdoc->parser, XML_FALSE);
-		xdoc->parse_ret = ret;
-		return;
+static void *
+exml_arena_alloc(struct xml_doc *xdoc,
+		 size_t len)
+{
+	struct xml_arena_chunk *chunk = xdoc->arena;
+	void *p;
+
+	len = (len + 7) & ~(size_t)7;
+	if ((chunk == NULL) || (chunk->size - chunk->used < len)) {
+		size_t sz = (len > EXML_ARENA_CHUNK_SIZE
+					? len : EXML_ARENA_CHUNK_SIZE);
+		if ((xdoc->arena_spare != NULL)
+		 && (xdoc->arena_spare->size >= sz)) {
+			chunk = xdoc->arena_spare;
+			xdoc->arena_spare = NULL;
+		} else {
+			chunk = malloc(sizeof(*chunk) + sz);
+			if (chunk == NULL) {
+				return NULL;
+			}
+			chunk->size = sz;
+		}
+		chunk->used = 0;
+		chunk->prev = xdoc->arena;
+		xdoc->arena = chunk;
 	}
+
+	p = chunk->buf + chunk->used;
+	chunk->used += len;
+	return p;
 }
 
 static void
-exml_el_end_cb(void *priv_data,
-	      const char *elem)
+exml_arena_mark_get(struct xml_doc *xdoc,
+		    struct xml_arena_mark *mark)
 {
-	struct xml_doc *xdoc = priv_data;
-	int elem_len = strlen(elem);
-	int path_len;
-	char *tok;
+	mark->chunk = xdoc->arena;
+	mark->used = (xdoc->arena ? xdoc->arena->used : 0);
+}
 
-	/* overwrite the last leaf index */
-	tok = strrchr(xdoc->el_path, '[');
-	assert(tok != NULL);
-	*tok = '\0';
-	path_len = strlen(xdoc->el_path);
-	if ((elem_len >= path_len)
-	 || (strncmp(&xdoc->el_path[path_len - elem_len], elem,
-		     elem_len) != 0)) {
-		dbg(0, "end element %s outside current element path %s\n",
-		    elem, xdoc->el_path);
-		XML_StopParser(xdoc->parser, XML_FALSE);
-		xdoc->parse_ret = -EINVAL;
-		return;
+/* release everything allocated since @mark was taken */
+static void
+exml_arena_reset(struct xml_doc *xdoc,
+		 const struct xml_arena_mark *mark)
+{
+	while (xdoc->arena != mark->chunk) {
+		struct xml_arena_chunk *chunk = xdoc->arena;
+
+		xdoc->arena = chunk->prev;
+		if (xdoc->arena_spare == NULL) {
+			xdoc->arena_spare = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+	if (xdoc->arena != NULL) {
+		xdoc->arena->used = mark->used;
 	}
-	xdoc->el_path[path_len - elem_len] = '\0';
+}
 
-	dbg(3, "el_path changed to (%s)\n", xdoc->el_path);
+static void
+exml_arena_free(struct xml_doc *xdoc)
+{
+	struct xml_arena_mark mark = { NULL, 0 };
+
+	exml_arena_reset(xdoc, &mark);
+	free(xdoc->arena_spare);
+	xdoc->arena_spare = NULL;
 }
 
-int
-exml_finders_walk_free(struct xml_doc *xdoc,
-		       bool check_required,
-		       bool free_vals)
+static int
+exml_el_path_append(struct xml_doc *xdoc,
+		    const char *elem,
+		    size_t elem_len,
+		    int index)
 {
-	struct xml_finder *finder;
-	struct xml_finder *finder_n;
+	int ret;
+	/* name + "[" + max int digits + "]/" + nul */
+	size_t need = xdoc->el_path_len + elem_len + 16;
 
-	list_for_each_safe(&xdoc->finders, finder, finder_n, list) {
-		if (check_required && finder->required) {
-			dbg(1, "required xpath (%s) not found\n",
-			    finder->search_path);
-			/* clean up on exml_free() */
-			return -ENOENT;
-		}
-		list_del(&finder->list);
-		xdoc->num_finders--;
+	if (need > xdoc->el_path_alloced) {
+		size_t sz = xdoc->el_path_alloced * 2;
+		char *buf;
 
-		free(finder->search_path);
-		free(finder->search_attr);
-		free(finder);
-	}
-	list_for_each_safe(&xdoc->finders_val_wait, finder, finder_n, list) {
-		if (check_required && finder->required) {
-			dbg(1, "required xpath (%s) value not found\n",
-			    finder->search_path);
-			return -ENOENT;
+		while (sz < need) {
+			sz *= 2;
 		}
-		list_del(&finder->list);
-		free(finder->search_path);
-		free(finder->search_attr);
-		free(finder->found_el_path);
-		free(finder);
+		buf = realloc(xdoc->el_path, sz);
+		if (buf == NULL) {
+			return -ENOMEM;
+		}
+		xdoc->el_path = buf;
+		xdoc->el_path_alloced = sz;
 	}
-	list_for_each_safe(&xdoc->founders, finder, finder_n, list) {
-		if (free_vals) {
-			exml_finder_val_free(finder);
+
+	memcpy(xdoc->el_path + xdoc->el_path_len, elem, elem_len);
+	ret = snprintf(xdoc->el_path + xdoc->el_path_len + elem_len,
+		       xdoc->el_path_alloced - xdoc->el_path_len - elem_len,
+		       "[%d]/", index);
+	if ((ret < 0)
+	 || (ret >= xdoc->el_path_alloced - xdoc->el_path_len - elem_len)) {
+		dbg(0, "failed to append index suffix\n");
+		return -EINVAL;
+	}
+	xdoc->el_path_len += elem_len + ret;
+
+	return 0;
+}
+
+/*
+ * Push a new element onto the frame stack, and assign a leaf index based on
+ * how many siblings with the same name have already been encountered.
+ */
+static int
+exml_el_push(struct xml_doc *xdoc,
+	     const char *elem)
+{
+	int ret;
+	size_t elem_len = strlen(elem);
+	uint32_t hash = exml_name_hash(elem, elem_len);
+	struct xml_el_frame *parent = &xdoc->frames[xdoc->depth];
+	struct xml_el_frame *frame;
+	struct xml_el_sibling *sib;
+	size_t path_len = xdoc->el_path_len;
+
+	for (sib = parent->children; sib != NULL; sib = sib->next) {
+		if ((sib->hash == hash) && !strcmp(sib->name, elem)) {
+			break;
 		}
-		list_del(&finder->list);
-		free(finder->search_path);
-		free(finder->search_attr);
-		free(finder->found_el_path);
-		free(finder);
 	}
+	if (sib == NULL) {
+		/* allocated before the child mark, freed with the parent */
+		sib = exml_arena_alloc(xdoc, sizeof(*sib) + elem_len + 1);
+		if (sib == NULL) {
+			return -ENOMEM;
+		}
+		sib->hash = hash;
+		sib->count = 0;
+		memcpy(sib->name, elem, elem_len + 1);
+		sib->next = parent->children;
+		parent->children = sib;
+	}
+
+	if (xdoc->depth + 1 >= xdoc->frames_alloced) {
+		struct xml_el_frame *frames = realloc(xdoc->frames,
+				sizeof(*frames) * xdoc->frames_alloced * 2);
+		if (frames == NULL) {
+			return -ENOMEM;
+		}
+		xdoc->frames = frames;
+		xdoc->frames_alloced *= 2;
+	}
+
+	ret = exml_el_path_append(xdoc, elem, elem_len, sib->count);
+	if (ret < 0) {
+		return ret;
+	}
+	sib->count++;
+
+	frame = &xdoc->frames[++xdoc->depth];
+	frame->serial = xdoc->next_serial++;
+	frame->path_len = path_len;
+	frame->children = NULL;
+	frame->scoped = NULL;
+	frame->end_cbs = NULL;
+	exml_arena_mark_get(xdoc, &frame->mark);
+
 	return 0;
 }
 
+static void
+exml_finder_free(struct xml_finder *finder);
+
 /*
- * On failure, all xdoc state is cleaned up via exml_free(), aside from any
- * finders that were found and allocated under the value pointer. E.g. string
- * or base64 types.
+ * The element in scope for a set of relative finders is closing, with end
+ * callbacks registered. Check that required finders were found, and release
+ * all of them so that found values are owned by the end callback(s), which
+ * may consume and free them.
  */
+static int
+exml_el_scope_close(struct xml_doc *xdoc,
+		    struct xml_el_frame *frame)
+{
+	int ret;
+	struct xml_finder *finder;
+	struct xml_el_end_cb *end_cb;
+
+	for (finder = frame->scoped; finder != NULL;
+						finder = finder->scope_next) {
+		if (finder->required && (finder->handled == 0)) {
+			dbg(1, "required xpath (%s) not found in %s\n",
+			    finder->xp->expr, xdoc->el_path);
+			return -ENOENT;
+		}
+	}
+
+	while (frame->scoped != NULL) {
+		finder = frame->scoped;
+		frame->scoped = finder->scope_next;
+		list_del(&finder->list);
+		if (!finder->matched) {
+			xdoc->num_finders--;
+		}
+		exml_finder_free(finder);
+	}
+
+	for (end_cb = frame->end_cbs; end_cb != NULL; end_cb = end_cb->next) {
+		ret = end_cb->fn(xdoc, xdoc->el_path, NULL, end_cb->data);
+		if (ret < 0) {
+			dbg(0, "xml element (%s) end callback failed\n",
+			    xdoc->el_path);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int
+exml_el_pop(struct xml_doc *xdoc,
+	    const char *elem)
+{
+	int ret;
+	struct xml_el_frame *frame = &xdoc->frames[xdoc->depth];
+	size_t elem_len = strlen(elem);
+
+	if ((xdoc->depth == 0)
+	 || (xdoc->el_path_len - frame->path_len <= elem_len)
+	 || (strncmp(xdoc->el_path + frame->path_len, elem, elem_len) != 0)
+	 || (xdoc->el_path[frame->path_len + elem_len] != '[')) {
+		dbg(0, "end element %s outside current element path %s\n",
+		    elem, xdoc->el_path);
+		return -EINVAL;
+	}
+
+	if (frame->end_cbs != NULL) {
+		ret = exml_el_scope_close(xdoc, frame);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	xdoc->el_path_len = frame->path_len;
+	xdoc->el_path[xdoc->el_path_len] = '\0';
+	exml_arena_reset(xdoc, &frame->mark);
+	xdoc->depth--;
+
+	return 0;
+}
+
+static void
+exml_el_start_cb(void *priv_data,
+		const char *elem,
+		const char **atts)
+{
+	struct xml_doc *xdoc = priv_data;
+	int ret;
+
+	/* disable data cb here, as previous value may have been empty */
+	if (!list_empty(&xdoc->finders_val_wait)) {
+		dbg(2, "finders awaiting value at start cb\n");
+	}
+	XML_SetCharacterDataHandler(xdoc->parser, NULL);
+
+	ret = exml_el_push(xdoc, elem);
+	if (ret < 0) {
+		XML_StopParser(xdoc->parser, XML_FALSE);
+		xdoc->parse_ret = ret;
+		return;
+	}
+	dbg(3, "el path changed to (%s)\n", xdoc->el_path);
+
+	ret = exml_el_finders_search(xdoc, elem, xdoc->el_path, atts);
+	if (ret < 0) {
+		XML_StopParser(xdoc->parser, XML_FALSE);
+		xdoc->parse_ret = ret;
+		return;
+	}
+}
+
+static void
+exml_el_end_cb(void *priv_data,
+	      const char *elem)
+{
+	struct xml_doc *xdoc = priv_data;
+	int ret;
+
+	if (!list_empty(&xdoc->finders_val_wait)) {
+		ret = exml_el_val_wait_handle(xdoc);
+		if (ret < 0) {
+			XML_StopParser(xdoc->parser, XML_FALSE);
+			xdoc->parse_ret = ret;
+			return;
+		}
+	}
+	XML_SetCharacterDataHandler(xdoc->parser, NULL);
+	xdoc->val_len = 0;
+
+	ret = exml_el_pop(xdoc, elem);
+	if (ret < 0) {
+		XML_StopParser(xdoc->parser, XML_FALSE);
+		xdoc->parse_ret = ret;
+		return;
+	}
+
+	dbg(3, "el_path changed to (%s)\n", xdoc->el_path);
+}
+
+static void
+exml_xpath_free(struct xml_xpath *xp);
+
+static void
+exml_finder_free(struct xml_finder *finder)
+{
+	if (finder->xp_owned) {
+		exml_xpath_free((struct xml_xpath *)finder->xp);
+	}
+	free(finder);
+}
+
+static int
+exml_finders_unfound_walk_free(struct xml_doc *xdoc,
+			       struct list_head *finders,
+			       bool check_required)
+{
+	struct xml_finder *finder;
+	struct xml_finder *finder_n;
+
+	list_for_each_safe(finders, finder, finder_n, list) {
+		if (check_required && finder->required) {
+			dbg(1, "required xpath (%s) not found\n",
+			    finder->xp->expr);
+			/* clean up on exml_free() */
+			return -ENOENT;
+		}
+		list_del(&finder->list);
+		xdoc->num_finders--;
+		exml_finder_free(finder);
+	}
+	return 0;
+}
+
 int
-exml_parse(struct xml_doc *xdoc)
+exml_finders_walk_free(struct xml_doc *xdoc,
+		       bool check_required,
+		       bool free_vals)
 {
+	struct xml_finder *finder;
+	struct xml_finder *finder_n;
+	int i;
 	int ret;
+
+	for (i = 0; i < EXML_FINDER_TBL_SIZE; i++) {
+		ret = exml_finders_unfound_walk_free(xdoc, &xdoc->finder_tbl[i],
+						     check_required);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	ret = exml_finders_unfound_walk_free(xdoc, &xdoc->finders_expired,
+					     check_required);
+	if (ret < 0) {
+		return ret;
+	}
+	list_for_each_safe(&xdoc->finders_val_wait, finder, finder_n, list) {
+		if (check_required && finder->required) {
+			dbg(1, "required xpath (%s) value not found\n",
+			    finder->xp->expr);
+			return -ENOENT;
+		}
+		list_del(&finder->list);
+		exml_finder_free(finder);
+	}
+	list_for_each_safe(&xdoc->founders, finder, finder_n, list) {
+		if (free_vals) {
+			exml_finder_val_free(finder);
+		}
+		list_del(&finder->list);
+		exml_finder_free(finder);
+	}
+	return 0;
+}
+
+static int
+exml_parse_buf(struct xml_doc *xdoc,
+	       const char *buf,
+	       uint64_t buf_len,
+	       bool final)
+{
 	enum XML_Status xret;
 
 	if ((xdoc == NULL) || (xdoc->parser == NULL)) {
 		return -EINVAL;
 	}
 
-	XML_SetElementHandler(xdoc->parser, exml_el_start_cb, exml_el_end_cb);
-	XML_SetUserData(xdoc->parser, xdoc);
+	if (xdoc->parse_ret < 0) {
+		/* already failed, don't feed parser any more data */
+		return xdoc->parse_ret;
+	}
+
+	if (buf_len > INT_MAX) {
+		dbg(0, "xml buffer too large: %" PRIu64 "\n", buf_len);
+		return -E2BIG;
+	}
 
 	xdoc->parsing = true;
-	xret = XML_Parse(xdoc->parser, xdoc->buf, xdoc->buf_len, XML_TRUE);
+	xret = XML_Parse(xdoc->parser, buf, (int)buf_len,
+			 (final ? XML_TRUE : XML_FALSE));
 	xdoc->parsing = false;
-	if (xret != XML_STATUS_OK) {
+	if (xdoc->parse_ret < 0) {
+		dbg(0, "parsing failed: %s\n", strerror(-xdoc->parse_ret));
+		return xdoc->parse_ret;
+	} else if (xret != XML_STATUS_OK) {
 		enum XML_Error xerr = XML_GetErrorCode(xdoc->parser);
 		dbg(0, "bad parsing status: %s\n", XML_ErrorString(xerr));
+		xdoc->parse_ret = -EIO;
 		return -EIO;
-	} else if (xdoc->parse_ret < 0) {
-		dbg(0, "parsing failed: %s\n", strerror(-xdoc->parse_ret));
-		return xdoc->parse_ret;
 	}
 
-	if (dbg_level_get() >= 6) {
-		twalk(xdoc->root_el, exml_el_print);
+	return 0;
+}
+
+/*
+ * Feed a chunk of XML data into the xdoc parser. Finders are handled as
+ * elements are encountered, so values may be returned before
+ * exml_parse_finish() is called.
+ */
+int
+exml_parse_chunk(struct xml_doc *xdoc,
+		 const char *buf,
+		 uint64_t buf_len)
+{
+	dbg(10, "parsing %" PRIu64 " byte chunk: %*s\n",
+	    buf_len, (int)buf_len, buf);
+
+	return exml_parse_buf(xdoc, buf, buf_len, false);
+}
+
+/*
+ * Complete parsing of a document fed in via exml_parse_chunk(), and check
+ * that all required finders were found.
+ */
+int
+exml_parse_finish(struct xml_doc *xdoc)
+{
+	int ret;
+
+	ret = exml_parse_buf(xdoc, NULL, 0, true);
+	if (ret < 0) {
+		return ret;
 	}
-	tdestroy(xdoc->root_el, exml_el_free);
-	xdoc->root_el = NULL;
 
 	/* walk list of finders, return error if required is missing */
 	ret = exml_finders_walk_free(xdoc, true, false);
@@ -836,12 +1217,34 @@ exml_parse(struct xml_doc *xdoc)
 		return ret;
 	}
 
-	assert(list_empty(&xdoc->finders));
+	assert(list_empty(&xdoc->finders_expired));
 	assert(xdoc->num_finders == 0);
 
 	return 0;
 }
 
+/*
+ * On failure, all xdoc state is cleaned up via exml_free(), aside from any
+ * finders that were found and allocated under the value pointer. E.g. string
+ * or base64 types.
+ */
+int
+exml_parse(struct xml_doc *xdoc)
+{
+	int ret;
+
+	if ((xdoc == NULL) || (xdoc->parser == NULL)) {
+		return -EINVAL;
+	}
+
+	ret = exml_parse_buf(xdoc, xdoc->buf, xdoc->buf_len, false);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return exml_parse_finish(xdoc);
+}
+
 void
 exml_free(struct xml_doc *xdoc)
 {
@@ -853,35 +1256,90 @@ exml_free(struct xml_doc *xdoc)
 	exml_finders_walk_free(xdoc, false, true);
 
 	free(xdoc->el_path);
-	if (xdoc->root_el != NULL) {
-		/* parsing failed, need to free element tree */
-		tdestroy(xdoc->root_el, exml_el_free);
-	}
+	free(xdoc->val_buf);
+	free(xdoc->frames);
+	exml_arena_free(xdoc);
 	XML_ParserFree(xdoc->parser);
 	free(xdoc);
+
+	pthread_mutex_lock(&exml_xpath_cache.lock);
+	assert(exml_xpath_cache.num_docs > 0);
+	exml_xpath_cache.num_docs--;
+	pthread_mutex_unlock(&exml_xpath_cache.lock);
+}
+
+static void
+exml_xpath_free(struct xml_xpath *xp)
+{
+	int i;
+
+	for (i = 0; i < xp->num_comps; i++) {
+		free(xp->comps[i].name);
+	}
+	free(xp->comps);
+	free(xp->attr);
+	free(xp->expr);
+	free(xp);
+}
+
+static int
+exml_xpath_comp_parse(struct xml_xpath *xp,
+		      const char *tok,
+		      struct xml_xpath_comp *comp)
+{
+	char *sep;
+	char *end;
+
+	if (!strcmp(tok, "*")) {
+		comp->name = NULL;
+		comp->index = -1;
+		return 0;
+	} else if (strchr(tok, '*') != NULL) {
+		dbg(0, "invalid wildcard use (%s). Must consume one "
+		       "path component\n", xp->expr);
+		return -EINVAL;
+	}
+
+	comp->name = strdup(tok);
+	if (comp->name == NULL) {
+		return -ENOMEM;
+	}
+	comp->index = -1;
+
+	sep = strchr(comp->name, '[');
+	if (sep != NULL) {
+		*sep = '\0';
+		comp->index = strtol(sep + 1, &end, 10);
+		if ((end == sep + 1) || strcmp(end, "]") || (comp->index < 0)) {
+			dbg(0, "invalid index component in %s\n", xp->expr);
+			free(comp->name);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
 }
 
 /*
  * @xp_expr: xpath in the form of:
  *	/parent/child
- *	./relative/path - (current path with indexes is prepended)
+ *	./relative/path - (relative to the element in scope)
  *	/parent/child[@attribute]
  *	/parent[index]/child[index][@attribute]
  * 	/ * /child - (minus the spaces around the *)
  */
 static int
-exml_xpath_parse(const char *xp_expr,
-		 const char *cur_el_path,
-		 char **_search_path,
-		 bool *_path_wildcard,
-		 char **_attr)
+exml_xpath_compile(const char *xp_expr,
+		   struct xml_xpath **_xp)
 {
 	int ret;
-	char *search_path = NULL;
-	bool path_wildcard = false;
-	char *attr = NULL;
+	struct xml_xpath *xp;
+	const char *path;
+	char *path_dup;
+	char *tok;
+	char *saveptr;
 	char *s;
-	bool relative_path = false;
+	int num_wildcards = 0;
 
 	if ((xp_expr == NULL)
 	 || (strlen(xp_expr) == 0)
@@ -891,73 +1349,184 @@ exml_xpath_parse(const char *xp_expr,
 		goto err_out;
 	}
 
-	if (strncmp(xp_expr, "./", 2) == 0) {
-		relative_path = true;
-		xp_expr += 2;
-	} else if (xp_expr[0] != '/') {
+	xp = malloc(sizeof(*xp));
+	if (xp == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(xp, 0, sizeof(*xp));
+
+	xp->expr = strdup(xp_expr);
+	if (xp->expr == NULL) {
+		ret = -ENOMEM;
+		goto err_xp_free;
+	}
+
+	path = xp_expr;
+	if (strncmp(path, "./", 2) == 0) {
+		xp->relative = true;
+		path += 2;
+	} else if (path[0] != '/') {
 		dbg(0, "bad xp_expr: %s\n", xp_expr);
 		ret = -EINVAL;
-		goto err_out;
+		goto err_xp_free;
 	}
 
-	ret = asprintf(&search_path, "%s%s/",
-		       (relative_path ? cur_el_path : ""), xp_expr);
-	if (ret < 0) {
+	path_dup = strdup(path);
+	if (path_dup == NULL) {
 		ret = -ENOMEM;
-		goto err_out;
+		goto err_xp_free;
 	}
 
-	s = strstr(search_path, "[@");
+	s = strstr(path_dup, "[@");
 	if (s != NULL) {
-		*(s++) = '/';
-		*(s++) = '\0';	/* terminate path */
-		attr = strdup(s);
-		if (attr == NULL) {
-			ret = -ENOMEM;
-			goto err_path_free;
-		}
-
-		/* expecting [@attribute]/ enclosure */
-		s = strstr(attr, "]");
-		if ((s == NULL) || strcmp(s, "]/")) {
+		*s = '\0';	/* terminate path */
+		s += 2;
+		/* expecting [@attribute] enclosure */
+		tok = strchr(s, ']');
+		if ((tok == NULL) || strcmp(tok, "]")) {
 			dbg(0, "invalid attribute component in %s\n",
-			    search_path);
+			    xp_expr);
 			ret = -EINVAL;
-			goto err_attr_free;
+			goto err_dup_free;
+		}
+		*tok = '\0';
+		xp->attr = strdup(s);
+		if (xp->attr == NULL) {
+			ret = -ENOMEM;
+			goto err_dup_free;
 		}
-		*s = '\0';
 	}
 
-	s = strchr(search_path, '*');
-	if (s != NULL) {
-		path_wildcard = true;
-		if ((*(s + 1) != '/') || (*(s - 1) != '/')) {
-			dbg(0, "invalid wildcard use (%s). Must consume one "
-			       "path component\n", search_path);
-			ret = -EINVAL;
-			goto err_attr_free;
+	/* upper bound on components */
+	xp->comps = malloc(sizeof(*xp->comps) * (strlen(path_dup) / 2 + 1));
+	if (xp->comps == NULL) {
+		ret = -ENOMEM;
+		goto err_dup_free;
+	}
+
+	for (tok = strtok_r(path_dup, "/", &saveptr); tok != NULL;
+	     tok = strtok_r(NULL, "/", &saveptr)) {
+		struct xml_xpath_comp *comp = &xp->comps[xp->num_comps];
+
+		ret = exml_xpath_comp_parse(xp, tok, comp);
+		if (ret < 0) {
+			goto err_dup_free;
 		}
-		s = strchr(s + 1, '*');
-		if (s != NULL) {
-			dbg(0, "invalid multi-wildcard in (%s)\n", search_path);
+		xp->num_comps++;
+		if ((comp->name == NULL) && (++num_wildcards > 1)) {
+			dbg(0, "invalid multi-wildcard in (%s)\n", xp_expr);
 			ret = -EINVAL;
-			goto err_attr_free;
+			goto err_dup_free;
 		}
 	}
+	free(path_dup);
+
+	if (xp->num_comps == 0) {
+		dbg(0, "bad xp_expr: %s\n", xp_expr);
+		ret = -EINVAL;
+		goto err_xp_free;
+	}
 
-	*_search_path = search_path;
-	*_path_wildcard = path_wildcard;
-	*_attr = attr;
+	if (xp->comps[xp->num_comps - 1].name == NULL) {
+		xp->hash = EXML_WILDCARD_HASH;
+	} else {
+		const char *name = xp->comps[xp->num_comps - 1].name;
+		xp->hash = exml_name_hash(name, strlen(name));
+	}
+
+	*_xp = xp;
 	return 0;
 
-err_attr_free:
-	free(attr);
-err_path_free:
-	free(search_path);
+err_dup_free:
+	free(path_dup);
+err_xp_free:
+	exml_xpath_free(xp);
 err_out:
 	return ret;
 }
 
+/*
+ * Obtain compiled xpath for @xp_expr, from the cache if previously seen.
+ * @_owned is set if the cache is full and the caller must free @_xp.
+ */
+static int
+exml_xpath_get(const char *xp_expr,
+	       const struct xml_xpath **_xp,
+	       bool *_owned)
+{
+	int ret;
+	uint32_t slot;
+	struct xml_xpath *xp;
+
+	if (xp_expr == NULL) {
+		return -EINVAL;
+	}
+
+	slot = exml_name_hash(xp_expr, strlen(xp_expr))
+						% EXML_XPATH_CACHE_SIZE;
+
+	pthread_mutex_lock(&exml_xpath_cache.lock);
+	for (xp = exml_xpath_cache.tbl[slot]; xp != NULL; xp = xp->hnext) {
+		if (!strcmp(xp->expr, xp_expr)) {
+			pthread_mutex_unlock(&exml_xpath_cache.lock);
+			*_xp = xp;
+			*_owned = false;
+			return 0;
+		}
+	}
+
+	ret = exml_xpath_compile(xp_expr, &xp);
+	if (ret < 0) {
+		pthread_mutex_unlock(&exml_xpath_cache.lock);
+		return ret;
+	}
+
+	if (exml_xpath_cache.num_xps >= EXML_XPATH_CACHE_MAX) {
+		dbg(2, "xpath cache full, not caching %s\n", xp_expr);
+		*_owned = true;
+	} else {
+		xp->hnext = exml_xpath_cache.tbl[slot];
+		exml_xpath_cache.tbl[slot] = xp;
+		exml_xpath_cache.num_xps++;
+		*_owned = false;
+	}
+	pthread_mutex_unlock(&exml_xpath_cache.lock);
+	*_xp = xp;
+
+	return 0;
+}
+
+/*
+ * Free all cached xpaths. Must only be called once all documents have been
+ * freed, as their finders reference cached entries.
+ */
+void
+exml_subsys_deinit(void)
+{
+	int i;
+
+	pthread_mutex_lock(&exml_xpath_cache.lock);
+	if (exml_xpath_cache.num_docs != 0) {
+		dbg(0, "%d xml docs still in use, not freeing xpath cache\n",
+		    exml_xpath_cache.num_docs);
+		assert(exml_xpath_cache.num_docs == 0);
+		pthread_mutex_unlock(&exml_xpath_cache.lock);
+		return;
+	}
+	for (i = 0; i < EXML_XPATH_CACHE_SIZE; i++) {
+		struct xml_xpath *xp = exml_xpath_cache.tbl[i];
+		while (xp != NULL) {
+			struct xml_xpath *xp_n = xp->hnext;
+			exml_xpath_free(xp);
+			xp = xp_n;
+		}
+		exml_xpath_cache.tbl[i] = NULL;
+	}
+	exml_xpath_cache.num_xps = 0;
+	pthread_mutex_unlock(&exml_xpath_cache.lock);
+}
+
 /*
  * allocate and initialise an xpath search struct for use in a subsequent
  * xml_parse() call.
@@ -976,6 +1545,7 @@ exml_finder_init(struct xml_doc *xdoc,
 {
 	int ret;
 	struct xml_finder *finder;
+	struct list_head *bucket;
 
 	finder = malloc(sizeof(*finder));
 	if (finder == NULL) {
@@ -984,14 +1554,24 @@ exml_finder_init(struct xml_doc *xdoc,
 	}
 	memset(finder, 0, sizeof(*finder));
 
-	ret = exml_xpath_parse(xp_expr, xdoc->el_path, &finder->search_path,
-			       &finder->path_wildcard, &finder->search_attr);
+	ret = exml_xpath_get(xp_expr, &finder->xp, &finder->xp_owned);
 	if (ret < 0) {
 		goto err_finder_free;
 	}
-	dbg(4, "new finder for (%s) [@%s]\n",
-	    finder->search_path,
-	    finder->search_attr ? finder->search_attr : "NONE");
+	dbg(4, "new finder for (%s)\n", finder->xp->expr);
+
+	if (finder->xp->relative) {
+		finder->scope_depth = xdoc->depth;
+		finder->scope_serial = xdoc->frames[xdoc->depth].serial;
+		finder->scope_next = xdoc->frames[xdoc->depth].scoped;
+		xdoc->frames[xdoc->depth].scoped = finder;
+		finder->match_depth = xdoc->depth + finder->xp->num_comps;
+	} else {
+		finder->match_depth = finder->xp->num_comps;
+	}
+	if (finder->xp->hash == EXML_WILDCARD_HASH) {
+		xdoc->num_wildcard_finders++;
+	}
 
 	finder->required = required;
 	finder->type = type;
@@ -999,7 +1579,9 @@ exml_finder_init(struct xml_doc *xdoc,
 		*present = false;
 		finder->_present = present;
 	}
-	list_add(&xdoc->finders, &finder->list);
+	bucket = exml_finder_tbl_bucket(xdoc, finder->xp->hash,
+					finder->match_depth);
+	list_add(bucket, &finder->list);
 	xdoc->num_finders++;
 	*_finder = finder;
 
@@ -1188,3 +1770,301 @@ exml_path_cb_want(struct xml_doc *xdoc,
 	finder->ret_val.cb.data = cb_data;
 	return 0;
 }
+
+/*
+ * callback when the element currently being processed is closed. Any relative
+ * finders added under the element are checked and released beforehand, so
+ * values found via ./relative paths are complete and owned by the caller.
+ * Intended for handling list entries as they're parsed.
+ */
+int
+exml_scope_end_cb_want(struct xml_doc *xdoc,
+		       exml_want_cb_t cb,
+		       void *cb_data)
+{
+	struct xml_el_frame *frame;
+	struct xml_el_end_cb *end_cb;
+
+	if (!xdoc->parsing || (xdoc->depth == 0)) {
+		/* only valid from a path callback */
+		return -EINVAL;
+	}
+	frame = &xdoc->frames[xdoc->depth];
+
+	/* released once the element is closed */
+	end_cb = exml_arena_alloc(xdoc, sizeof(*end_cb));
+	if (end_cb == NULL) {
+		return -ENOMEM;
+	}
+	end_cb->fn = cb;
+	end_cb->data = cb_data;
+	end_cb->next = frame->end_cbs;
+	frame->end_cbs = end_cb;
+	return 0;
+}
+
+/*
+ * Streaming XML writer, for request bodies. Output goes to a fixed size
+ * caller buffer. Without a buffer only the serialized length is tracked, which
+ * allows for exact sizing of a buffer prior to a second pass.
+ */
+struct xml_writer {
+	uint8_t *buf;
+	uint64_t buf_len;
+	uint64_t off;		/* bytes currently in @buf */
+	uint64_t total;		/* bytes serialized */
+	int depth;
+	int err;		/* sticky, returned by exml_writer_finish() */
+};
+
+/*
+ * @buf: output buffer of size @buf_len, or NULL to only calculate the length
+ *	 of the serialized document.
+ */
+int
+exml_writer_buf_new(uint8_t *buf,
+		    uint64_t buf_len,
+		    struct xml_writer **_xw)
+{
+	struct xml_writer *xw;
+
+	if ((buf == NULL) && (buf_len != 0)) {
+		return -EINVAL;
+	}
+
+	xw = malloc(sizeof(*xw));
+	if (xw == NULL) {
+		return -ENOMEM;
+	}
+	memset(xw, 0, sizeof(*xw));
+	xw->buf = buf;
+	xw->buf_len = buf_len;
+	*_xw = xw;
+
+	return 0;
+}
+
+static int
+exml_writer_put(struct xml_writer *xw,
+		const char *data,
+		uint64_t len)
+{
+	if (xw->err < 0) {
+		return xw->err;
+	}
+
+	xw->total += len;
+	if (xw->buf == NULL) {
+		return 0;	/* length only */
+	}
+
+	if (len > xw->buf_len - xw->off) {
+		dbg(0, "xml writer buffer overflow at %" PRIu64 "\n",
+		    xw->total);
+		xw->err = -E2BIG;
+		return xw->err;
+	}
+	memcpy(xw->buf + xw->off, data, len);
+	xw->off += len;
+
+	return 0;
+}
+
+/* element text, with markup characters escaped */
+static int
+exml_writer_text_put(struct xml_writer *xw,
+		     const char *val)
+{
+	int ret;
+	const char *run = val;
+	const char *p;
+
+	for (p = val; *p != '\0'; p++) {
+		const char *ent;
+
+		switch (*p) {
+		case '&':
+			ent = "&amp;";
+			break;
+		case '<':
+			ent = "&lt;";
+			break;
+		case '>':
+			ent = "&gt;";
+			break;
+		default:
+			continue;
+		}
+		ret = exml_writer_put(xw, run, p - run);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = exml_writer_put(xw, ent, strlen(ent));
+		if (ret < 0) {
+			return ret;
+		}
+		run = p + 1;
+	}
+
+	return exml_writer_put(xw, run, p - run);
+}
+
+static int
+exml_writer_tag_put(struct xml_writer *xw,
+		    const char *name,
+		    bool close)
+{
+	int ret;
+
+	ret = exml_writer_put(xw, (close ? "</" : "<"), (close ? 2 : 1));
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_writer_put(xw, name, strlen(name));
+	if (ret < 0) {
+		return ret;
+	}
+	return exml_writer_put(xw, ">", 1);
+}
+
+int
+exml_decl_write(struct xml_writer *xw)
+{
+	const char decl[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>";
+
+	if (xw->total != 0) {
+		return -EINVAL;
+	}
+	return exml_writer_put(xw, decl, sizeof(decl) - 1);
+}
+
+int
+exml_el_open(struct xml_writer *xw,
+	     const char *name)
+{
+	int ret;
+
+	ret = exml_writer_tag_put(xw, name, false);
+	if (ret < 0) {
+		return ret;
+	}
+	xw->depth++;
+	return 0;
+}
+
+int
+exml_el_close(struct xml_writer *xw,
+	      const char *name)
+{
+	if (xw->depth <= 0) {
+		dbg(0, "xml writer close of %s without open element\n", name);
+		xw->err = -EINVAL;
+		return xw->err;
+	}
+	xw->depth--;
+	return exml_writer_tag_put(xw, name, true);
+}
+
+/* <@name>@val</@name> */
+int
+exml_str_write(struct xml_writer *xw,
+	       const char *name,
+	       const char *val)
+{
+	int ret;
+
+	ret = exml_writer_tag_put(xw, name, false);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_writer_text_put(xw, val);
+	if (ret < 0) {
+		return ret;
+	}
+	return exml_writer_tag_put(xw, name, true);
+}
+
+int
+exml_uint64_write(struct xml_writer *xw,
+		  const char *name,
+		  uint64_t val)
+{
+	int ret;
+	char num[32];
+
+	ret = exml_writer_tag_put(xw, name, false);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = snprintf(num, sizeof(num), "%" PRIu64, val);
+	ret = exml_writer_put(xw, num, ret);
+	if (ret < 0) {
+		return ret;
+	}
+	return exml_writer_tag_put(xw, name, true);
+}
+
+/* <@name>base64(@data)</@name>, encoded without intermediate allocation */
+int
+exml_base64_write(struct xml_writer *xw,
+		  const char *name,
+		  const void *data,
+		  uint64_t len)
+{
+	int ret;
+	const uint8_t *p = data;
+	char enc[BASE64_ENCODE_LEN(192)];
+
+	ret = exml_writer_tag_put(xw, name, false);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (xw->buf == NULL) {
+		/* length only */
+		xw->total += BASE64_ENCODE_LEN(len);
+	}
+	while ((xw->buf != NULL) && (len > 0)) {
+		/* multiple of three, so that no padding is added mid stream */
+		int n = (len > 192 ? 192 : len);
+
+		ret = base64_encode_buf(p, n, enc);
+		ret = exml_writer_put(xw, enc, ret);
+		if (ret < 0) {
+			return ret;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return exml_writer_tag_put(xw, name, true);
+}
+
+/*
+ * Check that the document is complete.
+ * @_len: total number of bytes serialized, may be NULL.
+ */
+int
+exml_writer_finish(struct xml_writer *xw,
+		   uint64_t *_len)
+{
+	if (xw->err < 0) {
+		return xw->err;
+	}
+	if (xw->depth != 0) {
+		dbg(0, "xml writer finished with %d open elements\n",
+		    xw->depth);
+		return -EINVAL;
+	}
+
+	if (_len != NULL) {
+		*_len = xw->total;
+	}
+	return 0;
+}
+
+void
+exml_writer_free(struct xml_writer *xw)
+{
+	free(xw);
+}
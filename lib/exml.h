@@ -21,9 +21,20 @@ exml_slurp(const char *buf,
 	  uint64_t buf_len,
 	  struct xml_doc **xdoc_out);
 
+int
+exml_stream_new(struct xml_doc **xdoc_out);
+
 int
 exml_parse(struct xml_doc *xdoc);
 
+int
+exml_parse_chunk(struct xml_doc *xdoc,
+		 const char *buf,
+		 uint64_t buf_len);
+
+int
+exml_parse_finish(struct xml_doc *xdoc);
+
 int
 exml_str_want(struct xml_doc *xdoc,
 	     const char *xp_expr,
@@ -93,7 +104,57 @@ exml_path_cb_want(struct xml_doc *xdoc,
 	     void *cb_data,
 	     bool *present);
 
+int
+exml_scope_end_cb_want(struct xml_doc *xdoc,
+		       exml_want_cb_t cb,
+		       void *cb_data);
+
 void
 exml_free(struct xml_doc *xdoc);
 
+/* only valid once all xml docs have been freed */
+void
+exml_subsys_deinit(void);
+
+struct xml_writer;
+
+int
+exml_writer_buf_new(uint8_t *buf,
+		    uint64_t buf_len,
+		    struct xml_writer **_xw);
+
+int
+exml_decl_write(struct xml_writer *xw);
+
+int
+exml_el_open(struct xml_writer *xw,
+	     const char *name);
+
+int
+exml_el_close(struct xml_writer *xw,
+	      const char *name);
+
+int
+exml_str_write(struct xml_writer *xw,
+	       const char *name,
+	       const char *val);
+
+int
+exml_uint64_write(struct xml_writer *xw,
+		  const char *name,
+		  uint64_t val);
+
+int
+exml_base64_write(struct xml_writer *xw,
+		  const char *name,
+		  const void *data,
+		  uint64_t len);
+
+int
+exml_writer_finish(struct xml_writer *xw,
+		   uint64_t *_len);
+
+void
+exml_writer_free(struct xml_writer *xw);
+
 #endif /* _AZURE_EXML_H_ */
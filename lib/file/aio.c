@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "ccan/list/list.h"
+#include "lib/util.h"
+#include "lib/dbg.h"
+#include "lib/data.h"
+#include "file_api.h"
+#include "handle.h"
+#include "aio.h"
+#include "readahead.h"
+#include "scache.h"
+#include "wback.h"
+
+#define ELASTO_FAIO_NCHANS_DEFAULT 4
+#define ELASTO_FAIO_NCHANS_MAX 64
+
+struct elasto_faio_req {
+	struct list_node list;
+	struct elasto_fio fio;
+	void *tag;
+	int ret;
+};
+
+struct elasto_faio;
+
+/*
+ * @fh: channel handle, opened with the parent's credentials and path. Backend
+ *	connections aren't thread safe, so each channel has its own.
+ * @thread: worker thread which dispatches requests via @fh.
+ */
+struct elasto_faio_chan {
+	struct elasto_faio *aio;
+	struct elasto_fh *fh;
+	pthread_t thread;
+	bool thread_started;
+};
+
+/*
+ * @lock: protects all fields below
+ * @sub_cond: signalled on submission and on shutdown
+ * @cmpl_cond: signalled on completion
+ * @sub_reqs: submitted requests, awaiting a free channel
+ * @cmpl_reqs: completed requests, awaiting reap
+ * @num_pending: submitted requests that haven't yet been reaped
+ * @efd: eventfd in semaphore mode, with a count matching @cmpl_reqs
+ * @fh: parent handle, its read-ahead and cached stat are invalidated by async
+ *	modifications
+ */
+struct elasto_faio {
+	pthread_mutex_t lock;
+	pthread_cond_t sub_cond;
+	pthread_cond_t cmpl_cond;
+	struct list_head sub_reqs;
+	struct list_head cmpl_reqs;
+	uint64_t num_pending;
+	bool stopping;
+	int efd;
+	uint32_t nchans;
+	struct elasto_faio_chan *chans;
+	struct elasto_fh *fh;
+};
+
+static struct elasto_faio_req *
+elasto_faio_req_pop(struct list_head *reqs)
+{
+	struct elasto_faio_req *req;
+
+	req = list_top(reqs, struct elasto_faio_req, list);
+	if (req != NULL) {
+		list_del(&req->list);
+	}
+	return req;
+}
+
+static int
+elasto_faio_req_dispatch(struct elasto_fh *fh,
+			 struct elasto_fio *fio)
+{
+	switch (fio->opcode) {
+	case ELASTO_FIO_READ:
+		return elasto_fread(fh, fio->off, fio->len, fio->buf);
+	case ELASTO_FIO_WRITE:
+		return elasto_fwrite(fh, fio->off, fio->len, fio->buf);
+	case ELASTO_FIO_ALLOCATE:
+		return elasto_fallocate(fh, fio->mode, fio->off, fio->len);
+	case ELASTO_FIO_STAT:
+		return elasto_fstat(fh, fio->fstat);
+	default:
+		break;
+	}
+
+	return -EINVAL;
+}
+
+static void *
+elasto_faio_chan_thread(void *arg)
+{
+	struct elasto_faio_chan *chan = arg;
+	struct elasto_faio *aio = chan->aio;
+	struct elasto_faio_req *req;
+	uint64_t one = 1;
+	ssize_t wret;
+
+	pthread_mutex_lock(&aio->lock);
+	while (true) {
+		while (!aio->stopping && list_empty(&aio->sub_reqs)) {
+			pthread_cond_wait(&aio->sub_cond, &aio->lock);
+		}
+		if (aio->stopping) {
+			break;
+		}
+		req = elasto_faio_req_pop(&aio->sub_reqs);
+		pthread_mutex_unlock(&aio->lock);
+
+		req->ret = elasto_faio_req_dispatch(chan->fh, &req->fio);
+		dbg(4, "async request %p (op %d) completed: %d\n",
+		    req->tag, req->fio.opcode, req->ret);
+		if ((req->fio.opcode == ELASTO_FIO_WRITE)
+		 || (req->fio.opcode == ELASTO_FIO_ALLOCATE)) {
+			elasto_fra_invalidate(aio->fh);
+			elasto_fsc_fh_invalidate(aio->fh);
+		}
+
+		pthread_mutex_lock(&aio->lock);
+		list_add_tail(&aio->cmpl_reqs, &req->list);
+		/* eventfd is updated under lock, so it tracks @cmpl_reqs */
+		wret = write(aio->efd, &one, sizeof(one));
+		if (wret != sizeof(one)) {
+			dbg(0, "failed to signal completion eventfd\n");
+		}
+		pthread_cond_broadcast(&aio->cmpl_cond);
+	}
+	pthread_mutex_unlock(&aio->lock);
+
+	return NULL;
+}
+
+static void
+elasto_faio_free(struct elasto_faio *aio)
+{
+	struct elasto_faio_req *req;
+	uint32_t i;
+
+	pthread_mutex_lock(&aio->lock);
+	aio->stopping = true;
+	pthread_cond_broadcast(&aio->sub_cond);
+	pthread_mutex_unlock(&aio->lock);
+
+	/* in-flight requests complete before workers exit */
+	for (i = 0; i < aio->nchans; i++) {
+		if (aio->chans[i].thread_started) {
+			pthread_join(aio->chans[i].thread, NULL);
+		}
+		if (aio->chans[i].fh != NULL) {
+			elasto_fclose(aio->chans[i].fh);
+		}
+	}
+
+	while ((req = elasto_faio_req_pop(&aio->sub_reqs)) != NULL) {
+		dbg(1, "dropping unprocessed async request %p\n", req->tag);
+		free(req);
+	}
+	while ((req = elasto_faio_req_pop(&aio->cmpl_reqs)) != NULL) {
+		dbg(1, "dropping unreaped async completion %p\n", req->tag);
+		free(req);
+	}
+
+	close(aio->efd);
+	pthread_cond_destroy(&aio->cmpl_cond);
+	pthread_cond_destroy(&aio->sub_cond);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio->chans);
+	free(aio);
+}
+
+static int
+elasto_faio_init(struct elasto_fh *fh,
+		 uint32_t nchans,
+		 struct elasto_faio **_aio)
+{
+	struct elasto_faio *aio;
+	uint64_t chan_flags;
+	struct elasto_ftoken_list *chan_toks = NULL;
+	uint32_t i;
+	int ret;
+
+	aio = malloc(sizeof(*aio));
+	if (aio == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(aio, 0, sizeof(*aio));
+	list_head_init(&aio->sub_reqs);
+	list_head_init(&aio->cmpl_reqs);
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->sub_cond, NULL);
+	pthread_cond_init(&aio->cmpl_cond, NULL);
+
+	aio->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (aio->efd < 0) {
+		ret = -errno;
+		dbg(0, "failed to create eventfd: %s\n", strerror(-ret));
+		goto err_aio_free;
+	}
+
+	aio->chans = calloc(nchans, sizeof(*aio->chans));
+	if (aio->chans == NULL) {
+		ret = -ENOMEM;
+		goto err_efd_close;
+	}
+	aio->nchans = nchans;
+	aio->fh = fh;
+
+	/* requests are independent, so channels don't read ahead */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_READAHEAD_MAX, "0",
+				&chan_toks);
+	if (ret < 0) {
+		goto err_chans_array_free;
+	}
+
+	/* channels modify the file behind each other's backs, so don't cache */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_STAT_TTL, "0", &chan_toks);
+	if (ret < 0) {
+		goto err_toks_free;
+	}
+
+	/* the path already exists, having been opened by @fh */
+	chan_flags = fh->open_flags
+			& ~(ELASTO_FOPEN_CREATE | ELASTO_FOPEN_EXCL);
+	for (i = 0; i < nchans; i++) {
+		struct elasto_faio_chan *chan = &aio->chans[i];
+
+		chan->aio = aio;
+		ret = elasto_fopen(&fh->auth, fh->open_path, chan_flags,
+				   chan_toks, &chan->fh);
+		if (ret < 0) {
+			dbg(0, "failed to open async channel %u: %s\n",
+			    i, strerror(-ret));
+			goto err_chans_free;
+		}
+
+		ret = pthread_create(&chan->thread, NULL,
+				     elasto_faio_chan_thread, chan);
+		if (ret != 0) {
+			ret = -ret;
+			goto err_chans_free;
+		}
+		chan->thread_started = true;
+	}
+	elasto_ftoken_list_free(chan_toks);
+
+	*_aio = aio;
+	return 0;
+
+err_chans_free:
+	elasto_ftoken_list_free(chan_toks);
+	/* tears down any opened channels and started threads */
+	elasto_faio_free(aio);
+	goto err_out;
+err_toks_free:
+	elasto_ftoken_list_free(chan_toks);
+err_chans_array_free:
+	free(aio->chans);
+err_efd_close:
+	close(aio->efd);
+err_aio_free:
+	pthread_cond_destroy(&aio->cmpl_cond);
+	pthread_cond_destroy(&aio->sub_cond);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio);
+err_out:
+	return ret;
+}
+
+static int
+elasto_faio_fh_validate(struct elasto_fh *fh)
+{
+	int ret;
+
+	ret = elasto_fh_validate(fh);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (fh->open_flags & ELASTO_FOPEN_DIRECTORY) {
+		dbg(1, "invalid async IO request for directory handle\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int
+elasto_fio_setup(struct elasto_fh *fh,
+		 uint32_t nchans,
+		 int *_efd)
+{
+	int ret;
+
+	ret = elasto_faio_fh_validate(fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if ((nchans == 0) || (nchans > ELASTO_FAIO_NCHANS_MAX)) {
+		dbg(0, "invalid async channel count: %u\n", nchans);
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	if (fh->aio != NULL) {
+		ret = -EBUSY;
+		goto err_out;
+	}
+
+	ret = elasto_faio_init(fh, nchans, &fh->aio);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if (_efd != NULL) {
+		*_efd = fh->aio->efd;
+	}
+	ret = 0;
+err_out:
+	return ret;
+}
+
+int
+elasto_fsubmit(struct elasto_fh *fh,
+	       const struct elasto_fio *fio,
+	       void *tag)
+{
+	int ret;
+	struct elasto_faio_req *req;
+
+	ret = elasto_faio_fh_validate(fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if (fio == NULL) {
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	switch (fio->opcode) {
+	case ELASTO_FIO_READ:
+	case ELASTO_FIO_WRITE:
+		if (fio->buf == NULL) {
+			ret = -EINVAL;
+			goto err_out;
+		}
+		break;
+	case ELASTO_FIO_ALLOCATE:
+		break;
+	case ELASTO_FIO_STAT:
+		if (fio->fstat == NULL) {
+			ret = -EINVAL;
+			goto err_out;
+		}
+		break;
+	default:
+		dbg(0, "invalid async opcode: %d\n", fio->opcode);
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	if (fh->aio == NULL) {
+		ret = elasto_faio_init(fh, ELASTO_FAIO_NCHANS_DEFAULT,
+				       &fh->aio);
+		if (ret < 0) {
+			goto err_out;
+		}
+	}
+
+	/* channels bypass write-back, so must follow any buffered data */
+	if (fio->opcode == ELASTO_FIO_STAT) {
+		ret = elasto_fwb_flush(fh, 0, UINT64_MAX);
+	} else {
+		ret = elasto_fwb_flush(fh, fio->off, fio->len);
+	}
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	req = malloc(sizeof(*req));
+	if (req == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(req, 0, sizeof(*req));
+	req->fio = *fio;
+	req->tag = tag;
+
+	dbg(4, "submitting async request %p (op %d) at %" PRIu64 ", len %"
+	    PRIu64 "\n", tag, fio->opcode, fio->off, fio->len);
+
+	pthread_mutex_lock(&fh->aio->lock);
+	list_add_tail(&fh->aio->sub_reqs, &req->list);
+	fh->aio->num_pending++;
+	pthread_cond_signal(&fh->aio->sub_cond);
+	pthread_mutex_unlock(&fh->aio->lock);
+
+	ret = 0;
+err_out:
+	return ret;
+}
+
+int
+elasto_freap(struct elasto_fh *fh,
+	     uint32_t min_cmpls,
+	     uint32_t max_cmpls,
+	     struct elasto_fio_cmpl *cmpls)
+{
+	int ret;
+	struct elasto_faio *aio;
+	struct elasto_faio_req *req;
+	uint32_t n = 0;
+
+	ret = elasto_faio_fh_validate(fh);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if ((min_cmpls > max_cmpls) || ((max_cmpls > 0) && (cmpls == NULL))) {
+		return -EINVAL;
+	}
+
+	aio = fh->aio;
+	if (aio == NULL) {
+		return (min_cmpls > 0 ? -EINVAL : 0);
+	}
+
+	pthread_mutex_lock(&aio->lock);
+	if (min_cmpls > aio->num_pending) {
+		/* would never be woken */
+		pthread_mutex_unlock(&aio->lock);
+		return -EINVAL;
+	}
+
+	while (n < max_cmpls) {
+		uint64_t cnt;
+		ssize_t rret;
+
+		req = elasto_faio_req_pop(&aio->cmpl_reqs);
+		if (req == NULL) {
+			if (n >= min_cmpls) {
+				break;
+			}
+			pthread_cond_wait(&aio->cmpl_cond, &aio->lock);
+			continue;
+		}
+
+		rret = read(aio->efd, &cnt, sizeof(cnt));
+		if (rret != sizeof(cnt)) {
+			dbg(0, "completion eventfd out of sync\n");
+		}
+		aio->num_pending--;
+		cmpls[n].tag = req->tag;
+		cmpls[n].ret = req->ret;
+		free(req);
+		n++;
+	}
+	pthread_mutex_unlock(&aio->lock);
+
+	return n;
+}
+
+void
+elasto_faio_destroy(struct elasto_fh *fh)
+{
+	if (fh->aio == NULL) {
+		return;
+	}
+
+	elasto_faio_free(fh->aio);
+	fh->aio = NULL;
+}
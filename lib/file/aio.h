@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _AIO_H_
+#define _AIO_H_
+
+/*
+ * Wait for in-flight async requests on @fh, drop any that are queued or
+ * unreaped, and close the async channels.
+ */
+void
+elasto_faio_destroy(struct elasto_fh *fh);
+
+#endif /* _AIO_H_ */
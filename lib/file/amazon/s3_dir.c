@@ -39,6 +39,34 @@
 #include "s3_open.h"
 #include "s3_dir.h"
 
+/* state for list entries streamed to the readdir dent_cb */
+struct s3_readdir_ctx {
+	void *cli_priv;
+	int (*dent_cb)(struct elasto_dent *, void *);
+	int cb_ret;
+};
+
+static int
+s3_freaddir_obj_cb(struct s3_object *obj,
+		   void *cb_priv)
+{
+	struct s3_readdir_ctx *ctx = cb_priv;
+	struct elasto_dent dent;
+
+	memset(&dent, 0, sizeof(dent));
+	dent.name = obj->key;
+	dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
+	dent.fstat.size = obj->size;
+	dent.fstat.blksize = 0;	/* flag as vacant */
+	dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
+	dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_SIZE);
+
+	/* cb may request immediate error return, which stops the parse */
+	ctx->cb_ret = ctx->dent_cb(&dent, ctx->cli_priv);
+	return ctx->cb_ret;
+}
+
 static int
 s3_freaddir_bkt(struct s3_fh *s3_fh,
 		void *cli_priv,
@@ -47,41 +75,25 @@ s3_freaddir_bkt(struct s3_fh *s3_fh,
 {
 	int ret;
 	struct op *op;
-	struct s3_rsp_bkt_list *bkt_list_rsp;
-	struct s3_object *obj;
+	struct s3_readdir_ctx ctx = { cli_priv, dent_cb, 0 };
 
 	ret = s3_req_bkt_list(&s3_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	ret = elasto_fop_send_recv(s3_fh->conn, op);
+	/* dents are emitted as the response is parsed, without an obj list */
+	ret = s3_req_bkt_list_cb_set(op, s3_freaddir_obj_cb, &ctx);
 	if (ret < 0) {
 		goto err_op_free;
 	}
 
-	bkt_list_rsp = s3_rsp_bkt_list(op);
-	if (bkt_list_rsp == NULL) {
-		ret = -ENOMEM;
+	ret = elasto_fop_send_recv(s3_fh->conn, op);
+	if (ctx.cb_ret < 0) {
+		ret = ctx.cb_ret;
+		goto err_op_free;
+	} else if (ret < 0) {
 		goto err_op_free;
-	}
-
-	list_for_each(&bkt_list_rsp->objs, obj, list) {
-		struct elasto_dent dent;
-
-		memset(&dent, 0, sizeof(dent));
-		dent.name = obj->key;
-		dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
-		dent.fstat.size = obj->size;
-		dent.fstat.blksize = 0;	/* flag as vacant */
-		dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
-		dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
-					| ELASTO_FSTAT_FIELD_SIZE);
-		ret = dent_cb(&dent, cli_priv);
-		if (ret < 0) {
-			/* cb requests immediate error return */
-			goto err_op_free;
-		}
 	}
 
 	ret = 0;
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 #include <time.h>
 #include <unistd.h>
@@ -43,6 +44,26 @@
 #include "s3_stat.h"
 #include "s3_unlink.h"
 
+static int
+s3_fh_presign_method_parse(const char *method_str,
+			   enum op_req_method *_method)
+{
+	if ((method_str == NULL) || (strcasecmp(method_str, "GET") == 0)) {
+		*_method = REQ_METHOD_GET;
+	} else if (strcasecmp(method_str, "PUT") == 0) {
+		*_method = REQ_METHOD_PUT;
+	} else if (strcasecmp(method_str, "HEAD") == 0) {
+		*_method = REQ_METHOD_HEAD;
+	} else if (strcasecmp(method_str, "DELETE") == 0) {
+		*_method = REQ_METHOD_DELETE;
+	} else {
+		dbg(0, "unsupported pre-signed method: %s\n", method_str);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int
 s3_fh_init(const struct elasto_fauth *auth,
 	   void **_fh_priv,
@@ -60,14 +81,47 @@ s3_fh_init(const struct elasto_fauth *auth,
 	}
 	memset(s3_fh, 0, sizeof(*s3_fh));
 
-	ret = s3_creds_csv_process(auth->s3.creds_path,
-				   &s3_fh->iam_user,
-				   &s3_fh->key_id,
-				   &s3_fh->secret);
-	if (ret < 0) {
+	if (auth->s3.creds_path != NULL) {
+		ret = s3_creds_csv_process(auth->s3.creds_path,
+					   &s3_fh->iam_user,
+					   &s3_fh->key_id,
+					   &s3_fh->secret);
+		if (ret < 0) {
+			goto err_priv_free;
+		}
+	} else if (auth->s3.presign_query != NULL) {
+		ret = s3_fh_presign_method_parse(auth->s3.presign_method,
+						 &s3_fh->presign_method);
+		if (ret < 0) {
+			goto err_priv_free;
+		}
+		s3_fh->presign_query = strdup(auth->s3.presign_query);
+		if (s3_fh->presign_query == NULL) {
+			ret = -ENOMEM;
+			goto err_priv_free;
+		}
+	} else {
+		dbg(0, "init called without auth credentials\n");
+		ret = -EINVAL;
 		goto err_priv_free;
 	}
 
+	if (auth->s3.region != NULL) {
+		s3_fh->region = strdup(auth->s3.region);
+		if (s3_fh->region == NULL) {
+			ret = -ENOMEM;
+			goto err_creds_free;
+		}
+	}
+
+	if (auth->s3.endpoint != NULL) {
+		s3_fh->endpoint = strdup(auth->s3.endpoint);
+		if (s3_fh->endpoint == NULL) {
+			ret = -ENOMEM;
+			goto err_region_free;
+		}
+	}
+
 	s3_fh->insecure_http = auth->insecure_http;
 	/* connect on open */
 
@@ -83,6 +137,7 @@ s3_fh_init(const struct elasto_fauth *auth,
 		.splice = s3_fsplice,
 		.stat = s3_fstat,
 		.statfs = s3_fstatvfs,
+		.stat_invalidate = s3_fstat_invalidate,
 		.lease_acquire = NULL,
 		.lease_break = NULL,
 		.lease_release = NULL,
@@ -93,6 +148,13 @@ s3_fh_init(const struct elasto_fauth *auth,
 
 	return 0;
 
+err_region_free:
+	free(s3_fh->region);
+err_creds_free:
+	free(s3_fh->iam_user);
+	free(s3_fh->key_id);
+	free(s3_fh->secret);
+	free(s3_fh->presign_query);
 err_priv_free:
 	free(s3_fh);
 err_out:
@@ -119,5 +181,8 @@ s3_fh_free(void *mod_priv)
 	free(s3_fh->iam_user);
 	free(s3_fh->key_id);
 	free(s3_fh->secret);
+	free(s3_fh->region);
+	free(s3_fh->endpoint);
+	free(s3_fh->presign_query);
 	free(s3_fh);
 }
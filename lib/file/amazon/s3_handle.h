@@ -19,8 +19,19 @@ struct s3_fh {
 	char *iam_user;
 	char *key_id;
 	char *secret;
+	char *region;
+	char *endpoint;		/* replaces path.host if set */
+	char *presign_query;	/* used instead of key_id/secret if set */
+	enum op_req_method presign_method;
 	bool insecure_http;
 	struct elasto_conn *conn;
+	uint32_t io_depth;
+	/* reads larger than this are split into parallel ranged requests */
+	uint64_t io_chunk;
+	/* duplicates of @conn for parallel I/O */
+	struct elasto_fxmit_pool *xmit_pool;
+	/* object stat results, NULL if disabled */
+	struct elasto_fsc *stat_cache;
 };
 
 /* module entry point */
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "ccan/list/list.h"
 #include "lib/exml.h"
@@ -36,6 +37,7 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "s3_handle.h"
 #include "s3_stat.h"
 #include "s3_io.h"
@@ -50,6 +52,8 @@ struct s3_fwrite_multi_data_ctx {
 	uint64_t this_off;
 	uint64_t this_len;
 	struct elasto_data *src_data;
+	/* parts are sent in parallel, so serialise source callbacks */
+	pthread_mutex_t *src_lock;
 };
 
 static int
@@ -62,7 +66,6 @@ s3_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
 	struct s3_fwrite_multi_data_ctx *data_ctx = priv;
 	int ret;
 	uint8_t *this_src_buf;
-	uint8_t *out_buf;
 
 	/* sanity checks */
 	if ((need > S3_MAX_PART)
@@ -73,18 +76,10 @@ s3_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
 		goto err_out;
 	}
 
-	/* TODO add free_cb to ELASTO_DATA_CB and avoid copy */
-	out_buf = malloc(need);
-	if (out_buf == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
-	}
-
+	/* lend the source buffer, see s3_fwrite_multi_iov_data_out_free */
 	this_src_buf = data_ctx->src_data->iov.buf
 					+ data_ctx->this_off + stream_off;
-	memcpy(out_buf, this_src_buf, need);
-	/* out_buf freed by connection layer after send */
-	*_out_buf = out_buf;
+	*_out_buf = this_src_buf;
 	*buf_len = need;
 
 	ret = 0;
@@ -112,14 +107,16 @@ s3_fwrite_multi_cb_data_out_cb(uint64_t stream_off,
 		goto err_out;
 	}
 
+	pthread_mutex_lock(data_ctx->src_lock);
 	ret = data_ctx->src_data->cb.out_cb(data_ctx->this_off + stream_off,
 					    need, &this_out_buf, &this_buf_len,
 					    data_ctx->src_data->cb.priv);
+	pthread_mutex_unlock(data_ctx->src_lock);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	/* out_buf freed by connection layer after send */
+	/* returned to src_data via s3_fwrite_multi_cb_data_out_free */
 	*_out_buf = this_out_buf;
 	*buf_len = this_buf_len;
 
@@ -128,16 +125,46 @@ err_out:
 	return ret;
 }
 
+/*
+ * nothing to release. The conn layer drops any body references before the
+ * request returns, so the caller's iov buffer is never used beyond it.
+ */
+static void
+s3_fwrite_multi_iov_data_out_free(uint8_t *out_buf,
+				void *priv)
+{
+	return;
+}
+
+static void
+s3_fwrite_multi_cb_data_out_free(uint8_t *out_buf,
+			       void *priv)
+{
+	struct s3_fwrite_multi_data_ctx *data_ctx = priv;
+
+	pthread_mutex_lock(data_ctx->src_lock);
+	elasto_data_cb_out_buf_put(data_ctx->src_data, out_buf);
+	pthread_mutex_unlock(data_ctx->src_lock);
+}
+
 static int
 s3_fwrite_multi_data_setup(uint64_t this_off,
 			    uint64_t this_len,
 			    struct elasto_data *src_data,
+			    pthread_mutex_t *src_lock,
 			    struct elasto_data **_this_data)
 {
 	struct elasto_data *this_data;
 	struct s3_fwrite_multi_data_ctx *data_ctx;
+	void (*out_free_cb)(uint8_t *out_buf, void *priv);
 	int ret;
 
+	if (src_data->type == ELASTO_DATA_IOVEC) {
+		/* parts reference the source segments directly */
+		return elasto_data_iovec_slice_new(src_data, this_off, this_len,
+						   _this_data);
+	}
+
 	data_ctx = malloc(sizeof(*data_ctx));
 	if (data_ctx == NULL) {
 		ret = -ENOMEM;
@@ -147,15 +174,18 @@ s3_fwrite_multi_data_setup(uint64_t this_off,
 	data_ctx->this_off = this_off;
 	data_ctx->this_len = this_len;
 	data_ctx->src_data = src_data;
+	data_ctx->src_lock = src_lock;
 
 	if (src_data->type == ELASTO_DATA_IOV) {
 		ret = elasto_data_cb_new(this_len,
 					 s3_fwrite_multi_iov_data_out_cb,
 					 0, NULL, data_ctx, &this_data);
+		out_free_cb = s3_fwrite_multi_iov_data_out_free;
 	} else if (src_data->type == ELASTO_DATA_CB) {
 		ret = elasto_data_cb_new(this_len,
 					 s3_fwrite_multi_cb_data_out_cb,
 					 0, NULL, data_ctx, &this_data);
+		out_free_cb = s3_fwrite_multi_cb_data_out_free;
 	} else {
 		assert(false);	/* already checked */
 	}
@@ -163,10 +193,17 @@ s3_fwrite_multi_data_setup(uint64_t this_off,
 		goto err_ctx_free;
 	}
 
+	ret = elasto_data_cb_out_free_set(this_data, out_free_cb);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+
 	*_this_data = this_data;
 
 	return 0;
 
+err_data_free:
+	elasto_data_free(this_data);
 err_ctx_free:
 	free(data_ctx);
 err_out:
@@ -177,9 +214,12 @@ static void
 s3_fwrite_multi_data_free(struct elasto_data *this_data)
 {
 	/* TODO implement and use elasto_data_cbpriv_get */
-	struct s3_fwrite_multi_data_ctx *data_ctx = this_data->cb.priv;
+	struct s3_fwrite_multi_data_ctx *data_ctx;
 
-	free(data_ctx);
+	if (this_data->type == ELASTO_DATA_CB) {
+		data_ctx = this_data->cb.priv;
+		free(data_ctx);
+	}
 	elasto_data_free(this_data);
 }
 
@@ -221,83 +261,52 @@ err_out:
 }
 
 static int
-s3_fwrite_multi_handle(struct s3_fh *s3_fh,
-		       const char *upload_id,
-		       int part_num,
-		       struct elasto_data *this_data,
-		       struct s3_part **_part)
+s3_fwrite_multi_finish(struct s3_fh *s3_fh,
+		       char *upload_id,
+		       uint64_t num_parts,
+		       struct list_head *parts)
 {
 	int ret;
 	struct op *op;
-	struct s3_rsp_part_put *part_put_rsp;
-	struct s3_part *part;
-
-	part = malloc(sizeof(*part));
-	if (part == NULL) {
-		goto err_out;
-	}
-	memset(part, 0, sizeof(*part));
 
-	ret = s3_req_part_put(&s3_fh->path, upload_id, part_num, this_data,
-			      &op);
+	ret = s3_req_mp_done(&s3_fh->path, upload_id, num_parts, parts, &op);
 	if (ret < 0) {
-		goto err_part_free;
+		goto err_out;
 	}
 
 	ret = elasto_fop_send_recv(s3_fh->conn, op);
 	if (ret < 0) {
-		dbg(0, "part put failed: %s\n", strerror(-ret));
-		goto err_op_free;
-	}
-
-	part_put_rsp = s3_rsp_part_put(op);
-	if (part_put_rsp == NULL) {
-		ret = -ENOMEM;
-		goto err_op_free;
-	}
-
-	part->pnum = part_num;
-	part->etag = strdup(part_put_rsp->etag);
-	if (part->etag == NULL) {
-		ret = -ENOMEM;
+		dbg(0, "multi-part done req failed: %s\n", strerror(-ret));
 		goto err_op_free;
 	}
-	*_part = part;
-	op->req.data = NULL;
-	op_free(op);
-
-	return 0;
 
+	dbg(0, "multipart upload %s finished\n", upload_id);
+	ret = 0;
 err_op_free:
-	op->req.data = NULL;
 	op_free(op);
-err_part_free:
-	free(part);
 err_out:
 	return ret;
 }
 
 static int
-s3_fwrite_multi_finish(struct s3_fh *s3_fh,
-		       char *upload_id,
-		       uint64_t num_parts,
-		       struct list_head *parts)
+s3_fwrite_multi_abort(struct s3_fh *s3_fh,
+		      char *upload_id)
 {
 	int ret;
 	struct op *op;
 
-	ret = s3_req_mp_done(&s3_fh->path, upload_id, num_parts, parts, &op);
+	ret = s3_req_mp_abort(&s3_fh->path, upload_id, &op);
 	if (ret < 0) {
 		goto err_out;
 	}
 
 	ret = elasto_fop_send_recv(s3_fh->conn, op);
 	if (ret < 0) {
-		dbg(0, "multi-part done req failed: %s\n", strerror(-ret));
+		dbg(0, "multi-part abort req failed: %s\n", strerror(-ret));
 		goto err_op_free;
 	}
 
-	dbg(0, "multipart upload %s finished\n", upload_id);
+	dbg(0, "multipart upload %s aborted\n", upload_id);
 	ret = 0;
 err_op_free:
 	op_free(op);
@@ -305,44 +314,114 @@ err_out:
 	return ret;
 }
 
+/*
+ * State shared by parallel part uploads. S3 part numbers start at one, so
+ * @parts[unit] carries part number unit + 1.
+ */
+struct s3_fwrite_multi_ctx {
+	struct s3_fh *s3_fh;
+	const char *upload_id;
+	uint64_t dest_off;
+	uint64_t dest_len;
+	uint64_t max_io;
+	struct elasto_data *src_data;
+	pthread_mutex_t src_lock;
+	struct s3_part *parts;
+};
+
 static int
-s3_fwrite_multi_abort(struct s3_fh *s3_fh,
-		      char *upload_id)
+s3_fwrite_multi_op_get(uint64_t unit,
+		       void *priv,
+		       struct op **_op)
 {
 	int ret;
+	struct s3_fwrite_multi_ctx *mctx = priv;
+	uint64_t data_off = unit * mctx->max_io;
+	uint64_t this_off = mctx->dest_off + data_off;
+	uint64_t this_len = MIN(mctx->max_io, mctx->dest_len - data_off);
+	struct elasto_data *this_data;
 	struct op *op;
 
-	ret = s3_req_mp_abort(&s3_fh->path, upload_id, &op);
+	dbg(0, "%" PRIu64 " multi fwrite: off=%" PRIu64 ", len=%"
+	       PRIu64 "\n", unit + 1, this_off, this_len);
+
+	ret = s3_fwrite_multi_data_setup(this_off, this_len, mctx->src_data,
+					 &mctx->src_lock, &this_data);
 	if (ret < 0) {
+		dbg(0, "data setup failed\n");
 		goto err_out;
 	}
 
-	ret = elasto_fop_send_recv(s3_fh->conn, op);
+	ret = s3_req_part_put(&mctx->s3_fh->path, mctx->upload_id, unit + 1,
+			      this_data, &op);
 	if (ret < 0) {
-		dbg(0, "multi-part abort req failed: %s\n", strerror(-ret));
+		goto err_data_free;
+	}
+	*_op = op;
+
+	return 0;
+
+err_data_free:
+	s3_fwrite_multi_data_free(this_data);
+err_out:
+	return ret;
+}
+
+static int
+s3_fwrite_multi_op_put(uint64_t unit,
+		       struct op *op,
+		       int ret,
+		       void *priv)
+{
+	struct s3_fwrite_multi_ctx *mctx = priv;
+	struct elasto_data *this_data = op->req.data;
+	struct s3_part *part = &mctx->parts[unit];
+	struct s3_rsp_part_put *part_put_rsp;
+
+	if (ret < 0) {
+		dbg(0, "part %" PRIu64 " put failed: %s\n",
+		    unit + 1, strerror(-ret));
 		goto err_op_free;
 	}
 
-	dbg(0, "multipart upload %s aborted\n", upload_id);
+	part_put_rsp = s3_rsp_part_put(op);
+	if (part_put_rsp == NULL) {
+		ret = -ENOMEM;
+		goto err_op_free;
+	}
+
+	part->pnum = unit + 1;
+	part->etag = strdup(part_put_rsp->etag);
+	if (part->etag == NULL) {
+		ret = -ENOMEM;
+		goto err_op_free;
+	}
 	ret = 0;
+
 err_op_free:
+	op->req.data = NULL;
 	op_free(op);
-err_out:
+	s3_fwrite_multi_data_free(this_data);
 	return ret;
 }
 
 static void
-s3_fwrite_parts_free(struct list_head *parts)
+s3_fwrite_parts_free(struct s3_part *parts,
+		     uint64_t num_parts)
 {
-	struct s3_part *part;
-	struct s3_part *part_n;
+	uint64_t i;
 
-	list_for_each_safe(parts, part, part_n, list) {
-		free(part->etag);
-		free(part);
+	for (i = 0; i < num_parts; i++) {
+		free(parts[i].etag);
 	}
+	free(parts);
 }
 
+/*
+ * Parts are uploaded in parallel across the handle's connection pool. A
+ * failed part is resent on its own, and the upload is only aborted once a
+ * part has exhausted its attempts.
+ */
 static int
 s3_fwrite_multi(struct s3_fh *s3_fh,
 		uint64_t dest_off,
@@ -352,63 +431,74 @@ s3_fwrite_multi(struct s3_fh *s3_fh,
 {
 	int ret;
 	char *upload_id;
-	struct elasto_data *this_data;
-	uint64_t data_remain = dest_len;
-	uint64_t data_off = 0;
+	struct s3_fwrite_multi_ctx mctx;
 	struct list_head parts;
-	uint64_t part_num = 1;	/* must be > 0 */
+	uint64_t num_parts = (dest_len + max_io - 1) / max_io;
+	uint64_t i;
 
-	ret = s3_fwrite_multi_start(s3_fh, &upload_id);
-	if (ret < 0) {
+	if (s3_fh->xmit_pool == NULL) {
+		ret = elasto_fxmit_pool_init(s3_fh->conn, s3_fh->io_depth,
+					     &s3_fh->xmit_pool);
+		if (ret < 0) {
+			goto err_out;
+		}
+	}
+
+	memset(&mctx, 0, sizeof(mctx));
+	mctx.parts = calloc(num_parts, sizeof(*mctx.parts));
+	if (mctx.parts == NULL) {
+		ret = -ENOMEM;
 		goto err_out;
 	}
 
-	list_head_init(&parts);
-	while (data_remain > 0) {
-		struct s3_part *part;
-		uint64_t this_off = dest_off + data_off;
-		uint64_t this_len = MIN(max_io, data_remain);
+	ret = pthread_mutex_init(&mctx.src_lock, NULL);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_parts_free;
+	}
 
-		dbg(0, "%" PRIu64 " multi fwrite: off=%" PRIu64 ", len=%"
-		       PRIu64 "\n", part_num, this_off, this_len);
+	ret = s3_fwrite_multi_start(s3_fh, &upload_id);
+	if (ret < 0) {
+		goto err_lock_destroy;
+	}
 
-		ret = s3_fwrite_multi_data_setup(this_off, this_len, src_data,
-						  &this_data);
-		if (ret < 0) {
-			dbg(0, "data setup failed\n");
-			goto err_mp_abort;
-		}
+	mctx.s3_fh = s3_fh;
+	mctx.upload_id = upload_id;
+	mctx.dest_off = dest_off;
+	mctx.dest_len = dest_len;
+	mctx.max_io = max_io;
+	mctx.src_data = src_data;
 
-		ret = s3_fwrite_multi_handle(s3_fh, upload_id, part_num,
-					     this_data, &part);
-		if (ret < 0) {
-			goto err_data_free;
-		}
+	ret = elasto_fop_send_recv_par(s3_fh->xmit_pool, num_parts, &mctx,
+				       s3_fwrite_multi_op_get,
+				       s3_fwrite_multi_op_put);
+	if (ret < 0) {
+		goto err_mp_abort;
+	}
 
-		s3_fwrite_multi_data_free(this_data);
-		data_off += this_len;
-		data_remain -= this_len;
-		list_add_tail(&parts, &part->list);
-		part_num++;
+	/* completion needs the ETag list in part order */
+	list_head_init(&parts);
+	for (i = 0; i < num_parts; i++) {
+		list_add_tail(&parts, &mctx.parts[i].list);
 	}
 
-	/* -1, as @part_num starts at 1 */
-	ret = s3_fwrite_multi_finish(s3_fh, upload_id, part_num - 1,
-				     &parts);
+	ret = s3_fwrite_multi_finish(s3_fh, upload_id, num_parts, &parts);
 	if (ret < 0) {
 		goto err_mp_abort;
 	}
 	free(upload_id);
-	s3_fwrite_parts_free(&parts);
+	pthread_mutex_destroy(&mctx.src_lock);
+	s3_fwrite_parts_free(mctx.parts, num_parts);
 
 	return 0;
 
-err_data_free:
-	s3_fwrite_multi_data_free(this_data);
 err_mp_abort:
 	s3_fwrite_multi_abort(s3_fh, upload_id);
 	free(upload_id);
-	s3_fwrite_parts_free(&parts);
+err_lock_destroy:
+	pthread_mutex_destroy(&mctx.src_lock);
+err_parts_free:
+	s3_fwrite_parts_free(mctx.parts, num_parts);
 err_out:
 	return ret;
 }
@@ -421,7 +511,7 @@ s3_fwrite(void *mod_priv,
 {
 	int ret;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	struct s3_fh *s3_fh = mod_priv;
 	uint32_t max_io;
 
@@ -437,19 +527,24 @@ s3_fwrite(void *mod_priv,
 		goto err_out;
 	}
 
-	/* check current length <= dest_len, otherwise overwrite truncates */
-	ret = s3_fstat(mod_priv, &fstat);
-	if (ret < 0) {
-		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
+	/*
+	 * check current length <= dest_len, otherwise overwrite truncates.
+	 * A pre-signed PUT can't be used to stat, so always replaces.
+	 */
+	if (s3_fh->presign_query != NULL) {
+		cur_len = 0;
+	} else {
+		ret = elasto_fsc_size_get(s3_fh->stat_cache, mod_priv,
+					  s3_fstat, 0, dest_len, &cur_len);
+		if (ret < 0) {
+			goto err_out;
+		}
 	}
 
-	if (fstat.size > dest_len) {
+	if (cur_len > dest_len) {
 		dbg(0, "S3 backend doesn't allow overwrites when IO len (%"
 		    PRIu64 ") < current len (%" PRIu64 ")\n",
-		    dest_len, fstat.size);
+		    dest_len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -463,6 +558,9 @@ s3_fwrite(void *mod_priv,
 		/* split large IOs into multi-part uploads */
 		ret = s3_fwrite_multi(s3_fh, dest_off, dest_len,
 				      src_data, max_io);
+		if (ret == 0) {
+			elasto_fsc_size_set(s3_fh->stat_cache, dest_len);
+		}
 		return ret;
 	}
 
@@ -475,6 +573,8 @@ s3_fwrite(void *mod_priv,
 	if (ret < 0) {
 		goto err_op_free;
 	}
+	/* the put replaces the object, leaving it dest_len long */
+	elasto_fsc_size_set(s3_fh->stat_cache, dest_len);
 	ret = 0;
 
 err_op_free:
@@ -484,6 +584,18 @@ err_out:
 	return ret;
 }
 
+static int
+s3_fread_par_op_get(uint64_t off,
+		    uint64_t len,
+		    struct elasto_data *this_data,
+		    void *priv,
+		    struct op **_op)
+{
+	struct s3_fh *s3_fh = priv;
+
+	return s3_req_obj_get(&s3_fh->path, off, len, this_data, _op);
+}
+
 int
 s3_fread(void *mod_priv,
 	 uint64_t src_off,
@@ -494,6 +606,21 @@ s3_fread(void *mod_priv,
 	struct op *op;
 	struct s3_fh *s3_fh = mod_priv;
 
+	if ((src_len > s3_fh->io_chunk) && (dest_data != NULL)) {
+		if (s3_fh->xmit_pool == NULL) {
+			ret = elasto_fxmit_pool_init(s3_fh->conn,
+						     s3_fh->io_depth,
+						     &s3_fh->xmit_pool);
+			if (ret < 0) {
+				goto err_out;
+			}
+		}
+		/* fetch @io_chunk sized ranges in parallel */
+		return elasto_fop_read_par(s3_fh->xmit_pool, src_off, src_len,
+					   dest_data, s3_fh->io_chunk, s3_fh,
+					   s3_fread_par_op_get);
+	}
+
 	ret = s3_req_obj_get(&s3_fh->path, src_off, src_len, dest_data, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -522,7 +649,7 @@ s3_fsplice(void *src_mod_priv,
 	struct s3_fh *src_s3_fh = src_mod_priv;
 	struct s3_fh *dest_s3_fh = dest_mod_priv;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	int ret;
 
 	if (len == 0) {
@@ -538,18 +665,16 @@ s3_fsplice(void *src_mod_priv,
 	}
 
 	/* check source length matches the copy length */
-	ret = s3_fstat(src_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(src_s3_fh->stat_cache, src_mod_priv,
+				  s3_fstat, len, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size != len) {
+	if (cur_len != len) {
 		/* TODO could play with multi-part copies here */
 		dbg(0, "S3 backend doesn't allow partial copies: src_len=%"
-		    PRIu64 ", copy_len=%" PRIu64 "\n", fstat.size, len);
+		    PRIu64 ", copy_len=%" PRIu64 "\n", cur_len, len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -558,18 +683,16 @@ s3_fsplice(void *src_mod_priv,
 	 * check dest file's current length <= copy len, otherwise overwrite
 	 * truncates.
 	 */
-	ret = s3_fstat(dest_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(dest_s3_fh->stat_cache, dest_mod_priv,
+				  s3_fstat, 0, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size > len) {
+	if (cur_len > len) {
 		dbg(0, "S3 backend doesn't allow splice overwrites when IO len "
 		       "(%" PRIu64 ") < current len (%" PRIu64 ")\n",
-		       len, fstat.size);
+		       len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -583,6 +706,7 @@ s3_fsplice(void *src_mod_priv,
 	if (ret < 0) {
 		goto err_op_free;
 	}
+	elasto_fsc_size_set(dest_s3_fh->stat_cache, len);
 
 	ret = 0;
 err_op_free:
@@ -37,17 +37,49 @@
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
 #include "lib/file/token.h"
+#include "lib/file/scache.h"
 #include "s3_handle.h"
+#include "s3_stat.h"
 #include "s3_open.h"
 
 #define S3_FOPEN_LOCATION_DEFAULT "eu-central-1"
 
+/* limit the connection to the single request covered by the signature */
+static int
+s3_fopen_presign_setup(struct s3_fh *s3_fh)
+{
+	int ret;
+	char *url_path;
+
+	if (s3_fh->path.obj == NULL) {
+		dbg(0, "pre-signed auth is only supported for objects\n");
+		return -EACCES;
+	}
+
+	ret = elasto_conn_sign_setquery(s3_fh->conn, s3_fh->presign_query);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = s3_req_url_path_get(&s3_fh->path, &url_path);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = elasto_conn_sign_setquery_scope(s3_fh->conn,
+					      s3_fh->presign_method, url_path);
+	free(url_path);
+	return ret;
+}
+
 static int
 s3_fopen_obj(struct s3_fh *s3_fh,
 	     uint64_t flags)
 {
 	int ret;
 	struct op *op;
+	struct s3_rsp_obj_head *obj_head_rsp;
+	struct elasto_fstat fstat;
 	bool created = false;
 
 	if (flags & ELASTO_FOPEN_DIRECTORY) {
@@ -56,6 +88,18 @@ s3_fopen_obj(struct s3_fh *s3_fh,
 		goto err_out;
 	}
 
+	if ((s3_fh->presign_query != NULL)
+	 && (s3_fh->presign_method != REQ_METHOD_HEAD)) {
+		/* existence can't be checked, PUT creates on write */
+		if (flags & ELASTO_FOPEN_EXCL) {
+			dbg(0, "exclusive create needs a pre-signed HEAD\n");
+			ret = -EACCES;
+			goto err_out;
+		}
+		ret = ELASTO_FOPEN_RET_EXISTED;
+		goto err_out;
+	}
+
 	ret = s3_req_obj_head(&s3_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -89,6 +133,15 @@ s3_fopen_obj(struct s3_fh *s3_fh,
 		created = true;
 	} else if (ret < 0) {
 		goto err_op_free;
+	} else {
+		obj_head_rsp = s3_rsp_obj_head(op);
+		if (obj_head_rsp == NULL) {
+			ret = -ENOMEM;
+			goto err_op_free;
+		}
+		/* seed the stat cache, saving a round trip on first write */
+		s3_fstat_obj_fill(obj_head_rsp, &fstat);
+		elasto_fsc_set(s3_fh->stat_cache, &fstat);
 	}
 
 	ret = (created ? ELASTO_FOPEN_RET_CREATED : ELASTO_FOPEN_RET_EXISTED);
@@ -211,24 +264,55 @@ s3_fopen(void *mod_priv,
 	char *url_host;
 	struct s3_fh *s3_fh = mod_priv;
 
-	ret = s3_path_parse(path, &s3_fh->path);
+	ret = elasto_fxmit_depth_get(open_toks, &s3_fh->io_depth);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = elasto_fxmit_chunk_get(open_toks, &s3_fh->io_chunk);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	/* TODO s3_fh->path.host is currently ignored */
-	ret = s3_req_hostname_get(s3_fh->path.bkt, &url_host);
+	ret = elasto_fsc_setup(open_toks, &s3_fh->stat_cache);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = s3_path_parse(path, &s3_fh->path);
+	if (ret < 0) {
+		goto err_sc_free;
+	}
+
+	if (s3_fh->endpoint != NULL) {
+		free(s3_fh->path.host);
+		s3_fh->path.host = strdup(s3_fh->endpoint);
+		if (s3_fh->path.host == NULL) {
+			ret = -ENOMEM;
+			goto err_path_free;
+		}
+	}
+
+	ret = s3_req_hostname_get(&s3_fh->path, &url_host);
 	if (ret < 0) {
 		goto err_path_free;
 	}
 
 	ret = elasto_conn_init_s3(s3_fh->key_id, s3_fh->secret,
-				  s3_fh->insecure_http, url_host, &s3_fh->conn);
+				  s3_fh->region, s3_fh->insecure_http,
+				  url_host, &s3_fh->conn);
 	free(url_host);
 	if (ret < 0) {
 		goto err_path_free;
 	}
 
+	if (s3_fh->presign_query != NULL) {
+		ret = s3_fopen_presign_setup(s3_fh);
+		if (ret < 0) {
+			goto err_conn_free;
+		}
+	}
+
 	if (s3_fh->path.obj != NULL) {
 		ret = s3_fopen_obj(s3_fh, flags);
 		if (ret < 0) {
@@ -252,6 +336,9 @@ err_conn_free:
 	elasto_conn_free(s3_fh->conn);
 err_path_free:
 	s3_path_free(&s3_fh->path);
+err_sc_free:
+	elasto_fsc_free(s3_fh->stat_cache);
+	s3_fh->stat_cache = NULL;
 err_out:
 	return ret;
 }
@@ -261,6 +348,10 @@ s3_fclose(void *mod_priv)
 {
 	struct s3_fh *s3_fh = mod_priv;
 
+	elasto_fxmit_pool_free(s3_fh->xmit_pool);
+	s3_fh->xmit_pool = NULL;
+	elasto_fsc_free(s3_fh->stat_cache);
+	s3_fh->stat_cache = NULL;
 	elasto_conn_free(s3_fh->conn);
 	s3_path_free(&s3_fh->path);
 
@@ -35,9 +35,25 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "s3_handle.h"
 #include "s3_stat.h"
 
+/* fill @fstat from an object HEAD response, obtained on stat or open */
+void
+s3_fstat_obj_fill(struct s3_rsp_obj_head *obj_head_rsp,
+		  struct elasto_fstat *fstat)
+{
+	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
+	fstat->size = obj_head_rsp->len;
+	fstat->blksize = 0;	/* leave vacant for now */
+	fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
+	/* flag which values are valid in the stat response */
+	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_SIZE);
+	elasto_fstat_etag_set(fstat, obj_head_rsp->etag);
+}
+
 static int
 s3_fstat_obj(struct s3_fh *s3_fh,
 	     struct elasto_fstat *fstat)
@@ -46,6 +62,11 @@ s3_fstat_obj(struct s3_fh *s3_fh,
 	struct op *op;
 	struct s3_rsp_obj_head *obj_head_rsp;
 
+	ret = elasto_fsc_get(s3_fh->stat_cache, 0, fstat);
+	if (ret == 0) {
+		goto err_out;
+	}
+
 	ret = s3_req_obj_head(&s3_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -62,13 +83,8 @@ s3_fstat_obj(struct s3_fh *s3_fh,
 		goto err_op_free;
 	}
 
-	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
-	fstat->size = obj_head_rsp->len;
-	fstat->blksize = 0;	/* leave vacant for now */
-	fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
-	/* flag which values are valid in the stat response */
-	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
-				| ELASTO_FSTAT_FIELD_SIZE);
+	s3_fstat_obj_fill(obj_head_rsp, fstat);
+	elasto_fsc_set(s3_fh->stat_cache, fstat);
 	ret = 0;
 
 err_op_free:
@@ -162,6 +178,14 @@ err_out:
 	return ret;
 }
 
+void
+s3_fstat_invalidate(void *mod_priv)
+{
+	struct s3_fh *s3_fh = mod_priv;
+
+	elasto_fsc_invalidate(s3_fh->stat_cache);
+}
+
 const struct elasto_fstatfs_region s3_regions[] = {
 	{"US Standard", "us-east-1"},
 	{"US West (Oregon)", "us-west-2"},
@@ -178,8 +202,10 @@ int
 s3_fstatvfs(void *mod_priv,
 	    struct elasto_fstatfs *fstatfs)
 {
+	struct s3_fh *s3_fh = mod_priv;
+
 	fstatfs->iosize_min = 1;
-	fstatfs->iosize_optimal = 512;
+	fstatfs->iosize_optimal = s3_fh->io_chunk * s3_fh->io_depth;
 
 	/*
 	 * S3 objects aren't sparse, nor can they be written to at arbitrary
@@ -14,10 +14,19 @@
 #ifndef _S3_STAT_H_
 #define _S3_STAT_H_
 
+struct s3_rsp_obj_head;
+
+void
+s3_fstat_obj_fill(struct s3_rsp_obj_head *obj_head_rsp,
+		  struct elasto_fstat *fstat);
+
 int
 s3_fstat(void *mod_priv,
 	 struct elasto_fstat *fstat);
 
+void
+s3_fstat_invalidate(void *mod_priv);
+
 int
 s3_fstatvfs(void *mod_priv,
 	    struct elasto_fstatfs *fstatfs);
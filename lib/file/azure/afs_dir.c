@@ -42,6 +42,42 @@
 #include "afs_open.h"
 #include "afs_dir.h"
 
+/* state for list entries streamed to the readdir dent_cb */
+struct afs_readdir_ctx {
+	void *cli_priv;
+	int (*dent_cb)(struct elasto_dent *, void *);
+	int cb_ret;
+};
+
+static int
+afs_freaddir_ent_cb(struct az_fs_ent *fs_ent,
+		    void *cb_priv)
+{
+	struct afs_readdir_ctx *ctx = cb_priv;
+	struct elasto_dent dent;
+
+	memset(&dent, 0, sizeof(dent));
+	if (fs_ent->type == AZ_FS_ENT_TYPE_FILE) {
+		dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
+		dent.name = fs_ent->file.name;
+		dent.fstat.size = fs_ent->file.size;
+		dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
+					| ELASTO_FSTAT_FIELD_SIZE);
+	} else if (fs_ent->type == AZ_FS_ENT_TYPE_DIR) {
+		dent.fstat.ent_type = ELASTO_FSTAT_ENT_DIR;
+		dent.name = fs_ent->dir.name;
+		dent.fstat.field_mask = ELASTO_FSTAT_FIELD_TYPE;
+	} else {
+		dbg(0, "invalid fs_ent type: %d\n", (int)fs_ent->type);
+		ctx->cb_ret = -EINVAL;
+		return ctx->cb_ret;
+	}
+
+	/* cb may request immediate error return, which stops the parse */
+	ctx->cb_ret = ctx->dent_cb(&dent, ctx->cli_priv);
+	return ctx->cb_ret;
+}
+
 static int
 afs_freaddir_share(struct afs_fh *afs_fh,
 		   void *cli_priv,
@@ -50,50 +86,25 @@ afs_freaddir_share(struct afs_fh *afs_fh,
 {
 	int ret;
 	struct op *op;
-	struct az_fs_rsp_dirs_files_list *dirs_files_list_rsp;
-	struct az_fs_ent *fs_ent;
+	struct afs_readdir_ctx ctx = { cli_priv, dent_cb, 0 };
 
 	ret = az_fs_req_dirs_files_list(&afs_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	ret = elasto_fop_send_recv(afs_fh->io_conn, op);
+	/* dents are emitted as the response is parsed, without an ent list */
+	ret = az_fs_req_dirs_files_list_cb_set(op, afs_freaddir_ent_cb, &ctx);
 	if (ret < 0) {
 		goto err_op_free;
 	}
 
-	dirs_files_list_rsp = az_fs_rsp_dirs_files_list(op);
-	if (dirs_files_list_rsp == NULL) {
-		ret = -ENOMEM;
+	ret = elasto_fop_send_recv(afs_fh->io_conn, op);
+	if (ctx.cb_ret < 0) {
+		ret = ctx.cb_ret;
+		goto err_op_free;
+	} else if (ret < 0) {
 		goto err_op_free;
-	}
-
-	list_for_each(&dirs_files_list_rsp->ents, fs_ent, list) {
-		struct elasto_dent dent;
-
-		memset(&dent, 0, sizeof(dent));
-		if (fs_ent->type == AZ_FS_ENT_TYPE_FILE) {
-			dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
-			dent.name = fs_ent->file.name;
-			dent.fstat.size = fs_ent->file.size;
-			dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
-						| ELASTO_FSTAT_FIELD_SIZE);
-		} else if (fs_ent->type == AZ_FS_ENT_TYPE_DIR) {
-			dent.fstat.ent_type = ELASTO_FSTAT_ENT_DIR;
-			dent.name = fs_ent->dir.name;
-			dent.fstat.field_mask = ELASTO_FSTAT_FIELD_TYPE;
-		} else {
-			dbg(0, "invalid fs_ent type: %d\n", (int)fs_ent->type);
-			ret = -EINVAL;
-			goto err_op_free;
-		}
-
-		ret = dent_cb(&dent, cli_priv);
-		if (ret < 0) {
-			/* cb requests immediate error return */
-			goto err_op_free;
-		}
 	}
 
 	ret = 0;
@@ -71,6 +71,12 @@ afs_fh_init(const struct elasto_fauth *auth,
 			ret = -ENOMEM;
 			goto err_priv_free;
 		}
+	} else if (auth->az.sas_token != NULL) {
+		afs_fh->sas_token = strdup(auth->az.sas_token);
+		if (afs_fh->sas_token == NULL) {
+			ret = -ENOMEM;
+			goto err_priv_free;
+		}
 	} else {
 		dbg(0, "init called without auth credentials\n");
 		ret = -EINVAL;
@@ -116,6 +122,7 @@ elasto_file_mod_fh_init(const struct elasto_fauth *auth,
 		.splice = afs_fsplice,
 		.stat = afs_fstat,
 		.statfs = afs_fstatvfs,
+		.stat_invalidate = afs_fstat_invalidate,
 		.lease_acquire = NULL,
 		.lease_break = NULL,
 		.lease_release = NULL,
@@ -144,5 +151,6 @@ afs_fh_free(void *mod_priv)
 		free(afs_fh->sub_name);
 	}
 	free(afs_fh->acc_access_key);
+	free(afs_fh->sas_token);
 	free(afs_fh);
 }
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "ccan/list/list.h"
 #include "lib/exml.h"
@@ -38,6 +39,7 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "afs_handle.h"
 #include "afs_stat.h"
 #include "afs_io.h"
@@ -50,11 +52,19 @@
 #define AFS_MAX_WRITE (4 * BYTES_IN_MB)
 #define AFS_IO_SIZE_HTTP (2 * BYTES_IN_MB)
 #define AFS_IO_SIZE_HTTPS (2 * BYTES_IN_MB)
+/*
+ * Clear ranges aren't subject to the Put Range size limit, but large ones are
+ * split so that they proceed in parallel, and each completes well within the
+ * connection timeout.
+ */
+#define AFS_CLEAR_SIZE (64 * BYTES_IN_MB)
 
 struct afs_fwrite_multi_data_ctx {
 	uint64_t this_off;
 	uint64_t this_len;
 	struct elasto_data *src_data;
+	/* ranges are sent in parallel, so serialise source callbacks */
+	pthread_mutex_t *src_lock;
 };
 
 static int
@@ -67,7 +77,6 @@ afs_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
 	struct afs_fwrite_multi_data_ctx *data_ctx = priv;
 	int ret;
 	uint8_t *this_src_buf;
-	uint8_t *out_buf;
 
 	/* sanity checks */
 	if ((need > AFS_MAX_WRITE)
@@ -78,18 +87,10 @@ afs_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
 		goto err_out;
 	}
 
-	/* TODO add free_cb to ELASTO_DATA_CB and avoid copy */
-	out_buf = malloc(need);
-	if (out_buf == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
-	}
-
+	/* lend the source buffer, see afs_fwrite_multi_iov_data_out_free */
 	this_src_buf = data_ctx->src_data->iov.buf
 					+ data_ctx->this_off + stream_off;
-	memcpy(out_buf, this_src_buf, need);
-	/* out_buf freed by connection layer after send */
-	*_out_buf = out_buf;
+	*_out_buf = this_src_buf;
 	*buf_len = need;
 
 	ret = 0;
@@ -117,14 +118,16 @@ afs_fwrite_multi_cb_data_out_cb(uint64_t stream_off,
 		goto err_out;
 	}
 
+	pthread_mutex_lock(data_ctx->src_lock);
 	ret = data_ctx->src_data->cb.out_cb(data_ctx->this_off + stream_off,
 					    need, &this_out_buf, &this_buf_len,
 					    data_ctx->src_data->cb.priv);
+	pthread_mutex_unlock(data_ctx->src_lock);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	/* out_buf freed by connection layer after send */
+	/* returned to src_data via afs_fwrite_multi_cb_data_out_free */
 	*_out_buf = this_out_buf;
 	*buf_len = this_buf_len;
 
@@ -133,16 +136,46 @@ err_out:
 	return ret;
 }
 
+/*
+ * nothing to release. The conn layer drops any body references before the
+ * request returns, so the caller's iov buffer is never used beyond it.
+ */
+static void
+afs_fwrite_multi_iov_data_out_free(uint8_t *out_buf,
+				void *priv)
+{
+	return;
+}
+
+static void
+afs_fwrite_multi_cb_data_out_free(uint8_t *out_buf,
+			       void *priv)
+{
+	struct afs_fwrite_multi_data_ctx *data_ctx = priv;
+
+	pthread_mutex_lock(data_ctx->src_lock);
+	elasto_data_cb_out_buf_put(data_ctx->src_data, out_buf);
+	pthread_mutex_unlock(data_ctx->src_lock);
+}
+
 static int
 afs_fwrite_multi_data_setup(uint64_t this_off,
 			    uint64_t this_len,
 			    struct elasto_data *src_data,
+			    pthread_mutex_t *src_lock,
 			    struct elasto_data **_this_data)
 {
 	struct elasto_data *this_data;
 	struct afs_fwrite_multi_data_ctx *data_ctx;
+	void (*out_free_cb)(uint8_t *out_buf, void *priv);
 	int ret;
 
+	if (src_data->type == ELASTO_DATA_IOVEC) {
+		/* parts reference the source segments directly */
+		return elasto_data_iovec_slice_new(src_data, this_off, this_len,
+						   _this_data);
+	}
+
 	data_ctx = malloc(sizeof(*data_ctx));
 	if (data_ctx == NULL) {
 		ret = -ENOMEM;
@@ -152,15 +185,18 @@ afs_fwrite_multi_data_setup(uint64_t this_off,
 	data_ctx->this_off = this_off;
 	data_ctx->this_len = this_len;
 	data_ctx->src_data = src_data;
+	data_ctx->src_lock = src_lock;
 
 	if (src_data->type == ELASTO_DATA_IOV) {
 		ret = elasto_data_cb_new(this_len,
 					 afs_fwrite_multi_iov_data_out_cb,
 					 0, NULL, data_ctx, &this_data);
+		out_free_cb = afs_fwrite_multi_iov_data_out_free;
 	} else if (src_data->type == ELASTO_DATA_CB) {
 		ret = elasto_data_cb_new(this_len,
 					 afs_fwrite_multi_cb_data_out_cb,
 					 0, NULL, data_ctx, &this_data);
+		out_free_cb = afs_fwrite_multi_cb_data_out_free;
 	} else {
 		assert(false);	/* already checked */
 	}
@@ -168,10 +204,17 @@ afs_fwrite_multi_data_setup(uint64_t this_off,
 		goto err_ctx_free;
 	}
 
+	ret = elasto_data_cb_out_free_set(this_data, out_free_cb);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+
 	*_this_data = this_data;
 
 	return 0;
 
+err_data_free:
+	elasto_data_free(this_data);
 err_ctx_free:
 	free(data_ctx);
 err_out:
@@ -182,69 +225,138 @@ static void
 afs_fwrite_multi_data_free(struct elasto_data *this_data)
 {
 	/* TODO implement and use elasto_data_cbpriv_get */
-	struct afs_fwrite_multi_data_ctx *data_ctx = this_data->cb.priv;
+	struct afs_fwrite_multi_data_ctx *data_ctx;
 
-	free(data_ctx);
+	if (this_data->type == ELASTO_DATA_CB) {
+		data_ctx = this_data->cb.priv;
+		free(data_ctx);
+	}
 	elasto_data_free(this_data);
 }
 
+/*
+ * State shared by parallel range puts. @src_data is NULL for clear ranges,
+ * otherwise its offsets are relative to @dest_off.
+ */
+struct afs_fwrite_multi_ctx {
+	struct afs_fh *afs_fh;
+	uint64_t dest_off;
+	uint64_t dest_len;
+	uint64_t max_io;
+	struct elasto_data *src_data;
+	pthread_mutex_t src_lock;
+};
+
 static int
-afs_fwrite_multi(struct afs_fh *afs_fh,
-		 uint64_t dest_off,
-		 uint64_t dest_len,
-		 struct elasto_data *src_data,
-		 uint64_t max_io)
+afs_fwrite_multi_op_get(uint64_t unit,
+			void *priv,
+			struct op **_op)
 {
 	int ret;
+	struct afs_fwrite_multi_ctx *mctx = priv;
+	uint64_t data_off = unit * mctx->max_io;
+	uint64_t this_off = mctx->dest_off + data_off;
+	uint64_t this_len = MIN(mctx->max_io, mctx->dest_len - data_off);
+	struct elasto_data *this_data = NULL;
 	struct op *op;
-	struct elasto_data *this_data;
-	uint64_t data_remain = dest_len;
-	uint64_t data_off = 0;
 
-	while (data_remain > 0) {
-		uint64_t this_off = dest_off + data_off;
-		uint64_t this_len = MIN(max_io, data_remain);
+	dbg(0, "multi fwrite: off=%" PRIu64 ", len=%" PRIu64 "\n",
+	    this_off, this_len);
 
-		dbg(0, "multi fwrite: off=%" PRIu64 ", len=%" PRIu64 "\n",
-		    this_off, this_len);
-
-		ret = afs_fwrite_multi_data_setup(this_off, this_len, src_data,
-						  &this_data);
+	if (mctx->src_data != NULL) {
+		ret = afs_fwrite_multi_data_setup(data_off, this_len,
+						  mctx->src_data,
+						  &mctx->src_lock, &this_data);
 		if (ret < 0) {
 			dbg(0, "data setup failed\n");
 			goto err_out;
 		}
+	}
 
-		ret = az_fs_req_file_put(&afs_fh->path,
-					 this_off,
-					 this_len,
-					 this_data,
-					 &op);
-		if (ret < 0) {
-			goto err_data_free;
-		}
+	ret = az_fs_req_file_put(&mctx->afs_fh->path,
+				 this_off,
+				 this_len,
+				 this_data,	/* NULL: clear range */
+				 &op);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+	*_op = op;
 
-		ret = elasto_fop_send_recv(afs_fh->io_conn, op);
-		if (ret < 0) {
-			dbg(0, "multi-write failed at data_off %" PRIu64 "\n",
-			    data_off);
-			goto err_op_free;
-		}
+	return 0;
 
-		op->req.data = NULL;
-		op_free(op);
+err_data_free:
+	if (this_data != NULL) {
 		afs_fwrite_multi_data_free(this_data);
-		data_off += this_len;
-		data_remain -= this_len;
 	}
+err_out:
+	return ret;
+}
 
-	return 0;
+static int
+afs_fwrite_multi_op_put(uint64_t unit,
+			struct op *op,
+			int ret,
+			void *priv)
+{
+	struct afs_fwrite_multi_ctx *mctx = priv;
+	struct elasto_data *this_data = op->req.data;
+
+	if (ret < 0) {
+		dbg(0, "multi-write failed at data_off %" PRIu64 "\n",
+		    unit * mctx->max_io);
+	}
 
-err_op_free:
 	op->req.data = NULL;
 	op_free(op);
-err_data_free:
-	afs_fwrite_multi_data_free(this_data);
+	if (this_data != NULL) {
+		afs_fwrite_multi_data_free(this_data);
+	}
+
+	return ret;
+}
+
+/*
+ * AFS ranges are independent, so split writes and clears are dispatched in
+ * parallel across the handle's connection pool. The first range to fail
+ * after exhausting its resend attempts fails the whole request.
+ */
+static int
+afs_fwrite_multi(struct afs_fh *afs_fh,
+		 uint64_t dest_off,
+		 uint64_t dest_len,
+		 struct elasto_data *src_data,
+		 uint64_t max_io)
+{
+	int ret;
+	struct afs_fwrite_multi_ctx mctx;
+	uint64_t num_ranges = (dest_len + max_io - 1) / max_io;
+
+	if (afs_fh->xmit_pool == NULL) {
+		ret = elasto_fxmit_pool_init(afs_fh->io_conn, afs_fh->io_depth,
+					     &afs_fh->xmit_pool);
+		if (ret < 0) {
+			goto err_out;
+		}
+	}
+
+	memset(&mctx, 0, sizeof(mctx));
+	ret = pthread_mutex_init(&mctx.src_lock, NULL);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_out;
+	}
+
+	mctx.afs_fh = afs_fh;
+	mctx.dest_off = dest_off;
+	mctx.dest_len = dest_len;
+	mctx.max_io = max_io;
+	mctx.src_data = src_data;
+
+	ret = elasto_fop_send_recv_par(afs_fh->xmit_pool, num_ranges, &mctx,
+				       afs_fwrite_multi_op_get,
+				       afs_fwrite_multi_op_put);
+	pthread_mutex_destroy(&mctx.src_lock);
 err_out:
 	return ret;
 }
@@ -258,29 +370,32 @@ afs_fwrite(void *mod_priv,
 	int ret;
 	struct op *op;
 	struct afs_fh *afs_fh = mod_priv;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	uint64_t max_io;
 
 	if ((src_data->type != ELASTO_DATA_CB)
-				&& (src_data->type != ELASTO_DATA_IOV)) {
-		dbg(0, "afs write only supports CB and IOV data types\n");
+				&& (src_data->type != ELASTO_DATA_IOV)
+				&& (src_data->type != ELASTO_DATA_IOVEC)) {
+		dbg(0, "afs write only supports CB, IOV and IOVEC data types\n");
 		ret = -EINVAL;
 		goto err_out;
 	}
 
-	ret = afs_fstat(mod_priv, &fstat);
+	/* a stale cached length mustn't trigger a shrinking truncate */
+	ret = elasto_fsc_size_get(afs_fh->stat_cache, mod_priv, afs_fstat,
+				  dest_off + dest_len, UINT64_MAX, &cur_len);
 	if (ret < 0) {
 		dbg(0, "failed to stat dest file: %s\n", strerror(-ret));
 		goto err_out;
 	}
 
-	if (fstat.size < dest_off + dest_len) {
+	if (cur_len < dest_off + dest_len) {
 		/*
 		 * Need to truncate file out to new (larger) length, as AFS Put
 		 * Range doesn't allow writes past the current length.
 		 */
 		dbg(0, "truncating file from %" PRIu64 " to %" PRIu64
-		    " prior to write\n", fstat.size, dest_off + dest_len);
+		    " prior to write\n", cur_len, dest_off + dest_len);
 		ret = afs_ftruncate(mod_priv, dest_off + dest_len);
 		if (ret < 0) {
 			dbg(0, "failed to truncate dest file: %s\n",
@@ -294,6 +409,9 @@ afs_fwrite(void *mod_priv,
 	} else {
 		max_io = AFS_IO_SIZE_HTTPS;
 	}
+	/* Put Range leaves the length alone, but assigns a new ETag */
+	elasto_fsc_modified(afs_fh->stat_cache);
+
 	if (dest_len > max_io) {
 		ret = afs_fwrite_multi(afs_fh, dest_off, dest_len,
 				       src_data, max_io);
@@ -322,6 +440,18 @@ err_out:
 	return ret;
 }
 
+static int
+afs_fread_par_op_get(uint64_t off,
+		     uint64_t len,
+		     struct elasto_data *this_data,
+		     void *priv,
+		     struct op **_op)
+{
+	struct afs_fh *afs_fh = priv;
+
+	return az_fs_req_file_get(&afs_fh->path, off, len, this_data, _op);
+}
+
 int
 afs_fread(void *mod_priv,
 	  uint64_t src_off,
@@ -332,6 +462,21 @@ afs_fread(void *mod_priv,
 	struct op *op;
 	struct afs_fh *afs_fh = mod_priv;
 
+	if ((src_len > afs_fh->io_chunk) && (dest_data != NULL)) {
+		if (afs_fh->xmit_pool == NULL) {
+			ret = elasto_fxmit_pool_init(afs_fh->io_conn,
+						     afs_fh->io_depth,
+						     &afs_fh->xmit_pool);
+			if (ret < 0) {
+				goto err_out;
+			}
+		}
+		/* fetch @io_chunk sized ranges in parallel */
+		return elasto_fop_read_par(afs_fh->xmit_pool, src_off, src_len,
+					   dest_data, afs_fh->io_chunk, afs_fh,
+					   afs_fread_par_op_get);
+	}
+
 	ret = az_fs_req_file_get(&afs_fh->path,
 				 src_off,
 				 src_len,
@@ -375,6 +520,7 @@ afs_ftruncate(void *mod_priv,
 	if (ret < 0) {
 		goto err_op_free;
 	}
+	elasto_fsc_size_set(afs_fh->stat_cache, len);
 	ret = 0;
 
 err_op_free:
@@ -398,6 +544,14 @@ afs_fallocate(void *mod_priv,
 		goto err_out;
 	}
 
+	elasto_fsc_modified(afs_fh->stat_cache);
+
+	if (dest_len > AFS_CLEAR_SIZE) {
+		ret = afs_fwrite_multi(afs_fh, dest_off, dest_len,
+				       NULL, AFS_CLEAR_SIZE);
+		return ret;
+	}
+
 	ret = az_fs_req_file_put(&afs_fh->path,
 				 dest_off,
 				 dest_len,
@@ -430,7 +584,7 @@ afs_fsplice(void *src_mod_priv,
 	struct afs_fh *src_afs_fh = src_mod_priv;
 	struct afs_fh *dest_afs_fh = dest_mod_priv;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	struct az_fs_rsp_file_cp *file_cp_rsp;
 	int ret;
 
@@ -447,18 +601,16 @@ afs_fsplice(void *src_mod_priv,
 	}
 
 	/* check source length matches the copy length */
-	ret = afs_fstat(src_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(src_afs_fh->stat_cache, src_mod_priv,
+				  afs_fstat, len, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size != len) {
+	if (cur_len != len) {
 		dbg(0, "Azure FS backend doesn't allow partial copies: "
 		       "src_len=%" PRIu64 ", copy_len=%" PRIu64 "\n",
-		       fstat.size, len);
+		       cur_len, len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -467,18 +619,16 @@ afs_fsplice(void *src_mod_priv,
 	 * check dest file's current length <= copy len, otherwise overwrite
 	 * truncates.
 	 */
-	ret = afs_fstat(dest_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(dest_afs_fh->stat_cache, dest_mod_priv,
+				  afs_fstat, 0, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size > len) {
+	if (cur_len > len) {
 		dbg(0, "Azure FS backend doesn't allow splice overwrites when "
 		       "IO len (%" PRIu64 ") < current len (%" PRIu64 ")\n",
-		       len, fstat.size);
+		       len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -503,9 +653,11 @@ afs_fsplice(void *src_mod_priv,
 
 	if (file_cp_rsp->cp_status == AOP_CP_STATUS_SUCCESS) {
 		dbg(2, "Azure FS file copy completed immediately\n");
+		elasto_fsc_size_set(dest_afs_fh->stat_cache, len);
 	} else if (file_cp_rsp->cp_status == AOP_CP_STATUS_PENDING) {
 		dbg(0, "Azure FS file copy pending: %s\n", file_cp_rsp->cp_id);
 		/* TODO block until copy completes */
+		elasto_fsc_invalidate(dest_afs_fh->stat_cache);
 	} else {
 		dbg(0, "Azure FS file copy failed\n");
 		ret = -EIO;
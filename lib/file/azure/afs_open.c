@@ -40,7 +40,9 @@
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
 #include "lib/file/token.h"
+#include "lib/file/scache.h"
 #include "afs_handle.h"
+#include "afs_stat.h"
 #include "afs_open.h"
 
 #define AFS_FOPEN_LOCATION_DEFAULT "West Europe"
@@ -94,7 +96,11 @@ afs_io_conn_init(struct afs_fh *afs_fh,
 	char *url_host;
 	struct elasto_conn *io_conn;
 
-	if ((afs_fh->acc_access_key == NULL) && (afs_fh->mgmt_conn != NULL)) {
+	if (afs_fh->sas_token != NULL) {
+		/* SAS is appended to each request, no key lookup needed */
+		dbg(3, "using SAS for IO conn\n");
+	} else if ((afs_fh->acc_access_key == NULL)
+		&& (afs_fh->mgmt_conn != NULL)) {
 		ret = afs_acc_key_get(afs_fh, &afs_fh->acc_access_key);
 		if (ret < 0) {
 			dbg(0, "failed to get account access key\n");
@@ -119,8 +125,12 @@ afs_io_conn_init(struct afs_fh *afs_fh,
 		goto err_out;
 	}
 
-	ret = elasto_conn_sign_setkey(io_conn, afs_fh->path.acc,
-				      afs_fh->acc_access_key);
+	if (afs_fh->sas_token != NULL) {
+		ret = elasto_conn_sign_setquery(io_conn, afs_fh->sas_token);
+	} else {
+		ret = elasto_conn_sign_setkey(io_conn, afs_fh->path.acc,
+					      afs_fh->acc_access_key);
+	}
 	if (ret < 0) {
 		goto err_conn_free;
 	}
@@ -141,6 +151,8 @@ afs_fopen_file(struct afs_fh *afs_fh,
 {
 	int ret;
 	struct op *op;
+	struct az_fs_rsp_file_prop_get *file_prop_get_rsp;
+	struct elasto_fstat fstat;
 	bool created = false;
 
 	if (flags & ELASTO_FOPEN_DIRECTORY) {
@@ -180,6 +192,16 @@ afs_fopen_file(struct afs_fh *afs_fh,
 		goto err_op_free;
 	}
 
+	file_prop_get_rsp = az_fs_rsp_file_prop_get(op);
+	if (file_prop_get_rsp == NULL) {
+		ret = -ENOMEM;
+		goto err_op_free;
+	}
+
+	/* seed the stat cache, saving a round trip for the first size check */
+	afs_fstat_file_fill(file_prop_get_rsp, &fstat);
+	elasto_fsc_set(afs_fh->stat_cache, &fstat);
+
 done:
 	ret = (created ? ELASTO_FOPEN_RET_CREATED : ELASTO_FOPEN_RET_EXISTED);
 err_op_free:
@@ -532,11 +554,26 @@ afs_fopen(void *mod_priv,
 	int ret;
 	struct afs_fh *afs_fh = mod_priv;
 
-	ret = az_fs_path_parse(path, &afs_fh->path);
+	ret = elasto_fxmit_depth_get(open_toks, &afs_fh->io_depth);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = elasto_fxmit_chunk_get(open_toks, &afs_fh->io_chunk);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = elasto_fsc_setup(open_toks, &afs_fh->stat_cache);
 	if (ret < 0) {
 		goto err_out;
 	}
 
+	ret = az_fs_path_parse(path, &afs_fh->path);
+	if (ret < 0) {
+		goto err_sc_free;
+	}
+
 	if (afs_fh->pem_path != NULL) {
 		char *mgmt_host;
 		/*
@@ -548,7 +585,7 @@ afs_fopen(void *mod_priv,
 		 */
 		ret = az_mgmt_req_hostname_get(&mgmt_host);
 		if (ret < 0) {
-			goto err_out;
+			goto err_path_free;
 		}
 
 		ret = elasto_conn_init_az(afs_fh->pem_path, false, mgmt_host,
@@ -559,7 +596,8 @@ afs_fopen(void *mod_priv,
 		}
 	} else {
 		/* checked in afs_fh_init() */
-		assert(afs_fh->acc_access_key != NULL);
+		assert((afs_fh->acc_access_key != NULL)
+		    || (afs_fh->sas_token != NULL));
 	}
 
 	if (afs_fh->path.fs_ent != NULL) {
@@ -632,6 +670,9 @@ err_mgmt_conn_free:
 	elasto_conn_free(afs_fh->mgmt_conn);
 err_path_free:
 	az_fs_path_free(&afs_fh->path);
+err_sc_free:
+	elasto_fsc_free(afs_fh->stat_cache);
+	afs_fh->stat_cache = NULL;
 err_out:
 	return ret;
 }
@@ -641,6 +682,10 @@ afs_fclose(void *mod_priv)
 {
 	struct afs_fh *afs_fh = mod_priv;
 
+	elasto_fxmit_pool_free(afs_fh->xmit_pool);
+	afs_fh->xmit_pool = NULL;
+	elasto_fsc_free(afs_fh->stat_cache);
+	afs_fh->stat_cache = NULL;
 	/* @io_conn may be null (root opens) */
 	elasto_conn_free(afs_fh->io_conn);
 	elasto_conn_free(afs_fh->mgmt_conn);
@@ -38,9 +38,25 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "afs_handle.h"
 #include "afs_stat.h"
 
+/* fill @fstat from a file properties response, obtained on stat or open */
+void
+afs_fstat_file_fill(struct az_fs_rsp_file_prop_get *file_prop_get_rsp,
+		    struct elasto_fstat *fstat)
+{
+	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
+	fstat->size = file_prop_get_rsp->len;
+	fstat->blksize = 0;
+	fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
+	/* flag which values are valid in the stat response */
+	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_SIZE);
+	elasto_fstat_etag_set(fstat, file_prop_get_rsp->etag);
+}
+
 static int
 afs_fstat_file(struct afs_fh *afs_fh,
 	       struct elasto_fstat *fstat)
@@ -49,6 +65,11 @@ afs_fstat_file(struct afs_fh *afs_fh,
 	struct op *op;
 	struct az_fs_rsp_file_prop_get *file_prop_get_rsp;
 
+	ret = elasto_fsc_get(afs_fh->stat_cache, 0, fstat);
+	if (ret == 0) {
+		goto err_out;
+	}
+
 	ret = az_fs_req_file_prop_get(&afs_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -65,13 +86,8 @@ afs_fstat_file(struct afs_fh *afs_fh,
 		goto err_op_free;
 	}
 
-	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
-	fstat->size = file_prop_get_rsp->len;
-	fstat->blksize = 0;
-	fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
-	/* flag which values are valid in the stat response */
-	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
-				| ELASTO_FSTAT_FIELD_SIZE);
+	afs_fstat_file_fill(file_prop_get_rsp, fstat);
+	elasto_fsc_set(afs_fh->stat_cache, fstat);
 	ret = 0;
 
 err_op_free:
@@ -250,6 +266,14 @@ err_out:
 	return ret;
 }
 
+void
+afs_fstat_invalidate(void *mod_priv)
+{
+	struct afs_fh *afs_fh = mod_priv;
+
+	elasto_fsc_invalidate(afs_fh->stat_cache);
+}
+
 /* same as apb - TODO move to lib/az_mgmt_req */
 const struct elasto_fstatfs_region afs_regions[] = {
 	{"Central US", "Iowa"},
@@ -275,9 +299,11 @@ int
 afs_fstatvfs(void *mod_priv,
 	     struct elasto_fstatfs *fstatfs)
 {
+	struct afs_fh *afs_fh = mod_priv;
+
 	/* fstatfs checked by caller */
 	fstatfs->iosize_min = 1;
-	fstatfs->iosize_optimal = 512;
+	fstatfs->iosize_optimal = afs_fh->io_chunk * afs_fh->io_depth;
 
 	/*
 	 * Azure File Service files are sparse and can be written at any
@@ -14,10 +14,19 @@
 #ifndef _APB_STAT_H_
 #define _APB_STAT_H_
 
+struct az_fs_rsp_file_prop_get;
+
+void
+afs_fstat_file_fill(struct az_fs_rsp_file_prop_get *file_prop_get_rsp,
+		    struct elasto_fstat *fstat);
+
 int
 afs_fstat(void *mod_priv,
 	  struct elasto_fstat *fstat);
 
+void
+afs_fstat_invalidate(void *mod_priv);
+
 int
 afs_fstatvfs(void *mod_priv,
 	     struct elasto_fstatfs *fstatfs);
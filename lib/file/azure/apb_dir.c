@@ -42,6 +42,41 @@
 #include "apb_open.h"
 #include "apb_dir.h"
 
+/* state for list entries streamed to the readdir dent_cb */
+struct apb_readdir_ctx {
+	void *cli_priv;
+	int (*dent_cb)(struct elasto_dent *, void *);
+	int cb_ret;
+};
+
+static int
+apb_freaddir_blob_cb(struct azure_blob *blob,
+		     void *cb_priv)
+{
+	struct apb_readdir_ctx *ctx = cb_priv;
+	struct elasto_dent dent;
+
+	memset(&dent, 0, sizeof(dent));
+	dent.name = blob->name;
+	dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
+	dent.fstat.size = blob->len;
+	dent.fstat.blksize = 512;
+	if (blob->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
+		dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
+	} else if (blob->lease_status == AOP_LEASE_STATUS_LOCKED) {
+		dent.fstat.lease_status = ELASTO_FLEASE_LOCKED;
+	}
+	/* flag which values are valid in the stat response */
+	dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_SIZE
+				| ELASTO_FSTAT_FIELD_BSIZE
+				| ELASTO_FSTAT_FIELD_LEASE);
+
+	/* cb may request immediate error return, which stops the parse */
+	ctx->cb_ret = ctx->dent_cb(&dent, ctx->cli_priv);
+	return ctx->cb_ret;
+}
+
 static int
 apb_freaddir_ctnr(struct apb_fh *apb_fh,
 		  void *cli_priv,
@@ -50,49 +85,25 @@ apb_freaddir_ctnr(struct apb_fh *apb_fh,
 {
 	int ret;
 	struct op *op;
-	struct az_rsp_blob_list *blob_list_rsp;
-	struct azure_blob *blob;
+	struct apb_readdir_ctx ctx = { cli_priv, dent_cb, 0 };
 
 	ret = az_req_blob_list(&apb_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
+	/* dents are emitted as the response is parsed, without a blob list */
+	ret = az_req_blob_list_cb_set(op, apb_freaddir_blob_cb, &ctx);
 	if (ret < 0) {
 		goto err_op_free;
 	}
 
-	blob_list_rsp = az_rsp_blob_list(op);
-	if (blob_list_rsp == NULL) {
-		ret = -ENOMEM;
+	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
+	if (ctx.cb_ret < 0) {
+		ret = ctx.cb_ret;
+		goto err_op_free;
+	} else if (ret < 0) {
 		goto err_op_free;
-	}
-
-	list_for_each(&blob_list_rsp->blobs, blob, list) {
-		struct elasto_dent dent;
-
-		memset(&dent, 0, sizeof(dent));
-		dent.name = blob->name;
-		dent.fstat.ent_type = ELASTO_FSTAT_ENT_FILE;
-		dent.fstat.size = blob->len;
-		dent.fstat.blksize = 512;
-		if (blob->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
-			dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
-		} else if (blob->lease_status == AOP_LEASE_STATUS_LOCKED) {
-			dent.fstat.lease_status = ELASTO_FLEASE_LOCKED;
-		}
-		/* flag which values are valid in the stat response */
-		dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
-					| ELASTO_FSTAT_FIELD_SIZE
-					| ELASTO_FSTAT_FIELD_BSIZE
-					| ELASTO_FSTAT_FIELD_LEASE);
-
-		ret = dent_cb(&dent, cli_priv);
-		if (ret < 0) {
-			/* cb requests immediate error return */
-			goto err_op_free;
-		}
 	}
 
 	ret = 0;
@@ -103,6 +114,31 @@ err_out:
 	return ret;
 }
 
+static int
+apb_freaddir_ctnr_cb(struct azure_ctnr *ctnr,
+		     void *cb_priv)
+{
+	struct apb_readdir_ctx *ctx = cb_priv;
+	struct elasto_dent dent;
+
+	memset(&dent, 0, sizeof(dent));
+	dent.name = ctnr->name;
+	dent.fstat.ent_type = ELASTO_FSTAT_ENT_DIR;
+	dent.fstat.size = 0;
+	dent.fstat.blksize = 512;
+	if (ctnr->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
+		dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
+	} else if (ctnr->lease_status == AOP_LEASE_STATUS_LOCKED) {
+		dent.fstat.lease_status = ELASTO_FLEASE_LOCKED;
+	}
+	dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_BSIZE
+				| ELASTO_FSTAT_FIELD_LEASE);
+
+	ctx->cb_ret = ctx->dent_cb(&dent, ctx->cli_priv);
+	return ctx->cb_ret;
+}
+
 static int
 apb_freaddir_acc(struct apb_fh *apb_fh,
 		 void *cli_priv,
@@ -111,46 +147,24 @@ apb_freaddir_acc(struct apb_fh *apb_fh,
 {
 	int ret;
 	struct op *op;
-	struct az_rsp_ctnr_list *ctnr_list_rsp;
-	struct azure_ctnr *ctnr;
+	struct apb_readdir_ctx ctx = { cli_priv, dent_cb, 0 };
 
 	ret = az_req_ctnr_list(&apb_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
+	ret = az_req_ctnr_list_cb_set(op, apb_freaddir_ctnr_cb, &ctx);
 	if (ret < 0) {
 		goto err_op_free;
 	}
 
-	ctnr_list_rsp = az_rsp_ctnr_list(op);
-	if (ctnr_list_rsp == NULL) {
-		ret = -ENOMEM;
+	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
+	if (ctx.cb_ret < 0) {
+		ret = ctx.cb_ret;
+		goto err_op_free;
+	} else if (ret < 0) {
 		goto err_op_free;
-	}
-
-	list_for_each(&ctnr_list_rsp->ctnrs, ctnr, list) {
-		struct elasto_dent dent;
-
-		memset(&dent, 0, sizeof(dent));
-		dent.name = ctnr->name;
-		dent.fstat.ent_type = ELASTO_FSTAT_ENT_DIR;
-		dent.fstat.size = 0;
-		dent.fstat.blksize = 512;
-		if (ctnr->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
-			dent.fstat.lease_status = ELASTO_FLEASE_UNLOCKED;
-		} else if (ctnr->lease_status == AOP_LEASE_STATUS_LOCKED) {
-			dent.fstat.lease_status = ELASTO_FLEASE_LOCKED;
-		}
-		dent.fstat.field_mask = (ELASTO_FSTAT_FIELD_TYPE
-					| ELASTO_FSTAT_FIELD_BSIZE
-					| ELASTO_FSTAT_FIELD_LEASE);
-		ret = dent_cb(&dent, cli_priv);
-		if (ret < 0) {
-			/* cb requests immediate error return */
-			goto err_op_free;
-		}
 	}
 
 	ret = 0;
@@ -73,6 +73,12 @@ apb_fh_init(const struct elasto_fauth *auth,
 			ret = -ENOMEM;
 			goto err_priv_free;
 		}
+	} else if (auth->az.sas_token != NULL) {
+		apb_fh->sas_token = strdup(auth->az.sas_token);
+		if (apb_fh->sas_token == NULL) {
+			ret = -ENOMEM;
+			goto err_priv_free;
+		}
 	} else {
 		dbg(0, "init called without auth credentials\n");
 		ret = -EINVAL;
@@ -115,6 +121,7 @@ elasto_file_mod_fh_init(const struct elasto_fauth *auth,
 			.splice = apb_fsplice,
 			.stat = apb_fstat,
 			.statfs = apb_fstatvfs,
+			.stat_invalidate = apb_fstat_invalidate,
 			.lease_acquire = apb_flease_acquire,
 			.lease_break = apb_flease_break,
 			.lease_release = apb_flease_release,
@@ -139,6 +146,7 @@ elasto_file_mod_fh_init(const struct elasto_fauth *auth,
 			.splice = abb_fsplice,
 			.stat = abb_fstat,
 			.statfs = abb_fstatvfs,
+			.stat_invalidate = apb_fstat_invalidate,
 			.lease_acquire = apb_flease_acquire,
 			.lease_break = apb_flease_break,
 			.lease_release = apb_flease_release,
@@ -170,5 +178,6 @@ apb_fh_free(void *mod_priv)
 		free(apb_fh->sub_name);
 	}
 	free(apb_fh->acc_access_key);
+	free(apb_fh->sas_token);
 	free(apb_fh);
 }
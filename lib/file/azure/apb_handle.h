@@ -23,9 +23,16 @@
  * @sub_id: Subscription ID. NULL if access key auth.
  * @sub_name: Subscription name. NULL if access key auth.
  * @acc_access_key: Account access key.
+ * @sas_token: Shared Access Signature query string. Requests aren't signed,
+ *	       and no mgmt connection or access key is needed, if set.
  * @insecure_http: Use HTTP instead of HTTPS where applicable.
  * @mgmt_conn: Connection to Management service. NULL if access key auth.
  * @io_conn: Connection to Azure File Service.
+ * @io_depth: maximum number of requests in flight for a large I/O.
+ * @io_chunk: reads larger than this are split into parallel ranged requests.
+ * @xmit_pool: duplicates of @io_conn for parallel I/O, opened on first use.
+ * @stat_cache: blob stat results, saving a round trip for internal size
+ *		checks. NULL if disabled.
  */
 struct apb_fh {
 	struct az_blob_path path;
@@ -33,9 +40,14 @@ struct apb_fh {
 	char *sub_id;
 	char *sub_name;
 	char *acc_access_key;
+	char *sas_token;
 	bool insecure_http;
 	struct elasto_conn *mgmt_conn;
 	struct elasto_conn *io_conn;
+	uint32_t io_depth;
+	uint64_t io_chunk;
+	struct elasto_fxmit_pool *xmit_pool;
+	struct elasto_fsc *stat_cache;
 };
 
 /* module entry point */
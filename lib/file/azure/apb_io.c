@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "ccan/list/list.h"
 #include "lib/exml.h"
@@ -38,10 +39,327 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "apb_handle.h"
 #include "apb_stat.h"
 #include "apb_io.h"
 
+/*
+ * Page and block puts may each carry up to 4 MB, the service rejects larger
+ * requests with 413 (Request Entity Too Large).
+ */
+#define APB_ABB_MAX_PUT (4 * BYTES_IN_MB)
+/*
+ * Clear ranges aren't subject to the put size limit, but large ones are split
+ * so that they proceed in parallel, and each completes well within the
+ * connection timeout.
+ */
+#define APB_CLEAR_SIZE (64 * BYTES_IN_MB)
+
+/* FIXME data_ctx is a dup of afx_io. combine in vfs */
+struct apb_abb_fwrite_multi_data_ctx {
+	uint64_t this_off;
+	uint64_t this_len;
+	struct elasto_data *src_data;
+	/* pages and blocks are sent in parallel, so serialise source callbacks */
+	pthread_mutex_t *src_lock;
+};
+
+static int
+apb_abb_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
+				     uint64_t need,
+				     uint8_t **_out_buf,
+				     uint64_t *buf_len,
+				     void *priv)
+{
+	struct apb_abb_fwrite_multi_data_ctx *data_ctx = priv;
+	int ret;
+	uint8_t *this_src_buf;
+
+	/* sanity checks */
+	if ((need > APB_ABB_MAX_PUT)
+	 || (data_ctx->this_off + stream_off + need
+					> data_ctx->src_data->len)) {
+		dbg(0, "failed write len sanity check!\n");
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	/* lend the source buffer, see apb_abb_fwrite_multi_iov_data_out_free */
+	this_src_buf = data_ctx->src_data->iov.buf
+					+ data_ctx->this_off + stream_off;
+	*_out_buf = this_src_buf;
+	*buf_len = need;
+
+	ret = 0;
+err_out:
+	return ret;
+}
+
+static int
+apb_abb_fwrite_multi_cb_data_out_cb(uint64_t stream_off,
+				    uint64_t need,
+				    uint8_t **_out_buf,
+				    uint64_t *buf_len,
+				    void *priv)
+{
+	struct apb_abb_fwrite_multi_data_ctx *data_ctx = priv;
+	int ret;
+	uint8_t *this_out_buf = NULL;
+	uint64_t this_buf_len = 0;
+
+	/* sanity checks */
+	if ((need > APB_ABB_MAX_PUT)
+	 || (data_ctx->this_off + stream_off + need > data_ctx->src_data->len)) {
+		dbg(0, "failed write len sanity check!\n");
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	pthread_mutex_lock(data_ctx->src_lock);
+	ret = data_ctx->src_data->cb.out_cb(data_ctx->this_off + stream_off,
+					    need, &this_out_buf, &this_buf_len,
+					    data_ctx->src_data->cb.priv);
+	pthread_mutex_unlock(data_ctx->src_lock);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	/* returned to src_data via apb_abb_fwrite_multi_cb_data_out_free */
+	*_out_buf = this_out_buf;
+	*buf_len = this_buf_len;
+
+	ret = 0;
+err_out:
+	return ret;
+}
+
+/*
+ * nothing to release. The conn layer drops any body references before the
+ * request returns, so the caller's iov buffer is never used beyond it.
+ */
+static void
+apb_abb_fwrite_multi_iov_data_out_free(uint8_t *out_buf,
+				       void *priv)
+{
+	return;
+}
+
+static void
+apb_abb_fwrite_multi_cb_data_out_free(uint8_t *out_buf,
+				      void *priv)
+{
+	struct apb_abb_fwrite_multi_data_ctx *data_ctx = priv;
+
+	pthread_mutex_lock(data_ctx->src_lock);
+	elasto_data_cb_out_buf_put(data_ctx->src_data, out_buf);
+	pthread_mutex_unlock(data_ctx->src_lock);
+}
+
+static int
+apb_abb_fwrite_multi_data_setup(uint64_t this_off,
+				uint64_t this_len,
+				struct elasto_data *src_data,
+				pthread_mutex_t *src_lock,
+				struct elasto_data **_this_data)
+{
+	struct elasto_data *this_data;
+	struct apb_abb_fwrite_multi_data_ctx *data_ctx;
+	void (*out_free_cb)(uint8_t *out_buf, void *priv);
+	int ret;
+
+	if (src_data->type == ELASTO_DATA_IOVEC) {
+		/* parts reference the source segments directly */
+		return elasto_data_iovec_slice_new(src_data, this_off, this_len,
+						   _this_data);
+	}
+
+	data_ctx = malloc(sizeof(*data_ctx));
+	if (data_ctx == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
+	data_ctx->this_off = this_off;
+	data_ctx->this_len = this_len;
+	data_ctx->src_data = src_data;
+	data_ctx->src_lock = src_lock;
+
+	if (src_data->type == ELASTO_DATA_IOV) {
+		ret = elasto_data_cb_new(this_len,
+					 apb_abb_fwrite_multi_iov_data_out_cb,
+					 0, NULL, data_ctx, &this_data);
+		out_free_cb = apb_abb_fwrite_multi_iov_data_out_free;
+	} else if (src_data->type == ELASTO_DATA_CB) {
+		ret = elasto_data_cb_new(this_len,
+					 apb_abb_fwrite_multi_cb_data_out_cb,
+					 0, NULL, data_ctx, &this_data);
+		out_free_cb = apb_abb_fwrite_multi_cb_data_out_free;
+	} else {
+		assert(false);	/* already checked */
+	}
+	if (ret < 0) {
+		goto err_ctx_free;
+	}
+
+	ret = elasto_data_cb_out_free_set(this_data, out_free_cb);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+
+	*_this_data = this_data;
+
+	return 0;
+
+err_data_free:
+	elasto_data_free(this_data);
+err_ctx_free:
+	free(data_ctx);
+err_out:
+	return ret;
+}
+
+static void
+apb_abb_fwrite_multi_data_free(struct elasto_data *this_data)
+{
+	struct apb_abb_fwrite_multi_data_ctx *data_ctx;
+
+	if (this_data->type == ELASTO_DATA_CB) {
+		data_ctx = this_data->cb.priv;
+		free(data_ctx);
+	}
+	elasto_data_free(this_data);
+}
+
+/*
+ * State shared by parallel page puts. @src_data is NULL for clear ranges,
+ * otherwise its offsets are relative to @dest_off.
+ */
+struct apb_fwrite_multi_ctx {
+	struct apb_fh *apb_fh;
+	uint64_t dest_off;
+	uint64_t dest_len;
+	uint64_t max_io;
+	struct elasto_data *src_data;
+	pthread_mutex_t src_lock;
+};
+
+static int
+apb_fwrite_multi_op_get(uint64_t unit,
+			void *priv,
+			struct op **_op)
+{
+	int ret;
+	struct apb_fwrite_multi_ctx *mctx = priv;
+	uint64_t data_off = unit * mctx->max_io;
+	uint64_t this_off = mctx->dest_off + data_off;
+	uint64_t this_len = MIN(mctx->max_io, mctx->dest_len - data_off);
+	struct elasto_data *this_data = NULL;
+	struct op *op;
+
+	dbg(0, "multi fwrite: off=%" PRIu64 ", len=%" PRIu64 "\n",
+	    this_off, this_len);
+
+	if (mctx->src_data != NULL) {
+		ret = apb_abb_fwrite_multi_data_setup(data_off, this_len,
+						      mctx->src_data,
+						      &mctx->src_lock,
+						      &this_data);
+		if (ret < 0) {
+			dbg(0, "data setup failed\n");
+			goto err_out;
+		}
+	}
+
+	ret = az_req_page_put(&mctx->apb_fh->path,
+			      this_data,	/* NULL: clear range */
+			      this_off,
+			      this_len,
+			      &op);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+	*_op = op;
+
+	return 0;
+
+err_data_free:
+	if (this_data != NULL) {
+		apb_abb_fwrite_multi_data_free(this_data);
+	}
+err_out:
+	return ret;
+}
+
+static int
+apb_fwrite_multi_op_put(uint64_t unit,
+			struct op *op,
+			int ret,
+			void *priv)
+{
+	struct apb_fwrite_multi_ctx *mctx = priv;
+	struct elasto_data *this_data = op->req.data;
+
+	if (ret < 0) {
+		dbg(0, "multi-write failed at data_off %" PRIu64 "\n",
+		    unit * mctx->max_io);
+	}
+
+	op->req.data = NULL;
+	op_free(op);
+	if (this_data != NULL) {
+		apb_abb_fwrite_multi_data_free(this_data);
+	}
+
+	return ret;
+}
+
+/*
+ * Page ranges are independent, so split writes and clears are dispatched in
+ * parallel across the handle's connection pool. @max_io is a multiple of the
+ * page size, so each put stays aligned. The first put to fail after exhausting
+ * its resend attempts fails the whole request.
+ */
+static int
+apb_fwrite_multi(struct apb_fh *apb_fh,
+		 uint64_t dest_off,
+		 uint64_t dest_len,
+		 struct elasto_data *src_data,
+		 uint64_t max_io)
+{
+	int ret;
+	struct apb_fwrite_multi_ctx mctx;
+	uint64_t num_puts = (dest_len + max_io - 1) / max_io;
+
+	if (apb_fh->xmit_pool == NULL) {
+		ret = elasto_fxmit_pool_init(apb_fh->io_conn, apb_fh->io_depth,
+					     &apb_fh->xmit_pool);
+		if (ret < 0) {
+			goto err_out;
+		}
+	}
+
+	memset(&mctx, 0, sizeof(mctx));
+	ret = pthread_mutex_init(&mctx.src_lock, NULL);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_out;
+	}
+
+	mctx.apb_fh = apb_fh;
+	mctx.dest_off = dest_off;
+	mctx.dest_len = dest_len;
+	mctx.max_io = max_io;
+	mctx.src_data = src_data;
+
+	ret = elasto_fop_send_recv_par(apb_fh->xmit_pool, num_puts, &mctx,
+				       apb_fwrite_multi_op_get,
+				       apb_fwrite_multi_op_put);
+	pthread_mutex_destroy(&mctx.src_lock);
+err_out:
+	return ret;
+}
+
 int
 apb_fwrite(void *mod_priv,
 	   uint64_t dest_off,
@@ -52,6 +370,24 @@ apb_fwrite(void *mod_priv,
 	struct op *op;
 	struct apb_fh *apb_fh = mod_priv;
 
+	/* any page put, even a failed split one, may assign a new ETag */
+	elasto_fsc_modified(apb_fh->stat_cache);
+
+	if (dest_len > APB_ABB_MAX_PUT) {
+		if ((src_data->type != ELASTO_DATA_CB)
+					&& (src_data->type != ELASTO_DATA_IOV)
+					&& (src_data->type != ELASTO_DATA_IOVEC)) {
+			dbg(0, "apb split write only supports CB, IOV and "
+			       "IOVEC data types\n");
+			ret = -EINVAL;
+			goto err_out;
+		}
+		/* split into page aligned puts within the service limit */
+		ret = apb_fwrite_multi(apb_fh, dest_off, dest_len, src_data,
+				       APB_ABB_MAX_PUT);
+		return ret;
+	}
+
 	ret = az_req_page_put(&apb_fh->path,
 			      src_data,
 			      dest_off,
@@ -74,6 +410,51 @@ err_out:
 	return ret;
 }
 
+struct apb_abb_fread_par_ctx {
+	struct apb_fh *apb_fh;
+	bool is_page;
+};
+
+static int
+apb_abb_fread_par_op_get(uint64_t off,
+			 uint64_t len,
+			 struct elasto_data *this_data,
+			 void *priv,
+			 struct op **_op)
+{
+	struct apb_abb_fread_par_ctx *rctx = priv;
+
+	return az_req_blob_get(&rctx->apb_fh->path, rctx->is_page, this_data,
+			       off, len, _op);
+}
+
+/* fetch @io_chunk sized ranges of a large read in parallel */
+static int
+apb_abb_fread_par(struct apb_fh *apb_fh,
+		  bool is_page,
+		  uint64_t src_off,
+		  uint64_t src_len,
+		  struct elasto_data *dest_data)
+{
+	int ret;
+	struct apb_abb_fread_par_ctx rctx;
+
+	if (apb_fh->xmit_pool == NULL) {
+		ret = elasto_fxmit_pool_init(apb_fh->io_conn, apb_fh->io_depth,
+					     &apb_fh->xmit_pool);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	rctx.apb_fh = apb_fh;
+	rctx.is_page = is_page;
+
+	return elasto_fop_read_par(apb_fh->xmit_pool, src_off, src_len,
+				   dest_data, apb_fh->io_chunk, &rctx,
+				   apb_abb_fread_par_op_get);
+}
+
 int
 apb_fread(void *mod_priv,
 	  uint64_t src_off,
@@ -84,6 +465,11 @@ apb_fread(void *mod_priv,
 	struct op *op;
 	struct apb_fh *apb_fh = mod_priv;
 
+	if ((src_len > apb_fh->io_chunk) && (dest_data != NULL)) {
+		return apb_abb_fread_par(apb_fh, true, src_off, src_len,
+					 dest_data);
+	}
+
 	ret = az_req_blob_get(&apb_fh->path,
 			      true,
 			      dest_data,
@@ -127,6 +513,7 @@ apb_ftruncate(void *mod_priv,
 	if (ret < 0) {
 		goto err_op_free;
 	}
+	elasto_fsc_size_set(apb_fh->stat_cache, len);
 	ret = 0;
 
 err_op_free:
@@ -150,6 +537,14 @@ apb_fallocate(void *mod_priv,
 		goto err_out;
 	}
 
+	elasto_fsc_modified(apb_fh->stat_cache);
+
+	if (dest_len > APB_CLEAR_SIZE) {
+		ret = apb_fwrite_multi(apb_fh, dest_off, dest_len, NULL,
+				       APB_CLEAR_SIZE);
+		return ret;
+	}
+
 	ret = az_req_page_put(&apb_fh->path,
 			      NULL, /* clear range */
 			      dest_off,
@@ -172,6 +567,96 @@ err_out:
 	return ret;
 }
 
+#define APB_CP_POLL_PERIOD 2
+#define APB_CP_POLL_TIMEOUT 30	/* multiplied by APB_CP_POLL_PERIOD */
+
+/* poll destination properties until copy @cp_id leaves the pending state */
+static int
+apb_fsplice_cp_wait(struct apb_fh *dest_apb_fh,
+		    const char *cp_id,
+		    enum az_cp_status *_cp_status)
+{
+	int ret;
+	int i;
+	struct op *op;
+	struct az_rsp_blob_prop_get *blob_prop_get_rsp;
+
+	for (i = 0; i < APB_CP_POLL_TIMEOUT; i++) {
+		sleep(APB_CP_POLL_PERIOD);
+
+		ret = az_req_blob_prop_get(&dest_apb_fh->path, &op);
+		if (ret < 0) {
+			return ret;
+		}
+
+		ret = elasto_fop_send_recv(dest_apb_fh->io_conn, op);
+		if (ret < 0) {
+			op_free(op);
+			return ret;
+		}
+
+		blob_prop_get_rsp = az_rsp_blob_prop_get(op);
+		if (blob_prop_get_rsp == NULL) {
+			op_free(op);
+			return -EFAULT;
+		}
+
+		if ((blob_prop_get_rsp->cp_id == NULL)
+		 || (strcmp(blob_prop_get_rsp->cp_id, cp_id) != 0)) {
+			dbg(0, "Azure blob copy %s superseded\n", cp_id);
+			op_free(op);
+			return -EIO;
+		}
+
+		if (blob_prop_get_rsp->cp_status != AOP_CP_STATUS_PENDING) {
+			*_cp_status = blob_prop_get_rsp->cp_status;
+			op_free(op);
+			return 0;
+		}
+		op_free(op);
+	}
+
+	return -EINPROGRESS;
+}
+
+/*
+ * Copy Blob may complete asynchronously, in which case the destination size
+ * isn't known until it does. Block until then, or return -EINPROGRESS if it
+ * doesn't complete within the polling timeout, while the service continues
+ * the copy.
+ */
+static int
+apb_fsplice_cp_status_check(struct apb_fh *dest_apb_fh,
+			    struct op *op,
+			    uint64_t len)
+{
+	int ret;
+	struct az_rsp_blob_cp *blob_cp_rsp = az_rsp_blob_cp(op);
+	enum az_cp_status cp_status = blob_cp_rsp->cp_status;
+
+	if (cp_status == AOP_CP_STATUS_PENDING) {
+		dbg(1, "Azure blob copy pending: %s\n", blob_cp_rsp->cp_id);
+		ret = apb_fsplice_cp_wait(dest_apb_fh, blob_cp_rsp->cp_id,
+					  &cp_status);
+		if (ret < 0) {
+			dbg(0, "Azure blob copy %s incomplete: %s\n",
+			    blob_cp_rsp->cp_id, strerror(-ret));
+			elasto_fsc_invalidate(dest_apb_fh->stat_cache);
+			return ret;
+		}
+	}
+
+	if (cp_status != AOP_CP_STATUS_SUCCESS) {
+		dbg(0, "Azure blob copy failed\n");
+		elasto_fsc_invalidate(dest_apb_fh->stat_cache);
+		return -EIO;
+	}
+
+	dbg(2, "Azure blob copy completed\n");
+	elasto_fsc_size_set(dest_apb_fh->stat_cache, len);
+	return 0;
+}
+
 int
 apb_fsplice(void *src_mod_priv,
 	    uint64_t src_off,
@@ -182,7 +667,7 @@ apb_fsplice(void *src_mod_priv,
 	struct apb_fh *src_apb_fh = src_mod_priv;
 	struct apb_fh *dest_apb_fh = dest_mod_priv;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	int ret;
 
 	if (len == 0) {
@@ -198,18 +683,16 @@ apb_fsplice(void *src_mod_priv,
 	}
 
 	/* check source length matches the copy length */
-	ret = apb_fstat(src_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(src_apb_fh->stat_cache, src_mod_priv,
+				  apb_fstat, len, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size != len) {
+	if (cur_len != len) {
 		dbg(0, "Azure blob backend doesn't allow partial copies: "
 		       "src_len=%" PRIu64 ", copy_len=%" PRIu64 "\n",
-		       fstat.size, len);
+		       cur_len, len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -218,18 +701,16 @@ apb_fsplice(void *src_mod_priv,
 	 * check dest file's current length <= copy len, otherwise overwrite
 	 * truncates.
 	 */
-	ret = apb_fstat(dest_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(dest_apb_fh->stat_cache, dest_mod_priv,
+				  apb_fstat, 0, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size > len) {
+	if (cur_len > len) {
 		dbg(0, "Azure backend doesn't allow splice overwrites when IO "
 		       "len (%" PRIu64 ") < current len (%" PRIu64 ")\n",
-		       len, fstat.size);
+		       len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -244,6 +725,11 @@ apb_fsplice(void *src_mod_priv,
 		goto err_op_free;
 	}
 
+	ret = apb_fsplice_cp_status_check(dest_apb_fh, op, len);
+	if (ret < 0) {
+		goto err_op_free;
+	}
+
 	ret = 0;
 err_op_free:
 	op_free(op);
@@ -251,229 +737,221 @@ err_out:
 	return ret;
 }
 
-#define ABB_MAX_PART (4 * BYTES_IN_MB)
 #define ABB_IO_SIZE_HTTP (2 * BYTES_IN_MB)
 #define ABB_IO_SIZE_HTTPS (2 * BYTES_IN_MB)
 
-/* FIXME data_ctx is a dup of afx_io. combine in vfs */
-struct abb_fwrite_multi_data_ctx {
-	uint64_t this_off;
-	uint64_t this_len;
+/*
+ * State shared by parallel block uploads, @blks[unit] describes the block
+ * carrying @src_data bytes from unit * @max_io.
+ */
+struct abb_fwrite_multi_ctx {
+	struct apb_fh *apb_fh;
+	uint64_t dest_off;
+	uint64_t dest_len;
+	uint64_t max_io;
 	struct elasto_data *src_data;
+	pthread_mutex_t src_lock;
+	struct azure_block *blks;
 };
 
 static int
-abb_fwrite_multi_iov_data_out_cb(uint64_t stream_off,
-				uint64_t need,
-				uint8_t **_out_buf,
-				uint64_t *buf_len,
-				void *priv)
+abb_fwrite_multi_op_get(uint64_t unit,
+			void *priv,
+			struct op **_op)
 {
-	struct abb_fwrite_multi_data_ctx *data_ctx = priv;
 	int ret;
-	uint8_t *this_src_buf;
-	uint8_t *out_buf;
+	struct abb_fwrite_multi_ctx *mctx = priv;
+	struct azure_block *blk = &mctx->blks[unit];
+	uint64_t data_off = unit * mctx->max_io;
+	uint64_t this_off = mctx->dest_off + data_off;
+	uint64_t this_len = MIN(mctx->max_io, mctx->dest_len - data_off);
+	struct elasto_data *this_data;
+	struct op *op;
 
-	/* sanity checks */
-	if ((need > ABB_MAX_PART)
-	 || (data_ctx->this_off + stream_off + need
-					> data_ctx->src_data->len)) {
-		dbg(0, "failed write len sanity check!\n");
-		ret = -EINVAL;
-		goto err_out;
+	dbg(0, "multi fwrite: off=%" PRIu64 ", len=%" PRIu64 "\n",
+	    this_off, this_len);
+
+	/* retained for resend */
+	if (blk->id == NULL) {
+		/*
+		 * For a given blob, the length of the value specified for the
+		 * blockid parameter must be the same size for each block, and
+		 * mustn't exceed 64 bytes.
+		 */
+		ret = asprintf(&blk->id, "block%06" PRIu64, unit);
+		if (ret < 0) {
+			blk->id = NULL;
+			ret = -ENOMEM;
+			goto err_out;
+		}
 	}
 
-	/* TODO add free_cb to ELASTO_DATA_CB and avoid copy */
-	out_buf = malloc(need);
-	if (out_buf == NULL) {
-		ret = -ENOMEM;
+	ret = apb_abb_fwrite_multi_data_setup(this_off, this_len,
+					      mctx->src_data,
+					      &mctx->src_lock, &this_data);
+	if (ret < 0) {
+		dbg(0, "data setup failed\n");
 		goto err_out;
 	}
 
-	this_src_buf = data_ctx->src_data->iov.buf
-					+ data_ctx->this_off + stream_off;
-	memcpy(out_buf, this_src_buf, need);
-	/* out_buf freed by connection layer after send */
-	*_out_buf = out_buf;
-	*buf_len = need;
+	ret = az_req_block_put(&mctx->apb_fh->path,
+			       blk->id,
+			       this_data,
+			       &op);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+	*_op = op;
 
-	ret = 0;
+	return 0;
+
+err_data_free:
+	apb_abb_fwrite_multi_data_free(this_data);
 err_out:
 	return ret;
 }
 
 static int
-abb_fwrite_multi_cb_data_out_cb(uint64_t stream_off,
-			       uint64_t need,
-			       uint8_t **_out_buf,
-			       uint64_t *buf_len,
-			       void *priv)
+abb_fwrite_multi_op_put(uint64_t unit,
+			struct op *op,
+			int ret,
+			void *priv)
 {
-	struct abb_fwrite_multi_data_ctx *data_ctx = priv;
-	int ret;
-	uint8_t *this_out_buf = NULL;
-	uint64_t this_buf_len = 0;
-
-	/* sanity checks */
-	if ((need > ABB_MAX_PART)
-	 || (data_ctx->this_off + stream_off + need > data_ctx->src_data->len)) {
-		dbg(0, "failed write len sanity check!\n");
-		ret = -EINVAL;
-		goto err_out;
-	}
+	struct abb_fwrite_multi_ctx *mctx = priv;
+	struct elasto_data *this_data = op->req.data;
 
-	ret = data_ctx->src_data->cb.out_cb(data_ctx->this_off + stream_off,
-					    need, &this_out_buf, &this_buf_len,
-					    data_ctx->src_data->cb.priv);
 	if (ret < 0) {
-		goto err_out;
+		dbg(0, "part put failed: %s\n", strerror(-ret));
+	} else {
+		mctx->blks[unit].state = BLOCK_STATE_UNCOMMITED;
 	}
 
-	/* out_buf freed by connection layer after send */
-	*_out_buf = this_out_buf;
-	*buf_len = this_buf_len;
+	op->req.data = NULL;
+	op_free(op);
+	apb_abb_fwrite_multi_data_free(this_data);
 
-	ret = 0;
-err_out:
 	return ret;
 }
 
 static int
-abb_fwrite_multi_data_setup(uint64_t this_off,
-			    uint64_t this_len,
-			    struct elasto_data *src_data,
-			    struct elasto_data **_this_data)
+abb_fwrite_multi_finish(struct apb_fh *apb_fh,
+			uint64_t num_blks,
+			struct list_head *blks)
 {
-	struct elasto_data *this_data;
-	struct abb_fwrite_multi_data_ctx *data_ctx;
 	int ret;
+	struct op *op;
 
-	data_ctx = malloc(sizeof(*data_ctx));
-	if (data_ctx == NULL) {
-		ret = -ENOMEM;
+	ret = az_req_block_list_put(&apb_fh->path,
+				    num_blks, blks, NULL, &op);
+	if (ret < 0) {
+		dbg(0, "multi-part done req init failed: %s\n", strerror(-ret));
 		goto err_out;
 	}
 
-	data_ctx->this_off = this_off;
-	data_ctx->this_len = this_len;
-	data_ctx->src_data = src_data;
-
-	if (src_data->type == ELASTO_DATA_IOV) {
-		ret = elasto_data_cb_new(this_len,
-					 abb_fwrite_multi_iov_data_out_cb,
-					 0, NULL, data_ctx, &this_data);
-	} else if (src_data->type == ELASTO_DATA_CB) {
-		ret = elasto_data_cb_new(this_len,
-					 abb_fwrite_multi_cb_data_out_cb,
-					 0, NULL, data_ctx, &this_data);
-	} else {
-		assert(false);	/* already checked */
-	}
+	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
 	if (ret < 0) {
-		goto err_ctx_free;
+		dbg(0, "multi-part done req failed: %s\n", strerror(-ret));
+		goto err_op_free;
 	}
 
-	*_this_data = this_data;
-
-	return 0;
-
-err_ctx_free:
-	free(data_ctx);
+	dbg(0, "multipart upload finished\n");
+	ret = 0;
+err_op_free:
+	op_free(op);
 err_out:
 	return ret;
 }
 
 static void
-abb_fwrite_multi_data_free(struct elasto_data *this_data)
+abb_fwrite_blks_free(struct azure_block *blks,
+		     uint64_t num_blks)
 {
-	struct abb_fwrite_multi_data_ctx *data_ctx = this_data->cb.priv;
+	uint64_t i;
 
-	free(data_ctx);
-	elasto_data_free(this_data);
+	for (i = 0; i < num_blks; i++) {
+		free(blks[i].id);
+	}
+	free(blks);
 }
 
+/*
+ * Azure doesn't provide a request to delete uncommitted blocks, but any
+ * omitted from a block list put are discarded. Recommit the blob's current
+ * block list, so that the blocks of a failed upload don't linger until
+ * they're garbage collected a week later. The put is conditional on the ETag
+ * returned alongside the list, so a concurrent commit is never clobbered.
+ */
 static int
-abb_fwrite_multi_handle(struct apb_fh *apb_fh,
-			int blk_num,
-			struct elasto_data *this_data,
-			struct azure_block **_blk)
+abb_fwrite_multi_discard(struct apb_fh *apb_fh)
 {
 	int ret;
 	struct op *op;
+	struct op *put_op;
+	struct az_rsp_block_list_get *blk_list_get_rsp;
 	struct azure_block *blk;
+	struct azure_block *blk_n;
 
-	blk = malloc(sizeof(*blk));
-	if (blk == NULL) {
-		ret = -ENOMEM;
+	ret = az_req_block_list_get(&apb_fh->path, &op);
+	if (ret < 0) {
 		goto err_out;
 	}
-	memset(blk, 0, sizeof(*blk));
 
-	/*
-	 * For a given blob, the length of the value specified for the
-	 * blockid parameter must be the same size for each block, and
-	 * mustn't exceed 64 bytes.
-	 */
-	ret = asprintf(&blk->id, "block%06d", blk_num);
+	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto err_blk_free;
+		goto err_op_free;
 	}
 
-	ret = az_req_block_put(&apb_fh->path,
-			       blk->id,
-			       this_data,
-			       &op);
-	if (ret < 0) {
-		goto err_id_free;
+	blk_list_get_rsp = az_rsp_block_list_get(op);
+	if (blk_list_get_rsp == NULL) {
+		ret = -EFAULT;
+		goto err_op_free;
 	}
 
-	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
-	if (ret < 0) {
-		dbg(0, "part put failed: %s\n", strerror(-ret));
+	if (blk_list_get_rsp->etag == NULL) {
+		/* no committed blocks, so no validator to condition upon */
+		dbg(1, "blob without committed blocks, leaving uncommitted "
+		    "blocks for garbage collection\n");
+		ret = -ENOTSUP;
 		goto err_op_free;
 	}
 
-	blk->state = BLOCK_STATE_UNCOMMITED;
-	*_blk = blk;
-	op->req.data = NULL;
-	op_free(op);
-
-	return 0;
-
-err_op_free:
-	op->req.data = NULL;
-	op_free(op);
-err_id_free:
-	free(blk->id);
-err_blk_free:
-	free(blk);
-err_out:
-	return ret;
-}
+	list_for_each_safe(&blk_list_get_rsp->blks, blk, blk_n, list) {
+		if (blk->state == BLOCK_STATE_COMMITED) {
+			continue;
+		}
+		list_del(&blk->list);
+		free(blk->id);
+		free(blk);
+		blk_list_get_rsp->num_blks--;
+	}
 
-static int
-abb_fwrite_multi_finish(struct apb_fh *apb_fh,
-			uint64_t num_blks,
-			struct list_head *blks)
-{
-	int ret;
-	struct op *op;
+	if ((blk_list_get_rsp->num_blks == 0)
+	 && (blk_list_get_rsp->blob_len > 0)) {
+		/* put via a single blob request, an empty list would truncate */
+		dbg(1, "blob content isn't block based, leaving uncommitted "
+		    "blocks for garbage collection\n");
+		ret = -ENOTSUP;
+		goto err_op_free;
+	}
 
-	ret = az_req_block_list_put(&apb_fh->path,
-				    num_blks, blks, &op);
+	ret = az_req_block_list_put(&apb_fh->path, blk_list_get_rsp->num_blks,
+				    &blk_list_get_rsp->blks,
+				    blk_list_get_rsp->etag, &put_op);
 	if (ret < 0) {
-		dbg(0, "multi-part done req init failed: %s\n", strerror(-ret));
-		goto err_out;
+		goto err_op_free;
 	}
 
-	ret = elasto_fop_send_recv(apb_fh->io_conn, op);
+	ret = elasto_fop_send_recv(apb_fh->io_conn, put_op);
+	if ((ret < 0) && op_rsp_error_match(put_op, 412)) {
+		dbg(1, "blob modified since block list get, leaving "
+		    "uncommitted blocks for garbage collection\n");
+	}
+	op_free(put_op);
 	if (ret < 0) {
-		dbg(0, "multi-part done req failed: %s\n", strerror(-ret));
 		goto err_op_free;
 	}
 
-	dbg(0, "multipart upload finished\n");
+	dbg(1, "discarded uncommitted blocks\n");
 	ret = 0;
 err_op_free:
 	op_free(op);
@@ -481,18 +959,10 @@ err_out:
 	return ret;
 }
 
-static void
-abb_fwrite_blks_free(struct list_head *blks)
-{
-	struct azure_block *blk;
-	struct azure_block *blk_n;
-
-	list_for_each_safe(blks, blk, blk_n, list) {
-		free(blk->id);
-		free(blk);
-	}
-}
-
+/*
+ * Blocks are uploaded in parallel across the handle's connection pool, each
+ * resent on its own if it fails. The block list is then committed in order.
+ */
 static int
 abb_fwrite_multi(struct apb_fh *apb_fh,
 		 uint64_t dest_off,
@@ -501,11 +971,10 @@ abb_fwrite_multi(struct apb_fh *apb_fh,
 		 uint64_t max_io)
 {
 	int ret;
-	struct elasto_data *this_data;
-	uint64_t data_remain = dest_len;
-	uint64_t data_off = 0;
+	struct abb_fwrite_multi_ctx mctx;
 	struct list_head blks;
-	uint64_t blk_num = 0;	/* can start at 0, unlike S3 multi-part */
+	uint64_t num_blks = (dest_len + max_io - 1) / max_io;
+	uint64_t i;
 
 	if ((dest_len / max_io > 100000) || dest_len > INT64_MAX) {
 		/*
@@ -517,47 +986,60 @@ abb_fwrite_multi(struct apb_fh *apb_fh,
 		goto err_out;
 	}
 
-	list_head_init(&blks);
-	while (data_remain > 0) {
-		struct azure_block *blk;
-		uint64_t this_off = dest_off + data_off;
-		uint64_t this_len = MIN(max_io, data_remain);
-
-		dbg(0, "multi fwrite: off=%" PRIu64 ", len=%" PRIu64 "\n",
-		    this_off, this_len);
-
-		ret = abb_fwrite_multi_data_setup(this_off, this_len, src_data,
-						  &this_data);
+	if (apb_fh->xmit_pool == NULL) {
+		ret = elasto_fxmit_pool_init(apb_fh->io_conn, apb_fh->io_depth,
+					     &apb_fh->xmit_pool);
 		if (ret < 0) {
-			dbg(0, "data setup failed\n");
-			goto err_mp_abort;
+			goto err_out;
 		}
+	}
 
-		ret = abb_fwrite_multi_handle(apb_fh, blk_num, this_data, &blk);
-		if (ret < 0) {
-			goto err_data_free;
-		}
+	memset(&mctx, 0, sizeof(mctx));
+	mctx.blks = calloc(num_blks, sizeof(*mctx.blks));
+	if (mctx.blks == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
+	ret = pthread_mutex_init(&mctx.src_lock, NULL);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_blks_free;
+	}
+
+	mctx.apb_fh = apb_fh;
+	mctx.dest_off = dest_off;
+	mctx.dest_len = dest_len;
+	mctx.max_io = max_io;
+	mctx.src_data = src_data;
+
+	ret = elasto_fop_send_recv_par(apb_fh->xmit_pool, num_blks, &mctx,
+				       abb_fwrite_multi_op_get,
+				       abb_fwrite_multi_op_put);
+	if (ret < 0) {
+		goto err_blks_discard;
+	}
 
-		abb_fwrite_multi_data_free(this_data);
-		data_off += this_len;
-		data_remain -= this_len;
-		list_add_tail(&blks, &blk->list);
-		blk_num++;
+	list_head_init(&blks);
+	for (i = 0; i < num_blks; i++) {
+		list_add_tail(&blks, &mctx.blks[i].list);
 	}
 
-	ret = abb_fwrite_multi_finish(apb_fh, blk_num, &blks);
+	ret = abb_fwrite_multi_finish(apb_fh, num_blks, &blks);
 	if (ret < 0) {
-		goto err_mp_abort;
+		goto err_blks_discard;
 	}
-	abb_fwrite_blks_free(&blks);
+	pthread_mutex_destroy(&mctx.src_lock);
+	abb_fwrite_blks_free(mctx.blks, num_blks);
 
 	return 0;
 
-err_data_free:
-	abb_fwrite_multi_data_free(this_data);
-err_mp_abort:
-	/* FIXME cleanup uploaded blob blocks */
-	abb_fwrite_blks_free(&blks);
+err_blks_discard:
+	/* best effort, the original error is returned regardless */
+	abb_fwrite_multi_discard(apb_fh);
+	pthread_mutex_destroy(&mctx.src_lock);
+err_blks_free:
+	abb_fwrite_blks_free(mctx.blks, num_blks);
 err_out:
 	return ret;
 }
@@ -570,7 +1052,7 @@ abb_fwrite(void *mod_priv,
 {
 	int ret;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	struct apb_fh *apb_fh = mod_priv;
 	uint32_t max_io;
 
@@ -587,18 +1069,16 @@ abb_fwrite(void *mod_priv,
 	}
 
 	/* check current length <= dest_len, otherwise overwrite truncates */
-	ret = abb_fstat(mod_priv, &fstat);
+	ret = elasto_fsc_size_get(apb_fh->stat_cache, mod_priv, abb_fstat,
+				  0, dest_len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size > dest_len) {
+	if (cur_len > dest_len) {
 		dbg(0, "Azure block blobs don't allow overwrites when IO len (%"
 		    PRIu64 ") < current len (%" PRIu64 ")\n",
-		    dest_len, fstat.size);
+		    dest_len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -612,6 +1092,9 @@ abb_fwrite(void *mod_priv,
 		/* split large IOs into multi-part uploads */
 		ret = abb_fwrite_multi(apb_fh, dest_off, dest_len, src_data,
 				       max_io);
+		if (ret == 0) {
+			elasto_fsc_size_set(apb_fh->stat_cache, dest_len);
+		}
 		return ret;
 	}
 
@@ -626,6 +1109,8 @@ abb_fwrite(void *mod_priv,
 	if (ret < 0) {
 		goto err_op_free;
 	}
+	/* the put replaces the blob, leaving it dest_len long */
+	elasto_fsc_size_set(apb_fh->stat_cache, dest_len);
 	ret = 0;
 
 err_op_free:
@@ -645,6 +1130,11 @@ abb_fread(void *mod_priv,
 	struct op *op;
 	struct apb_fh *apb_fh = mod_priv;
 
+	if ((src_len > apb_fh->io_chunk) && (dest_data != NULL)) {
+		return apb_abb_fread_par(apb_fh, false, src_off, src_len,
+					 dest_data);
+	}
+
 	ret = az_req_blob_get(&apb_fh->path,
 			      false,
 			      dest_data,
@@ -678,7 +1168,7 @@ abb_fsplice(void *src_mod_priv,
 	struct apb_fh *src_apb_fh = src_mod_priv;
 	struct apb_fh *dest_apb_fh = dest_mod_priv;
 	struct op *op;
-	struct elasto_fstat fstat;
+	uint64_t cur_len;
 	int ret;
 
 	if (len == 0) {
@@ -694,18 +1184,16 @@ abb_fsplice(void *src_mod_priv,
 	}
 
 	/* check source length matches the copy length */
-	ret = abb_fstat(src_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(src_apb_fh->stat_cache, src_mod_priv,
+				  abb_fstat, len, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size != len) {
+	if (cur_len != len) {
 		dbg(0, "Azure blob backend doesn't allow partial copies: "
 		       "src_len=%" PRIu64 ", copy_len=%" PRIu64 "\n",
-		       fstat.size, len);
+		       cur_len, len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -714,18 +1202,16 @@ abb_fsplice(void *src_mod_priv,
 	 * check dest file's current length <= copy len, otherwise overwrite
 	 * truncates.
 	 */
-	ret = abb_fstat(dest_mod_priv, &fstat);
+	ret = elasto_fsc_size_get(dest_apb_fh->stat_cache, dest_mod_priv,
+				  abb_fstat, 0, len, &cur_len);
 	if (ret < 0) {
 		goto err_out;
-	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
-		ret = -EBADF;
-		goto err_out;
 	}
 
-	if (fstat.size > len) {
+	if (cur_len > len) {
 		dbg(0, "Azure backend doesn't allow splice overwrites when IO "
 		       "len (%" PRIu64 ") < current len (%" PRIu64 ")\n",
-		       len, fstat.size);
+		       len, cur_len);
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -740,6 +1226,11 @@ abb_fsplice(void *src_mod_priv,
 		goto err_op_free;
 	}
 
+	ret = apb_fsplice_cp_status_check(dest_apb_fh, op, len);
+	if (ret < 0) {
+		goto err_op_free;
+	}
+
 	ret = 0;
 err_op_free:
 	op_free(op);
@@ -37,6 +37,7 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "apb_handle.h"
 #include "apb_lease.h"
 
@@ -201,6 +202,8 @@ apb_flease_acquire(void *mod_priv,
 		if (ret < 0) {
 			goto err_lease_free;
 		}
+		/* the cached lease status is now stale */
+		elasto_fsc_invalidate(apb_fh->stat_cache);
 	} else if (apb_fh->path.ctnr != NULL) {
 		ret = apb_flease_acquire_ctnr(apb_fh, duration, &lease->lid);
 		if (ret < 0) {
@@ -309,6 +312,7 @@ apb_flease_break(void *mod_priv,
 		if (ret < 0) {
 			goto err_out;
 		}
+		elasto_fsc_invalidate(apb_fh->stat_cache);
 	} else if (apb_fh->path.ctnr != NULL) {
 		ret = apb_flease_break_ctnr(apb_fh, lid);
 		if (ret < 0) {
@@ -419,6 +423,7 @@ apb_flease_release(void *mod_priv,
 		if (ret < 0) {
 			goto err_out;
 		}
+		elasto_fsc_invalidate(apb_fh->stat_cache);
 	} else if (apb_fh->path.ctnr != NULL) {
 		ret = apb_flease_release_ctnr(apb_fh, lease->lid);
 		if (ret < 0) {
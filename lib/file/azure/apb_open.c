@@ -40,7 +40,9 @@
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
 #include "lib/file/token.h"
+#include "lib/file/scache.h"
 #include "apb_handle.h"
+#include "apb_stat.h"
 #include "apb_open.h"
 
 #define APB_FOPEN_LOCATION_DEFAULT "West Europe"
@@ -94,7 +96,11 @@ apb_io_conn_init(struct apb_fh *apb_fh,
 	char *url_host;
 	struct elasto_conn *io_conn;
 
-	if ((apb_fh->acc_access_key == NULL) && (apb_fh->mgmt_conn != NULL)) {
+	if (apb_fh->sas_token != NULL) {
+		/* SAS is appended to each request, no key lookup needed */
+		dbg(3, "using SAS for IO conn\n");
+	} else if ((apb_fh->acc_access_key == NULL)
+		&& (apb_fh->mgmt_conn != NULL)) {
 		ret = apb_acc_key_get(apb_fh, &apb_fh->acc_access_key);
 		if (ret < 0) {
 			dbg(0, "failed to get account access key\n");
@@ -120,8 +126,12 @@ apb_io_conn_init(struct apb_fh *apb_fh,
 		goto err_out;
 	}
 
-	ret = elasto_conn_sign_setkey(io_conn, apb_fh->path.acc,
-				      apb_fh->acc_access_key);
+	if (apb_fh->sas_token != NULL) {
+		ret = elasto_conn_sign_setquery(io_conn, apb_fh->sas_token);
+	} else {
+		ret = elasto_conn_sign_setkey(io_conn, apb_fh->path.acc,
+					      apb_fh->acc_access_key);
+	}
 	if (ret < 0) {
 		goto err_conn_free;
 	}
@@ -143,6 +153,7 @@ apb_fopen_blob(struct apb_fh *apb_fh,
 	int ret;
 	struct op *op;
 	struct az_rsp_blob_prop_get *blob_prop_get_rsp;
+	struct elasto_fstat fstat;
 	bool created = false;
 
 	if (flags & ELASTO_FOPEN_DIRECTORY) {
@@ -192,6 +203,10 @@ apb_fopen_blob(struct apb_fh *apb_fh,
 		goto err_op_free;
 	}
 
+	/* seed the stat cache, saving a round trip for the first size check */
+	apb_fstat_blob_fill(blob_prop_get_rsp, &fstat);
+	elasto_fsc_set(apb_fh->stat_cache, &fstat);
+
 done:
 	ret = (created ? ELASTO_FOPEN_RET_CREATED : ELASTO_FOPEN_RET_EXISTED);
 err_op_free:
@@ -207,6 +222,7 @@ abb_fopen_blob(struct apb_fh *apb_fh,
 	int ret;
 	struct op *op;
 	struct az_rsp_blob_prop_get *blob_prop_get_rsp;
+	struct elasto_fstat fstat;
 	bool created = false;
 
 	if (flags & ELASTO_FOPEN_DIRECTORY) {
@@ -263,6 +279,9 @@ abb_fopen_blob(struct apb_fh *apb_fh,
 		goto err_op_free;
 	}
 
+	apb_fstat_blob_fill(blob_prop_get_rsp, &fstat);
+	elasto_fsc_set(apb_fh->stat_cache, &fstat);
+
 done:
 	ret = (created ? ELASTO_FOPEN_RET_CREATED : ELASTO_FOPEN_RET_EXISTED);
 err_op_free:
@@ -570,11 +589,26 @@ apb_abb_fopen(void *mod_priv,
 	int ret;
 	struct apb_fh *apb_fh = mod_priv;
 
-	ret = az_blob_path_parse(path, &apb_fh->path);
+	ret = elasto_fxmit_depth_get(open_toks, &apb_fh->io_depth);
 	if (ret < 0) {
 		goto err_out;
 	}
 
+	ret = elasto_fxmit_chunk_get(open_toks, &apb_fh->io_chunk);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = elasto_fsc_setup(open_toks, &apb_fh->stat_cache);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	ret = az_blob_path_parse(path, &apb_fh->path);
+	if (ret < 0) {
+		goto err_sc_free;
+	}
+
 	if (apb_fh->pem_path != NULL) {
 		char *mgmt_host;
 		/*
@@ -586,7 +620,7 @@ apb_abb_fopen(void *mod_priv,
 		 */
 		ret = az_mgmt_req_hostname_get(&mgmt_host);
 		if (ret < 0) {
-			goto err_out;
+			goto err_path_free;
 		}
 
 		ret = elasto_conn_init_az(apb_fh->pem_path, false, mgmt_host,
@@ -597,7 +631,8 @@ apb_abb_fopen(void *mod_priv,
 		}
 	} else {
 		/* checked in apb_fh_init() */
-		assert(apb_fh->acc_access_key != NULL);
+		assert((apb_fh->acc_access_key != NULL)
+		    || (apb_fh->sas_token != NULL));
 	}
 
 	if (apb_fh->path.blob != NULL) {
@@ -665,6 +700,9 @@ err_mgmt_conn_free:
 	elasto_conn_free(apb_fh->mgmt_conn);
 err_path_free:
 	az_blob_path_free(&apb_fh->path);
+err_sc_free:
+	elasto_fsc_free(apb_fh->stat_cache);
+	apb_fh->stat_cache = NULL;
 err_out:
 	return ret;
 }
@@ -683,6 +721,10 @@ apb_fclose(void *mod_priv)
 {
 	struct apb_fh *apb_fh = mod_priv;
 
+	elasto_fxmit_pool_free(apb_fh->xmit_pool);
+	apb_fh->xmit_pool = NULL;
+	elasto_fsc_free(apb_fh->stat_cache);
+	apb_fh->stat_cache = NULL;
 	/* @io_conn may be null (root opens) */
 	elasto_conn_free(apb_fh->io_conn);
 	elasto_conn_free(apb_fh->mgmt_conn);
@@ -38,9 +38,35 @@
 #include "lib/file/file_api.h"
 #include "lib/file/xmit.h"
 #include "lib/file/handle.h"
+#include "lib/file/scache.h"
 #include "apb_handle.h"
 #include "apb_stat.h"
 
+/* fill @fstat from a blob properties response, obtained on stat or open */
+void
+apb_fstat_blob_fill(struct az_rsp_blob_prop_get *blob_prop_get_rsp,
+		    struct elasto_fstat *fstat)
+{
+	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
+	fstat->size = blob_prop_get_rsp->len;
+	if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
+		fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
+	} else if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_LOCKED) {
+		fstat->lease_status = ELASTO_FLEASE_LOCKED;
+	}
+	/* flag which values are valid in the stat response */
+	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
+				| ELASTO_FSTAT_FIELD_SIZE
+				| ELASTO_FSTAT_FIELD_LEASE);
+	if (blob_prop_get_rsp->is_page) {
+		fstat->blksize = 512;
+		fstat->field_mask |= ELASTO_FSTAT_FIELD_BSIZE;
+	} else {
+		fstat->blksize = 0;	/* leave vacant for now */
+	}
+	elasto_fstat_etag_set(fstat, blob_prop_get_rsp->etag);
+}
+
 static int
 apb_fstat_blob(struct apb_fh *apb_fh,
 	       struct elasto_fstat *fstat)
@@ -49,6 +75,11 @@ apb_fstat_blob(struct apb_fh *apb_fh,
 	struct op *op;
 	struct az_rsp_blob_prop_get *blob_prop_get_rsp;
 
+	ret = elasto_fsc_get(apb_fh->stat_cache, 0, fstat);
+	if (ret == 0) {
+		goto err_out;
+	}
+
 	ret = az_req_blob_prop_get(&apb_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -72,19 +103,8 @@ apb_fstat_blob(struct apb_fh *apb_fh,
 		goto err_op_free;
 	}
 
-	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
-	fstat->size = blob_prop_get_rsp->len;
-	fstat->blksize = 512;
-	if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
-		fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
-	} else if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_LOCKED) {
-		fstat->lease_status = ELASTO_FLEASE_LOCKED;
-	}
-	/* flag which values are valid in the stat response */
-	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
-				| ELASTO_FSTAT_FIELD_SIZE
-				| ELASTO_FSTAT_FIELD_BSIZE
-				| ELASTO_FSTAT_FIELD_LEASE);
+	apb_fstat_blob_fill(blob_prop_get_rsp, fstat);
+	elasto_fsc_set(apb_fh->stat_cache, fstat);
 	ret = 0;
 
 err_op_free:
@@ -260,9 +280,11 @@ int
 apb_fstatvfs(void *mod_priv,
 	     struct elasto_fstatfs *fstatfs)
 {
+	struct apb_fh *apb_fh = mod_priv;
+
 	/* fstatfs checked by caller */
 	fstatfs->iosize_min = 512;
-	fstatfs->iosize_optimal = 512;
+	fstatfs->iosize_optimal = apb_fh->io_chunk * apb_fh->io_depth;
 
 	/* Azure Page Blobs are sparse and can be written at any offset */
 	fstatfs->cap_flags = (ELASTO_FSTATFS_CAP_SPARSE
@@ -284,6 +306,11 @@ abb_fstat_blob(struct apb_fh *apb_fh,
 	struct op *op;
 	struct az_rsp_blob_prop_get *blob_prop_get_rsp;
 
+	ret = elasto_fsc_get(apb_fh->stat_cache, 0, fstat);
+	if (ret == 0) {
+		goto err_out;
+	}
+
 	ret = az_req_blob_prop_get(&apb_fh->path, &op);
 	if (ret < 0) {
 		goto err_out;
@@ -307,18 +334,8 @@ abb_fstat_blob(struct apb_fh *apb_fh,
 		goto err_op_free;
 	}
 
-	fstat->ent_type = ELASTO_FSTAT_ENT_FILE;
-	fstat->size = blob_prop_get_rsp->len;
-	fstat->blksize = 0;	/* leave vacant for now */
-	if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_UNLOCKED) {
-		fstat->lease_status = ELASTO_FLEASE_UNLOCKED;
-	} else if (blob_prop_get_rsp->lease_status == AOP_LEASE_STATUS_LOCKED) {
-		fstat->lease_status = ELASTO_FLEASE_LOCKED;
-	}
-	/* flag which values are valid in the stat response */
-	fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
-				| ELASTO_FSTAT_FIELD_SIZE
-				| ELASTO_FSTAT_FIELD_LEASE);
+	apb_fstat_blob_fill(blob_prop_get_rsp, fstat);
+	elasto_fsc_set(apb_fh->stat_cache, fstat);
 	ret = 0;
 
 err_op_free:
@@ -366,8 +383,10 @@ int
 abb_fstatvfs(void *mod_priv,
 	     struct elasto_fstatfs *fstatfs)
 {
+	struct apb_fh *apb_fh = mod_priv;
+
 	fstatfs->iosize_min = 1;
-	fstatfs->iosize_optimal = 512;
+	fstatfs->iosize_optimal = apb_fh->io_chunk * apb_fh->io_depth;
 
 	/*
 	 * Azure Block Blobs aren't sparse, nor can they be written to at
@@ -14,11 +14,21 @@
 #ifndef _APB_STAT_H_
 #define _APB_STAT_H_
 
+struct az_rsp_blob_prop_get;
+
+void
+apb_fstat_blob_fill(struct az_rsp_blob_prop_get *blob_prop_get_rsp,
+		    struct elasto_fstat *fstat);
+
 /* page blob operations */
 int
 apb_fstat(void *mod_priv,
 	  struct elasto_fstat *fstat);
 
+/* also used for block blobs */
+void
+apb_fstat_invalidate(void *mod_priv);
+
 int
 apb_fstatvfs(void *mod_priv,
 	     struct elasto_fstatfs *fstatfs);
@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "ccan/list/list.h"
+#include "lib/util.h"
+#include "lib/dbg.h"
+#include "lib/data.h"
+#include "file_api.h"
+#include "handle.h"
+#include "bcache.h"
+
+/* maximum number of missing blocks fetched with a single backend read */
+#define ELASTO_FBC_FILL_MAX 16
+#define ELASTO_FBC_HASH_SIZE 1024
+
+/*
+ * Cache state for a single backend path, shared by all handles which have it
+ * open.
+ *
+ * @refs: number of attached handles
+ * @gen: bumped whenever blocks are dropped. Fills started under an older
+ *	 generation aren't inserted, as they may carry stale data.
+ * @blks: cached blocks for this path
+ * @valid: @size and @etag were obtained within the revalidation interval
+ * @etag: validator that cached blocks correspond to
+ * @size: file size at last validation
+ * @validated: time of last validation
+ */
+struct elasto_fbc_obj {
+	struct list_node list;
+	enum elasto_ftype type;
+	char *path;
+	uint32_t refs;
+	uint64_t gen;
+	struct list_head blks;
+	bool valid;
+	char etag[ELASTO_FSTAT_ETAG_MAX];
+	uint64_t size;
+	time_t validated;
+};
+
+/*
+ * @idx: block index, the block covers @len bytes from
+ *	 @idx * ELASTO_FBC_BLK_SIZE. @len is only short for the final block.
+ */
+struct elasto_fbc_blk {
+	struct list_node hash_list;
+	struct list_node obj_list;
+	struct list_node lru_list;
+	struct elasto_fbc_obj *obj;
+	uint64_t idx;
+	uint64_t len;
+	uint8_t *buf;
+};
+
+/*
+ * @lock: protects all cache state
+ * @max: memory cap for cached block data, zero if the cache is disabled
+ * @used: bytes of cached block data
+ * @reval_secs: interval after which an object's validator is rechecked
+ * @objs: cache objects, with attached handles or cached blocks
+ * @lru: cached blocks, least recently used first
+ * @hash: cached blocks, hashed by object and index
+ */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t max;
+	uint64_t used;
+	uint32_t reval_secs;
+	struct list_head objs;
+	struct list_head lru;
+	struct list_head *hash;
+} elasto_fbc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.objs = LIST_HEAD_INIT(elasto_fbc.objs),
+	.lru = LIST_HEAD_INIT(elasto_fbc.lru),
+};
+
+static struct list_head *
+elasto_fbc_bucket(struct elasto_fbc_obj *obj,
+		  uint64_t idx)
+{
+	uint64_t h = ((uintptr_t)obj >> 4) ^ (idx * 0x9e3779b97f4a7c15ULL);
+
+	return &elasto_fbc.hash[(h >> 32) % ELASTO_FBC_HASH_SIZE];
+}
+
+/* called with @elasto_fbc.lock held */
+static struct elasto_fbc_blk *
+elasto_fbc_blk_lookup(struct elasto_fbc_obj *obj,
+		      uint64_t idx)
+{
+	struct elasto_fbc_blk *blk;
+
+	list_for_each(elasto_fbc_bucket(obj, idx), blk, hash_list) {
+		if ((blk->obj == obj) && (blk->idx == idx)) {
+			return blk;
+		}
+	}
+	return NULL;
+}
+
+/* called with @elasto_fbc.lock held */
+static void
+elasto_fbc_blk_free(struct elasto_fbc_blk *blk)
+{
+	list_del(&blk->hash_list);
+	list_del(&blk->obj_list);
+	list_del(&blk->lru_list);
+	elasto_fbc.used -= blk->len;
+	free(blk->buf);
+	free(blk);
+}
+
+/* called with @elasto_fbc.lock held */
+static void
+elasto_fbc_obj_put(struct elasto_fbc_obj *obj)
+{
+	if ((obj->refs > 0) || !list_empty(&obj->blks)) {
+		return;
+	}
+
+	list_del(&obj->list);
+	free(obj->path);
+	free(obj);
+}
+
+/* free least recently used blocks until @need more bytes fit */
+static void
+elasto_fbc_evict(uint64_t need)
+{
+	struct elasto_fbc_blk *blk;
+
+	while (elasto_fbc.used + need > elasto_fbc.max) {
+		struct elasto_fbc_obj *obj;
+
+		blk = list_top(&elasto_fbc.lru, struct elasto_fbc_blk,
+			       lru_list);
+		if (blk == NULL) {
+			break;
+		}
+		obj = blk->obj;
+		elasto_fbc_blk_free(blk);
+		elasto_fbc_obj_put(obj);
+	}
+}
+
+/*
+ * Drop all blocks, leaving @obj allocated.
+ * Called with @elasto_fbc.lock held.
+ */
+static void
+elasto_fbc_obj_drop(struct elasto_fbc_obj *obj)
+{
+	struct elasto_fbc_blk *blk;
+	struct elasto_fbc_blk *blk_n;
+
+	list_for_each_safe(&obj->blks, blk, blk_n, obj_list) {
+		elasto_fbc_blk_free(blk);
+	}
+	obj->gen++;
+}
+
+int
+elasto_fcache_setup(uint64_t max_bytes,
+		    uint32_t revalidate_secs)
+{
+	int i;
+
+	if ((max_bytes != 0) && (max_bytes < ELASTO_FBC_BLK_SIZE)) {
+		dbg(0, "block cache limit %" PRIu64 " smaller than block size\n",
+		    max_bytes);
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	if ((max_bytes != 0) && (elasto_fbc.hash == NULL)) {
+		elasto_fbc.hash = malloc(sizeof(*elasto_fbc.hash)
+						* ELASTO_FBC_HASH_SIZE);
+		if (elasto_fbc.hash == NULL) {
+			pthread_mutex_unlock(&elasto_fbc.lock);
+			return -ENOMEM;
+		}
+		for (i = 0; i < ELASTO_FBC_HASH_SIZE; i++) {
+			list_head_init(&elasto_fbc.hash[i]);
+		}
+	}
+
+	dbg(3, "block cache limit %" PRIu64 " -> %" PRIu64 " bytes, "
+	    "revalidation interval %u secs\n",
+	    elasto_fbc.max, max_bytes, revalidate_secs);
+	elasto_fbc.max = max_bytes;
+	elasto_fbc.reval_secs = revalidate_secs;
+	/* a lower limit takes effect immediately, zero drops everything */
+	elasto_fbc_evict(0);
+	pthread_mutex_unlock(&elasto_fbc.lock);
+
+	return 0;
+}
+
+int
+elasto_fbc_attach(struct elasto_fh *fh)
+{
+	int ret;
+	struct elasto_fbc_obj *obj;
+
+	if (fh->open_flags & ELASTO_FOPEN_DIRECTORY) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	if (elasto_fbc.max == 0) {
+		ret = 0;
+		goto out_unlock;
+	}
+
+	list_for_each(&elasto_fbc.objs, obj, list) {
+		if ((obj->type == fh->type) && !strcmp(obj->path, fh->open_path)) {
+			goto found;
+		}
+	}
+
+	obj = malloc(sizeof(*obj));
+	if (obj == NULL) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	memset(obj, 0, sizeof(*obj));
+	obj->path = strdup(fh->open_path);
+	if (obj->path == NULL) {
+		free(obj);
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	obj->type = fh->type;
+	list_head_init(&obj->blks);
+	list_add_tail(&elasto_fbc.objs, &obj->list);
+found:
+	obj->refs++;
+	/* close-to-open consistency: check for outside changes on first use */
+	obj->valid = false;
+	fh->bc = obj;
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&elasto_fbc.lock);
+	return ret;
+}
+
+/*
+ * Check the object's validator against the backend, if the revalidation
+ * interval has passed, dropping all cached blocks if it changed.
+ */
+static int
+elasto_fbc_revalidate(struct elasto_fh *fh,
+		      struct elasto_fbc_obj *obj)
+{
+	int ret;
+	struct elasto_fstat fstat;
+	time_t now = time(NULL);
+	uint64_t gen;
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	if (obj->valid && (now - obj->validated < elasto_fbc.reval_secs)) {
+		pthread_mutex_unlock(&elasto_fbc.lock);
+		return 0;
+	}
+	gen = obj->gen;
+	pthread_mutex_unlock(&elasto_fbc.lock);
+
+	ret = fh->ops.stat(fh->mod_priv, &fstat);
+	if (ret < 0) {
+		return ret;
+	}
+	if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0
+	 || (fstat.field_mask & ELASTO_FSTAT_FIELD_ETAG) == 0) {
+		dbg(1, "no size or validator for %s, bypassing cache\n",
+		    fh->open_path);
+		return -ENOTSUP;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	if (gen != obj->gen) {
+		/* raced with a modification, @fstat may already be stale */
+		ret = -EAGAIN;
+		goto out_unlock;
+	}
+	if (strcmp(obj->etag, fstat.etag)) {
+		dbg(3, "%s changed from %s to %s, dropping cached blocks\n",
+		    fh->open_path, obj->etag, fstat.etag);
+		elasto_fbc_obj_drop(obj);
+	}
+	strcpy(obj->etag, fstat.etag);
+	obj->size = fstat.size;
+	obj->validated = now;
+	obj->valid = true;
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&elasto_fbc.lock);
+	return ret;
+}
+
+static int
+elasto_fbc_copy(struct elasto_data *dest_data,
+		const uint8_t *buf,
+		uint64_t len)
+{
+	int ret;
+
+	if (dest_data->type == ELASTO_DATA_IOV) {
+		memcpy(dest_data->iov.buf + dest_data->off, buf, len);
+	} else {
+		ret = elasto_data_iovec_copy_in(dest_data, dest_data->off, len,
+						buf);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	dest_data->off += len;
+
+	return 0;
+}
+
+/*
+ * Read @num_blks blocks from @idx via a single backend request, copy the
+ * requested part to @dest_data, then insert the blocks into the cache.
+ */
+static int
+elasto_fbc_fill(struct elasto_fh *fh,
+		struct elasto_fbc_obj *obj,
+		uint64_t gen,
+		uint64_t size,
+		uint64_t idx,
+		int num_blks,
+		uint64_t cur,
+		uint64_t end,
+		struct elasto_data *dest_data,
+		uint64_t *_filled)
+{
+	int ret;
+	int i;
+	struct iovec iov[ELASTO_FBC_FILL_MAX];
+	struct elasto_data *blks_data;
+	uint64_t blks_off = idx * ELASTO_FBC_BLK_SIZE;
+	uint64_t filled = 0;
+
+	assert(num_blks <= ELASTO_FBC_FILL_MAX);
+	memset(iov, 0, sizeof(iov));
+	for (i = 0; i < num_blks; i++) {
+		uint64_t blk_off = blks_off + (i * ELASTO_FBC_BLK_SIZE);
+
+		iov[i].iov_len = MIN(ELASTO_FBC_BLK_SIZE, size - blk_off);
+		iov[i].iov_base = malloc(iov[i].iov_len);
+		if (iov[i].iov_base == NULL) {
+			ret = -ENOMEM;
+			goto err_bufs_free;
+		}
+	}
+
+	ret = elasto_data_iovec_new(iov, num_blks, &blks_data);
+	if (ret < 0) {
+		goto err_bufs_free;
+	}
+
+	dbg(4, "filling %d cache blocks at %" PRIu64 " for %s\n",
+	    num_blks, blks_off, fh->open_path);
+	ret = fh->ops.read(fh->mod_priv, blks_off, blks_data->len, blks_data);
+	elasto_data_free(blks_data);
+	if (ret < 0) {
+		goto err_bufs_free;
+	}
+
+	for (i = 0; (i < num_blks) && (cur < end); i++) {
+		uint64_t blk_off = blks_off + (i * ELASTO_FBC_BLK_SIZE);
+		uint64_t len = MIN(end - cur, blk_off + iov[i].iov_len - cur);
+		uint8_t *buf = iov[i].iov_base;
+
+		ret = elasto_fbc_copy(dest_data, buf + (cur - blk_off), len);
+		if (ret < 0) {
+			goto err_bufs_free;
+		}
+		cur += len;
+		filled += len;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	for (i = 0; i < num_blks; i++) {
+		struct elasto_fbc_blk *blk;
+
+		if ((gen != obj->gen) || (elasto_fbc.max < iov[i].iov_len)
+		 || (elasto_fbc_blk_lookup(obj, idx + i) != NULL)) {
+			/* modified, disabled, or filled concurrently */
+			free(iov[i].iov_base);
+			continue;
+		}
+
+		blk = malloc(sizeof(*blk));
+		if (blk == NULL) {
+			free(iov[i].iov_base);
+			continue;
+		}
+		elasto_fbc_evict(iov[i].iov_len);
+		blk->obj = obj;
+		blk->idx = idx + i;
+		blk->len = iov[i].iov_len;
+		blk->buf = iov[i].iov_base;
+		list_add_tail(elasto_fbc_bucket(obj, blk->idx), &blk->hash_list);
+		list_add_tail(&obj->blks, &blk->obj_list);
+		list_add_tail(&elasto_fbc.lru, &blk->lru_list);
+		elasto_fbc.used += blk->len;
+	}
+	pthread_mutex_unlock(&elasto_fbc.lock);
+
+	*_filled = filled;
+	return 0;
+
+err_bufs_free:
+	for (i = 0; i < num_blks; i++) {
+		free(iov[i].iov_base);
+	}
+	return ret;
+}
+
+int
+elasto_fbc_read(struct elasto_fh *fh,
+		uint64_t src_off,
+		uint64_t src_len,
+		struct elasto_data *dest_data,
+		uint64_t *_served)
+{
+	int ret;
+	struct elasto_fbc_obj *obj = fh->bc;
+	uint64_t end = src_off + src_len;
+	uint64_t cur = src_off;
+	uint64_t gen;
+	uint64_t size;
+
+	*_served = 0;
+	if ((obj == NULL) || (src_len == 0)
+	 || ((dest_data->type != ELASTO_DATA_IOV)
+	  && (dest_data->type != ELASTO_DATA_IOVEC))) {
+		return 0;
+	}
+
+	ret = elasto_fbc_revalidate(fh, obj);
+	if (ret < 0) {
+		/* let the backend have its say */
+		dbg(4, "bypassing block cache: %s\n", strerror(-ret));
+		return 0;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	if ((elasto_fbc.max == 0) || !obj->valid || (end > obj->size)) {
+		/* reads beyond EOF fail at the backend */
+		pthread_mutex_unlock(&elasto_fbc.lock);
+		return 0;
+	}
+	size = obj->size;
+
+	while (cur < end) {
+		uint64_t idx = cur / ELASTO_FBC_BLK_SIZE;
+		uint64_t blk_off = idx * ELASTO_FBC_BLK_SIZE;
+		struct elasto_fbc_blk *blk;
+		uint64_t filled;
+		int n;
+
+		blk = elasto_fbc_blk_lookup(obj, idx);
+		if ((blk != NULL)
+		 && (blk->len != MIN(ELASTO_FBC_BLK_SIZE, size - blk_off))) {
+			/* former final block, the file has since grown */
+			elasto_fbc_blk_free(blk);
+			blk = NULL;
+		}
+		if (blk != NULL) {
+			uint64_t len = MIN(end - cur, blk_off + blk->len - cur);
+
+			list_del(&blk->lru_list);
+			list_add_tail(&elasto_fbc.lru, &blk->lru_list);
+			ret = elasto_fbc_copy(dest_data,
+					      blk->buf + (cur - blk_off), len);
+			if (ret < 0) {
+				goto out_unlock;
+			}
+			*_served += len;
+			cur += len;
+			continue;
+		}
+
+		/* batch up consecutive missing blocks */
+		for (n = 1; n < ELASTO_FBC_FILL_MAX; n++) {
+			uint64_t next_off = blk_off + (n * ELASTO_FBC_BLK_SIZE);
+			if ((next_off >= end)
+			 || (elasto_fbc_blk_lookup(obj, idx + n) != NULL)) {
+				break;
+			}
+		}
+		gen = obj->gen;
+		pthread_mutex_unlock(&elasto_fbc.lock);
+
+		ret = elasto_fbc_fill(fh, obj, gen, size, idx, n, cur, end,
+				      dest_data, &filled);
+		if (ret < 0) {
+			return ret;
+		}
+		*_served += filled;
+		cur += filled;
+
+		pthread_mutex_lock(&elasto_fbc.lock);
+	}
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&elasto_fbc.lock);
+	return ret;
+}
+
+void
+elasto_fbc_invalidate(struct elasto_fh *fh)
+{
+	struct elasto_fbc_obj *obj = fh->bc;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	/*
+	 * The new validator isn't known, so the next one seen can't tell blocks
+	 * left unmodified here from those changed by another writer meanwhile.
+	 */
+	pthread_mutex_lock(&elasto_fbc.lock);
+	elasto_fbc_obj_drop(obj);
+	obj->valid = false;
+	obj->etag[0] = '\0';
+	pthread_mutex_unlock(&elasto_fbc.lock);
+}
+
+void
+elasto_fbc_detach(struct elasto_fh *fh)
+{
+	struct elasto_fbc_obj *obj = fh->bc;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&elasto_fbc.lock);
+	assert(obj->refs > 0);
+	obj->refs--;
+	elasto_fbc_obj_put(obj);
+	pthread_mutex_unlock(&elasto_fbc.lock);
+	fh->bc = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+/* size of each cached block, and the unit of backend reads on a miss */
+#define ELASTO_FBC_BLK_SIZE (256 * BYTES_IN_KB)
+
+/*
+ * Reference the cache object for @fh's backend and path, if the block cache
+ * is enabled. The object is revalidated on the first cached read.
+ */
+int
+elasto_fbc_attach(struct elasto_fh *fh);
+
+/*
+ * Serve @src_off / @src_len from cached blocks, fetching any missing blocks
+ * from the backend. @_served is set to @src_len, with @dest_data->off advanced
+ * to match, or to zero if the read bypassed the cache and should be sent to
+ * the backend by the caller.
+ */
+int
+elasto_fbc_read(struct elasto_fh *fh,
+		uint64_t src_off,
+		uint64_t src_len,
+		struct elasto_data *dest_data,
+		uint64_t *_served);
+
+/* drop all cached blocks for @fh's path, following a modification via @fh */
+void
+elasto_fbc_invalidate(struct elasto_fh *fh);
+
+/* drop the cache object reference taken on attach */
+void
+elasto_fbc_detach(struct elasto_fh *fh);
+
+#endif /* _BCACHE_H_ */
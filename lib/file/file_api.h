@@ -19,6 +19,7 @@ extern "C" {
 #endif
 
 struct elasto_fh;
+struct iovec;
 
 enum elasto_ftype {
 	ELASTO_FILE_AZURE = 1,	/* Alias for APB */
@@ -35,9 +36,32 @@ struct elasto_fauth {
 		struct {
 			char *ps_path;
 			char *access_key;
+			/* SAS token query string, used instead of keys */
+			char *sas_token;
 		} az;
 		struct {
 			char *creds_path;
+			/* SigV4 if set, otherwise legacy SigV2 signing */
+			char *region;
+			/*
+			 * pre-signed query string, used instead of creds. A
+			 * pre-signed URL covers a single method and object,
+			 * so the handle must be opened for the signed object
+			 * and any other request fails with -EACCES. Open only
+			 * checks for existence with a HEAD signature, and
+			 * writes via a PUT signature always replace the
+			 * object. Large writes need multi-part requests, so
+			 * aren't supported.
+			 */
+			char *presign_query;
+			/* method @presign_query was signed for, GET if NULL */
+			char *presign_method;
+			/*
+			 * host[:port] of an S3 compatible store, AWS if NULL.
+			 * Overrides any s3:// path host. Non-AWS hosts are
+			 * addressed path-style, i.e. host/bkt/obj.
+			 */
+			char *endpoint;
 		} s3;
 	};
 	bool insecure_http;
@@ -76,9 +100,30 @@ enum elasto_fopen_flags {
  *
  * @ELASTO_FOPEN_TOK_CREATE_AT_LOCATION specifies a location constraint for a
  * newly created directory, where applicable (e.g. Azure Account).
+ * @ELASTO_FOPEN_TOK_IO_DEPTH decimal maximum number of requests kept in flight
+ * when a large I/O is split across multiple connections (default 4, max 64).
+ * @ELASTO_FOPEN_TOK_IO_CHUNK_SIZE decimal byte size of the ranges that a large
+ * read is split into, a multiple of 512 (default 4 MiB).
+ * @ELASTO_FOPEN_TOK_READAHEAD_MAX decimal maximum byte size of the window
+ * prefetched once sequential reads are detected, zero disables read-ahead
+ * (default). Prefetches use a second backend connection, opened on the first
+ * sequential run.
+ * @ELASTO_FOPEN_TOK_WRITEBACK_MAX decimal maximum byte size of written data
+ * buffered for asynchronous write-back, zero writes through (default). Only
+ * supported by backends capable of range writes, see elasto_fsync(). Writes
+ * which aren't aligned to the backend's minimum I/O size are written through.
+ * @ELASTO_FOPEN_TOK_STAT_TTL decimal number of milliseconds for which backend
+ * stat results are cached on the handle, zero disables caching (default 1000,
+ * ignored for local files). Modifications via the handle update the cache,
+ * while changes made elsewhere may go unnoticed for up to this long.
  */
 enum elasto_fopen_token_key {
 	ELASTO_FOPEN_TOK_CREATE_AT_LOCATION	= 1,
+	ELASTO_FOPEN_TOK_IO_DEPTH		= 2,
+	ELASTO_FOPEN_TOK_IO_CHUNK_SIZE		= 3,
+	ELASTO_FOPEN_TOK_READAHEAD_MAX		= 4,
+	ELASTO_FOPEN_TOK_WRITEBACK_MAX		= 5,
+	ELASTO_FOPEN_TOK_STAT_TTL		= 6,
 };
 
 /**
@@ -128,12 +173,42 @@ elasto_fwrite_cb(struct elasto_fh *fh,
 			       uint64_t *buf_len,
 			       void *priv));
 
+/**
+ * Write the @iovcnt segments of @iov to the file, starting at @dest_off.
+ *
+ * The segments are sent as one contiguous range, so backends issue a single
+ * request (e.g. one APB page put) where the range would otherwise need one
+ * request per segment with elasto_fwrite(). The caller's segments are
+ * referenced, not copied, and must remain valid until return.
+ *
+ * @returns:	-errno on error, zero on success
+ */
+int
+elasto_fwritev(struct elasto_fh *fh,
+	       uint64_t dest_off,
+	       const struct iovec *iov,
+	       int iovcnt);
+
 int
 elasto_fread(struct elasto_fh *fh,
 	     uint64_t src_off,
 	     uint64_t src_len,
 	     uint8_t *in_buf);
 
+/**
+ * Read into the @iovcnt segments of @iov, starting at @src_off.
+ *
+ * A single ranged GET is issued for the combined segment length, with the
+ * response body scattered across the segments as it arrives.
+ *
+ * @returns:	-errno on error, zero on success
+ */
+int
+elasto_freadv(struct elasto_fh *fh,
+	      uint64_t src_off,
+	      const struct iovec *iov,
+	      int iovcnt);
+
 int
 elasto_fread_cb(struct elasto_fh *fh,
 		uint64_t src_off,
@@ -168,6 +243,20 @@ elasto_fsplice(struct elasto_fh *src_fh,
 	       uint64_t dest_off,
 	       uint64_t len);
 
+/**
+ * Flush data buffered for write-back to the backend
+ *
+ * With write-back enabled, small and adjacent writes are merged in memory and
+ * flushed asynchronously. Reads and other operations on the handle always see
+ * buffered data, but it only reaches the backend once flushed. Buffered data
+ * is also flushed by elasto_fclose(), and discarded by elasto_funlink_close().
+ *
+ * @returns:	-errno on error, including failures of earlier asynchronous
+ *		flushes, zero on success
+ */
+int
+elasto_fsync(struct elasto_fh *fh);
+
 int
 elasto_fclose(struct elasto_fh *fh);
 
@@ -192,8 +281,9 @@ enum elasto_fstat_field {
 	ELASTO_FSTAT_FIELD_SIZE		= 0x0002,
 	ELASTO_FSTAT_FIELD_BSIZE	= 0x0004,
 	ELASTO_FSTAT_FIELD_LEASE	= 0x0008,
+	ELASTO_FSTAT_FIELD_ETAG		= 0x0010,
 
-	ELASTO_FSTAT_FIELD_ALL_MASK	= 0x000F,
+	ELASTO_FSTAT_FIELD_ALL_MASK	= 0x001F,
 };
 
 enum elasto_fstat_ent_type {
@@ -202,11 +292,15 @@ enum elasto_fstat_ent_type {
 	ELASTO_FSTAT_ENT_ROOT	=	0x0004,
 };
 
+#define ELASTO_FSTAT_ETAG_MAX 128
+
 /**
  * @ent_type: type of entry
  * @size: total size, in bytes
  * @blksize: blocksize for file system I/O
  * @lease_status: whether locked or unlocked
+ * @etag: opaque nul-terminated version tag, which changes whenever the file
+ *	  is modified
  */
 struct elasto_fstat {
 	uint64_t field_mask;
@@ -214,6 +308,7 @@ struct elasto_fstat {
 	uint64_t size;
 	uint64_t blksize;
 	enum elasto_flease_status lease_status;
+	char etag[ELASTO_FSTAT_ETAG_MAX];
 };
 
 int
@@ -237,7 +332,9 @@ struct elasto_fstatfs_region {
 
 /**
  * @iosize_min: minimum unit of file system I/O
- * @iosize_min: optimal unit of file system I/O
+ * @iosize_optimal: optimal unit of file system I/O. For remote backends this
+ *		    is the read chunk size multiplied by the I/O depth, i.e.
+ *		    the size of a read that keeps all parallel requests busy.
  * @cap_flags: FS capabilities
  * @prop_flags: FS properties
  * @num_regions: number of entries in the regions array
@@ -261,6 +358,16 @@ struct elasto_dent {
 	struct elasto_fstat fstat;
 };
 
+/**
+ * List the entries of a directory (or container / bucket) handle
+ * @fh: a valid Elasto file handle, opened with ELASTO_FOPEN_DIRECTORY
+ * @priv: private data available in @dent_cb
+ * @dent_cb: function to call for each entry. Remote backends invoke it as list
+ *	     responses are parsed, from within the handle's connection event
+ *	     loop, so @dent_cb must not perform I/O on @fh or any other handle
+ *	     sharing its connection. The entry is only valid for the duration
+ *	     of the call. Returning an error aborts the listing.
+ */
 int
 elasto_freaddir(struct elasto_fh *fh,
 		void *priv,
@@ -300,6 +407,113 @@ elasto_flist_ranges(struct elasto_fh *fh,
 		    int (*range_cb)(struct elasto_frange *range,
 				    void *priv));
 
+enum elasto_fio_opcode {
+	ELASTO_FIO_READ = 1,
+	ELASTO_FIO_WRITE,
+	ELASTO_FIO_ALLOCATE,
+	ELASTO_FIO_STAT,
+};
+
+/**
+ * Asynchronous I/O request descriptor
+ *
+ * @opcode: operation to perform
+ * @off: file offset for read, write and allocate requests
+ * @len: length for read, write and allocate requests
+ * @buf: data source for writes, destination for reads
+ * @mode: enum elasto_falloc_flags for allocate requests
+ * @fstat: stat destination
+ */
+struct elasto_fio {
+	enum elasto_fio_opcode opcode;
+	uint64_t off;
+	uint64_t len;
+	uint8_t *buf;
+	uint32_t mode;
+	struct elasto_fstat *fstat;
+};
+
+/**
+ * Asynchronous I/O completion
+ *
+ * @tag: tag provided on submission
+ * @ret: request result, as returned by the corresponding synchronous call
+ */
+struct elasto_fio_cmpl {
+	void *tag;
+	int ret;
+};
+
+/**
+ * Configure asynchronous I/O for a handle
+ *
+ * Requests are dispatched over @nchans channels, each with its own back-end
+ * connection. Must be called prior to the first elasto_fsubmit(), otherwise a
+ * default channel count is used.
+ *
+ * @fh: a valid Elasto file handle
+ * @nchans: number of concurrent channels
+ * @_efd: eventfd returned on success, readable while completions are pending
+ */
+int
+elasto_fio_setup(struct elasto_fh *fh,
+		 uint32_t nchans,
+		 int *_efd);
+
+/**
+ * Queue an asynchronous request
+ *
+ * Requests in flight on the same handle may complete in any order, and
+ * overlapping writes aren't serialised. Buffers referenced by @fio must
+ * remain valid until completion is reaped. @fio itself may be reused
+ * immediately.
+ *
+ * @fh: a valid Elasto file handle
+ * @fio: request descriptor
+ * @tag: opaque value returned with the request's completion
+ */
+int
+elasto_fsubmit(struct elasto_fh *fh,
+	       const struct elasto_fio *fio,
+	       void *tag);
+
+/**
+ * Collect completed asynchronous requests
+ *
+ * @fh: a valid Elasto file handle
+ * @min_cmpls: block until at least this many completions are available
+ * @max_cmpls: size of the @cmpls array
+ * @cmpls: array filled with completions
+ *
+ * @returns: -errno on error, number of completions reaped on success
+ */
+int
+elasto_freap(struct elasto_fh *fh,
+	     uint32_t min_cmpls,
+	     uint32_t max_cmpls,
+	     struct elasto_fio_cmpl *cmpls);
+
+/**
+ * Configure the process-wide block cache
+ *
+ * Reads via elasto_fread() and elasto_freadv() are served from fixed-size
+ * blocks, shared by all handles with the same backend and path open. Blocks are
+ * dropped on modification via any handle in the process, and when the file's
+ * ETag is found to have changed. Only handles opened while the cache is enabled
+ * make use of it.
+ *
+ * @max_bytes: memory cap for cached data, zero (the default) disables the
+ *	       cache and frees all cached blocks
+ * @revalidate_secs: interval after which the ETag is rechecked on read, zero
+ *		     rechecks on every read. The ETag is also rechecked on the
+ *		     first read following open.
+ *
+ * @returns: -errno on error, zero on success
+ */
+int
+elasto_fcache_setup(uint64_t max_bytes,
+		    uint32_t revalidate_secs);
+
 int
 elasto_fdebug(int level);
 
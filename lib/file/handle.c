@@ -36,6 +36,64 @@
 #include "file_api.h"
 #include "handle.h"
 
+static void
+elasto_fauth_free(struct elasto_fauth *auth)
+{
+	if ((auth->type == ELASTO_FILE_AZURE)
+	 || (auth->type == ELASTO_FILE_ABB)
+	 || (auth->type == ELASTO_FILE_AFS)) {
+		free(auth->az.ps_path);
+		free(auth->az.access_key);
+		free(auth->az.sas_token);
+	} else if (auth->type == ELASTO_FILE_S3) {
+		free(auth->s3.creds_path);
+		free(auth->s3.region);
+		free(auth->s3.presign_query);
+		free(auth->s3.presign_method);
+		free(auth->s3.endpoint);
+	}
+	memset(auth, 0, sizeof(*auth));
+}
+
+#define ELASTO_FAUTH_STRDUP(_dest, _src) \
+	if ((_src) != NULL) { \
+		(_dest) = strdup(_src); \
+		if ((_dest) == NULL) { \
+			goto err_auth_free; \
+		} \
+	}
+
+static int
+elasto_fauth_dup(const struct elasto_fauth *src,
+		 struct elasto_fauth *dest)
+{
+	memset(dest, 0, sizeof(*dest));
+	dest->type = src->type;
+	dest->insecure_http = src->insecure_http;
+
+	if ((src->type == ELASTO_FILE_AZURE)
+	 || (src->type == ELASTO_FILE_ABB)
+	 || (src->type == ELASTO_FILE_AFS)) {
+		ELASTO_FAUTH_STRDUP(dest->az.ps_path, src->az.ps_path);
+		ELASTO_FAUTH_STRDUP(dest->az.access_key, src->az.access_key);
+		ELASTO_FAUTH_STRDUP(dest->az.sas_token, src->az.sas_token);
+	} else if (src->type == ELASTO_FILE_S3) {
+		ELASTO_FAUTH_STRDUP(dest->s3.creds_path, src->s3.creds_path);
+		ELASTO_FAUTH_STRDUP(dest->s3.region, src->s3.region);
+		ELASTO_FAUTH_STRDUP(dest->s3.presign_query,
+				    src->s3.presign_query);
+		ELASTO_FAUTH_STRDUP(dest->s3.presign_method,
+				    src->s3.presign_method);
+		ELASTO_FAUTH_STRDUP(dest->s3.endpoint, src->s3.endpoint);
+	}
+
+	return 0;
+
+err_auth_free:
+	elasto_fauth_free(dest);
+	return -ENOMEM;
+}
+
 int
 elasto_fh_init(const struct elasto_fauth *auth,
 	       const char *open_path,
@@ -80,16 +138,22 @@ elasto_fh_init(const struct elasto_fauth *auth,
 
 	fh->open_path = strdup(open_path);
 	if (fh->open_path == NULL) {
+		ret = -ENOMEM;
 		goto err_fh_free;
 	}
 	fh->open_flags = open_flags;
 
+	ret = elasto_fauth_dup(auth, &fh->auth);
+	if (ret < 0) {
+		goto err_path_free;
+	}
+
 	fh->mod_dl_h = dlopen(mod_path, RTLD_NOW);
 	if (fh->mod_dl_h == NULL) {
 		dbg(0, "failed to load module (%d) at path \"%s\": %s\n",
 		    auth->type, mod_path, dlerror());
 		ret = -EFAULT;
-		goto err_path_free;
+		goto err_auth_free;
 	}
 
 	_mod_vers = dlsym(fh->mod_dl_h, ELASTO_FILE_MOD_VERS_SYM);
@@ -130,6 +194,8 @@ elasto_fh_init(const struct elasto_fauth *auth,
 
 err_dl_close:
 	dlclose(fh->mod_dl_h);
+err_auth_free:
+	elasto_fauth_free(&fh->auth);
 err_path_free:
 	free(fh->open_path);
 err_fh_free:
@@ -150,6 +216,7 @@ elasto_fh_free(struct elasto_fh *fh)
 		    fh->type, dlerror());
 	}
 	free(fh->open_path);
+	elasto_fauth_free(&fh->auth);
 
 	BUILD_ASSERT(sizeof(ELASTO_FH_POISON) <= ARRAY_SIZE(fh->magic));
 	memcpy(fh->magic, ELASTO_FH_POISON, sizeof(ELASTO_FH_POISON));
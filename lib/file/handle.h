@@ -17,6 +17,12 @@
 #define ELASTO_FH_MAGIC "ElastoF"
 #define ELASTO_FH_POISON "PoisonF"
 
+struct elasto_data;
+struct elasto_faio;
+struct elasto_fra;
+struct elasto_fbc_obj;
+struct elasto_fwb;
+
 struct elasto_fh_mod_ops {
 	void (*fh_free)(void *mod_priv);
 	int (*open)(void *mod_priv,
@@ -47,6 +53,8 @@ struct elasto_fh_mod_ops {
 		    struct elasto_fstat *fstat);
 	int (*statfs)(void *mod_priv,
 		      struct elasto_fstatfs *fstatfs);
+	/* optional, drops stat results cached by the module */
+	void (*stat_invalidate)(void *mod_priv);
 	int (*lease_acquire)(void *mod_priv,
 			     int32_t duration,
 			     void **_flease_h);
@@ -74,7 +82,7 @@ struct elasto_fh_mod_ops {
 #define ELASTO_FILE_MOD_INIT_FN "elasto_file_mod_fh_init"
 /* Elasto file module internal API version */
 #define ELASTO_FILE_MOD_VERS_SYM "elasto_file_mod_version"
-#define ELASTO_FILE_MOD_VERS_VAL 2ULL
+#define ELASTO_FILE_MOD_VERS_VAL 3ULL
 
 /*
  * @magic: magic to verify handle on use
@@ -84,6 +92,11 @@ struct elasto_fh_mod_ops {
  * @ops: module functions
  * @lease_h: opaque lease handle, returned on acquisition
  * @lease_state: last known lease state
+ * @auth: copy of open credentials, used for opening async I/O channels
+ * @aio: async I/O state, allocated on first use
+ * @ra: read-ahead state, NULL if disabled
+ * @bc: block cache object, NULL if the cache was disabled on open
+ * @wb: write-back state, NULL if disabled
  */
 struct elasto_fh {
 	char magic[8];
@@ -98,6 +111,11 @@ struct elasto_fh {
 		ELASTO_FH_LEASE_NONE = 0,
 		ELASTO_FH_LEASE_ACQUIRED,
 	} lease_state;
+	struct elasto_fauth auth;
+	struct elasto_faio *aio;
+	struct elasto_fra *ra;
+	struct elasto_fbc_obj *bc;
+	struct elasto_fwb *wb;
 };
 
 int
@@ -112,4 +130,9 @@ elasto_fh_free(struct elasto_fh *fh);
 int
 elasto_fh_validate(struct elasto_fh *fh);
 
+/* fill @fstat->etag and flag it as valid, if @etag is non-NULL and fits */
+void
+elasto_fstat_etag_set(struct elasto_fstat *fstat,
+		      const char *etag);
+
 #endif /* _HANDLE_H_ */
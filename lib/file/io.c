@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "ccan/list/list.h"
 #include "lib/exml.h"
@@ -35,6 +36,55 @@
 #include "file_api.h"
 #include "handle.h"
 #include "xmit.h"
+#include "readahead.h"
+#include "bcache.h"
+#include "wback.h"
+
+/*
+ * serve what read-ahead can, then the remainder via the block cache or
+ * directly from the backend
+ */
+static int
+elasto_fread_data(struct elasto_fh *fh,
+		  uint64_t src_off,
+		  uint64_t src_len,
+		  struct elasto_data *dest_data)
+{
+	int ret;
+	uint64_t served;
+	uint64_t cached;
+
+	ret = elasto_fwb_flush(fh, src_off, src_len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = elasto_fra_read(fh, src_off, src_len, dest_data, &served);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (served == src_len) {
+		dbg(4, "read of %" PRIu64 " bytes at %" PRIu64 " served from "
+		       "read-ahead\n", src_len, src_off);
+		return 0;
+	}
+
+	ret = elasto_fbc_read(fh, src_off + served, src_len - served,
+			      dest_data, &cached);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (served + cached == src_len) {
+		dbg(4, "read of %" PRIu64 " bytes at %" PRIu64 " served via "
+		       "block cache\n", src_len - served, src_off + served);
+		return 0;
+	}
+
+	return fh->ops.read(fh->mod_priv, src_off + served, src_len - served,
+			    dest_data);
+}
 
 int
 elasto_fwrite(struct elasto_fh *fh,
@@ -44,6 +94,7 @@ elasto_fwrite(struct elasto_fh *fh,
 {
 	int ret;
 	struct elasto_data *src_data;
+	bool absorbed;
 
 	ret = elasto_fh_validate(fh);
 	if (ret < 0) {
@@ -69,8 +120,16 @@ elasto_fwrite(struct elasto_fh *fh,
 	dbg(3, "writing range at %" PRIu64 ", len %" PRIu64 "\n",
 	    dest_off, dest_len);
 
+	elasto_fra_invalidate(fh);
+	ret = elasto_fwb_write(fh, dest_off, dest_len, src_data, &absorbed);
+	if ((ret < 0) || absorbed) {
+		goto err_data_free;
+	}
+
 	ret = fh->ops.write(fh->mod_priv, dest_off, dest_len,
 			    src_data);
+	/* after the write, so that racing cache fills are discarded */
+	elasto_fbc_invalidate(fh);
 	if (ret < 0) {
 		goto err_data_free;
 	}
@@ -95,6 +154,7 @@ elasto_fwrite_cb(struct elasto_fh *fh,
 {
 	int ret;
 	struct elasto_data *src_data;
+	bool absorbed;
 
 	ret = elasto_fh_validate(fh);
 	if (ret < 0) {
@@ -120,7 +180,70 @@ elasto_fwrite_cb(struct elasto_fh *fh,
 	dbg(3, "writing range at %" PRIu64 ", len %" PRIu64 "\n",
 	    dest_off, dest_len);
 
+	elasto_fra_invalidate(fh);
+	/* callback data isn't buffered, this flushes any overlap */
+	ret = elasto_fwb_write(fh, dest_off, dest_len, src_data, &absorbed);
+	if ((ret < 0) || absorbed) {
+		goto err_data_free;
+	}
+
 	ret = fh->ops.write(fh->mod_priv, dest_off, dest_len, src_data);
+	elasto_fbc_invalidate(fh);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+	ret = 0;
+
+err_data_free:
+	elasto_data_free(src_data);
+err_out:
+	return ret;
+}
+
+int
+elasto_fwritev(struct elasto_fh *fh,
+	       uint64_t dest_off,
+	       const struct iovec *iov,
+	       int iovcnt)
+{
+	int ret;
+	struct elasto_data *src_data;
+	bool absorbed;
+
+	ret = elasto_fh_validate(fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if (fh->open_flags & ELASTO_FOPEN_DIRECTORY) {
+		dbg(1, "invalid IO request for directory handle\n");
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	if ((iov == NULL) || (iovcnt <= 0)) {
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	ret = elasto_data_iovec_new(iov, iovcnt, &src_data);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	dbg(3, "writing %d segments at %" PRIu64 ", len %" PRIu64 "\n",
+	    iovcnt, dest_off, src_data->len);
+
+	/* a single backend request covers all segments */
+	elasto_fra_invalidate(fh);
+	ret = elasto_fwb_write(fh, dest_off, src_data->len, src_data,
+			       &absorbed);
+	if ((ret < 0) || absorbed) {
+		goto err_data_free;
+	}
+
+	ret = fh->ops.write(fh->mod_priv, dest_off, src_data->len, src_data);
+	elasto_fbc_invalidate(fh);
 	if (ret < 0) {
 		goto err_data_free;
 	}
@@ -165,7 +288,53 @@ elasto_fread(struct elasto_fh *fh,
 	dbg(3, "reading range at %" PRIu64 ", len %" PRIu64 "\n",
 	    src_off, src_len);
 
-	ret = fh->ops.read(fh->mod_priv, src_off, src_len, dest_data);
+	ret = elasto_fread_data(fh, src_off, src_len, dest_data);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+	ret = 0;
+
+err_data_free:
+	elasto_data_free(dest_data);
+err_out:
+	return ret;
+}
+
+int
+elasto_freadv(struct elasto_fh *fh,
+	      uint64_t src_off,
+	      const struct iovec *iov,
+	      int iovcnt)
+{
+	int ret;
+	struct elasto_data *dest_data;
+
+	ret = elasto_fh_validate(fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if (fh->open_flags & ELASTO_FOPEN_DIRECTORY) {
+		dbg(1, "invalid IO request for directory handle\n");
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	if ((iov == NULL) || (iovcnt <= 0)) {
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	ret = elasto_data_iovec_new(iov, iovcnt, &dest_data);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	dbg(3, "reading %d segments at %" PRIu64 ", len %" PRIu64 "\n",
+	    iovcnt, src_off, dest_data->len);
+
+	/* response body is scattered directly into the segments */
+	ret = elasto_fread_data(fh, src_off, dest_data->len, dest_data);
 	if (ret < 0) {
 		goto err_data_free;
 	}
@@ -215,6 +384,10 @@ elasto_fread_cb(struct elasto_fh *fh,
 	dbg(3, "reading range at %" PRIu64 ", len %" PRIu64 "\n",
 	    src_off, src_len);
 
+	ret = elasto_fwb_flush(fh, src_off, src_len);
+	if (ret < 0) {
+		goto err_data_free;
+	}
 	ret = fh->ops.read(fh->mod_priv, src_off, src_len, dest_data);
 	if (ret < 0) {
 		goto err_data_free;
@@ -251,7 +424,7 @@ elasto_fallocate(struct elasto_fh *fh,
 		goto err_out;
 	}
 
-	if ((mode & ELASTO_FALLOC_ALL_MASK) == mode) {
+	if ((mode & ELASTO_FALLOC_ALL_MASK) != mode) {
 		ret = -EINVAL;
 		goto err_out;
 	}
@@ -259,7 +432,13 @@ elasto_fallocate(struct elasto_fh *fh,
 	dbg(3, "hole-punching range at %" PRIu64 ", len %" PRIu64 "\n",
 	    dest_off, dest_len);
 
+	ret = elasto_fwb_flush(fh, dest_off, dest_len);
+	if (ret < 0) {
+		goto err_out;
+	}
+	elasto_fra_invalidate(fh);
 	ret = fh->ops.allocate(fh->mod_priv, mode, dest_off, dest_len);
+	elasto_fbc_invalidate(fh);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -293,7 +472,14 @@ elasto_ftruncate(struct elasto_fh *fh,
 
 	dbg(3, "truncating to len %" PRIu64 "\n", len);
 
+	/* buffered data beyond @len mustn't be written after truncation */
+	ret = elasto_fwb_flush(fh, 0, UINT64_MAX);
+	if (ret < 0) {
+		goto err_out;
+	}
+	elasto_fra_invalidate(fh);
 	ret = fh->ops.truncate(fh->mod_priv, len);
+	elasto_fbc_invalidate(fh);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -344,8 +530,46 @@ elasto_fsplice(struct elasto_fh *src_fh,
 	dbg(3, "splicing %" PRIu64 " bytes from %s to %s\n",
 	    len, src_fh->open_path, dest_fh->open_path);
 
+	ret = elasto_fwb_flush(src_fh, src_off, len);
+	if (ret < 0) {
+		goto err_out;
+	}
+	ret = elasto_fwb_flush(dest_fh, dest_off, len);
+	if (ret < 0) {
+		goto err_out;
+	}
+	elasto_fra_invalidate(dest_fh);
 	ret = src_fh->ops.splice(src_fh->mod_priv, src_off,
 				 dest_fh->mod_priv, dest_off, len);
+	elasto_fbc_invalidate(dest_fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+	ret = 0;
+
+err_out:
+	return ret;
+}
+
+int
+elasto_fsync(struct elasto_fh *fh)
+{
+	int ret;
+
+	ret = elasto_fh_validate(fh);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	if (fh->open_flags & ELASTO_FOPEN_DIRECTORY) {
+		dbg(1, "invalid IO request for directory handle\n");
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	dbg(3, "syncing %s\n", fh->open_path);
+
+	ret = elasto_fwb_sync(fh);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -391,6 +615,10 @@ elasto_flist_ranges(struct elasto_fh *fh,
 	dbg(3, "listing ranges %" PRIu64 " bytes at %" PRIu64 " from %s\n",
 	    len, off, fh->open_path);
 
+	ret = elasto_fwb_flush(fh, off, len);
+	if (ret < 0) {
+		goto err_out;
+	}
 	ret = fh->ops.list_ranges(fh->mod_priv, off, len, flags,
 				  cb_priv, range_cb);
 	if (ret < 0) {
@@ -27,9 +27,11 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "ccan/list/list.h"
 #include "lib/dbg.h"
+#include "lib/util.h"
 #include "lib/data.h"
 #include "lib/file/file_api.h"
 #include "lib/file/handle.h"
@@ -38,6 +40,85 @@
 #include "local_stat.h"
 #include "local_io.h"
 
+/*
+ * pwritev/preadv until all of @iovs has been transferred. @iovs is modified
+ * to track progress across short transfers.
+ */
+static int
+local_iovs_xfer(int fd,
+		bool write,
+		struct iovec *iovs,
+		int iovcnt,
+		uint64_t off)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		if (iovs->iov_len == 0) {
+			iovs++;
+			iovcnt--;
+			continue;
+		}
+		if (write) {
+			ret = pwritev(fd, iovs, MIN(iovcnt, IOV_MAX), off);
+		} else {
+			ret = preadv(fd, iovs, MIN(iovcnt, IOV_MAX), off);
+		}
+		if (ret < 0) {
+			ret = -errno;
+			dbg(0, "%s failed: %s\n", (write ? "pwritev" : "preadv"),
+			    strerror(-ret));
+			return ret;
+		}
+		if (ret == 0) {
+			dbg(0, "invalid %s return %zd\n",
+			    (write ? "pwritev" : "preadv"), ret);
+			return -EIO;
+		}
+		off += ret;
+		while ((iovcnt > 0) && ((size_t)ret >= iovs->iov_len)) {
+			ret -= iovs->iov_len;
+			iovs++;
+			iovcnt--;
+		}
+		if (ret > 0) {
+			iovs->iov_base += ret;
+			iovs->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+/* scatter-gather IO straight to / from the caller's segments */
+static int
+local_fio_iovec(struct local_fh *local_fh,
+		bool write,
+		uint64_t off,
+		uint64_t len,
+		struct elasto_data *data)
+{
+	int ret;
+	struct iovec *iovs;
+	int iovcnt;
+
+	ret = elasto_data_iovec_slice(data, data->off, len, &iovs, &iovcnt);
+	if (ret < 0) {
+		dbg(0, "failed to obtain %s iovec of len %" PRIu64 "\n",
+		    (write ? "write" : "read"), len);
+		return ret;
+	}
+
+	ret = local_iovs_xfer(local_fh->fd, write, iovs, iovcnt, off);
+	free(iovs);
+	if (ret < 0) {
+		return ret;
+	}
+	data->off += len;
+
+	return 0;
+}
+
 static int
 local_fwrite_buf_get(struct elasto_data *src_data,
 		     uint64_t need_len,
@@ -77,7 +158,7 @@ local_fwrite_buf_get(struct elasto_data *src_data,
 			dbg(0, "out_cb didn't provide enough data: needed %"
 			       PRIu64 " got %" PRIu64 "\n", need_len, buf_len);
 			/* now buf owner, so must cleanup */
-			free(out_buf);
+			elasto_data_cb_out_buf_put(src_data, out_buf);
 			return -EINVAL;
 		}
 		iov->iov_base = out_buf;
@@ -98,7 +179,7 @@ local_fwrite_buf_commit(struct elasto_data *src_data,
 {
 	if (src_data->type == ELASTO_DATA_CB) {
 		/* no longer need to keep write buffer around */
-		free(iov->iov_base);
+		elasto_data_cb_out_buf_put(src_data, iov->iov_base);
 	}
 	src_data->off += iov->iov_len;
 }
@@ -116,6 +197,11 @@ local_fwrite(void *mod_priv,
 
 	assert(src_data != NULL);
 
+	if (src_data->type == ELASTO_DATA_IOVEC) {
+		return local_fio_iovec(local_fh, true, dest_off, dest_len,
+				       src_data);
+	}
+
 	ret = local_fwrite_buf_get(src_data, dest_len, &iov);
 	if (ret < 0) {
 		dbg(0, "failed to obtain write buf of len %" PRIu64 "\n",
@@ -124,22 +210,9 @@ local_fwrite(void *mod_priv,
 	}
 
 	iov_remain = iov;
-
-	while (iov_remain.iov_len > 0) {
-		ret = pwritev(local_fh->fd, &iov_remain, 1, dest_off);
-		if (ret < 0) {
-			ret = -errno;
-			dbg(0, "pwritev failed: %s\n", strerror(-ret));
-			goto err_buf_put;
-		}
-		if ((ret == 0) || (ret > iov_remain.iov_len)) {
-			dbg(0, "invalid pwritev return %d\n", ret);
-			ret = -EIO;
-			goto err_buf_put;
-		}
-		dest_off += ret;
-		iov_remain.iov_base += ret;
-		iov_remain.iov_len -= ret;
+	ret = local_iovs_xfer(local_fh->fd, true, &iov_remain, 1, dest_off);
+	if (ret < 0) {
+		goto err_buf_put;
 	}
 
 	local_fwrite_buf_commit(src_data, &iov);
@@ -149,7 +222,7 @@ local_fwrite(void *mod_priv,
 err_buf_put:
 	if (src_data->type == ELASTO_DATA_CB) {
 		/* no longer need to keep write buffer around */
-		free(iov.iov_base);
+		elasto_data_cb_out_buf_put(src_data, iov.iov_base);
 	}
 err_out:
 	return ret;
@@ -231,6 +304,11 @@ local_fread(void *mod_priv,
 
 	assert(dest_data != NULL);
 
+	if (dest_data->type == ELASTO_DATA_IOVEC) {
+		return local_fio_iovec(local_fh, false, src_off, src_len,
+				       dest_data);
+	}
+
 	ret = local_fread_buf_get(dest_data, src_len, &iov);
 	if (ret < 0) {
 		dbg(0, "failed to obtain read buf of len %" PRIu64 "\n",
@@ -239,22 +317,9 @@ local_fread(void *mod_priv,
 	}
 
 	iov_remain = iov;
-
-	while (iov_remain.iov_len > 0) {
-		ret = preadv(local_fh->fd, &iov_remain, 1, src_off);
-		if (ret < 0) {
-			ret = -errno;
-			dbg(0, "preadv failed: %s\n", strerror(-ret));
-			goto err_buf_put;
-		}
-		if ((ret == 0) || (ret > iov_remain.iov_len)) {
-			dbg(0, "invalid preadv return %d\n", ret);
-			ret = -EIO;
-			goto err_buf_put;
-		}
-		src_off += ret;
-		iov_remain.iov_base += ret;
-		iov_remain.iov_len -= ret;
+	ret = local_iovs_xfer(local_fh->fd, false, &iov_remain, 1, src_off);
+	if (ret < 0) {
+		goto err_buf_put;
 	}
 
 	ret = local_fread_buf_commit(dest_data, &iov);
@@ -303,7 +368,10 @@ local_fallocate(void *mod_priv,
 		goto err_out;
 	}
 
-	ret = fallocate(local_fh->fd, FALLOC_FL_PUNCH_HOLE, dest_off, dest_len);
+	/* Linux only supports hole punching which retains the file size */
+	ret = fallocate(local_fh->fd,
+			(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE),
+			dest_off, dest_len);
 	if (ret < 0) {
 		ret = -errno;
 		goto err_out;
@@ -56,6 +56,12 @@ local_fstat(void *mod_priv,
 		fstat->field_mask = (ELASTO_FSTAT_FIELD_TYPE
 					| ELASTO_FSTAT_FIELD_SIZE
 					| ELASTO_FSTAT_FIELD_BSIZE);
+		/* inode, size and mtime based, as commonly used by HTTP servers */
+		snprintf(fstat->etag, sizeof(fstat->etag),
+			 "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 ".%09ld\"",
+			 (uint64_t)sbuf.st_ino, (uint64_t)sbuf.st_size,
+			 (uint64_t)sbuf.st_mtim.tv_sec, sbuf.st_mtim.tv_nsec);
+		fstat->field_mask |= ELASTO_FSTAT_FIELD_ETAG;
 	} else if (S_ISDIR(sbuf.st_mode)) {
 		fstat->ent_type = ELASTO_FSTAT_ENT_DIR;
 		fstat->field_mask = ELASTO_FSTAT_FIELD_TYPE;
@@ -34,6 +34,10 @@
 #include "file_api.h"
 #include "handle.h"
 #include "xmit.h"
+#include "aio.h"
+#include "readahead.h"
+#include "bcache.h"
+#include "wback.h"
 
 int
 elasto_fopen(const struct elasto_fauth *auth,
@@ -43,6 +47,7 @@ elasto_fopen(const struct elasto_fauth *auth,
 	     struct elasto_fh **_fh)
 {
 	int ret;
+	int open_ret;
 	struct elasto_fh *fh;
 
 	if ((auth->type != ELASTO_FILE_AZURE)
@@ -75,14 +80,37 @@ elasto_fopen(const struct elasto_fauth *auth,
 		goto err_out;
 	}
 
-	ret = fh->ops.open(fh->mod_priv, path, flags, open_toks);
+	ret = elasto_fra_setup(fh, open_toks);
 	if (ret < 0) {
 		goto err_fh_free;
 	}
 
-	*_fh = fh;
-	return ret;
+	ret = elasto_fbc_attach(fh);
+	if (ret < 0) {
+		goto err_ra_destroy;
+	}
+
+	ret = fh->ops.open(fh->mod_priv, path, flags, open_toks);
+	if (ret < 0) {
+		goto err_bc_detach;
+	}
+	open_ret = ret;
+
+	/* depends on backend capabilities, so must follow open */
+	ret = elasto_fwb_setup(fh, open_toks);
+	if (ret < 0) {
+		goto err_close;
+	}
 
+	*_fh = fh;
+	return open_ret;
+
+err_close:
+	fh->ops.close(fh->mod_priv);
+err_bc_detach:
+	elasto_fbc_detach(fh);
+err_ra_destroy:
+	elasto_fra_destroy(fh);
 err_fh_free:
 	elasto_fh_free(fh);
 err_out:
@@ -94,12 +122,24 @@ int
 elasto_fclose(struct elasto_fh *fh)
 {
 	int ret;
+	int sync_ret;
 
 	ret = elasto_fh_validate(fh);
 	if (ret < 0) {
 		return ret;
 	}
 
+	/* the handle is closed regardless, with any failure reported after */
+	sync_ret = elasto_fwb_sync(fh);
+	if (sync_ret < 0) {
+		dbg(0, "failed to flush %s on close: %s\n",
+		    fh->open_path, strerror(-sync_ret));
+	}
+	elasto_fwb_destroy(fh);
+	elasto_faio_destroy(fh);
+	elasto_fra_destroy(fh);
+	elasto_fbc_detach(fh);
+
 	if (fh->lease_state == ELASTO_FH_LEASE_ACQUIRED) {
 		dbg(4, "cleaning up lease %p on close\n", fh->flease_h);
 		ret = elasto_flease_release(fh);
@@ -118,19 +158,31 @@ elasto_fclose(struct elasto_fh *fh)
 
 	elasto_fh_free(fh);
 
-	return 0;
+	return sync_ret;
 }
 
 int
 elasto_funlink_close(struct elasto_fh *fh)
 {
 	int ret;
+	int wb_ret;
 
 	ret = elasto_fh_validate(fh);
 	if (ret < 0) {
 		return ret;
 	}
 
+	/*
+	 * No point flushing data for a file that's about to go, but an earlier
+	 * write-back failure is still reported.
+	 */
+	wb_ret = elasto_fwb_destroy(fh);
+	elasto_faio_destroy(fh);
+	elasto_fra_destroy(fh);
+	/* blocks for the removed path are of no further use */
+	elasto_fbc_invalidate(fh);
+	elasto_fbc_detach(fh);
+
 	ret = fh->ops.unlink(fh->mod_priv);
 	if (ret < 0) {
 		return ret;
@@ -143,7 +195,7 @@ elasto_funlink_close(struct elasto_fh *fh)
 
 	elasto_fh_free(fh);
 
-	return 0;
+	return wb_ret;
 }
 
 int
@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+#include "lib/util.h"
+#include "lib/dbg.h"
+#include "lib/data.h"
+#include "file_api.h"
+#include "handle.h"
+#include "token.h"
+#include "readahead.h"
+
+/* initial prefetch window, doubled with each sequential read */
+#define ELASTO_FRA_WIN_MIN (128 * BYTES_IN_KB)
+/* consecutive sequential reads needed before prefetching starts */
+#define ELASTO_FRA_SEQ_MIN 2
+/* one window is consumed while the next is fetched */
+#define ELASTO_FRA_NBUFS 2
+
+enum elasto_fra_buf_state {
+	ELASTO_FRA_BUF_IDLE = 0,
+	ELASTO_FRA_BUF_QUEUED,
+	ELASTO_FRA_BUF_BUSY,
+	ELASTO_FRA_BUF_READY,
+	ELASTO_FRA_BUF_FAILED,
+};
+
+/*
+ * @gen: read-ahead generation when queued, completions for an older
+ *	 generation are dropped
+ * @buf: allocation of @buf_size bytes, holding @len bytes from @off
+ */
+struct elasto_fra_buf {
+	enum elasto_fra_buf_state state;
+	uint64_t gen;
+	uint64_t off;
+	uint64_t len;
+	uint8_t *buf;
+	uint64_t buf_size;
+};
+
+/*
+ * @lock: protects all fields below
+ * @cond: signalled on prefetch queue, completion and shutdown
+ * @max: prefetch window cap, zero once read-ahead is disabled
+ * @gen: bumped whenever prefetched data is dropped
+ * @next_off: offset at which the next sequential read is expected
+ * @seq_cnt: number of sequential reads in the current run
+ * @win: current prefetch window size
+ * @pf_end: end of the range prefetched or queued for prefetch
+ * @size: file size, prefetches are clamped to it. Refreshed after
+ *	  invalidation.
+ * @chan_fh: handle for prefetch I/O, opened with the parent's credentials and
+ *	     path once a sequential run is detected. Backend connections aren't
+ *	     thread safe, so the prefetch thread has its own.
+ * @preparing: channel open or size refresh in progress, with @lock dropped
+ */
+struct elasto_fra {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+	uint64_t max;
+	uint64_t gen;
+	uint64_t next_off;
+	uint32_t seq_cnt;
+	uint64_t win;
+	uint64_t pf_end;
+	uint64_t size;
+	bool size_valid;
+	bool preparing;
+	struct elasto_fh *chan_fh;
+	pthread_t thread;
+	bool thread_started;
+	struct elasto_fra_buf bufs[ELASTO_FRA_NBUFS];
+};
+
+int
+elasto_fra_setup(struct elasto_fh *fh,
+		 struct elasto_ftoken_list *open_toks)
+{
+	int ret;
+	struct elasto_fra *ra;
+	const char *val;
+	char *end;
+	unsigned long long max;
+
+	ret = elasto_ftoken_find(open_toks, ELASTO_FOPEN_TOK_READAHEAD_MAX,
+				 &val);
+	if (ret == -ENOENT) {
+		/* opt-in, as prefetching needs a second backend connection */
+		return 0;
+	} else if (ret < 0) {
+		return ret;
+	} else {
+		errno = 0;
+		max = strtoull(val, &end, 10);
+		if ((errno != 0) || (end == val) || (*end != '\0')) {
+			dbg(0, "invalid read-ahead token: %s\n", val);
+			return -EINVAL;
+		}
+	}
+
+	if ((max == 0) || (fh->open_flags & ELASTO_FOPEN_DIRECTORY)) {
+		return 0;
+	}
+
+	ra = malloc(sizeof(*ra));
+	if (ra == NULL) {
+		return -ENOMEM;
+	}
+	memset(ra, 0, sizeof(*ra));
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ra->max = max;
+	fh->ra = ra;
+
+	return 0;
+}
+
+/* called with @ra->lock held */
+static void
+elasto_fra_bufs_drop(struct elasto_fra *ra)
+{
+	int i;
+
+	ra->gen++;
+	for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+		/* in-flight prefetches are dropped on completion */
+		if (ra->bufs[i].state != ELASTO_FRA_BUF_BUSY) {
+			ra->bufs[i].state = ELASTO_FRA_BUF_IDLE;
+		}
+	}
+	ra->pf_end = 0;
+}
+
+static int
+elasto_fra_chan_read(struct elasto_fh *chan_fh,
+		     uint64_t off,
+		     uint64_t len,
+		     uint8_t *buf)
+{
+	int ret;
+	struct elasto_data *dest_data;
+
+	ret = elasto_data_iov_new(buf, len, false, &dest_data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = chan_fh->ops.read(chan_fh->mod_priv, off, len, dest_data);
+	elasto_data_free(dest_data);
+
+	return ret;
+}
+
+static struct elasto_fra_buf *
+elasto_fra_buf_queued(struct elasto_fra *ra)
+{
+	int i;
+
+	for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+		if (ra->bufs[i].state == ELASTO_FRA_BUF_QUEUED) {
+			return &ra->bufs[i];
+		}
+	}
+	return NULL;
+}
+
+static void *
+elasto_fra_thread(void *arg)
+{
+	struct elasto_fra *ra = arg;
+	struct elasto_fra_buf *b;
+
+	pthread_mutex_lock(&ra->lock);
+	while (true) {
+		uint64_t off;
+		uint64_t len;
+		int ret;
+
+		while (!ra->stopping
+		    && ((b = elasto_fra_buf_queued(ra)) == NULL)) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		}
+		if (ra->stopping) {
+			break;
+		}
+		/* @buf isn't reallocated while busy */
+		b->state = ELASTO_FRA_BUF_BUSY;
+		off = b->off;
+		len = b->len;
+		pthread_mutex_unlock(&ra->lock);
+
+		ret = elasto_fra_chan_read(ra->chan_fh, off, len, b->buf);
+		dbg(4, "prefetch of %" PRIu64 " bytes at %" PRIu64
+		    " completed: %d\n", len, off, ret);
+
+		pthread_mutex_lock(&ra->lock);
+		if (b->gen != ra->gen) {
+			b->state = ELASTO_FRA_BUF_IDLE;
+		} else if (ret < 0) {
+			b->state = ELASTO_FRA_BUF_FAILED;
+		} else {
+			b->state = ELASTO_FRA_BUF_READY;
+		}
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+/* open the prefetch I/O channel, called without @ra->lock held */
+static int
+elasto_fra_chan_open(struct elasto_fh *fh,
+		     struct elasto_fh **_chan_fh)
+{
+	int ret;
+	uint64_t chan_flags;
+	struct elasto_ftoken_list *toks = NULL;
+
+	/* the prefetch channel mustn't itself read ahead */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_READAHEAD_MAX, "0", &toks);
+	if (ret < 0) {
+		return ret;
+	}
+
+	/* the path already exists, having been opened by @fh */
+	chan_flags = fh->open_flags & ~(ELASTO_FOPEN_CREATE | ELASTO_FOPEN_EXCL);
+	ret = elasto_fopen(&fh->auth, fh->open_path, chan_flags, toks,
+			   _chan_fh);
+	elasto_ftoken_list_free(toks);
+	if (ret < 0) {
+		dbg(0, "failed to open read-ahead channel: %s\n",
+		    strerror(-ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+/* called with @ra->lock held */
+static int
+elasto_fra_chan_start(struct elasto_fra *ra,
+		      struct elasto_fh *chan_fh)
+{
+	int ret;
+
+	ra->chan_fh = chan_fh;
+	ret = pthread_create(&ra->thread, NULL, elasto_fra_thread, ra);
+	if (ret != 0) {
+		ra->chan_fh = NULL;
+		return -ret;
+	}
+	ra->thread_started = true;
+
+	return 0;
+}
+
+/*
+ * Open the prefetch channel and obtain the file size, if needed. Called with
+ * @ra->lock held, which is dropped for the backend round-trips so that
+ * invalidation from async I/O threads isn't held up.
+ */
+static int
+elasto_fra_prepare(struct elasto_fh *fh,
+		   struct elasto_fra *ra)
+{
+	int ret;
+	uint64_t gen;
+	struct elasto_fh *chan_fh;
+	struct elasto_fstat fstat;
+
+	if (ra->preparing) {
+		/* retried on the next sequential read */
+		return -EBUSY;
+	}
+
+	if (!ra->thread_started) {
+		ra->preparing = true;
+		pthread_mutex_unlock(&ra->lock);
+		ret = elasto_fra_chan_open(fh, &chan_fh);
+		pthread_mutex_lock(&ra->lock);
+		ra->preparing = false;
+		if (ret == 0) {
+			ret = elasto_fra_chan_start(ra, chan_fh);
+			if (ret < 0) {
+				elasto_fclose(chan_fh);
+			}
+		}
+		if (ret < 0) {
+			dbg(0, "disabling read-ahead\n");
+			ra->max = 0;
+			return ret;
+		}
+	}
+
+	if (ra->size_valid) {
+		return 0;
+	}
+
+	gen = ra->gen;
+	ra->preparing = true;
+	pthread_mutex_unlock(&ra->lock);
+	ret = fh->ops.stat(fh->mod_priv, &fstat);
+	pthread_mutex_lock(&ra->lock);
+	ra->preparing = false;
+	if (ret < 0) {
+		dbg(1, "failed to obtain size for read-ahead: %s\n",
+		    strerror(-ret));
+		return ret;
+	}
+	if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
+		return -EBADF;
+	}
+	if (gen != ra->gen) {
+		/* invalidated meanwhile, so the size may be stale */
+		return -EAGAIN;
+	}
+
+	ra->size = fstat.size;
+	ra->size_valid = true;
+	return 0;
+}
+
+/*
+ * Grow the window and queue prefetches into any free buffers, following a
+ * sequential read which ended at @ra->next_off. Called with @ra->lock held,
+ * which may be dropped while preparing.
+ */
+static void
+elasto_fra_schedule(struct elasto_fh *fh,
+		    struct elasto_fra *ra,
+		    uint64_t read_len)
+{
+	int ret;
+	int i;
+
+	ret = elasto_fra_prepare(fh, ra);
+	if (ret < 0) {
+		return;
+	}
+
+	if (ra->win == 0) {
+		ra->win = MAX(ELASTO_FRA_WIN_MIN, read_len);
+	} else {
+		ra->win *= 2;
+	}
+	ra->win = MIN(ra->win, ra->max);
+
+	if (ra->pf_end < ra->next_off) {
+		/* reader has overtaken the prefetched range */
+		ra->pf_end = ra->next_off;
+	}
+
+	for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+		struct elasto_fra_buf *b = &ra->bufs[i];
+
+		if ((b->state == ELASTO_FRA_BUF_FAILED)
+		 || ((b->state == ELASTO_FRA_BUF_READY)
+		  && (b->off + b->len <= ra->next_off))) {
+			/* failed, or fully consumed */
+			b->state = ELASTO_FRA_BUF_IDLE;
+		}
+	}
+
+	for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+		struct elasto_fra_buf *b = &ra->bufs[i];
+		uint64_t len;
+
+		if (ra->pf_end >= ra->size) {
+			break;
+		}
+		if (b->state != ELASTO_FRA_BUF_IDLE) {
+			continue;
+		}
+
+		len = MIN(ra->win, ra->size - ra->pf_end);
+		if (b->buf_size < len) {
+			uint8_t *buf = realloc(b->buf, len);
+			if (buf == NULL) {
+				break;
+			}
+			b->buf = buf;
+			b->buf_size = len;
+		}
+		b->gen = ra->gen;
+		b->off = ra->pf_end;
+		b->len = len;
+		b->state = ELASTO_FRA_BUF_QUEUED;
+		ra->pf_end += len;
+		dbg(4, "queued prefetch of %" PRIu64 " bytes at %" PRIu64 "\n",
+		    len, b->off);
+	}
+	pthread_cond_broadcast(&ra->cond);
+}
+
+/* called with @ra->lock held, which is dropped while waiting on prefetches */
+static int
+elasto_fra_copy(struct elasto_fra *ra,
+		uint64_t src_off,
+		uint64_t src_len,
+		struct elasto_data *dest_data,
+		uint64_t *_served)
+{
+	int ret;
+	uint64_t served = 0;
+
+	while (served < src_len) {
+		uint64_t cur = src_off + served;
+		struct elasto_fra_buf *b = NULL;
+		uint64_t len;
+		int i;
+
+		for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+			if ((ra->bufs[i].state != ELASTO_FRA_BUF_IDLE)
+			 && (ra->bufs[i].gen == ra->gen)
+			 && (ra->bufs[i].off <= cur)
+			 && (cur < ra->bufs[i].off + ra->bufs[i].len)) {
+				b = &ra->bufs[i];
+				break;
+			}
+		}
+		if ((b == NULL) || (b->state == ELASTO_FRA_BUF_FAILED)) {
+			break;
+		}
+		if ((b->state == ELASTO_FRA_BUF_QUEUED)
+		 || (b->state == ELASTO_FRA_BUF_BUSY)) {
+			/* cheaper to wait than to fetch the same range again */
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+
+		len = MIN(src_len - served, b->off + b->len - cur);
+		if (dest_data->type == ELASTO_DATA_IOV) {
+			memcpy(dest_data->iov.buf + dest_data->off,
+			       b->buf + (cur - b->off), len);
+		} else {
+			ret = elasto_data_iovec_copy_in(dest_data,
+							dest_data->off, len,
+							b->buf + (cur - b->off));
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		dest_data->off += len;
+		served += len;
+	}
+
+	*_served = served;
+	return 0;
+}
+
+int
+elasto_fra_read(struct elasto_fh *fh,
+		uint64_t src_off,
+		uint64_t src_len,
+		struct elasto_data *dest_data,
+		uint64_t *_served)
+{
+	int ret;
+	struct elasto_fra *ra = fh->ra;
+
+	*_served = 0;
+	if ((ra == NULL) || (src_len == 0)
+	 || ((dest_data->type != ELASTO_DATA_IOV)
+	  && (dest_data->type != ELASTO_DATA_IOVEC))) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	if (ra->max == 0) {
+		ret = 0;
+		goto out_unlock;
+	}
+
+	if (src_off != ra->next_off) {
+		/* random access, wait for a new sequential run */
+		if (ra->seq_cnt > 0) {
+			dbg(4, "non-sequential read at %" PRIu64 ", dropping "
+			       "read-ahead\n", src_off);
+			elasto_fra_bufs_drop(ra);
+			ra->seq_cnt = 0;
+			ra->win = 0;
+		}
+		ra->next_off = src_off + src_len;
+		ret = 0;
+		goto out_unlock;
+	}
+	ra->next_off = src_off + src_len;
+	if (ra->seq_cnt < ELASTO_FRA_SEQ_MIN) {
+		ra->seq_cnt++;
+	}
+
+	ret = elasto_fra_copy(ra, src_off, src_len, dest_data, _served);
+	if (ret < 0) {
+		goto out_unlock;
+	}
+
+	if (ra->seq_cnt >= ELASTO_FRA_SEQ_MIN) {
+		elasto_fra_schedule(fh, ra, src_len);
+	}
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&ra->lock);
+	return ret;
+}
+
+void
+elasto_fra_invalidate(struct elasto_fh *fh)
+{
+	struct elasto_fra *ra = fh->ra;
+
+	if (ra == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	elasto_fra_bufs_drop(ra);
+	/* the modification may have changed the file size */
+	ra->size_valid = false;
+	pthread_mutex_unlock(&ra->lock);
+}
+
+void
+elasto_fra_destroy(struct elasto_fh *fh)
+{
+	struct elasto_fra *ra = fh->ra;
+	int i;
+
+	if (ra == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stopping = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	/* an in-flight prefetch completes before the thread exits */
+	if (ra->thread_started) {
+		pthread_join(ra->thread, NULL);
+	}
+	if (ra->chan_fh != NULL) {
+		elasto_fclose(ra->chan_fh);
+	}
+
+	for (i = 0; i < ELASTO_FRA_NBUFS; i++) {
+		free(ra->bufs[i].buf);
+	}
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+	fh->ra = NULL;
+}
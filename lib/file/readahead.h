@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+/*
+ * Parse ELASTO_FOPEN_TOK_READAHEAD_MAX and allocate read-ahead state for @fh,
+ * if it's enabled.
+ */
+int
+elasto_fra_setup(struct elasto_fh *fh,
+		 struct elasto_ftoken_list *open_toks);
+
+/*
+ * Copy any prefetched data at the head of @src_off / @src_len into @dest_data,
+ * and prefetch further if the read continues a sequential run. @_served is
+ * set to the number of bytes copied, and @dest_data->off advanced to match.
+ * The caller is responsible for reading the remainder.
+ */
+int
+elasto_fra_read(struct elasto_fh *fh,
+		uint64_t src_off,
+		uint64_t src_len,
+		struct elasto_data *dest_data,
+		uint64_t *_served);
+
+/*
+ * Drop prefetched data on @fh, following a modification. Safe to call from
+ * async I/O threads.
+ */
+void
+elasto_fra_invalidate(struct elasto_fh *fh);
+
+/* wait for in-flight prefetches, and free all read-ahead state */
+void
+elasto_fra_destroy(struct elasto_fh *fh);
+
+#endif /* _READAHEAD_H_ */
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+#include "lib/util.h"
+#include "lib/dbg.h"
+#include "file_api.h"
+#include "handle.h"
+#include "token.h"
+#include "scache.h"
+
+/*
+ * Stat results cached on a backend handle.
+ *
+ * @lock: protects all fields, invalidations arrive from channel threads
+ * @ttl_ms: lifetime of fetched results, bounding how long changes made by
+ *	    other handles or clients may go unnoticed
+ * @expires_ms: CLOCK_MONOTONIC time at which @fstat must be refetched
+ * @fetched_mask: fields returned by the backend stat, zero if empty
+ * @fstat: cached result, with field_mask limited to fields that are still
+ *	   accurate following modifications via the handle
+ */
+struct elasto_fsc {
+	pthread_mutex_t lock;
+	uint64_t ttl_ms;
+	uint64_t expires_ms;
+	uint64_t fetched_mask;
+	struct elasto_fstat fstat;
+};
+
+static uint64_t
+elasto_fsc_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+int
+elasto_fsc_setup(struct elasto_ftoken_list *open_toks,
+		 struct elasto_fsc **_sc)
+{
+	int ret;
+	const char *val;
+	char *end;
+	unsigned long long ttl_ms;
+	struct elasto_fsc *sc;
+
+	ret = elasto_ftoken_find(open_toks, ELASTO_FOPEN_TOK_STAT_TTL, &val);
+	if (ret == -ENOENT) {
+		ttl_ms = ELASTO_FSC_TTL_MS_DEFAULT;
+	} else if (ret < 0) {
+		goto err_out;
+	} else {
+		errno = 0;
+		ttl_ms = strtoull(val, &end, 10);
+		if ((errno != 0) || (end == val) || (*end != '\0')) {
+			dbg(0, "invalid stat TTL token: %s\n", val);
+			ret = -EINVAL;
+			goto err_out;
+		}
+	}
+
+	if (ttl_ms == 0) {
+		dbg(4, "stat cache disabled\n");
+		*_sc = NULL;
+		return 0;
+	}
+
+	sc = malloc(sizeof(*sc));
+	if (sc == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(sc, 0, sizeof(*sc));
+
+	ret = pthread_mutex_init(&sc->lock, NULL);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_sc_free;
+	}
+	sc->ttl_ms = ttl_ms;
+
+	*_sc = sc;
+	return 0;
+
+err_sc_free:
+	free(sc);
+err_out:
+	return ret;
+}
+
+void
+elasto_fsc_free(struct elasto_fsc *sc)
+{
+	if (sc == NULL) {
+		return;
+	}
+
+	pthread_mutex_destroy(&sc->lock);
+	free(sc);
+}
+
+int
+elasto_fsc_get(struct elasto_fsc *sc,
+	       uint64_t need_mask,
+	       struct elasto_fstat *fstat)
+{
+	int ret;
+
+	if (sc == NULL) {
+		return -ENOENT;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	if (sc->fetched_mask == 0) {
+		ret = -ENOENT;
+		goto out_unlock;
+	}
+
+	if (elasto_fsc_now_ms() >= sc->expires_ms) {
+		dbg(4, "cached stat expired\n");
+		sc->fetched_mask = 0;
+		ret = -ENOENT;
+		goto out_unlock;
+	}
+
+	if (need_mask == 0) {
+		need_mask = sc->fetched_mask;
+	}
+	if ((sc->fstat.field_mask & need_mask) != need_mask) {
+		dbg(4, "cached stat lacks fields 0x%" PRIx64 "\n",
+		    need_mask & ~sc->fstat.field_mask);
+		ret = -ENOENT;
+		goto out_unlock;
+	}
+
+	*fstat = sc->fstat;
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&sc->lock);
+	return ret;
+}
+
+int
+elasto_fsc_size_get(struct elasto_fsc *sc,
+		    void *mod_priv,
+		    int (*stat_fn)(void *mod_priv,
+				   struct elasto_fstat *fstat),
+		    uint64_t min,
+		    uint64_t max,
+		    uint64_t *_size)
+{
+	int ret;
+	struct elasto_fstat fstat;
+
+	ret = elasto_fsc_get(sc, ELASTO_FSTAT_FIELD_SIZE, &fstat);
+	if ((ret == 0) && (fstat.size >= min) && (fstat.size <= max)) {
+		*_size = fstat.size;
+		return 0;
+	} else if (ret == 0) {
+		dbg(3, "cached size %" PRIu64 " outside of %" PRIu64 "-%" PRIu64
+		    ", refreshing\n", fstat.size, min, max);
+	}
+
+	elasto_fsc_invalidate(sc);
+	ret = stat_fn(mod_priv, &fstat);
+	if (ret < 0) {
+		return ret;
+	} else if ((fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE) == 0) {
+		return -EBADF;
+	}
+
+	*_size = fstat.size;
+	return 0;
+}
+
+void
+elasto_fsc_set(struct elasto_fsc *sc,
+	       const struct elasto_fstat *fstat)
+{
+	if (sc == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->fstat = *fstat;
+	sc->fetched_mask = fstat->field_mask;
+	sc->expires_ms = elasto_fsc_now_ms() + sc->ttl_ms;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+void
+elasto_fsc_size_set(struct elasto_fsc *sc,
+		    uint64_t size)
+{
+	if (sc == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	if (sc->fetched_mask & ELASTO_FSTAT_FIELD_SIZE) {
+		sc->fstat.size = size;
+		sc->fstat.field_mask |= ELASTO_FSTAT_FIELD_SIZE;
+	}
+	/* any modification assigns a new validator */
+	sc->fstat.field_mask &= ~ELASTO_FSTAT_FIELD_ETAG;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+void
+elasto_fsc_modified(struct elasto_fsc *sc)
+{
+	if (sc == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->fstat.field_mask &= ~ELASTO_FSTAT_FIELD_ETAG;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+void
+elasto_fsc_invalidate(struct elasto_fsc *sc)
+{
+	if (sc == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	sc->fetched_mask = 0;
+	pthread_mutex_unlock(&sc->lock);
+}
+
+void
+elasto_fsc_fh_invalidate(struct elasto_fh *fh)
+{
+	if (fh->ops.stat_invalidate == NULL) {
+		/* backend doesn't cache */
+		return;
+	}
+
+	fh->ops.stat_invalidate(fh->mod_priv);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _SCACHE_H_
+#define _SCACHE_H_
+
+#define ELASTO_FSC_TTL_MS_DEFAULT 1000
+
+struct elasto_fsc;
+struct elasto_ftoken_list;
+
+/*
+ * Parse ELASTO_FOPEN_TOK_STAT_TTL and allocate a stat cache for a backend
+ * handle. @_sc is set to NULL if caching is disabled. All other calls accept a
+ * NULL cache.
+ */
+int
+elasto_fsc_setup(struct elasto_ftoken_list *open_toks,
+		 struct elasto_fsc **_sc);
+
+void
+elasto_fsc_free(struct elasto_fsc *sc);
+
+/*
+ * Fill @fstat from the cache, if it was fetched within the TTL and all fields
+ * in @need_mask remain valid. A zero @need_mask requires every fetched field.
+ * Returns -ENOENT on a miss.
+ */
+int
+elasto_fsc_get(struct elasto_fsc *sc,
+	       uint64_t need_mask,
+	       struct elasto_fstat *fstat);
+
+/*
+ * Obtain the current size of @mod_priv's file for an internal check which
+ * expects it to fall within @min / @max. A cached size is only trusted if it
+ * does, so that a stale entry can't fail or misdirect an I/O. Otherwise
+ * @stat_fn is called for a fresh result, which may fall outside the range.
+ */
+int
+elasto_fsc_size_get(struct elasto_fsc *sc,
+		    void *mod_priv,
+		    int (*stat_fn)(void *mod_priv,
+				   struct elasto_fstat *fstat),
+		    uint64_t min,
+		    uint64_t max,
+		    uint64_t *_size);
+
+/* store a freshly fetched @fstat, restarting the TTL */
+void
+elasto_fsc_set(struct elasto_fsc *sc,
+	       const struct elasto_fstat *fstat);
+
+/* write-through following a modification which leaves the file @size long */
+void
+elasto_fsc_size_set(struct elasto_fsc *sc,
+		    uint64_t size);
+
+/* write-through following a modification which doesn't change the size */
+void
+elasto_fsc_modified(struct elasto_fsc *sc);
+
+void
+elasto_fsc_invalidate(struct elasto_fsc *sc);
+
+/*
+ * Drop stat results cached by @fh's backend, following a modification made
+ * via a separate channel handle.
+ */
+void
+elasto_fsc_fh_invalidate(struct elasto_fh *fh);
+
+#endif /* _SCACHE_H_ */
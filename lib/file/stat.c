@@ -34,6 +34,20 @@
 #include "file_api.h"
 #include "handle.h"
 #include "xmit.h"
+#include "wback.h"
+
+void
+elasto_fstat_etag_set(struct elasto_fstat *fstat,
+		      const char *etag)
+{
+	if ((etag == NULL) || (strlen(etag) >= sizeof(fstat->etag))) {
+		/* validators which don't fit are left out */
+		return;
+	}
+
+	strcpy(fstat->etag, etag);
+	fstat->field_mask |= ELASTO_FSTAT_FIELD_ETAG;
+}
 
 int
 elasto_fstat(struct elasto_fh *fh,
@@ -51,6 +65,11 @@ elasto_fstat(struct elasto_fh *fh,
 		goto err_out;
 	}
 
+	/* buffered writes may extend the file */
+	ret = elasto_fwb_flush(fh, 0, UINT64_MAX);
+	if (ret < 0) {
+		goto err_out;
+	}
 	ret = fh->ops.stat(fh->mod_priv, fstat);
 	if (ret < 0) {
 		goto err_out;
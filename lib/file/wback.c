@@ -0,0 +1,712 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ccan/list/list.h"
+#include "lib/util.h"
+#include "lib/dbg.h"
+#include "lib/data.h"
+#include "file_api.h"
+#include "handle.h"
+#include "token.h"
+#include "readahead.h"
+#include "bcache.h"
+#include "scache.h"
+#include "wback.h"
+
+/* dirty data older than this is flushed, even if the extent isn't full */
+#define ELASTO_FWB_EXPIRE_SECS 1
+
+/*
+ * @buf: allocation of @buf_size bytes, holding @len dirty bytes from @off
+ * @busy: being written by the flusher, @buf mustn't be modified
+ * @dirtied: time at which the extent was created
+ */
+struct elasto_fwb_ext {
+	struct list_node list;
+	uint64_t off;
+	uint64_t len;
+	uint8_t *buf;
+	uint64_t buf_size;
+	bool busy;
+	time_t dirtied;
+};
+
+/*
+ * @lock: protects all fields below
+ * @cond: signalled on absorb, flush completion, flush request and shutdown
+ * @max: dirty data cap, zero once write-back is disabled
+ * @ext_max: merged extent size cap, writes larger than this aren't buffered
+ * @align: backend write granularity, unaligned writes aren't buffered so that
+ *	   merged extents remain aligned
+ * @dirty: sum of all extent lengths
+ * @exts: dirty extents sorted by offset. Extents never overlap, but may be
+ *	  adjacent if merging would exceed @ext_max.
+ * @flush_reqs: number of waiters needing all extents flushed
+ * @err: first flush failure since the last sync
+ * @fh: parent handle, its read-ahead, cached blocks and cached stat are
+ *	invalidated as extents are flushed
+ * @chan_fh: handle for flush I/O, so that the parent's connection remains
+ *	     free for the caller
+ */
+struct elasto_fwb {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+	uint64_t max;
+	uint64_t ext_max;
+	uint64_t align;
+	uint64_t dirty;
+	struct list_head exts;
+	uint32_t flush_reqs;
+	int err;
+	struct elasto_fh *fh;
+	struct elasto_fh *chan_fh;
+	pthread_t thread;
+	bool thread_started;
+};
+
+int
+elasto_fwb_setup(struct elasto_fh *fh,
+		 struct elasto_ftoken_list *open_toks)
+{
+	int ret;
+	struct elasto_fwb *wb;
+	struct elasto_fstatfs fstatfs;
+	const char *val;
+	char *end;
+	unsigned long long max;
+
+	ret = elasto_ftoken_find(open_toks, ELASTO_FOPEN_TOK_WRITEBACK_MAX,
+				 &val);
+	if (ret == -ENOENT) {
+		return 0;
+	} else if (ret < 0) {
+		return ret;
+	}
+
+	errno = 0;
+	max = strtoull(val, &end, 10);
+	if ((errno != 0) || (end == val) || (*end != '\0')) {
+		dbg(0, "invalid write-back token: %s\n", val);
+		return -EINVAL;
+	}
+
+	if ((max == 0) || (fh->open_flags & ELASTO_FOPEN_DIRECTORY)) {
+		return 0;
+	}
+
+	/* buffered writes are flushed as arbitrary ranges */
+	ret = fh->ops.statfs(fh->mod_priv, &fstatfs);
+	if (ret < 0) {
+		return ret;
+	}
+	if ((fstatfs.cap_flags & ELASTO_FSTATFS_CAP_WRITE_RANGE) == 0) {
+		dbg(0, "write-back requires range write support\n");
+		return -ENOTSUP;
+	}
+
+	wb = malloc(sizeof(*wb));
+	if (wb == NULL) {
+		return -ENOMEM;
+	}
+	memset(wb, 0, sizeof(*wb));
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+	list_head_init(&wb->exts);
+	wb->max = max;
+	wb->ext_max = MIN(ELASTO_FWB_EXT_MAX, max);
+	wb->align = MAX(fstatfs.iosize_min, 1);
+	wb->fh = fh;
+	fh->wb = wb;
+
+	return 0;
+}
+
+/* returns the extent following @ext, or NULL. Called with @wb->lock held */
+static struct elasto_fwb_ext *
+elasto_fwb_ext_after(struct elasto_fwb *wb,
+		     struct elasto_fwb_ext *ext)
+{
+	if (ext->list.next == &wb->exts.n) {
+		return NULL;
+	}
+	return list_entry(ext->list.next, struct elasto_fwb_ext, list);
+}
+
+/*
+ * Link @ext ahead of @next, or at the tail if @next is NULL.
+ * Called with @wb->lock held.
+ */
+static void
+elasto_fwb_ext_link(struct elasto_fwb *wb,
+		    struct elasto_fwb_ext *ext,
+		    struct elasto_fwb_ext *next)
+{
+	if (next == NULL) {
+		list_add_tail(&wb->exts, &ext->list);
+		return;
+	}
+	ext->list.next = &next->list;
+	ext->list.prev = next->list.prev;
+	next->list.prev->next = &ext->list;
+	next->list.prev = &ext->list;
+}
+
+/* called with @wb->lock held */
+static void
+elasto_fwb_ext_free(struct elasto_fwb *wb,
+		    struct elasto_fwb_ext *ext)
+{
+	list_del(&ext->list);
+	wb->dirty -= ext->len;
+	free(ext->buf);
+	free(ext);
+}
+
+/*
+ * Pick the next extent to flush, or NULL if nothing needs flushing yet.
+ * Called with @wb->lock held.
+ */
+static struct elasto_fwb_ext *
+elasto_fwb_ext_next(struct elasto_fwb *wb,
+		    time_t now)
+{
+	struct elasto_fwb_ext *ext;
+	bool all = ((wb->flush_reqs > 0) || (wb->dirty >= wb->max / 2));
+
+	list_for_each(&wb->exts, ext, list) {
+		if (ext->busy) {
+			continue;
+		}
+		if (all || (ext->len >= wb->ext_max)
+		 || (now - ext->dirtied >= ELASTO_FWB_EXPIRE_SECS)) {
+			return ext;
+		}
+	}
+	return NULL;
+}
+
+static void *
+elasto_fwb_thread(void *arg)
+{
+	struct elasto_fwb *wb = arg;
+	struct elasto_fwb_ext *ext;
+
+	pthread_mutex_lock(&wb->lock);
+	while (true) {
+		struct elasto_data *src_data;
+		struct timespec ts;
+		int ret;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		while (!wb->stopping
+		    && ((ext = elasto_fwb_ext_next(wb, ts.tv_sec)) == NULL)) {
+			if (list_empty(&wb->exts)) {
+				pthread_cond_wait(&wb->cond, &wb->lock);
+			} else {
+				/* recheck for expired extents */
+				ts.tv_sec += 1;
+				pthread_cond_timedwait(&wb->cond, &wb->lock,
+						       &ts);
+			}
+			clock_gettime(CLOCK_REALTIME, &ts);
+		}
+		if (wb->stopping) {
+			break;
+		}
+		ext->busy = true;
+		pthread_mutex_unlock(&wb->lock);
+
+		ret = elasto_data_iov_new(ext->buf, ext->len, false, &src_data);
+		if (ret == 0) {
+			ret = wb->chan_fh->ops.write(wb->chan_fh->mod_priv,
+						     ext->off, ext->len,
+						     src_data);
+			elasto_data_free(src_data);
+		}
+		dbg(4, "flush of %" PRIu64 " bytes at %" PRIu64
+		    " completed: %d\n", ext->len, ext->off, ret);
+		elasto_fra_invalidate(wb->fh);
+		elasto_fbc_invalidate(wb->fh);
+		elasto_fsc_fh_invalidate(wb->fh);
+
+		pthread_mutex_lock(&wb->lock);
+		if ((ret < 0) && (wb->err == 0)) {
+			/* the data is dropped, as with a failed kernel flush */
+			dbg(0, "write-back of %" PRIu64 " bytes at %" PRIu64
+			    " failed: %s\n", ext->len, ext->off, strerror(-ret));
+			wb->err = ret;
+		}
+		elasto_fwb_ext_free(wb, ext);
+		pthread_cond_broadcast(&wb->cond);
+	}
+	pthread_mutex_unlock(&wb->lock);
+
+	return NULL;
+}
+
+/* called with @wb->lock held */
+static int
+elasto_fwb_chan_start(struct elasto_fh *fh,
+		      struct elasto_fwb *wb)
+{
+	int ret;
+	uint64_t chan_flags;
+	struct elasto_ftoken_list *toks = NULL;
+
+	/* write-back is disabled by default, only read-ahead needs a token */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_READAHEAD_MAX, "0", &toks);
+	if (ret < 0) {
+		goto err_out;
+	}
+
+	/* flushes are checked against the current size, not a cached one */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_STAT_TTL, "0", &toks);
+	if (ret < 0) {
+		goto err_toks_free;
+	}
+
+	chan_flags = fh->open_flags & ~(ELASTO_FOPEN_CREATE | ELASTO_FOPEN_EXCL);
+	ret = elasto_fopen(&fh->auth, fh->open_path, chan_flags, toks,
+			   &wb->chan_fh);
+	if (ret < 0) {
+		dbg(0, "failed to open write-back channel: %s\n",
+		    strerror(-ret));
+		goto err_toks_free;
+	}
+
+	ret = pthread_create(&wb->thread, NULL, elasto_fwb_thread, wb);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_chan_close;
+	}
+	wb->thread_started = true;
+	elasto_ftoken_list_free(toks);
+
+	return 0;
+
+err_chan_close:
+	elasto_fclose(wb->chan_fh);
+	wb->chan_fh = NULL;
+err_toks_free:
+	elasto_ftoken_list_free(toks);
+err_out:
+	return ret;
+}
+
+static int
+elasto_fwb_copy(struct elasto_data *src_data,
+		uint64_t len,
+		uint8_t *buf)
+{
+	if (src_data->type == ELASTO_DATA_IOV) {
+		memcpy(buf, src_data->iov.buf + src_data->off, len);
+		return 0;
+	}
+	return elasto_data_iovec_copy_out(src_data, src_data->off, len, buf);
+}
+
+/*
+ * Obtain a contiguous view of @len bytes of @src_data. IOVEC data is copied
+ * into *@_tmp, which the caller must free.
+ */
+static int
+elasto_fwb_src_get(struct elasto_data *src_data,
+		   uint64_t len,
+		   const uint8_t **_src,
+		   uint8_t **_tmp)
+{
+	int ret;
+	uint8_t *tmp;
+
+	if (src_data->type == ELASTO_DATA_IOV) {
+		*_src = src_data->iov.buf + src_data->off;
+		*_tmp = NULL;
+		return 0;
+	}
+
+	tmp = malloc(len);
+	if (tmp == NULL) {
+		return -ENOMEM;
+	}
+	ret = elasto_data_iovec_copy_out(src_data, src_data->off, len, tmp);
+	if (ret < 0) {
+		free(tmp);
+		return ret;
+	}
+	*_src = tmp;
+	*_tmp = tmp;
+	return 0;
+}
+
+/*
+ * Merge the write at @off / @len with the touching extents from @first to
+ * @last, which combined don't exceed @wb->ext_max. Everything that may fail is
+ * done before the extents are modified. Called with @wb->lock held.
+ */
+static int
+elasto_fwb_merge(struct elasto_fwb *wb,
+		 struct elasto_fwb_ext *first,
+		 struct elasto_fwb_ext *last,
+		 uint64_t off,
+		 uint64_t len,
+		 struct elasto_data *src_data)
+{
+	int ret;
+	uint64_t u_off = MIN(off, first->off);
+	uint64_t u_len = MAX(off + len, last->off + last->len) - u_off;
+	uint64_t old_len = first->len;
+	struct elasto_fwb_ext *ext;
+	const uint8_t *src;
+	uint8_t *tmp;
+
+	ret = elasto_fwb_src_get(src_data, len, &src, &tmp);
+	if (ret < 0) {
+		dbg(0, "failed to copy write-back data: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	if ((first->buf_size < u_len) || (u_off != first->off)) {
+		uint64_t size = MIN(wb->ext_max, MAX(u_len, first->buf_size * 2));
+		uint8_t *buf = malloc(size);
+		if (buf == NULL) {
+			free(tmp);
+			return -ENOMEM;
+		}
+		memcpy(buf + (first->off - u_off), first->buf, first->len);
+		free(first->buf);
+		first->buf = buf;
+		first->buf_size = size;
+		first->off = u_off;
+	}
+
+	while (first != last) {
+		bool done;
+
+		ext = elasto_fwb_ext_after(wb, first);
+		memcpy(first->buf + (ext->off - u_off), ext->buf, ext->len);
+		done = (ext == last);
+		elasto_fwb_ext_free(wb, ext);
+		if (done) {
+			break;
+		}
+	}
+
+	/* the new data lands on top of any older overlapping data */
+	memcpy(first->buf + (off - u_off), src, len);
+	free(tmp);
+	first->len = u_len;
+	wb->dirty += (u_len - old_len);
+
+	return 0;
+}
+
+/* called with @wb->lock held */
+static int
+elasto_fwb_insert(struct elasto_fwb *wb,
+		  struct elasto_fwb_ext *next,
+		  uint64_t off,
+		  uint64_t len,
+		  struct elasto_data *src_data)
+{
+	int ret;
+	struct elasto_fwb_ext *ext;
+
+	ext = malloc(sizeof(*ext));
+	if (ext == NULL) {
+		return -ENOMEM;
+	}
+	ext->buf = malloc(len);
+	if (ext->buf == NULL) {
+		free(ext);
+		return -ENOMEM;
+	}
+	ret = elasto_fwb_copy(src_data, len, ext->buf);
+	if (ret < 0) {
+		free(ext->buf);
+		free(ext);
+		return ret;
+	}
+	ext->off = off;
+	ext->len = len;
+	ext->buf_size = len;
+	ext->busy = false;
+	ext->dirtied = time(NULL);
+
+	elasto_fwb_ext_link(wb, ext, next);
+	wb->dirty += len;
+
+	return 0;
+}
+
+int
+elasto_fwb_write(struct elasto_fh *fh,
+		 uint64_t dest_off,
+		 uint64_t dest_len,
+		 struct elasto_data *src_data,
+		 bool *_absorbed)
+{
+	int ret;
+	struct elasto_fwb *wb = fh->wb;
+	uint64_t dest_end = dest_off + dest_len;
+
+	*_absorbed = false;
+	if (wb == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	if ((wb->max == 0) || (dest_len == 0) || (dest_len > wb->ext_max)
+	 || (dest_off % wb->align != 0) || (dest_len % wb->align != 0)
+	 || ((src_data->type != ELASTO_DATA_IOV)
+	  && (src_data->type != ELASTO_DATA_IOVEC))) {
+		pthread_mutex_unlock(&wb->lock);
+		/* write through, after any older overlapping data */
+		return elasto_fwb_flush(fh, dest_off, dest_len);
+	}
+
+	if (!wb->thread_started) {
+		ret = elasto_fwb_chan_start(fh, wb);
+		if (ret < 0) {
+			dbg(0, "disabling write-back\n");
+			wb->max = 0;
+			pthread_mutex_unlock(&wb->lock);
+			return 0;
+		}
+	}
+
+	while (true) {
+		struct elasto_fwb_ext *ext;
+		struct elasto_fwb_ext *first = NULL;
+		struct elasto_fwb_ext *last = NULL;
+		struct elasto_fwb_ext *next = NULL;
+		bool overlap = false;
+		bool wait = false;
+		uint64_t touch_len = 0;
+		uint64_t u_off = dest_off;
+		uint64_t u_end = dest_end;
+		uint64_t growth;
+
+		list_for_each(&wb->exts, ext, list) {
+			uint64_t ext_end = ext->off + ext->len;
+
+			if (ext->off > dest_end) {
+				next = ext;
+				break;
+			}
+			if (ext_end < dest_off) {
+				continue;
+			}
+			if ((ext->off < dest_end) && (ext_end > dest_off)) {
+				overlap = true;
+				if (ext->busy) {
+					/* must land after the in-flight data */
+					wait = true;
+					break;
+				}
+			}
+			if (ext->busy) {
+				/* adjacent only, left alone */
+				if (ext->off >= dest_end) {
+					next = ext;
+					break;
+				}
+				continue;
+			}
+			if (first == NULL) {
+				first = ext;
+			}
+			last = ext;
+			touch_len += ext->len;
+			u_off = MIN(u_off, ext->off);
+			u_end = MAX(u_end, ext_end);
+		}
+
+		if (!wait && (first != NULL) && (u_end - u_off > wb->ext_max)) {
+			if (overlap) {
+				/* can't merge, so overlapped data must go first */
+				wait = true;
+			} else {
+				/* adjacent extents are full enough, start anew */
+				next = (last->off >= dest_end) ? last
+					: elasto_fwb_ext_after(wb, last);
+				first = NULL;
+				touch_len = 0;
+				u_off = dest_off;
+				u_end = dest_end;
+			}
+		}
+
+		growth = (u_end - u_off) - touch_len;
+		if (!wait && (wb->dirty > 0) && (wb->dirty + growth > wb->max)) {
+			dbg(4, "dirty limit reached, waiting for flush\n");
+			wait = true;
+		}
+
+		if (wait) {
+			wb->flush_reqs++;
+			pthread_cond_broadcast(&wb->cond);
+			pthread_cond_wait(&wb->cond, &wb->lock);
+			wb->flush_reqs--;
+			continue;
+		}
+
+		if (first != NULL) {
+			ret = elasto_fwb_merge(wb, first, last, dest_off,
+					       dest_len, src_data);
+		} else {
+			ret = elasto_fwb_insert(wb, next, dest_off, dest_len,
+						src_data);
+		}
+		break;
+	}
+	if (ret < 0) {
+		goto out_unlock;
+	}
+
+	dbg(4, "absorbed %" PRIu64 " bytes at %" PRIu64 ", %" PRIu64
+	    " dirty\n", dest_len, dest_off, wb->dirty);
+	*_absorbed = true;
+	/* the flusher decides whether anything is due */
+	pthread_cond_broadcast(&wb->cond);
+	ret = 0;
+out_unlock:
+	pthread_mutex_unlock(&wb->lock);
+	return ret;
+}
+
+/* called with @wb->lock held */
+static bool
+elasto_fwb_overlaps(struct elasto_fwb *wb,
+		    uint64_t off,
+		    uint64_t end)
+{
+	struct elasto_fwb_ext *ext;
+
+	list_for_each(&wb->exts, ext, list) {
+		if (ext->off >= end) {
+			break;
+		}
+		if (ext->off + ext->len > off) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+elasto_fwb_flush(struct elasto_fh *fh,
+		 uint64_t off,
+		 uint64_t len)
+{
+	int ret;
+	struct elasto_fwb *wb = fh->wb;
+	uint64_t end;
+
+	if (wb == NULL) {
+		return 0;
+	}
+
+	end = (len > UINT64_MAX - off) ? UINT64_MAX : off + len;
+
+	pthread_mutex_lock(&wb->lock);
+	wb->flush_reqs++;
+	pthread_cond_broadcast(&wb->cond);
+	while (elasto_fwb_overlaps(wb, off, end)) {
+		pthread_cond_wait(&wb->cond, &wb->lock);
+	}
+	wb->flush_reqs--;
+	ret = wb->err;
+	pthread_mutex_unlock(&wb->lock);
+
+	return ret;
+}
+
+int
+elasto_fwb_sync(struct elasto_fh *fh)
+{
+	int ret;
+	struct elasto_fwb *wb = fh->wb;
+
+	if (wb == NULL) {
+		return 0;
+	}
+
+	elasto_fwb_flush(fh, 0, UINT64_MAX);
+
+	pthread_mutex_lock(&wb->lock);
+	ret = wb->err;
+	wb->err = 0;
+	pthread_mutex_unlock(&wb->lock);
+
+	return ret;
+}
+
+int
+elasto_fwb_destroy(struct elasto_fh *fh)
+{
+	int ret;
+	struct elasto_fwb *wb = fh->wb;
+	struct elasto_fwb_ext *ext;
+
+	if (wb == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&wb->lock);
+	wb->stopping = true;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	/* an in-flight flush completes before the thread exits */
+	if (wb->thread_started) {
+		pthread_join(wb->thread, NULL);
+	}
+	if (wb->chan_fh != NULL) {
+		elasto_fclose(wb->chan_fh);
+	}
+
+	if (wb->dirty > 0) {
+		dbg(0, "discarding %" PRIu64 " dirty bytes of %s\n",
+		    wb->dirty, fh->open_path);
+	}
+	while ((ext = list_top(&wb->exts, struct elasto_fwb_ext, list)) != NULL) {
+		dbg(1, "discarding %" PRIu64 " dirty bytes at %" PRIu64 "\n",
+		    ext->len, ext->off);
+		elasto_fwb_ext_free(wb, ext);
+	}
+	if (wb->err < 0) {
+		dbg(0, "unreported write-back failure for %s: %s\n",
+		    fh->open_path, strerror(-wb->err));
+	}
+	ret = wb->err;
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+	fh->wb = NULL;
+
+	return ret;
+}
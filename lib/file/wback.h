@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _WBACK_H_
+#define _WBACK_H_
+
+/* dirty extents are merged up to this size, matching the APB put limit */
+#define ELASTO_FWB_EXT_MAX (4 * BYTES_IN_MB)
+
+/*
+ * Parse ELASTO_FOPEN_TOK_WRITEBACK_MAX and allocate write-back state for the
+ * opened @fh, if enabled. Fails with -ENOTSUP if the backend can't write
+ * ranges.
+ */
+int
+elasto_fwb_setup(struct elasto_fh *fh,
+		 struct elasto_ftoken_list *open_toks);
+
+/*
+ * Buffer @src_data for writing at @dest_off. @_absorbed is set to false if the
+ * write is too large to buffer, in which case any overlapping dirty data is
+ * flushed first and the caller is responsible for writing through.
+ */
+int
+elasto_fwb_write(struct elasto_fh *fh,
+		 uint64_t dest_off,
+		 uint64_t dest_len,
+		 struct elasto_data *src_data,
+		 bool *_absorbed);
+
+/*
+ * Wait for dirty data overlapping @off / @len to reach the backend, ahead of
+ * an operation which depends on it. Returns any latched flush failure, which
+ * remains latched until elasto_fwb_sync().
+ */
+int
+elasto_fwb_flush(struct elasto_fh *fh,
+		 uint64_t off,
+		 uint64_t len);
+
+/* flush all dirty data, returning and clearing any latched flush failure */
+int
+elasto_fwb_sync(struct elasto_fh *fh);
+
+/*
+ * stop the flusher and free write-back state, discarding any dirty data.
+ * Returns any flush failure latched since the last elasto_fwb_sync().
+ */
+int
+elasto_fwb_destroy(struct elasto_fh *fh);
+
+#endif /* _WBACK_H_ */
@@ -23,14 +23,18 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "ccan/list/list.h"
 #include "lib/exml.h"
 #include "lib/op.h"
 #include "lib/conn.h"
+#include "lib/data.h"
 #include "lib/azure_ssl.h"
 #include "lib/util.h"
 #include "lib/dbg.h"
+#include "file_api.h"
+#include "token.h"
 #include "xmit.h"
 
 int
@@ -59,11 +63,568 @@ elasto_fop_send_recv(struct elasto_conn *conn,
 			case 404:
 				return -ENOENT;
 				break;
+			case 408:
+				return -ETIMEDOUT;
+				break;
 			default:
-				return -EIO;
 				break;
 		}
+		if ((op->rsp.err_code >= 500) && (op->rsp.err_code < 600)) {
+			/* server side failure, may succeed on resend */
+			return -EAGAIN;
+		}
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* parse ELASTO_FOPEN_TOK_IO_DEPTH, falling back to the default if absent */
+int
+elasto_fxmit_depth_get(struct elasto_ftoken_list *open_toks,
+		       uint32_t *_depth)
+{
+	int ret;
+	const char *val;
+	char *end;
+	unsigned long depth;
+
+	ret = elasto_ftoken_find(open_toks, ELASTO_FOPEN_TOK_IO_DEPTH, &val);
+	if (ret == -ENOENT) {
+		*_depth = ELASTO_FXMIT_DEPTH_DEFAULT;
+		return 0;
+	} else if (ret < 0) {
+		return ret;
 	}
 
+	errno = 0;
+	depth = strtoul(val, &end, 10);
+	if ((errno != 0) || (end == val) || (*end != '\0')
+	 || (depth == 0) || (depth > ELASTO_FXMIT_DEPTH_MAX)) {
+		dbg(0, "invalid IO depth token: %s\n", val);
+		return -EINVAL;
+	}
+
+	*_depth = depth;
 	return 0;
 }
+
+/* parse ELASTO_FOPEN_TOK_IO_CHUNK_SIZE, falling back to the default if absent */
+int
+elasto_fxmit_chunk_get(struct elasto_ftoken_list *open_toks,
+		       uint64_t *_chunk)
+{
+	int ret;
+	const char *val;
+	char *end;
+	unsigned long long chunk;
+
+	ret = elasto_ftoken_find(open_toks, ELASTO_FOPEN_TOK_IO_CHUNK_SIZE,
+				 &val);
+	if (ret == -ENOENT) {
+		*_chunk = ELASTO_FXMIT_CHUNK_DEFAULT;
+		return 0;
+	} else if (ret < 0) {
+		return ret;
+	}
+
+	errno = 0;
+	chunk = strtoull(val, &end, 10);
+	if ((errno != 0) || (end == val) || (*end != '\0') || (chunk == 0)
+	 || ((chunk % ELASTO_FXMIT_CHUNK_ALIGN) != 0)) {
+		dbg(0, "invalid IO chunk size token: %s\n", val);
+		return -EINVAL;
+	}
+
+	*_chunk = chunk;
+	return 0;
+}
+
+int
+elasto_fxmit_pool_init(struct elasto_conn *conn,
+		       uint32_t depth,
+		       struct elasto_fxmit_pool **_pool)
+{
+	struct elasto_fxmit_pool *pool;
+
+	if ((conn == NULL) || (depth == 0) || (depth > ELASTO_FXMIT_DEPTH_MAX)) {
+		return -EINVAL;
+	}
+
+	pool = malloc(sizeof(*pool));
+	if (pool == NULL) {
+		return -ENOMEM;
+	}
+	memset(pool, 0, sizeof(*pool));
+
+	/* @conn carries one request stream, so one less duplicate needed */
+	if (depth > 1) {
+		pool->conns = calloc(depth - 1, sizeof(*pool->conns));
+		if (pool->conns == NULL) {
+			free(pool);
+			return -ENOMEM;
+		}
+	}
+	pool->conn = conn;
+	pool->depth = depth;
+	*_pool = pool;
+
+	return 0;
+}
+
+void
+elasto_fxmit_pool_free(struct elasto_fxmit_pool *pool)
+{
+	uint32_t i;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	for (i = 0; i < pool->num_conns; i++) {
+		elasto_conn_free(pool->conns[i]);
+	}
+	free(pool->conns);
+	free(pool);
+}
+
+/*
+ * Open duplicate connections until @want are available. A failure to connect
+ * isn't fatal, dispatch just continues with fewer requests in flight.
+ */
+static void
+elasto_fxmit_pool_grow(struct elasto_fxmit_pool *pool,
+		       uint32_t want)
+{
+	int ret;
+
+	assert(want < pool->depth);
+	while (pool->num_conns < want) {
+		ret = elasto_conn_dup(pool->conn,
+				      &pool->conns[pool->num_conns]);
+		if (ret < 0) {
+			dbg(0, "failed to open parallel connection %u: %s\n",
+			    pool->num_conns + 1, strerror(-ret));
+			break;
+		}
+		pool->num_conns++;
+	}
+}
+
+/*
+ * @lock: serialises unit allocation and the op_get / op_put callbacks
+ * @next_unit: next unit to be dispatched
+ * @ret: first failure, stops dispatch of further units
+ */
+struct elasto_fxmit_par {
+	pthread_mutex_t lock;
+	uint64_t num_units;
+	uint64_t next_unit;
+	int ret;
+	void *priv;
+	int (*op_get)(uint64_t unit, void *priv, struct op **_op);
+	int (*op_put)(uint64_t unit, struct op *op, int ret, void *priv);
+};
+
+struct elasto_fxmit_worker {
+	struct elasto_fxmit_par *par;
+	struct elasto_conn *conn;
+	pthread_t thread;
+};
+
+/*
+ * transport and server side (5xx) failures which may succeed on resend.
+ * -EIO covers permanent request errors, so isn't retried.
+ */
+static bool
+elasto_fxmit_err_retry(int ret)
+{
+	switch (ret) {
+	case -ECONNABORTED:
+	case -ETIMEDOUT:
+	case -EAGAIN:
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/* called and returns with @par->lock held */
+static int
+elasto_fxmit_unit_send_recv(struct elasto_fxmit_par *par,
+			    struct elasto_conn *conn,
+			    uint64_t unit)
+{
+	int ret;
+	int attempt;
+	struct op *op;
+
+	for (attempt = 1; ; attempt++) {
+		ret = par->op_get(unit, par->priv, &op);
+		if (ret < 0) {
+			return ret;
+		}
+
+		pthread_mutex_unlock(&par->lock);
+		ret = elasto_fop_send_recv(conn, op);
+		pthread_mutex_lock(&par->lock);
+
+		ret = par->op_put(unit, op, ret, par->priv);
+		if (ret == 0) {
+			return 0;
+		}
+
+		/* don't bother resending if the dispatch is already failed */
+		if ((attempt >= ELASTO_FXMIT_ATTEMPTS)
+		 || !elasto_fxmit_err_retry(ret) || (par->ret < 0)) {
+			return ret;
+		}
+		dbg(1, "unit %" PRIu64 " attempt %d failed: %s, resending\n",
+		    unit, attempt, strerror(-ret));
+	}
+}
+
+static void *
+elasto_fxmit_worker_run(void *arg)
+{
+	struct elasto_fxmit_worker *worker = arg;
+	struct elasto_fxmit_par *par = worker->par;
+
+	pthread_mutex_lock(&par->lock);
+	while ((par->ret == 0) && (par->next_unit < par->num_units)) {
+		uint64_t unit = par->next_unit++;
+		int ret;
+
+		ret = elasto_fxmit_unit_send_recv(par, worker->conn, unit);
+		if ((ret < 0) && (par->ret == 0)) {
+			dbg(0, "unit %" PRIu64 " failed: %s\n",
+			    unit, strerror(-ret));
+			par->ret = ret;
+		}
+	}
+	pthread_mutex_unlock(&par->lock);
+
+	return NULL;
+}
+
+int
+elasto_fop_send_recv_par(struct elasto_fxmit_pool *pool,
+			 uint64_t num_units,
+			 void *priv,
+			 int (*op_get)(uint64_t unit,
+				       void *priv,
+				       struct op **_op),
+			 int (*op_put)(uint64_t unit,
+				       struct op *op,
+				       int ret,
+				       void *priv))
+{
+	int ret;
+	struct elasto_fxmit_par par;
+	struct elasto_fxmit_worker *workers;
+	uint32_t num_workers;
+	uint32_t num_started = 0;
+	uint32_t i;
+
+	if ((pool == NULL) || (op_get == NULL) || (op_put == NULL)) {
+		return -EINVAL;
+	}
+
+	if (num_units == 0) {
+		return 0;
+	}
+
+	num_workers = MIN(pool->depth, num_units);
+	elasto_fxmit_pool_grow(pool, num_workers - 1);
+	num_workers = MIN(num_workers, pool->num_conns + 1);
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL) {
+		return -ENOMEM;
+	}
+
+	memset(&par, 0, sizeof(par));
+	ret = pthread_mutex_init(&par.lock, NULL);
+	if (ret != 0) {
+		free(workers);
+		return -ret;
+	}
+	par.num_units = num_units;
+	par.priv = priv;
+	par.op_get = op_get;
+	par.op_put = op_put;
+
+	dbg(3, "dispatching %" PRIu64 " units across %u connections\n",
+	    num_units, num_workers);
+
+	/* the calling thread services the handle's own connection */
+	workers[0].par = &par;
+	workers[0].conn = pool->conn;
+	for (i = 1; i < num_workers; i++) {
+		workers[i].par = &par;
+		workers[i].conn = pool->conns[i - 1];
+		ret = pthread_create(&workers[i].thread, NULL,
+				     elasto_fxmit_worker_run, &workers[i]);
+		if (ret != 0) {
+			dbg(0, "failed to start IO thread: %s\n",
+			    strerror(ret));
+			break;
+		}
+		num_started++;
+	}
+
+	elasto_fxmit_worker_run(&workers[0]);
+
+	for (i = 1; i <= num_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	ret = par.ret;
+	pthread_mutex_destroy(&par.lock);
+	free(workers);
+
+	return ret;
+}
+
+/*
+ * @batch_unit: first unit of the current dispatch, CB destinations are read
+ *		one batch of @cb_bufs at a time
+ * @cb_bufs: CB destination buffers, indexed relative to @batch_unit
+ */
+struct elasto_fread_par {
+	uint64_t src_off;
+	uint64_t src_len;
+	uint64_t chunk;
+	struct elasto_data *dest_data;
+	uint64_t batch_unit;
+	uint8_t **cb_bufs;
+	void *priv;
+	int (*op_get)(uint64_t off, uint64_t len, struct elasto_data *this_data,
+		      void *priv, struct op **_op);
+};
+
+static void
+elasto_fread_par_range(struct elasto_fread_par *rpar,
+		       uint64_t unit,
+		       uint64_t *_off,
+		       uint64_t *_len)
+{
+	uint64_t start = (rpar->src_off / rpar->chunk + unit) * rpar->chunk;
+	uint64_t end = start + rpar->chunk;
+
+	start = MAX(start, rpar->src_off);
+	end = MIN(end, rpar->src_off + rpar->src_len);
+	*_off = start;
+	*_len = end - start;
+}
+
+static int
+elasto_fread_par_op_get(uint64_t unit,
+			void *priv,
+			struct op **_op)
+{
+	int ret;
+	struct elasto_fread_par *rpar = priv;
+	struct elasto_data *dest_data = rpar->dest_data;
+	struct elasto_data *this_data;
+	uint64_t off;
+	uint64_t len;
+	uint64_t data_off;
+	uint8_t *buf;
+
+	unit += rpar->batch_unit;
+	elasto_fread_par_range(rpar, unit, &off, &len);
+	data_off = dest_data->off + (off - rpar->src_off);
+
+	switch (dest_data->type) {
+	case ELASTO_DATA_IOV:
+		ret = elasto_data_iov_new(dest_data->iov.buf + data_off, len,
+					  false, &this_data);
+		break;
+	case ELASTO_DATA_IOVEC:
+		ret = elasto_data_iovec_slice_new(dest_data, data_off, len,
+						  &this_data);
+		break;
+	case ELASTO_DATA_CB:
+		/* freed or handed to in_cb once the range is complete */
+		buf = malloc(len);
+		if (buf == NULL) {
+			return -ENOMEM;
+		}
+		ret = elasto_data_iov_new(buf, len, false, &this_data);
+		if (ret < 0) {
+			free(buf);
+		}
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = rpar->op_get(off, len, this_data, rpar->priv, _op);
+	if (ret < 0) {
+		goto err_data_free;
+	}
+
+	return 0;
+
+err_data_free:
+	if (dest_data->type == ELASTO_DATA_CB) {
+		free(this_data->iov.buf);
+	}
+	elasto_data_free(this_data);
+	return ret;
+}
+
+static int
+elasto_fread_par_op_put(uint64_t unit,
+			struct op *op,
+			int ret,
+			void *priv)
+{
+	struct elasto_fread_par *rpar = priv;
+	struct elasto_data *this_data = op->rsp.data;
+
+	op->rsp.data = NULL;
+	op_free(op);
+
+	if ((ret == 0) && (this_data->off != this_data->len)) {
+		dbg(0, "short read of %" PRIu64 " bytes, expected %" PRIu64
+		       "\n", this_data->off, this_data->len);
+		ret = -EIO;
+	}
+
+	if (rpar->dest_data->type == ELASTO_DATA_CB) {
+		if (ret == 0) {
+			rpar->cb_bufs[unit] = this_data->iov.buf;
+		} else {
+			free(this_data->iov.buf);
+		}
+	}
+	elasto_data_free(this_data);
+
+	return ret;
+}
+
+/* hand a completed batch to in_cb, in offset order */
+static int
+elasto_fread_par_cb_deliver(struct elasto_fread_par *rpar,
+			    uint64_t batch_units)
+{
+	int ret;
+	struct elasto_data *dest_data = rpar->dest_data;
+	uint64_t i;
+
+	for (i = 0; i < batch_units; i++) {
+		uint64_t off;
+		uint64_t len;
+
+		elasto_fread_par_range(rpar, rpar->batch_unit + i, &off, &len);
+		/* in_cb is responsible for freeing the buffer on success */
+		ret = dest_data->cb.in_cb(dest_data->off, len, rpar->cb_bufs[i],
+					  len, dest_data->cb.priv);
+		if (ret < 0) {
+			dbg(0, "data in_cb returned an error (%d)\n", ret);
+			return -EIO;
+		}
+		rpar->cb_bufs[i] = NULL;
+		dest_data->off += len;
+	}
+
+	return 0;
+}
+
+int
+elasto_fop_read_par(struct elasto_fxmit_pool *pool,
+		    uint64_t src_off,
+		    uint64_t src_len,
+		    struct elasto_data *dest_data,
+		    uint64_t chunk,
+		    void *priv,
+		    int (*op_get)(uint64_t off,
+				  uint64_t len,
+				  struct elasto_data *this_data,
+				  void *priv,
+				  struct op **_op))
+{
+	int ret;
+	struct elasto_fread_par rpar;
+	uint64_t num_units;
+	uint64_t i;
+
+	if ((pool == NULL) || (dest_data == NULL) || (chunk == 0)
+	 || (op_get == NULL)) {
+		return -EINVAL;
+	}
+
+	if (((dest_data->type == ELASTO_DATA_IOV)
+	  || (dest_data->type == ELASTO_DATA_IOVEC))
+	 && (dest_data->off + src_len > dest_data->len)) {
+		dbg(0, "read of %" PRIu64 " bytes exceeds buffer\n", src_len);
+		return -E2BIG;
+	} else if ((dest_data->type == ELASTO_DATA_CB)
+		&& (dest_data->cb.in_cb == NULL)) {
+		return -EINVAL;
+	}
+
+	memset(&rpar, 0, sizeof(rpar));
+	rpar.src_off = src_off;
+	rpar.src_len = src_len;
+	rpar.chunk = chunk;
+	rpar.dest_data = dest_data;
+	rpar.priv = priv;
+	rpar.op_get = op_get;
+
+	num_units = (src_off + src_len + chunk - 1) / chunk - src_off / chunk;
+
+	if (dest_data->type != ELASTO_DATA_CB) {
+		ret = elasto_fop_send_recv_par(pool, num_units, &rpar,
+					       elasto_fread_par_op_get,
+					       elasto_fread_par_op_put);
+		if (ret < 0) {
+			return ret;
+		}
+		dest_data->off += src_len;
+		return 0;
+	}
+
+	/*
+	 * in_cb consumers expect a stream, so ranges completed out of order
+	 * must be held back. Batching bounds how much is held.
+	 */
+	rpar.cb_bufs = calloc(pool->depth, sizeof(*rpar.cb_bufs));
+	if (rpar.cb_bufs == NULL) {
+		return -ENOMEM;
+	}
+
+	ret = 0;
+	while (rpar.batch_unit < num_units) {
+		uint64_t batch_units = MIN(pool->depth,
+					   num_units - rpar.batch_unit);
+
+		ret = elasto_fop_send_recv_par(pool, batch_units, &rpar,
+					       elasto_fread_par_op_get,
+					       elasto_fread_par_op_put);
+		if (ret < 0) {
+			break;
+		}
+
+		ret = elasto_fread_par_cb_deliver(&rpar, batch_units);
+		if (ret < 0) {
+			break;
+		}
+		rpar.batch_unit += batch_units;
+	}
+
+	for (i = 0; i < pool->depth; i++) {
+		free(rpar.cb_bufs[i]);
+	}
+	free(rpar.cb_bufs);
+
+	return ret;
+}
@@ -18,4 +18,97 @@ int
 elasto_fop_send_recv(struct elasto_conn *conn,
 		     struct op *op);
 
+struct elasto_ftoken_list;
+
+#define ELASTO_FXMIT_DEPTH_DEFAULT 4
+#define ELASTO_FXMIT_DEPTH_MAX 64
+/* attempts per request before a parallel dispatch is failed */
+#define ELASTO_FXMIT_ATTEMPTS 3
+/* ranged reads larger than this are split and fetched in parallel */
+#define ELASTO_FXMIT_CHUNK_DEFAULT (4 * BYTES_IN_MB)
+/* chunks must be page blob sector aligned */
+#define ELASTO_FXMIT_CHUNK_ALIGN 512
+
+/**
+ * Connections for dispatching independent requests in parallel.
+ *
+ * @conn: handle connection, carries the first request stream (not owned)
+ * @depth: maximum number of requests in flight
+ * @num_conns: number of connected duplicates in @conns
+ * @conns: duplicates of @conn, opened on first use and kept for reuse
+ */
+struct elasto_fxmit_pool {
+	struct elasto_conn *conn;
+	uint32_t depth;
+	uint32_t num_conns;
+	struct elasto_conn **conns;
+};
+
+int
+elasto_fxmit_depth_get(struct elasto_ftoken_list *open_toks,
+		       uint32_t *_depth);
+
+int
+elasto_fxmit_chunk_get(struct elasto_ftoken_list *open_toks,
+		       uint64_t *_chunk);
+
+int
+elasto_fxmit_pool_init(struct elasto_conn *conn,
+		       uint32_t depth,
+		       struct elasto_fxmit_pool **_pool);
+
+void
+elasto_fxmit_pool_free(struct elasto_fxmit_pool *pool);
+
+/**
+ * Send @num_units independent requests, up to @pool->depth at a time.
+ *
+ * @op_get: build the request for @unit
+ * @op_put: consume the response for @unit and free @op. @ret carries the send
+ *	    result, the return value is taken as the unit's result. Failed
+ *	    units are rebuilt and resent following transport or 5xx server
+ *	    failures, up to ELASTO_FXMIT_ATTEMPTS times.
+ *
+ * Callbacks are serialised, but may be invoked from I/O threads.
+ *
+ * @returns:	-errno of the first unit to fail, or zero once all succeed
+ */
+int
+elasto_fop_send_recv_par(struct elasto_fxmit_pool *pool,
+			 uint64_t num_units,
+			 void *priv,
+			 int (*op_get)(uint64_t unit,
+				       void *priv,
+				       struct op **_op),
+			 int (*op_put)(uint64_t unit,
+				       struct op *op,
+				       int ret,
+				       void *priv));
+
+/**
+ * Read @src_len bytes at @src_off into @dest_data, split into ranges aligned
+ * to @chunk boundaries, which are fetched up to @pool->depth at a time.
+ *
+ * @op_get: build the ranged GET request for @off and @len, receiving into
+ *	    @this_data. The response data is detached before @op is freed.
+ *
+ * IOV and IOVEC destinations are filled in place. Ranges for a CB destination
+ * are buffered, and handed to its in_cb strictly in offset order, with at most
+ * @pool->depth ranges held at once.
+ *
+ * @returns:	-errno of the first range to fail, or zero once all are read
+ */
+int
+elasto_fop_read_par(struct elasto_fxmit_pool *pool,
+		    uint64_t src_off,
+		    uint64_t src_len,
+		    struct elasto_data *dest_data,
+		    uint64_t chunk,
+		    void *priv,
+		    int (*op_get)(uint64_t off,
+				  uint64_t len,
+				  struct elasto_data *this_data,
+				  void *priv,
+				  struct op **_op));
+
 #endif /* _XMIT_H_ */
@@ -212,7 +212,7 @@ op_hdr_del(struct list_head *hdrs,
 	return -ENOENT;
 }
 
-static int
+int
 op_req_hdr_del(struct op *op,
 	       const char *key)
 {
@@ -295,13 +295,24 @@ op_req_free(struct op *op)
 static void
 op_rsp_free(struct op *op)
 {
+	bool streamed = (op->rsp.xdoc != NULL);
+
 	op_hdrs_free(&op->rsp.hdrs);
 	elasto_data_free(op->rsp.data);
 
+	if (streamed) {
+		/* frees any found values, must precede rsp_free */
+		exml_free(op->rsp.xdoc);
+		op->rsp.xdoc = NULL;
+	}
+
 	if (op->rsp.is_error) {
-		/* error response only, no aop data */
 		op_rsp_error_free(&op->rsp.err);
-		return;
+		if (!streamed) {
+			/* error response only, no aop data */
+			return;
+		}
+		/* streamed response may have been cancelled mid-parse */
 	}
 
 	free(op->rsp.req_id);
@@ -312,6 +323,7 @@ void
 op_free(struct op *op)
 {
 	free(op->sig_src);
+	free(op->sig_hdrs);
 	free(op->url_host);
 	free(op->url_path);
 	op_req_free(op);
@@ -417,20 +429,44 @@ op_req_dup_hdrs_del(struct op *op)
 	if (ret < 0) {
 		dbg(0, "no clen for to-be-resent req\n");
 	}
-	if (op->req_sign != NULL) {
+	if (op->signed_hdr) {
 		ret = op_req_hdr_del(op, "Authorization");
 		if (ret < 0) {
 			dbg(0, "no auth header for to-be-resent req\n");
 		}
+		op->signed_hdr = false;
 	}
 }
 
+/*
+ * Clear the response for resend, keeping any caller provided data buffer. A
+ * streaming parser can't be reused, so it's rebuilt via the rsp_stream hook.
+ */
+static int
+op_rsp_reset(struct op *op)
+{
+	struct elasto_data *data;
+
+	assert(!op->rsp.xdoc_fed);
+
+	data = op->rsp.data;
+	op->rsp.data = NULL;
+	op_rsp_free(op);
+	memset(&op->rsp, 0, sizeof(op->rsp));
+	list_head_init(&op->rsp.hdrs);
+	op->rsp.data = data;
+
+	if (op->rsp_stream != NULL) {
+		return op->rsp_stream(op);
+	}
+
+	return 0;
+}
+
 #define OP_MAX_REDIRECTS 2
 int
 op_req_redirect(struct op *op)
 {
-	struct elasto_data *data;
-
 	if (!op->rsp.is_error || (op->rsp.err_code != 307)) {
 		dbg(0, "no redirect response for op\n");
 		return -EINVAL;
@@ -439,6 +475,10 @@ op_req_redirect(struct op *op)
 		dbg(0, "no endpoint for redirect\n");
 		return -EFAULT;
 	}
+	if (op->rsp.xdoc_fed) {
+		dbg(0, "can't redirect, response body already parsed\n");
+		return -EIO;
+	}
 	if (op->redirects >= OP_MAX_REDIRECTS) {
 		dbg(0, "maximum redirects exceeded: %d\n", op->redirects);
 		return -ELOOP;
@@ -453,23 +493,18 @@ op_req_redirect(struct op *op)
 
 	op_req_dup_hdrs_del(op);
 
-	/* save rsp data buffer */
-	data = op->rsp.data;
-	op->rsp.data = NULL;
-	op_rsp_free(op);
-	memset(&op->rsp, 0, sizeof(op->rsp));
-	list_head_init(&op->rsp.hdrs);
-	op->rsp.data = data;
-
-	return 0;
+	return op_rsp_reset(op);
 }
 
 #define OP_MAX_RETRIES 2
 int
 op_req_retry(struct op *op)
 {
-	struct elasto_data *data;
-
+	if (op->rsp.xdoc_fed) {
+		/* streamed entries may already have been handed to the caller */
+		dbg(0, "can't retry, response body already parsed\n");
+		return -EIO;
+	}
 	if (op->retries >= OP_MAX_RETRIES) {
 		dbg(0, "maximum retries exceeded: %d\n", op->retries);
 		return -ETIMEDOUT;
@@ -481,13 +516,29 @@ op_req_retry(struct op *op)
 
 	op_req_dup_hdrs_del(op);
 
-	/* save rsp data buffer */
-	data = op->rsp.data;
-	op->rsp.data = NULL;
-	op_rsp_free(op);
-	memset(&op->rsp, 0, sizeof(op->rsp));
-	list_head_init(&op->rsp.hdrs);
-	op->rsp.data = data;
+	return op_rsp_reset(op);
+}
+
+/*
+ * Parse the XML response body as it's received, rather than buffering it
+ * for rsp_process. Finders should be added to the returned @_xdoc before the
+ * request is sent; their values are available once rsp_process is called.
+ */
+int
+op_rsp_xml_stream(struct op *op,
+		  struct xml_doc **_xdoc)
+{
+	int ret;
+
+	if (op->rsp.xdoc != NULL) {
+		return -EEXIST;
+	}
+
+	ret = exml_stream_new(&op->rsp.xdoc);
+	if (ret < 0) {
+		return ret;
+	}
+	*_xdoc = op->rsp.xdoc;
 
 	return 0;
 }
@@ -505,6 +556,14 @@ op_rsp_process(struct op *op)
 		return op_rsp_error_process(op);
 	}
 
+	if (op->rsp.xdoc != NULL) {
+		/* body already fed to the parser by the conn layer */
+		ret = exml_parse_finish(op->rsp.xdoc);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
 	ret = op->rsp_process(op);
 	return ret;
 }
@@ -38,29 +38,57 @@ enum op_req_method {
 };
 
 struct op;
+struct sign_key;
+struct evp_md_ctx_st;
+struct xml_doc;
+struct iovec;
 typedef int (*req_sign_cb_t)(const char *acc,
-			     const uint8_t *key,
-			     int key_len,
+			     struct sign_key *skey,
 			     struct op *op);
 typedef void (*req_free_cb_t)(struct op *op);
 typedef void (*rsp_free_cb_t)(struct op *op);
 typedef int (*rsp_process_cb_t)(struct op *op);
+typedef int (*rsp_stream_cb_t)(struct op *op);
+/* size of the chunk header buffer passed to req_enc_chunk_cb_t */
+#define OP_ENC_CHUNK_HDR_MAX 128
+typedef int (*req_enc_chunk_cb_t)(struct op *op,
+				  const struct iovec *iov,
+				  int iovcnt,
+				  uint64_t chunk_len,
+				  char *hdr,
+				  size_t hdr_size);
 typedef void (*ebo_free_cb_t)(struct op *op);
 
 struct op {
 	struct elasto_conn *econn;
 	int opcode;
 	char *sig_src;	/* debug, compare with signing error response */
+	size_t sig_src_size;	/* allocated, reused if op is resigned */
+	const struct op_hdr **sig_hdrs;	/* sorted for signing, reused */
+	uint32_t sig_hdrs_size;
 	enum op_req_method method;
 	bool url_https_only;	/* overrides conn insecure_http setting */
+	bool req_content_md5;	/* conn layer adds Content-MD5 for req body */
+	bool rsp_content_md5;	/* conn layer checks rsp body Content-MD5 */
 	char *url_host;
 	char *url_path;
 	int redirects;
 	int retries;
+	bool signed_hdr;	/* Authorization added by req_sign, not query auth */
 
 	struct {
 		uint64_t read_cbs;
 		struct elasto_data *data;
+		/* @data offset at first send, a resend starts from here again */
+		uint64_t data_off;
+		bool data_sent;
+		/*
+		 * if set, @data is sent in @enc_chunk_size chunks, each
+		 * preceded by the header written by @enc_chunk and followed by
+		 * CRLF. A final zero length chunk terminates the body.
+		 */
+		req_enc_chunk_cb_t enc_chunk;
+		uint64_t enc_chunk_size;
 		uint32_t num_hdrs;
 		struct list_head hdrs;
 		struct evhttp_request *ev_http;
@@ -76,6 +104,10 @@ struct op {
 		uint64_t write_cbs;
 		struct elasto_data *data;
 		bool recv_cb_alloced;	/* data buffer alloced by conn cb */
+		struct evp_md_ctx_st *md5_ctx;	/* rsp_content_md5 state */
+		/* if set, conn layer parses body as it arrives instead of @data */
+		struct xml_doc *xdoc;
+		bool xdoc_fed;	/* body parsed, so op can't be resent */
 		uint32_t num_hdrs;
 		struct list_head hdrs;
 	} rsp;
@@ -84,6 +116,8 @@ struct op {
 	req_free_cb_t req_free;
 	rsp_free_cb_t rsp_free;
 	rsp_process_cb_t rsp_process;
+	/* (re)creates the streaming parser and finders, called before resend */
+	rsp_stream_cb_t rsp_stream;
 	ebo_free_cb_t ebo_free;
 };
 
@@ -96,6 +130,10 @@ op_req_hdr_add(struct op *op,
 	       const char *key,
 	       const char *val);
 
+int
+op_req_hdr_del(struct op *op,
+	       const char *key);
+
 int
 op_rsp_hdr_add(struct op *op,
 	       const char *key,
@@ -138,6 +176,10 @@ op_req_retry(struct op *op);
 void
 op_free(struct op *op);
 
+int
+op_rsp_xml_stream(struct op *op,
+		  struct xml_doc **_xdoc);
+
 int
 op_rsp_process(struct op *op);
 
@@ -32,6 +32,7 @@
 #include "exml.h"
 #include "data.h"
 #include "op.h"
+#include "conn.h"
 #include "sign.h"
 #include "s3_path.h"
 #include "s3_req.h"
@@ -43,26 +44,200 @@ struct s3_ebo {
 	enum s3_opcode opcode;
 	struct s3_req req;
 	struct s3_rsp rsp;
+	/* aws-chunked signing state, valid while the request is sent */
+	struct {
+		struct sign_key *skey;
+		char amz_date[sizeof("YYYYMMDDTHHMMSSZ")];
+		char sig[SIGN_S3_V4_SIG_LEN + 1];
+	} chunk_sign;
 	struct op op;
 };
 
+/* aws-chunked payload chunk size, for streaming SigV4 uploads */
+#define S3_V4_CHUNK_SIZE (64 * 1024)
+
+/* replace any value left over from a previous signing of @op */
+static int
+s3_req_hdr_set(struct op *op,
+	       const char *key,
+	       const char *val)
+{
+	op_req_hdr_del(op, key);
+	return op_req_hdr_add(op, key, val);
+}
+
+/*
+ * Payloads sent over TLS are integrity protected by the transport, so aren't
+ * hashed. Plain HTTP payloads are sent aws-chunked with per-chunk signatures.
+ */
+static const char *
+s3_req_v4_payload_type(struct op *op)
+{
+	if ((op->req.data == NULL) || (op->req.data->len == 0)) {
+		return SIGN_S3_V4_EMPTY_PAYLOAD;
+	}
+	if ((op->econn != NULL) && op->econn->insecure_http
+	 && !op->url_https_only) {
+		return SIGN_S3_V4_STREAMING_PAYLOAD;
+	}
+	return SIGN_S3_V4_UNSIGNED_PAYLOAD;
+}
+
+static int
+s3_req_v4_chunked_hdrs_set(struct op *op)
+{
+	int ret;
+	char len_buf[30];
+
+	ret = s3_req_hdr_set(op, "Content-Encoding", "aws-chunked");
+	if (ret < 0) {
+		return ret;
+	}
+
+	snprintf(len_buf, sizeof(len_buf), "%" PRIu64, op->req.data->len);
+	ret = s3_req_hdr_set(op, "x-amz-decoded-content-length", len_buf);
+	if (ret < 0) {
+		return ret;
+	}
+
+	snprintf(len_buf, sizeof(len_buf), "%" PRIu64,
+		 sign_s3_v4_chunked_len(op->req.data->len, S3_V4_CHUNK_SIZE));
+	return s3_req_hdr_set(op, "Content-Length", len_buf);
+}
+
+/*
+ * Called by the conn layer as each aws-chunked chunk is queued for sending.
+ * Chunk signatures are chained, starting from the request seed signature.
+ */
+static int
+s3_req_v4_chunk_enc(struct op *op,
+		    const struct iovec *iov,
+		    int iovcnt,
+		    uint64_t chunk_len,
+		    char *hdr,
+		    size_t hdr_size)
+{
+	int ret;
+	struct s3_ebo *ebo = container_of(op, struct s3_ebo, op);
+
+	ret = sign_gen_s3_v4_chunk(ebo->chunk_sign.skey,
+				   ebo->chunk_sign.amz_date,
+				   ebo->chunk_sign.sig, iov, iovcnt,
+				   ebo->chunk_sign.sig);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return sign_s3_v4_chunk_hdr(chunk_len, ebo->chunk_sign.sig,
+				    hdr, hdr_size);
+}
+
+static int
+s3_req_sign_v4(const char *acc,
+	       struct sign_key *skey,
+	       struct op *op)
+{
+	int ret;
+	char amz_date[sizeof("YYYYMMDDTHHMMSSZ")];
+	char seed_sig[SIGN_S3_V4_SIG_LEN + 1];
+	char *payload_type = NULL;
+	bool streaming;
+	char *hdr_str;
+	time_t t;
+	struct tm tm_gmt;
+
+	/* refreshed on each (re)signing */
+	time(&t);
+	gmtime_r(&t, &tm_gmt);
+	if (strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ",
+		     &tm_gmt) == 0) {
+		return -E2BIG;
+	}
+	ret = s3_req_hdr_set(op, "x-amz-date", amz_date);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = op_hdr_val_lookup(&op->req.hdrs, "x-amz-content-sha256",
+				&payload_type);
+	if (ret == -ENOENT) {
+		ret = op_req_hdr_add(op, "x-amz-content-sha256",
+				     s3_req_v4_payload_type(op));
+		if (ret < 0) {
+			return ret;
+		}
+		ret = op_hdr_val_lookup(&op->req.hdrs, "x-amz-content-sha256",
+					&payload_type);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	streaming = (strcmp(payload_type, SIGN_S3_V4_STREAMING_PAYLOAD) == 0);
+	free(payload_type);
+
+	if (streaming) {
+		ret = s3_req_v4_chunked_hdrs_set(op);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	ret = sign_gen_s3_v4(acc, skey, op, &hdr_str, seed_sig);
+	if (ret < 0) {
+		dbg(0, "S3 SigV4 signing failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	op->req.enc_chunk = NULL;
+	if (streaming) {
+		struct s3_ebo *ebo = container_of(op, struct s3_ebo, op);
+
+		ebo->chunk_sign.skey = skey;
+		memcpy(ebo->chunk_sign.amz_date, amz_date, sizeof(amz_date));
+		memcpy(ebo->chunk_sign.sig, seed_sig, sizeof(seed_sig));
+		op->req.enc_chunk = s3_req_v4_chunk_enc;
+		op->req.enc_chunk_size = S3_V4_CHUNK_SIZE;
+	}
+
+	ret = op_req_hdr_add(op, "Authorization", hdr_str);
+	free(hdr_str);
+	return ret;
+}
+
+/*
+ * AWS requests are addressed virtual-hosted style, with the bucket as a host
+ * prefix. S3 compatible stores at any other host are addressed path-style,
+ * as they can't be relied upon to resolve bucket subdomains.
+ */
+static bool
+s3_req_path_style(const struct s3_path *path)
+{
+	return ((path->host != NULL)
+		&& (strcmp(path->host, S3_PATH_HOST_DEFAULT) != 0));
+}
+
 static int
 s3_req_sign(const char *acc,
-	    const uint8_t *key,
-	    int key_len,
+	    struct sign_key *skey,
 	    struct op *op)
 {
 	int ret;
 	char *sig_str;
 	char *hdr_str;
+	const char *bkt;
 	struct s3_ebo *ebo = container_of(op, struct s3_ebo, op);
 
-	if (key == NULL) {
+	if (skey == NULL) {
 		return -EINVAL;
 	}
 
-	ret = sign_gen_s3(ebo->req.path.bkt, key, key_len,
-			  op, &op->sig_src, &sig_str);
+	if (sign_key_alg_get(skey) == SIGN_KEY_AWS4_HMAC_SHA256) {
+		return s3_req_sign_v4(acc, skey, op);
+	}
+
+	/* a path-style request already carries the bucket in url_path */
+	bkt = (s3_req_path_style(&ebo->req.path) ? NULL : ebo->req.path.bkt);
+	ret = sign_gen_s3(bkt, skey, op, &sig_str);
 	if (ret < 0) {
 		dbg(0, "S3 signing failed: %s\n",
 		    strerror(-ret));
@@ -147,23 +322,29 @@ s3_req_fill_hdr_common(struct op *op)
 }
 
 int
-s3_req_hostname_get(char *bkt,
+s3_req_hostname_get(const struct s3_path *path,
 		    char **_hostname)
 {
 	int ret;
 	char *hostname;
 
-	if (_hostname== NULL) {
+	if ((path == NULL) || (_hostname == NULL)) {
 		return -EINVAL;
 	}
 
-	if (bkt == NULL) {
-		hostname = strdup("s3.amazonaws.com");
+	if (s3_req_path_style(path)) {
+		hostname = strdup(path->host);
+		if (hostname == NULL) {
+			return -ENOMEM;
+		}
+	} else if (path->bkt == NULL) {
+		hostname = strdup(S3_PATH_HOST_DEFAULT);
 		if (hostname == NULL) {
 			return -ENOMEM;
 		}
 	} else {
-		ret = asprintf(&hostname, "%s.s3.amazonaws.com", bkt);
+		ret = asprintf(&hostname, "%s.%s", path->bkt,
+			       S3_PATH_HOST_DEFAULT);
 		if (ret < 0) {
 			return -ENOMEM;
 		}
@@ -184,13 +365,32 @@ s3_req_url_encode(const struct s3_path *path,
 	char *url_path;
 	const char *params_str = url_params ? url_params : "";
 
-	ret = s3_req_hostname_get(path->bkt, &url_host);
+	ret = s3_req_hostname_get(path, &url_host);
 	if (ret < 0) {
 		goto err_out;
 	}
 
-	if (S3_PATH_IS_SVC(path) || S3_PATH_IS_BKT(path)) {
-		/* svc and bkt requests use the same path, but host differs */
+	if (S3_PATH_IS_SVC(path)) {
+		ret = asprintf(&url_path, "/%s", params_str);
+		if (ret < 0) {
+			ret = -ENOMEM;
+			goto err_uhost_free;
+		}
+	} else if (s3_req_path_style(path) && S3_PATH_IS_BKT(path)) {
+		ret = asprintf(&url_path, "/%s%s", path->bkt, params_str);
+		if (ret < 0) {
+			ret = -ENOMEM;
+			goto err_uhost_free;
+		}
+	} else if (s3_req_path_style(path) && S3_PATH_IS_OBJ(path)) {
+		ret = asprintf(&url_path, "/%s/%s%s",
+			       path->bkt, path->obj, params_str);
+		if (ret < 0) {
+			ret = -ENOMEM;
+			goto err_uhost_free;
+		}
+	} else if (S3_PATH_IS_BKT(path)) {
+		/* bkt is carried in the virtual-hosted style hostname */
 		ret = asprintf(&url_path, "/%s", params_str);
 		if (ret < 0) {
 			ret = -ENOMEM;
@@ -218,6 +418,22 @@ err_out:
 	return ret;
 }
 
+/* request path used for @path, without any URL parameters */
+int
+s3_req_url_path_get(const struct s3_path *path,
+		    char **_url_path)
+{
+	int ret;
+	char *url_host;
+
+	ret = s3_req_url_encode(path, NULL, &url_host, _url_path);
+	if (ret < 0) {
+		return ret;
+	}
+	free(url_host);
+
+	return 0;
+}
 
 static void
 s3_bkt_free(struct s3_bucket **pbkt)
@@ -429,6 +645,9 @@ s3_rsp_bkt_list_free(struct s3_rsp_bkt_list *bkt_list_rsp)
 	}
 }
 
+static int
+s3_rsp_bkt_list_stream(struct op *op);
+
 int
 s3_req_bkt_list(const struct s3_path *path,
 		struct op **_op)
@@ -465,9 +684,17 @@ s3_req_bkt_list(const struct s3_path *path,
 		goto err_url_free;
 	}
 
+	op->rsp_stream = s3_rsp_bkt_list_stream;
+	ret = op->rsp_stream(op);
+	if (ret < 0) {
+		goto err_hdrs_free;
+	}
+
 	*_op = op;
 	return 0;
 
+err_hdrs_free:
+	op_hdrs_free(&op->req.hdrs);
 err_url_free:
 	free(op->url_path);
 	free(op->url_host);
@@ -479,6 +706,52 @@ err_out:
 	return ret;
 }
 
+/*
+ * Stream objects to @obj_cb as they're parsed, instead of accumulating them
+ * on the s3_rsp_bkt_list. Must be called before @op is sent.
+ */
+int
+s3_req_bkt_list_cb_set(struct op *op,
+		       s3_bkt_list_cb_t obj_cb,
+		       void *cb_priv)
+{
+	struct s3_ebo *ebo = container_of(op, struct s3_ebo, op);
+
+	if (op->opcode != S3OP_BKT_LIST) {
+		return -EINVAL;
+	}
+	ebo->rsp.bkt_list.obj_cb = obj_cb;
+	ebo->rsp.bkt_list.cb_priv = cb_priv;
+	return 0;
+}
+
+/*
+ * Contents element closed, all values are available. Hand the object to the
+ * caller instead of keeping it on the list.
+ */
+static int
+s3_rsp_obj_iter_end(struct xml_doc *xdoc,
+		    const char *path,
+		    const char *val,
+		    void *cb_data)
+{
+	struct s3_rsp_bkt_list *bkt_list_rsp
+				= (struct s3_rsp_bkt_list *)cb_data;
+	int ret;
+	struct s3_object *obj;
+
+	/* entries don't nest, so the one closing is the last added */
+	obj = list_tail(&bkt_list_rsp->objs, struct s3_object, list);
+	assert(obj != NULL);
+	list_del(&obj->list);
+	bkt_list_rsp->num_objs--;
+
+	ret = bkt_list_rsp->obj_cb(obj, bkt_list_rsp->cb_priv);
+	s3_obj_free(&obj);
+
+	return ret;
+}
+
 static int
 s3_rsp_obj_iter_process(struct xml_doc *xdoc,
 			const char *path,
@@ -524,6 +797,15 @@ s3_rsp_obj_iter_process(struct xml_doc *xdoc,
 		goto err_obj_free;
 	}
 
+	if (bkt_list_rsp->obj_cb != NULL) {
+		ret = exml_scope_end_cb_want(xdoc, s3_rsp_obj_iter_end,
+					     bkt_list_rsp);
+		if (ret < 0) {
+			goto err_obj_free;
+		}
+	}
+
+	/* freed via rsp_free if parsing fails before the callback */
 	list_add_tail(&bkt_list_rsp->objs, &obj->list);
 	bkt_list_rsp->num_objs++;
 
@@ -535,25 +817,21 @@ err_out:
 	return ret;
 }
 
+/*
+ * Objects are processed as the response body arrives, so the list wants must
+ * be in place before the request is sent.
+ */
 static int
-s3_rsp_bkt_list_process(struct op *op,
-			struct s3_rsp_bkt_list *bkt_list_rsp)
+s3_rsp_bkt_list_stream(struct op *op)
 {
 	int ret;
 	struct xml_doc *xdoc;
-	struct s3_object *obj;
-	struct s3_object *obj_n;
+	struct s3_ebo *ebo = container_of(op, struct s3_ebo, op);
+	struct s3_rsp_bkt_list *bkt_list_rsp = &ebo->rsp.bkt_list;
 
 	assert(op->opcode == S3OP_BKT_LIST);
 
-	if ((op->rsp.data == NULL) || (op->rsp.data->type != ELASTO_DATA_IOV)) {
-		dbg(1, "invalid data buffer in 0x%x response\n", op->opcode);
-		ret = -EIO;
-		goto err_out;
-	}
-
-	ret = exml_slurp((const char *)op->rsp.data->iov.buf,
-			 op->rsp.data->off, &xdoc);
+	ret = op_rsp_xml_stream(op, &xdoc);
 	if (ret < 0) {
 		goto err_out;
 	}
@@ -572,20 +850,11 @@ s3_rsp_bkt_list_process(struct op *op,
 		goto err_xdoc_free;
 	}
 
-	ret = exml_parse(xdoc);
-	if (ret < 0) {
-		goto err_objs_free;
-	}
-
-	exml_free(xdoc);
 	return 0;
 
-err_objs_free:
-	list_for_each_safe(&bkt_list_rsp->objs, obj, obj_n, list) {
-		s3_obj_free(&obj);
-	}
 err_xdoc_free:
 	exml_free(xdoc);
+	op->rsp.xdoc = NULL;
 err_out:
 	return ret;
 }
@@ -904,6 +1173,7 @@ s3_req_obj_put(const struct s3_path *path,
 	op = &ebo->op;
 	op->req.data = data;
 	/* TODO add a foreign flag so @req.data is not freed with @op */
+	op->req_content_md5 = true;
 
 	op->method = REQ_METHOD_PUT;
 
@@ -1240,6 +1510,7 @@ static void
 s3_rsp_obj_head_free(struct s3_rsp_obj_head *obj_head_rsp)
 {
 	free(obj_head_rsp->content_type);
+	free(obj_head_rsp->etag);
 }
 
 static int
@@ -1264,6 +1535,11 @@ s3_rsp_obj_head_process(struct op *op,
 		goto err_out;
 	}
 
+	ret = op_hdr_val_lookup(&op->rsp.hdrs, "ETag", &obj_head_rsp->etag);
+	if ((ret < 0) && (ret != -ENOENT)) {
+		goto err_out;
+	}
+
 	ret = 0;
 err_out:
 	return ret;
@@ -1374,80 +1650,92 @@ s3_req_mp_done_free(struct s3_req_mp_done *mp_done_req)
 	free(mp_done_req->upload_id);
 }
 
-#define S3_REQ_MP_DONE_PFX "<CompleteMultipartUpload>"
-#define S3_REQ_MP_DONE_ENT_FMT	"<Part>" \
-					"<PartNumber>%u</PartNumber>" \
-					"<ETag>%s</ETag>" \
-				"</Part>"
+static int
+s3_op_mp_done_xml_write(struct list_head *parts,
+			struct xml_writer *xw)
+{
+	int ret;
+	struct s3_part *part;
+
+	ret = exml_el_open(xw, "CompleteMultipartUpload");
+	if (ret < 0) {
+		return ret;
+	}
+
+	list_for_each(parts, part, list) {
+		ret = exml_el_open(xw, "Part");
+		if (ret < 0) {
+			return ret;
+		}
+		ret = exml_uint64_write(xw, "PartNumber", part->pnum);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = exml_str_write(xw, "ETag", part->etag);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = exml_el_close(xw, "Part");
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return exml_el_close(xw, "CompleteMultipartUpload");
+}
+
 /*
- * Amazon currently returns 32 byte etags, and part numbers can be up to 10000
+ * The part list is serialized twice: first to determine the exact body
+ * length, then into a single buffer of that size.
  */
-#define S3_REQ_MP_DONE_ENT_MAXLEN (sizeof(S3_REQ_MP_DONE_ENT_FMT) \
-					+ 32 + sizeof("10000"))
-#define S3_REQ_MP_DONE_SFX "</CompleteMultipartUpload>"
-
 static int
 s3_op_mp_done_fill_body(uint64_t num_parts,
 			struct list_head *parts,
 			struct elasto_data **req_data_out)
 {
 	int ret;
-	struct s3_part *part;
-	char *xml_data;
-	uint64_t buf_remain;
+	uint64_t xml_len;
+	struct xml_writer *xw;
 	struct elasto_data *req_data;
 
-	buf_remain = sizeof(S3_REQ_MP_DONE_PFX)
-		+ (num_parts * S3_REQ_MP_DONE_ENT_MAXLEN)
-		+ sizeof(S3_REQ_MP_DONE_SFX);
-	dbg(4, "allocating mp-done XML buffer len: %" PRIu64 "\n", buf_remain);
+	ret = exml_writer_buf_new(NULL, 0, &xw);
+	if (ret < 0) {
+		goto err_out;
+	}
+	ret = s3_op_mp_done_xml_write(parts, xw);
+	if (ret == 0) {
+		ret = exml_writer_finish(xw, &xml_len);
+	}
+	exml_writer_free(xw);
+	if (ret < 0) {
+		dbg(0, "failed to size mp-done XML\n");
+		goto err_out;
+	}
+	dbg(4, "allocating %" PRIu64 " part mp-done XML buffer len: %" PRIu64
+	    "\n", num_parts, xml_len);
 
-	ret = elasto_data_iov_new(NULL, buf_remain, true, &req_data);
+	ret = elasto_data_iov_new(NULL, xml_len, true, &req_data);
 	if (ret < 0) {
 		ret = -ENOMEM;
 		goto err_out;
 	}
 
-	xml_data = (char *)req_data->iov.buf;
-	ret = snprintf(xml_data, buf_remain, S3_REQ_MP_DONE_PFX);
-	if ((ret < 0) || (ret >= buf_remain)) {
-		dbg(0, "failed to fill mp-done prefix\n");
-		ret = -E2BIG;
+	ret = exml_writer_buf_new(req_data->iov.buf, xml_len, &xw);
+	if (ret < 0) {
 		goto err_buf_free;
 	}
-
-	xml_data += ret;
-	buf_remain -= ret;
-
-	list_for_each(parts, part, list) {
-		ret = snprintf(xml_data, buf_remain, S3_REQ_MP_DONE_ENT_FMT,
-			       (unsigned int)part->pnum,
-			       part->etag);
-		if ((ret < 0) || (ret >= buf_remain)) {
-			dbg(0, "failed to fill mp-done entry\n");
-			ret = -E2BIG;
-			goto err_buf_free;
-		}
-
-		xml_data += ret;
-		buf_remain -= ret;
+	ret = s3_op_mp_done_xml_write(parts, xw);
+	if (ret == 0) {
+		ret = exml_writer_finish(xw, NULL);
 	}
-
-	ret = snprintf(xml_data, buf_remain, S3_REQ_MP_DONE_SFX);
-	if ((ret < 0) || (ret >= buf_remain)) {
-		dbg(0, "failed to fill mp-done suffix\n");
-		ret = -E2BIG;
+	exml_writer_free(xw);
+	if (ret < 0) {
+		dbg(0, "failed to fill mp-done XML\n");
 		goto err_buf_free;
 	}
 
-	xml_data += ret;
-	buf_remain -= ret;
-
-	/* truncate buffer to what was written */
-	req_data->len = req_data->len - buf_remain;
-
-	dbg(4, "sending multipart upload complete req data: %s\n",
-	    (char *)req_data->iov.buf);
+	dbg(4, "sending multipart upload complete req data: %.*s\n",
+	    (int)xml_len, (char *)req_data->iov.buf);
 	*req_data_out = req_data;
 
 	return 0;
@@ -1676,6 +1964,7 @@ s3_req_part_put(const struct s3_path *path,
 
 	op->req.data = data;
 	/* TODO add a foreign flag so @req.data is not freed with @op */
+	op->req_content_md5 = true;
 
 	op->method = REQ_METHOD_PUT;
 
@@ -1834,9 +2123,6 @@ s3_rsp_process(struct op *op)
 	case S3OP_SVC_LIST:
 		ret = s3_rsp_svc_list_process(op, &ebo->rsp.svc_list);
 		break;
-	case S3OP_BKT_LIST:
-		ret = s3_rsp_bkt_list_process(op, &ebo->rsp.bkt_list);
-		break;
 	case S3OP_BKT_LOCATION_GET:
 		ret = s3_rsp_bkt_loc_get_process(op, &ebo->rsp.bkt_loc_get);
 		break;
@@ -1849,6 +2135,10 @@ s3_rsp_process(struct op *op)
 	case S3OP_PART_PUT:
 		ret = s3_rsp_part_put_process(op, &ebo->rsp.part_put);
 		break;
+	case S3OP_BKT_LIST:
+		/* parsed by the conn layer as the response arrived */
+		ret = 0;
+		break;
 	case S3OP_BKT_CREATE:
 	case S3OP_BKT_DEL:
 	case S3OP_OBJ_PUT:
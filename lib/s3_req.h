@@ -53,10 +53,20 @@ struct s3_object {
 	char *store_class;
 };
 
+typedef int (*s3_bkt_list_cb_t)(struct s3_object *obj,
+				void *cb_priv);
+
+/*
+ * @objs: struct s3_object list
+ * @obj_cb: if set, each object is passed to the callback as it's parsed,
+ *	    rather than being added to @objs.
+ */
 struct s3_rsp_bkt_list {
 	bool truncated;
 	int num_objs;
 	struct list_head objs;
+	s3_bkt_list_cb_t obj_cb;
+	void *cb_priv;
 };
 
 struct s3_req_bkt_create {
@@ -79,6 +89,7 @@ struct s3_req_obj_cp {
 struct s3_rsp_obj_head {
 	uint64_t len;
 	char *content_type;
+	char *etag;
 };
 
 struct s3_rsp_mp_start {
@@ -152,9 +163,13 @@ struct s3_rsp {
 };
 
 int
-s3_req_hostname_get(char *bkt,
+s3_req_hostname_get(const struct s3_path *path,
 		    char **_hostname);
 
+int
+s3_req_url_path_get(const struct s3_path *path,
+		    char **_url_path);
+
 int
 s3_req_svc_list(struct s3_path *s3_path,
 		struct op **_op);
@@ -163,6 +178,11 @@ int
 s3_req_bkt_list(const struct s3_path *path,
 		struct op **_op);
 
+int
+s3_req_bkt_list_cb_set(struct op *op,
+		       s3_bkt_list_cb_t obj_cb,
+		       void *cb_priv);
+
 int
 s3_req_bkt_create(const struct s3_path *path,
 		  const char *location,
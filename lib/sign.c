@@ -14,15 +14,21 @@
 #include <openssl/engine.h>
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <ctype.h>
-/* for http decoding */
-#include <event2/http.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
 #include "ccan/list/list.h"
 #include "base64.h"
@@ -31,45 +37,492 @@
 #include "util.h"
 #include "sign.h"
 
+/*
+ * The HMAC_CTX API is deprecated as of OpenSSL 3.0, in favour of EVP_MAC.
+ * Both are wrapped, so that keyed state can be precomputed with either.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX hmac_ctx_t;
+
+static hmac_ctx_t *
+hmac_ctx_new(void)
+{
+	EVP_MAC *mac;
+	EVP_MAC_CTX *ctx;
+
+	mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+	if (mac == NULL) {
+		return NULL;
+	}
+	/* ctx holds its own reference to @mac */
+	ctx = EVP_MAC_CTX_new(mac);
+	EVP_MAC_free(mac);
+	return ctx;
+}
+
+static void
+hmac_ctx_free(hmac_ctx_t *ctx)
+{
+	EVP_MAC_CTX_free(ctx);
+}
+
 static int
-hmac_sha(const EVP_MD *type, const uint8_t *key, int key_len,
-	 const uint8_t *msg, int msg_len,
-	 uint8_t **md, int *md_len)
+hmac_ctx_key(hmac_ctx_t *ctx,
+	     const EVP_MD *type,
+	     const uint8_t *key,
+	     int key_len)
+{
+	OSSL_PARAM params[2];
+
+	params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						(char *)EVP_MD_get0_name(type),
+						0);
+	params[1] = OSSL_PARAM_construct_end();
+
+	if (EVP_MAC_init(ctx, key, key_len, params) != 1) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* a NULL key resets @ctx to the keyed state */
+static int
+hmac_ctx_digest(hmac_ctx_t *ctx,
+		const uint8_t *msg, int msg_len,
+		uint8_t *md, unsigned int *md_len)
+{
+	size_t len;
+
+	if ((EVP_MAC_init(ctx, NULL, 0, NULL) != 1)
+	 || (EVP_MAC_update(ctx, msg, msg_len) != 1)
+	 || (EVP_MAC_final(ctx, md, &len, EVP_MAX_MD_SIZE) != 1)) {
+		return -EINVAL;
+	}
+	*md_len = len;
+	return 0;
+}
+#else
+typedef HMAC_CTX hmac_ctx_t;
+
+static hmac_ctx_t *
+hmac_ctx_new(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	HMAC_CTX *ctx = malloc(sizeof(*ctx));
+	if (ctx != NULL) {
+		HMAC_CTX_init(ctx);
+	}
+	return ctx;
+#else
+	return HMAC_CTX_new();
+#endif
+}
+
+static void
+hmac_ctx_free(hmac_ctx_t *ctx)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (ctx != NULL) {
+		HMAC_CTX_cleanup(ctx);
+		free(ctx);
+	}
+#else
+	HMAC_CTX_free(ctx);
+#endif
+}
+
+static int
+hmac_ctx_key(hmac_ctx_t *ctx,
+	     const EVP_MD *type,
+	     const uint8_t *key,
+	     int key_len)
+{
+	if (HMAC_Init_ex(ctx, key, key_len, type, NULL) != 1) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* a NULL key resets @ctx to the keyed state */
+static int
+hmac_ctx_digest(hmac_ctx_t *ctx,
+		const uint8_t *msg, int msg_len,
+		uint8_t *md, unsigned int *md_len)
+{
+	if ((HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) != 1)
+	 || (HMAC_Update(ctx, msg, msg_len) != 1)
+	 || (HMAC_Final(ctx, md, md_len) != 1)) {
+		return -EINVAL;
+	}
+	return 0;
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+/* YYYYMMDD, as used in the SigV4 credential scope */
+#define AWS4_DATE_LEN 8
+
+/*
+ * Keyed HMAC state, precomputed once for a connection's lifetime. OpenSSL
+ * keeps the inner and outer key pads hashed in the context, so resetting it
+ * with a NULL key restores the keyed state without rehashing the key.
+ *
+ * For SigV4, @ctx is keyed with the signing key derived from the secret for
+ * @v4.date, @v4.region and @v4.service. It's rederived when the date changes.
+ */
+struct sign_key {
+	enum sign_key_alg alg;
+	hmac_ctx_t *ctx;
+	struct {
+		uint8_t *secret;	/* "AWS4" prefixed */
+		int secret_len;
+		char *region;
+		char *service;
+		char date[AWS4_DATE_LEN + 1];
+	} v4;
+};
+
+int
+sign_key_init(enum sign_key_alg alg,
+	      const uint8_t *key,
+	      int key_len,
+	      struct sign_key **_skey)
 {
-	HMAC_CTX ctx;
-	uint8_t *md_buf;
-	unsigned int len;
+	int ret;
+	struct sign_key *skey;
+	const EVP_MD *type;
 
-	if (type == EVP_sha1()) {
-		len = 20;
+	if (alg == SIGN_KEY_HMAC_SHA1) {
+		type = EVP_sha1();
+	} else if (alg == SIGN_KEY_HMAC_SHA256) {
+		type = EVP_sha256();
 	} else {
-		/* assume sha256 */
-		len = 32;
+		dbg(0, "invalid signing key algorithm: %d\n", alg);
+		ret = -EINVAL;
+		goto err_out;
 	}
 
-	md_buf = malloc(len);
-	if (md_buf == NULL)
-		return -ENOMEM;
+	skey = malloc(sizeof(*skey));
+	if (skey == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(skey, 0, sizeof(*skey));
+	skey->alg = alg;
+
+	skey->ctx = hmac_ctx_new();
+	if (skey->ctx == NULL) {
+		ret = -ENOMEM;
+		goto err_skey_free;
+	}
 
-	HMAC_CTX_init(&ctx);
-	HMAC_Init_ex(&ctx, key, key_len, type, NULL);
-	HMAC_Update(&ctx, msg, msg_len);
-	HMAC_Final(&ctx, md_buf, &len);
-	HMAC_CTX_cleanup(&ctx);
+	ret = hmac_ctx_key(skey->ctx, type, key, key_len);
+	if (ret < 0) {
+		dbg(0, "failed to initialise HMAC key context\n");
+		goto err_ctx_free;
+	}
 
-	*md = md_buf;
-	*md_len = len;
+	*_skey = skey;
+	return 0;
+
+err_ctx_free:
+	hmac_ctx_free(skey->ctx);
+err_skey_free:
+	free(skey);
+err_out:
+	return ret;
+}
+
+#define AWS4_SECRET_PFX "AWS4"
+int
+sign_key_init_s3_v4(const uint8_t *secret,
+		    int secret_len,
+		    const char *region,
+		    const char *service,
+		    struct sign_key **_skey)
+{
+	int ret;
+	struct sign_key *skey;
+	int pfx_len = sizeof(AWS4_SECRET_PFX) - 1;
+
+	if ((region == NULL) || (service == NULL)) {
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	skey = malloc(sizeof(*skey));
+	if (skey == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(skey, 0, sizeof(*skey));
+	skey->alg = SIGN_KEY_AWS4_HMAC_SHA256;
+
+	skey->v4.secret = malloc(pfx_len + secret_len);
+	if (skey->v4.secret == NULL) {
+		ret = -ENOMEM;
+		goto err_skey_free;
+	}
+	memcpy(skey->v4.secret, AWS4_SECRET_PFX, pfx_len);
+	memcpy(skey->v4.secret + pfx_len, secret, secret_len);
+	skey->v4.secret_len = pfx_len + secret_len;
+
+	skey->v4.region = strdup(region);
+	if (skey->v4.region == NULL) {
+		ret = -ENOMEM;
+		goto err_secret_free;
+	}
+
+	skey->v4.service = strdup(service);
+	if (skey->v4.service == NULL) {
+		ret = -ENOMEM;
+		goto err_region_free;
+	}
+
+	/* signing key is derived on first use, once the date is known */
+	skey->ctx = hmac_ctx_new();
+	if (skey->ctx == NULL) {
+		ret = -ENOMEM;
+		goto err_service_free;
+	}
+
+	*_skey = skey;
 	return 0;
+
+err_service_free:
+	free(skey->v4.service);
+err_region_free:
+	free(skey->v4.region);
+err_secret_free:
+	free(skey->v4.secret);
+err_skey_free:
+	free(skey);
+err_out:
+	return ret;
+}
+
+enum sign_key_alg
+sign_key_alg_get(const struct sign_key *skey)
+{
+	return skey->alg;
+}
+
+void
+sign_key_free(struct sign_key *skey)
+{
+	if (skey == NULL) {
+		return;
+	}
+	hmac_ctx_free(skey->ctx);
+	free(skey->v4.secret);
+	free(skey->v4.region);
+	free(skey->v4.service);
+	free(skey);
+}
+
+/*
+ * @md must be at least EVP_MAX_MD_SIZE bytes. The keyed context is reset,
+ * rather than rekeyed, for each message.
+ */
+static int
+hmac_sha(struct sign_key *skey,
+	 const uint8_t *msg, int msg_len,
+	 uint8_t *md, unsigned int *md_len)
+{
+	return hmac_ctx_digest(skey->ctx, msg, msg_len, md, md_len);
+}
+
+/*
+ * The string-to-sign is emitted into a single growable buffer, which is
+ * retained as op->sig_src for debugging and reused if the op is resigned for
+ * a retry or redirect. Allocation failures are sticky, so that callers only
+ * need to check once the whole string has been emitted.
+ */
+struct sign_buf {
+	char *s;
+	size_t len;
+	size_t size;
+	int err;
+};
+
+#define SIGN_BUF_MIN 512
+
+static void
+sign_buf_init(struct sign_buf *sb,
+	      struct op *op)
+{
+	sb->s = op->sig_src;
+	sb->size = (sb->s != NULL) ? op->sig_src_size : 0;
+	sb->len = 0;
+	sb->err = 0;
+	if (sb->s != NULL) {
+		sb->s[0] = '\0';
+	}
+}
+
+/* ensure space for @add bytes, plus terminator */
+static bool
+sign_buf_reserve(struct sign_buf *sb,
+		 size_t add)
+{
+	size_t size;
+	char *s;
+
+	if (sb->err != 0) {
+		return false;
+	}
+	if (sb->len + add < sb->size) {
+		return true;
+	}
+
+	size = (sb->size > 0) ? sb->size : SIGN_BUF_MIN;
+	while (size <= sb->len + add) {
+		size *= 2;
+	}
+	s = realloc(sb->s, size);
+	if (s == NULL) {
+		sb->err = -ENOMEM;
+		return false;
+	}
+	sb->s = s;
+	sb->size = size;
+	return true;
+}
+
+static void
+sign_buf_append(struct sign_buf *sb,
+		const char *str,
+		size_t len)
+{
+	if (!sign_buf_reserve(sb, len)) {
+		return;
+	}
+	memcpy(sb->s + sb->len, str, len);
+	sb->len += len;
+	sb->s[sb->len] = '\0';
+}
+
+static void
+sign_buf_append_str(struct sign_buf *sb,
+		    const char *str)
+{
+	if (str == NULL) {
+		return;
+	}
+	sign_buf_append(sb, str, strlen(str));
+}
+
+static void
+sign_buf_append_c(struct sign_buf *sb,
+		  char c)
+{
+	sign_buf_append(sb, &c, 1);
+}
+
+/* append @str followed by a newline, @str may be NULL */
+static void
+sign_buf_append_line(struct sign_buf *sb,
+		     const char *str)
+{
+	sign_buf_append_str(sb, str);
+	sign_buf_append_c(sb, '\n');
+}
+
+static void
+sign_buf_append_lower(struct sign_buf *sb,
+		      const char *str,
+		      size_t len)
+{
+	size_t i;
+
+	if (!sign_buf_reserve(sb, len)) {
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		sb->s[sb->len++] = tolower(str[i]);
+	}
+	sb->s[sb->len] = '\0';
+}
+
+/*
+ * Copy a header value, dropping leading white space and unfolding any
+ * breaking white space (CRLF followed by white space) into a single space.
+ */
+static void
+sign_buf_append_hdr_val(struct sign_buf *sb,
+			const char *val)
+{
+	const char *s;
+
+	for (s = val; (*s == ' ') || (*s == '\t'); s++);
+
+	if (!sign_buf_reserve(sb, strlen(s))) {
+		return;
+	}
+	for (; *s != '\0'; s++) {
+		if ((*s == '\r') || (*s == '\n')) {
+			while ((s[1] == '\r') || (s[1] == '\n')
+			    || (s[1] == ' ') || (s[1] == '\t')) {
+				s++;
+			}
+			sb->s[sb->len++] = ' ';
+			continue;
+		}
+		sb->s[sb->len++] = *s;
+	}
+	sb->s[sb->len] = '\0';
+}
+
+static int
+hex_val(char c)
+{
+	if ((c >= '0') && (c <= '9')) {
+		return c - '0';
+	}
+	return tolower(c) - 'a' + 10;
+}
+
+/*
+ * return the next URI decoded character from @_s, advancing it. Same as
+ * evhttp_uridecode() with decode_plus=0, invalid escapes are passed as is.
+ */
+static int
+uri_dec_next(const char **_s,
+	     const char *end)
+{
+	const char *s = *_s;
+
+	if ((*s == '%') && (end - s >= 3)
+	 && isxdigit(s[1]) && isxdigit(s[2])) {
+		*_s = s + 3;
+		return (hex_val(s[1]) << 4) | hex_val(s[2]);
+	}
+	*_s = s + 1;
+	return (unsigned char)*s;
 }
 
 static void
-hdr_tolower(char *hdr)
+sign_buf_append_uri_dec(struct sign_buf *sb,
+			const char *str,
+			size_t len,
+			bool lower)
 {
-	char *colon;
-	colon = strchr(hdr, ':');
-	assert(colon != NULL);
-	for (; hdr < colon; hdr++)
-		*hdr = tolower(*hdr);
+	const char *s = str;
+	const char *end = str + len;
+
+	/* decoded string is never longer than the source */
+	if (!sign_buf_reserve(sb, len)) {
+		return;
+	}
+	while (s < end) {
+		int c = uri_dec_next(&s, end);
+		sb->s[sb->len++] = lower ? tolower(c) : c;
+	}
+	sb->s[sb->len] = '\0';
 }
 
 /*
@@ -84,20 +537,50 @@ key_is_vendor_date(const char *key,
 	return (strcasecmp(key_sfx, "date") == 0);
 }
 
-static int
-str_cmp_lexi(const void *p1, const void *p2)
-{
-	return strcmp(*(char * const *)p1, *(char * const *)p2);
-}
+/*
+ * Headers relevant to the string-to-sign. Standard header values and vendor
+ * header entries reference the op's request header list, nothing is copied.
+ * @vendor is the op's sig_hdrs array.
+ */
+struct canon_hdrs {
+	const char *content_type;
+	const char *content_md5;
+	const char *content_len;
+	const char *date;
+	const char *range;
+	uint32_t num_vendor;
+	const struct op_hdr **vendor;
+};
 
+#define SIGN_HDRS_MIN 16
+
+/*
+ * Sorted header references are kept in op->sig_hdrs, which is grown to fit
+ * all request headers (plus @extra), and retained alongside op->sig_src.
+ */
 static int
-hdr_key_lexi_cmp(const void *p1, const void *p2)
+sign_hdrs_reserve(struct op *op,
+		  uint32_t extra)
 {
-	const char *str1 = *(char * const *)p1;
-	const char *str2 = *(char * const *)p2;
-	size_t str1_key_len = strchr(str1, ':') - str1;
-	size_t str2_key_len = strchr(str2, ':') - str2;
-	return strncmp(str1, str2, MIN(str1_key_len, str2_key_len));
+	const struct op_hdr **hdrs;
+	uint32_t num = op->req.num_hdrs + extra;
+	uint32_t size;
+
+	if (num <= op->sig_hdrs_size) {
+		return 0;
+	}
+
+	size = (op->sig_hdrs_size > 0) ? op->sig_hdrs_size : SIGN_HDRS_MIN;
+	while (size < num) {
+		size *= 2;
+	}
+	hdrs = realloc(op->sig_hdrs, sizeof(*hdrs) * size);
+	if (hdrs == NULL) {
+		return -ENOMEM;
+	}
+	op->sig_hdrs = hdrs;
+	op->sig_hdrs_size = size;
+	return 0;
 }
 
 /*
@@ -121,210 +604,260 @@ hdr_key_lexi_cmp(const void *p1, const void *p2)
  * Finally, append a new line character to each canonicalized header in the
  * resulting list. Construct the CanonicalizedHeaders string by concatenating
  * all headers in this list into a single string.
+ *
+ * Vendor headers are collected and sorted here, canon_hdrs_emit() then does
+ * the lowercase conversion, duplicate collapsing and unfolding while copying.
  */
 static int
-canon_hdrs_gen(uint32_t num_hdrs,
-	       struct list_head *hdrs,
-	       const char *hdr_vendor_pfx,
-	       bool vendor_date_trumps,
-	       char **canon_hdrs_out,
-	       char **content_type_out,
-	       char **content_md5_out,
-	       char **content_len_out,
-	       char **date_out,
-	       char **range_out)
+canon_hdrs_gather(struct op *op,
+		  const char *hdr_vendor_pfx,
+		  bool vendor_date_trumps,
+		  struct canon_hdrs *canon)
 {
-	struct op_hdr *hdr;
-	int count = 0;
-	int i;
 	int ret;
-	char **hdr_array;
-	char *hdr_str;
-	char *ctype = NULL;
-	char *md5 = NULL;
-	char *clen = NULL;
-	char *date = NULL;
-	char *range = NULL;
-	char *s;
-	int hdr_str_len = 0;
-
-	if (num_hdrs == 0) {
-		hdr_str = strdup("");
-		if (hdr_str == NULL) {
-			ret = -ENOMEM;
-			goto err_out;
-		}
-		goto out_empty;
-	}
+	struct op_hdr *hdr;
+	size_t pfx_len = strlen(hdr_vendor_pfx);
+	uint32_t i;
 
-	hdr_array = malloc(num_hdrs * sizeof(char *));
-	if (hdr_array == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
+	memset(canon, 0, sizeof(*canon));
+	ret = sign_hdrs_reserve(op, 0);
+	if (ret < 0) {
+		return ret;
 	}
+	canon->vendor = op->sig_hdrs;
 
-	i = 0;
-	count = 0;
-	list_for_each(hdrs, hdr, list) {
-		if (strncasecmp(hdr->key, hdr_vendor_pfx,
-				strlen(hdr_vendor_pfx)) == 0) {
-			bool is_vd;
-			ret = asprintf(&hdr_array[i], "%s:%s",
-				       hdr->key, hdr->val);
-			if (ret < 0) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			hdr_tolower(hdr_array[i]);
-			is_vd = key_is_vendor_date(hdr->key, hdr_vendor_pfx);
-			if (is_vd && vendor_date_trumps) {
-				if (date != NULL) {
+	list_for_each(&op->req.hdrs, hdr, list) {
+		if (strncasecmp(hdr->key, hdr_vendor_pfx, pfx_len) == 0) {
+			if (vendor_date_trumps
+			 && key_is_vendor_date(hdr->key, hdr_vendor_pfx)) {
+				if (canon->date != NULL) {
 					dbg(3, "Date already set by standard "
 					    "header!\n");
-					free(date);
-				}
-				date = strdup(hdr->val);
-				if (date == NULL) {
-					ret = -ENOMEM;
-					goto err_array_free;
 				}
+				canon->date = hdr->val;
 				dbg(6, "vendor date hdr trumps HTTP date\n");
-				free(hdr_array[i]);
 				continue;
 			}
-			hdr_str_len += (strlen(hdr_array[i])
-					   + 1);	/* newline */
-			dbg(6, "got vendor hdr: %s\n", hdr_array[i]);
-			i++;
-			count = i;
-		} else if (strcasecmp(hdr->key, "Content-Type") == 0) {
-			assert(ctype == NULL);
-			ctype = strdup(hdr->val);
-			if (ctype == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
+			assert(canon->num_vendor < op->sig_hdrs_size);
+			/* insertion sort, keeps duplicates in request order */
+			for (i = canon->num_vendor; i > 0; i--) {
+				if (strcasecmp(canon->vendor[i - 1]->key,
+					       hdr->key) <= 0) {
+					break;
+				}
+				canon->vendor[i] = canon->vendor[i - 1];
 			}
-			dbg(6, "got Content-Type hdr: %s\n", ctype);
+			canon->vendor[i] = hdr;
+			canon->num_vendor++;
+			dbg(6, "got vendor hdr: %s\n", hdr->key);
+		} else if (strcasecmp(hdr->key, "Content-Type") == 0) {
+			assert(canon->content_type == NULL);
+			canon->content_type = hdr->val;
 		} else if (strcasecmp(hdr->key, "Content-MD5") == 0) {
-			assert(md5 == NULL);
-			md5 = strdup(hdr->val);
-			if (md5 == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			dbg(6, "got Content-MD5 hdr: %s\n", md5);
+			assert(canon->content_md5 == NULL);
+			canon->content_md5 = hdr->val;
 		} else if (strcasecmp(hdr->key, "Date") == 0) {
-			if (date != NULL) {
+			if (canon->date != NULL) {
 				dbg(3, "Date already set by vendor header!\n");
 				continue;
 			}
-			date = strdup(hdr->val);
-			if (date == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			dbg(6, "got Date hdr: %s\n", date);
+			canon->date = hdr->val;
 		} else if (strcasecmp(hdr->key, "Content-Length") == 0) {
-			assert(clen == NULL);
-			clen = strdup(hdr->val);
-			if (clen == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			dbg(6, "got Content-Length hdr: %s\n", clen);
+			assert(canon->content_len == NULL);
+			canon->content_len = hdr->val;
 		} else if (strcasecmp(hdr->key, "Range") == 0) {
-			assert(range == NULL);
-			range = strdup(hdr->val);
-			if (range == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			dbg(6, "got Range hdr: %s\n", range);
-		}
-	}
-	if (count == 0) {
-		free(hdr_array);
-		hdr_str = strdup("");
-		if (hdr_str == NULL) {
-			ret = -ENOMEM;
-			goto err_out;
+			assert(canon->range == NULL);
+			canon->range = hdr->val;
 		}
-		goto out_empty;
 	}
 
-	qsort(hdr_array, count, sizeof(char *), hdr_key_lexi_cmp);
+	return 0;
+}
 
-	/* TODO "Unfold" long headers! */
+static void
+canon_hdrs_emit(const struct canon_hdrs *canon,
+		struct sign_buf *sb)
+{
+	uint32_t i;
 
-	hdr_str = malloc(hdr_str_len + 1);
-	if (hdr_str == NULL) {
-		ret = -ENOMEM;
-		goto err_array_free;
-	}
+	for (i = 0; i < canon->num_vendor; i++) {
+		const struct op_hdr *hdr = canon->vendor[i];
 
-	s = hdr_str;
-	for (i = 0; i < count; i++) {
-		int len;
-		int dup_val_off = 0;;
 		if ((i > 0)
-		 && (hdr_key_lexi_cmp(&hdr_array[i - 1], &hdr_array[i]) == 0)) {
+		 && (strcasecmp(canon->vendor[i - 1]->key, hdr->key) == 0)) {
 			dbg(4, "collapsing duplicate header \"%s\"\n",
-			    hdr_array[i]);
-			/* duplicate headers, append value */
-			*(s - 1) = ',';	/* overwrite newline */
-			dup_val_off = (strchr(hdr_array[i], ':') + 1
-							- hdr_array[i]);
+			    hdr->key);
+			/* duplicate headers, overwrite newline and append */
+			if (sb->err == 0) {
+				assert(sb->len > 0);
+				sb->s[sb->len - 1] = ',';
+			}
+		} else {
+			sign_buf_append_lower(sb, hdr->key, strlen(hdr->key));
+			sign_buf_append_c(sb, ':');
 		}
+		sign_buf_append_hdr_val(sb, hdr->val);
+		sign_buf_append_c(sb, '\n');
+	}
+}
 
-		len = strlen(hdr_array[i] + dup_val_off);
-		memcpy(s, hdr_array[i] + dup_val_off, len);
-		free(hdr_array[i]);
-		hdr_array[i] = s;	/* needed for cmp */
-		*(s + len) = '\n';
-		s += (len + 1);
-		*s = '\0';	/* needed for cmp */
-	}
-	free(hdr_array);
-out_empty:
-	*canon_hdrs_out = hdr_str;
-	if (content_type_out != NULL) {
-		*content_type_out = ctype;
-	} else {
-		free(ctype);
+/* query parameter references into the request URL */
+struct canon_qp {
+	const char *key;
+	size_t key_len;
+	const char *val;	/* NULL if no '=' separator */
+	size_t val_len;
+};
+#define CANON_QPS_MAX 50
+
+/*
+ * Split @query_params (after the '?') into key/value references. Empty
+ * parameters are skipped if @skip_empty, otherwise considered invalid.
+ */
+static int
+canon_qps_split(const char *query_params,
+		bool skip_empty,
+		struct canon_qp *qps,
+		int *_num_qps)
+{
+	const char *q_start = query_params;
+	const char *q_end;
+	const char *eq;
+	int count = 0;
+
+	while (true) {
+		q_end = strchrnul(q_start, '&');
+		if ((q_start >= q_end) && skip_empty) {
+			goto next;
+		} else if (q_start >= q_end) {
+			dbg(0, "invalid query params: %s\n", query_params);
+			return -EINVAL;
+		}
+		if (count >= CANON_QPS_MAX) {
+			dbg(0, "too many query params: %s\n", query_params);
+			return -EINVAL;
+		}
+
+		qps[count].key = q_start;
+		eq = memchr(q_start, '=', q_end - q_start);
+		if (eq != NULL) {
+			qps[count].key_len = eq - q_start;
+			qps[count].val = eq + 1;
+			qps[count].val_len = q_end - (eq + 1);
+		} else {
+			qps[count].key_len = q_end - q_start;
+			qps[count].val = NULL;
+			qps[count].val_len = 0;
+		}
+		count++;
+next:
+		if (*q_end == '\0') {
+			break;
+		}
+		q_start = q_end + 1;
 	}
-	if (content_md5_out != NULL) {
-		*content_md5_out = md5;
-	} else {
-		free(md5);
+
+	*_num_qps = count;
+	return 0;
+}
+
+/* compare URI decoded strings, optionally ignoring case */
+static int
+uri_dec_cmp(const char *s1, size_t s1_len,
+	    const char *s2, size_t s2_len,
+	    bool ignore_case)
+{
+	const char *end1 = s1 + s1_len;
+	const char *end2 = s2 + s2_len;
+
+	while ((s1 < end1) && (s2 < end2)) {
+		int c1 = uri_dec_next(&s1, end1);
+		int c2 = uri_dec_next(&s2, end2);
+		if (ignore_case) {
+			c1 = tolower(c1);
+			c2 = tolower(c2);
+		}
+		if (c1 != c2) {
+			return c1 - c2;
+		}
 	}
-	if (content_len_out != NULL) {
-		*content_len_out = clen;
-	} else {
-		free(clen);
+	if (s1 < end1) {
+		return 1;
+	} else if (s2 < end2) {
+		return -1;
 	}
-	if (date_out != NULL) {
-		*date_out = date;
-	} else {
-		free(date);
+	return 0;
+}
+
+/* sort by lowercase decoded name, then by decoded value */
+static int
+qp_dec_cmp(const void *p1, const void *p2)
+{
+	const struct canon_qp *qp1 = p1;
+	const struct canon_qp *qp2 = p2;
+	int ret;
+
+	ret = uri_dec_cmp(qp1->key, qp1->key_len,
+			  qp2->key, qp2->key_len, true);
+	if (ret != 0) {
+		return ret;
 	}
-	if (range_out != NULL) {
-		*range_out = range;
-	} else {
-		free(range);
+	return uri_dec_cmp(qp1->val, qp1->val_len,
+			   qp2->val, qp2->val_len, false);
+}
+
+/*
+ * Convert all parameter names to lowercase.
+ *
+ * Sort the query parameters lexicographically by parameter name, in ascending
+ * order.
+ *
+ * URL-decode each query parameter name and value.
+ *
+ * Append each query parameter name and value to the string in the following
+ * format, making sure to include the colon (:) between the name and the value:
+ * parameter-name:parameter-value
+ *
+ * If a query parameter has more than one value, sort all values
+ * lexicographically, then include them in a comma-separated list:
+ * parameter-name:parameter-value-1,parameter-value-2,parameter-value-n
+ *
+ * Append a new-line character (\n) after each name-value pair.
+ * ----
+ * Newlines here are prefixed, as the last pair isn't newline terminated.
+ */
+static int
+canon_query_params_gen(const char *query_params,
+		       struct sign_buf *sb)
+{
+	struct canon_qp qps[CANON_QPS_MAX];
+	int count;
+	int i;
+	int ret;
+
+	ret = canon_qps_split(query_params, false, qps, &count);
+	if (ret < 0) {
+		return ret;
 	}
 
-	return 0;
+	qsort(qps, count, sizeof(struct canon_qp), qp_dec_cmp);
 
-err_array_free:
-	free(ctype);
-	free(md5);
-	free(date);
-	free(range);
-	for (i = 0; i < count; i++)
-		free(hdr_array[i]);
-	free(hdr_array);
-err_out:
-	return ret;
+	for (i = 0; i < count; i++) {
+		if ((i > 0)
+		 && (uri_dec_cmp(qps[i - 1].key, qps[i - 1].key_len,
+				 qps[i].key, qps[i].key_len, true) == 0)) {
+			/* multi value param, values already sorted */
+			sign_buf_append_c(sb, ',');
+		} else {
+			sign_buf_append_c(sb, '\n');
+			sign_buf_append_uri_dec(sb, qps[i].key, qps[i].key_len,
+						true);
+			sign_buf_append_c(sb, ':');
+		}
+		sign_buf_append_uri_dec(sb, qps[i].val, qps[i].val_len, false);
+	}
+
+	return 0;
 }
 
 /*
@@ -341,886 +874,912 @@ err_out:
  * component of the resource, append the appropriate query string. The query
  * string should include the question mark and the comp parameter (for example,
  * ?comp=metadata). No other parameters should be included on the query string.
- * ----
- *
- * @url_path is modified in place to pull out the comp parameter. Could be
- * optimized greatly, but simple code is nicer.
  */
-static char *
+static void
 canon_rsc_gen_lite(const char *account,
-		   const char *url_path)
+		   const char *url_path,
+		   struct sign_buf *sb)
 {
-	int ret;
-	char *s;
-	char *q;
-	char *comp;
-	char *rsc_str = NULL;
+	const char *s;
+	const char *q;
+	const char *comp;
 
 	/* find the first forward slash after the protocol */
 	s = strchrnul(url_path, '/');
 
+	sign_buf_append_c(sb, '/');
+	sign_buf_append_str(sb, account);
+
 	q = strchr(s, '?');
 	if (q == NULL) {
 		/* no parameters, nice and easy */
-		ret = asprintf(&rsc_str, "/%s%s", account, s);
-		if (ret < 0) {
-			rsc_str = NULL;
-		}
-		return rsc_str;
-	}
-
-	*q = '\0';
-	comp = strstr(q + 1, "comp=");
-	if (comp) {
-		char *amp = strchr(comp, '&');
-		if (amp)
-			*amp = '\0';
-		ret = asprintf(&rsc_str, "/%s%s?%s", account, s, comp);
-		if (amp)
-			*amp = '&';
-	} else {
-		ret = asprintf(&rsc_str, "/%s%s", account, s);
-	}
-	*q = '?';
-	if (ret < 0) {
-		rsc_str = NULL;
+		sign_buf_append_str(sb, s);
+		return;
 	}
+	sign_buf_append(sb, s, q - s);
 
-	return rsc_str;
+	for (comp = q + 1; comp != NULL; comp = strchr(comp, '&')) {
+		if (*comp == '&') {
+			comp++;
+		}
+		if (strncmp(comp, "comp=", sizeof("comp=") - 1) == 0) {
+			sign_buf_append_c(sb, '?');
+			sign_buf_append(sb, comp, strchrnul(comp, '&') - comp);
+			break;
+		}
+	}
 }
 
 /* generate base64 encoded signature string for @op */
 #define HDR_PREFIX_AZ "x-ms-"
 #define HDR_PREFIX_S3 "x-amz-"
-int
-sign_gen_lite_azure(const char *account,
-		    const uint8_t *key,
-		    int key_len,
-		    struct op *op,
-		    char **sig_src,
-		    char **sig_str)
+
+/* hand the buffer back to @op for debugging and later reuse */
+static void
+sign_buf_release(struct sign_buf *sb,
+		 struct op *op)
+{
+	op->sig_src = sb->s;
+	op->sig_src_size = sb->size;
+}
+
+/*
+ * Sign the string-to-sign in @sb, which is then released to op->sig_src.
+ */
+static int
+sign_buf_finish(struct sign_buf *sb,
+		struct sign_key *skey,
+		struct op *op,
+		char **sig_str)
 {
 	int ret;
-	char *canon_hdrs;
-	char *content_type = NULL;
-	char *canon_rsc;
-	char *str_to_sign = NULL;
-	uint8_t *md;
-	int md_len;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
 	char *md_b64;
-	const char *method_str;
 
-	method_str = op_method_str(op->method);
-	if (method_str == NULL) {
-		ret = -EINVAL;
-		goto err_out;
+	sign_buf_release(sb, op);
+	if (sb->err != 0) {
+		return sb->err;
 	}
+	dbg(4, "str to sign is: \"%s\"\n", sb->s);
 
-	ret = canon_hdrs_gen(op->req.num_hdrs, &op->req.hdrs,
-			     HDR_PREFIX_AZ, false,
-			     &canon_hdrs, &content_type,
-			     NULL, NULL, NULL, NULL);
+	ret = hmac_sha(skey, (uint8_t *)sb->s, sb->len, md, &md_len);
 	if (ret < 0) {
-		goto err_out;
+		dbg(0, "failed to generate sha\n");
+		return ret;
 	}
 
-	canon_rsc = canon_rsc_gen_lite(account, op->url_path);
-	if (canon_rsc == NULL) {
-		ret = -ENOMEM;
-		goto err_hdrs_free;
-	}
-
-	ret = asprintf(&str_to_sign,
-		       "%s\n"	/* VERB */
-		       "\n"	/* Content-MD5 (not supported) */
-		       "%s\n"	/* Content-Type */
-		       "\n"	/* Date (not supported) */
-		       "%s"	/* CanonicalizedHeaders */
-		       "%s",	/* CanonicalizedResource */
-		       method_str,
-		       content_type ? content_type : "",
-		       canon_hdrs, canon_rsc);
+	ret = base64_encode(md, md_len, &md_b64);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto err_rsc_free;
+		dbg(0, "failed to encode digest\n");
+		return -EINVAL;
 	}
+	*sig_str = md_b64;
 
-	ret = hmac_sha(EVP_sha256(), key, key_len,
-		       (uint8_t *)str_to_sign, strlen(str_to_sign),
-		       &md, &md_len);
-	if (ret < 0) {
-		goto err_str_free;
+	return ret;
+}
+
+int
+sign_gen_lite_azure(const char *account,
+		    struct sign_key *skey,
+		    struct op *op,
+		    char **sig_str)
+{
+	int ret;
+	struct canon_hdrs canon;
+	struct sign_buf sb;
+	const char *method_str;
+
+	assert(skey->alg == SIGN_KEY_HMAC_SHA256);
+
+	method_str = op_method_str(op->method);
+	if (method_str == NULL) {
+		return -EINVAL;
 	}
 
-	ret = base64_encode(md, md_len, &md_b64);
+	ret = canon_hdrs_gather(op, HDR_PREFIX_AZ, false, &canon);
 	if (ret < 0) {
-		ret = -EINVAL;
-		goto err_md_free;
+		return ret;
 	}
-	*sig_str = md_b64;
-	*sig_src = str_to_sign;
-	str_to_sign = NULL;
-
-err_md_free:
-	free(md);
-err_str_free:
-	free(str_to_sign);
-err_rsc_free:
-	free(canon_rsc);
-err_hdrs_free:
-	free(canon_hdrs);
-	free(content_type);
-err_out:
-	return ret;
-}
 
-struct qp {
-	char *lowered;
-	char *key_decoded;
-	size_t kd_len;
-	char *val_decoded;
-	size_t vd_len;
-};
+	sign_buf_init(&sb, op);
+	sign_buf_append_line(&sb, method_str);		/* VERB */
+	sign_buf_append_line(&sb, NULL);		/* Content-MD5 (n/a) */
+	sign_buf_append_line(&sb, canon.content_type);	/* Content-Type */
+	sign_buf_append_line(&sb, NULL);		/* Date (n/a) */
+	canon_hdrs_emit(&canon, &sb);			/* CanonicalizedHeaders */
+	canon_rsc_gen_lite(account, op->url_path, &sb);	/* CanonicalizedResource */
+
+	return sign_buf_finish(&sb, skey, op, sig_str);
+}
 
 static int
-qp_cmp_lexi(const void *p1, const void *p2)
+canon_rsc_gen(const char *account,
+	      const char *url_path,
+	      struct sign_buf *sb)
 {
-	const struct qp *qp1 = p1;
-	const struct qp *qp2 = p2;
-	return strcmp(qp1->lowered, qp2->lowered);
+	const char *s;
+	const char *q;
+
+	dbg(3, "generating canon rsc from: %s and %s\n", account, url_path);
+
+	/* find the first forward slash after the protocol */
+	s = strchrnul(url_path, '/');
+
+	sign_buf_append_c(sb, '/');
+	sign_buf_append_str(sb, account);
+
+	q = strchr(s, '?');
+	if (q == NULL) {
+		/* no parameters, nice and easy */
+		sign_buf_append_str(sb, s);
+		return 0;
+	}
+	sign_buf_append(sb, s, q - s);
+
+	return canon_query_params_gen(q + 1, sb);
 }
 
 /*
- * Convert all parameter names to lowercase.
- *
- * Sort the query parameters lexicographically by parameter name, in ascending
- * order.
- *
- * URL-decode each query parameter name and value.
- *
- * Append each query parameter name and value to the string in the following
- * format, making sure to include the colon (:) between the name and the value:
- * parameter-name:parameter-value
- *
- * If a query parameter has more than one value, sort all values
- * lexicographically, then include them in a comma-separated list:
- * parameter-name:parameter-value-1,parameter-value-2,parameter-value-n
- *
- * Append a new-line character (\n) after each name-value pair.
- *
- * TODO This could be optimised by storing the parameters as a linked list, and
- * requiring that k=v pairs are added to the list in lexicographic order.
+ * https://msdn.microsoft.com/en-us/library/azure/dd179428.aspx
+ * Shared Key for Blob, Queue, and File Services.
  */
-static int
-canon_query_params_gen(const char *query_params,
-		       char *out_buf,
-		       size_t buf_len)
+int
+sign_gen_shared_azure(const char *account,
+		    struct sign_key *skey,
+		    struct op *op,
+		    char **sig_str)
 {
-
-	struct qp params[50];
-	int count;
-	const char *q_start;
-	const char *q_end;
-	char *s;
-	size_t len;
-	int key_len_total;
-	int val_len_total;
-	int i;
 	int ret;
+	struct canon_hdrs canon;
+	struct sign_buf sb;
+	const char *method_str;
+	const char *clen;
 
-	key_len_total = 0;
-	val_len_total = 0;
-	count = 0;
-	q_start = query_params;
+	assert(skey->alg == SIGN_KEY_HMAC_SHA256);
 
-	for (i = 0; i < ARRAY_SIZE(params); i++) {
+	method_str = op_method_str(op->method);
+	if (method_str == NULL) {
+		return -EINVAL;
+	}
 
-		q_end = strchrnul(q_start, '&');
-		if (q_start >= q_end) {
-			dbg(0, "invalid query params: %s\n", query_params);
-			ret = -EINVAL;
-			goto err_array_free;
-		}
+	ret = canon_hdrs_gather(op, HDR_PREFIX_AZ, false, &canon);
+	if (ret < 0) {
+		return ret;
+	}
 
-		len = q_end - q_start;
-		assert(len > 0);
-		params[i].lowered = strndup(q_start, len);
-		if (params[i].lowered == NULL) {
-			ret = -ENOMEM;
-			goto err_array_free;
-		}
+	/* Content-Length must be empty if zero */
+	clen = canon.content_len;
+	if ((clen != NULL) && (strcmp(clen, "0") == 0)) {
+		clen = NULL;
+	}
 
-		/* convert param to lowercase */
-		for (s = params[i].lowered; ((*s != '=') && (*s != '\0')); s++) {
-			*s = tolower(*s);
-		}
+	sign_buf_init(&sb, op);
+	sign_buf_append_line(&sb, method_str);		/* VERB */
+	sign_buf_append_line(&sb, NULL);		/* Content-Encoding (n/a) */
+	sign_buf_append_line(&sb, NULL);		/* Content-Language (n/a) */
+	sign_buf_append_line(&sb, clen);		/* Content-Length */
+	sign_buf_append_line(&sb, canon.content_md5);	/* Content-MD5 */
+	sign_buf_append_line(&sb, canon.content_type);	/* Content-Type */
+	sign_buf_append_line(&sb, canon.date);		/* Date */
+	sign_buf_append_line(&sb, NULL);		/* If-Modified-Since */
+	sign_buf_append_line(&sb, NULL);		/* If-Match */
+	sign_buf_append_line(&sb, NULL);		/* If-None-Match */
+	sign_buf_append_line(&sb, NULL);		/* If-Unmodified-Since */
+	sign_buf_append_line(&sb, canon.range);		/* Range */
+	canon_hdrs_emit(&canon, &sb);			/* CanonicalizedHeaders */
+	/* CanonicalizedResource */
+	ret = canon_rsc_gen(account, op->url_path, &sb);
+	if (ret < 0) {
+		sign_buf_release(&sb, op);
+		return ret;
+	}
 
-		if (*s == '=') {
-			params[i].val_decoded = evhttp_uridecode(s + 1, 0,
-							&params[i].vd_len);
-			if (params[i].val_decoded == NULL) {
-				ret = -ENOMEM;
-				goto err_array_free;
-			}
-			/* terminate key for decoding */
-			*s = 0;
-		} else {
-			params[i].val_decoded = NULL;
-			params[i].vd_len = 0;
-		}
+	return sign_buf_finish(&sb, skey, op, sig_str);
+}
 
-		params[i].key_decoded = evhttp_uridecode(params[i].lowered, 0,
-							 &params[i].kd_len);
-		if (params[i].key_decoded == NULL) {
-			ret = -ENOMEM;
-			goto err_array_free;
-		}
+/*
+ * @url_host points to the hostname after the protocol prefix
+ */
+static void
+canon_rsc_bucket_gen(const char *bkt_name,
+		     const char *url_host,
+		     struct sign_buf *sb)
+{
+	const char *d;
+	const char *sep;
 
-		val_len_total += params[i].vd_len;
-		key_len_total += params[i].kd_len;
-		count++;
+	if (bkt_name == NULL) {
+		/* assume base URL only */
+		return;
+	}
 
-		if (*q_end == '\0') {
-			break;
-		}
-		q_start = q_end + 1;
+	sign_buf_append_c(sb, '/');
+
+	/* find the first dot, up to which may be the bucket name */
+	d = strchr(url_host, '.');
+	if ((d != NULL)
+	 && (strncmp(url_host, bkt_name, d - url_host) == 0)) {
+		dbg(6, "bucket prefix in S3 host path\n");
+		/*
+		 * There is a bucket name before the aws hostname, ensure the
+		 * required '/' prefix is included in the bucket string.
+		 */
+		sign_buf_append(sb, url_host, d - url_host);
+		return;
 	}
 
-	if (i == ARRAY_SIZE(params)) {
-		/* ensure cleanup */
-		count = ARRAY_SIZE(params) - 1;
-		ret = -EINVAL;
-		goto err_array_free;
+	dbg(2, "non S3 host, assuming CNAME bucket alias\n");
+	/* copy up to port, path or query sep */
+	sep = strchr(url_host + 1, ':');
+	if (sep == NULL) {
+		sign_buf_append_str(sb, url_host);
+	} else {
+		sign_buf_append(sb, url_host, sep - url_host);
 	}
+}
 
-	qsort(params, count, sizeof(struct qp), qp_cmp_lexi);
+/*
+ * The list of sub-resources that must be included when constructing the
+ * CanonicalizedResource Element are:
+ * ----
+ * Response header overrides are also included, along with their values.
+ */
+static const char *s3_sub_resources[] = {"acl", "lifecycle",
+				   "location", "logging",
+				   "notification",
+				   "partNumber", "policy",
+				   "requestPayment",
+				   "response-cache-control",
+				   "response-content-disposition",
+				   "response-content-encoding",
+				   "response-content-language",
+				   "response-content-type",
+				   "response-expires",
+				   "torrent",
+				   "uploadId", "uploads",
+				   "versionId", "versioning",
+				   "versions", "website"};
 
-	s = out_buf;
+static bool
+canon_rsc_sub_included(const struct canon_qp *qp)
+{
+	int i;
 
-	for (i = 0; i < count; i++) {
-		/*
-		 * TODO - If a query parameter has more than one value, sort all
-		 * values lexicographically, then include them in a
-		 * comma-separated list:
-		 * parameter-name:parameter-value-1,parameter-value-n
-		 * -> multi value params aren't used yet, so we can be lazy here
-		 */
-		if (i > 0) {
-			assert((params[i].kd_len != params[i - 1].kd_len)
-				|| memcmp(params[i].key_decoded,
-					  params[i - 1].key_decoded,
-				MIN(params[i].kd_len, params[i - 1].kd_len)));
+	for (i = 0; i < ARRAY_SIZE(s3_sub_resources); i++) {
+		if ((strlen(s3_sub_resources[i]) == qp->key_len)
+		 && (memcmp(s3_sub_resources[i], qp->key, qp->key_len) == 0)) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		memcpy(s, params[i].key_decoded, params[i].kd_len);
-		s += params[i].kd_len;
-		buf_len -= params[i].kd_len;
-		assert(buf_len >= 0);
+/* raw (not decoded) comparison of sub-resource name, then value */
+static int
+qp_raw_cmp(const void *p1, const void *p2)
+{
+	const struct canon_qp *qp1 = p1;
+	const struct canon_qp *qp2 = p2;
+	int ret;
 
-		*s = ':';
-		s++;
-		buf_len--;
-		assert(buf_len >= 0);
+	ret = memcmp(qp1->key, qp2->key, MIN(qp1->key_len, qp2->key_len));
+	if (ret != 0) {
+		return ret;
+	} else if (qp1->key_len != qp2->key_len) {
+		return (qp1->key_len < qp2->key_len) ? -1 : 1;
+	}
+	ret = memcmp(qp1->val, qp2->val, MIN(qp1->val_len, qp2->val_len));
+	if (ret != 0) {
+		return ret;
+	} else if (qp1->val_len != qp2->val_len) {
+		return (qp1->val_len < qp2->val_len) ? -1 : 1;
+	}
+	return 0;
+}
 
-		memcpy(s, params[i].val_decoded, params[i].vd_len);
-		s += params[i].vd_len;
-		buf_len -= params[i].vd_len;
-		assert(buf_len >= 0);
+/*
+ * @query_params points to the parameters after the question mark.
+ * Sub-resources must be lexicographically sorted by name and separated by
+ * '&', e.g. ?acl&versionId=value
+ */
+static int
+canon_rsc_sub_gen(const char *query_params,
+		  struct sign_buf *sb)
+{
+	struct canon_qp qps[CANON_QPS_MAX];
+	int count;
+	int i;
+	int j;
+	int ret;
 
-		*s = '\n';
-		s++;
-		buf_len--;
-		assert(buf_len >= 0);
+	ret = canon_qps_split(query_params, true, qps, &count);
+	if (ret < 0) {
+		return ret;
+	}
 
-		free(params[i].lowered);
-		free(params[i].val_decoded);
-		free(params[i].key_decoded);
+	/* filter in place */
+	for (i = 0, j = 0; i < count; i++) {
+		if (!canon_rsc_sub_included(&qps[i])) {
+			dbg(4, "sub rsc \"%.*s\" ignored for signature\n",
+			    (int)qps[i].key_len, qps[i].key);
+			continue;
+		}
+		qps[j++] = qps[i];
 	}
-	assert(count > 0);
-	assert(s > out_buf);
-	/* overwrite last newline with terminator */
-	*(s - 1) = '\0';
+	count = j;
 
-	return 0;
+	qsort(qps, count, sizeof(struct canon_qp), qp_raw_cmp);
 
-err_array_free:
 	for (i = 0; i < count; i++) {
-		free(params[i].lowered);
-		free(params[i].val_decoded);
-		free(params[i].key_decoded);
+		sign_buf_append_c(sb, (i == 0) ? '?' : '&');
+		sign_buf_append(sb, qps[i].key, qps[i].key_len);
+		if (qps[i].val != NULL) {
+			sign_buf_append_c(sb, '=');
+			sign_buf_append(sb, qps[i].val, qps[i].val_len);
+		}
 	}
-	return ret;
+
+	return 0;
 }
 
 static int
-canon_rsc_gen(const char *account,
-	      const char *url_path,
-	      char **_canon_rsc)
+canon_rsc_gen_s3(const char *bkt_name,
+		 const char *url_host,
+		 const char *url_path,
+		 struct sign_buf *sb)
 {
-	int ret;
-	char *s;
-	char *q;
-	char *comp;
-	char *buf = NULL;
-	int buf_len;
-	char *canon_query_str = NULL;
+	const char *s;
+	const char *q;
 
-	dbg(3, "generating canon rsc from: %s and %s\n", account, url_path);
+	canon_rsc_bucket_gen(bkt_name, url_host, sb);
 
 	/* find the first forward slash after the protocol */
 	s = strchrnul(url_path, '/');
 
+	/* up-to but not including the query string. */
 	q = strchr(s, '?');
 	if (q == NULL) {
-		/* no parameters, nice and easy */
-		ret = asprintf(&buf, "/%s%s", account, s);
-		if (ret < 0) {
-			ret = -ENOMEM;
-			goto err_out;
-		}
-		goto done;
-	}
-
-	/* +3 = '/' prefix, '\n' query separator, null term */
-	buf_len = strlen(account) + strlen(url_path) + 3;
-	buf = malloc(buf_len);
-	if (buf == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
-	}
-
-	/* terminate url str after estimating buffer length */
-	*q = '\0';
-
-	ret = snprintf(buf, buf_len, "/%s%s\n", account, s);
-	assert(ret > 0);
-	ret = canon_query_params_gen(q + 1, buf + ret, buf_len - ret);
-	if (ret < 0) {
-		goto err_buf_free;
+		sign_buf_append_str(sb, s);
+		return 0;
 	}
-	dbg(3, "generated canon rsc: %s\n", buf);
-
-done:
-	*_canon_rsc = buf;
-	return 0;
+	sign_buf_append(sb, s, q - s);
 
-err_buf_free:
-	free(buf);
-err_out:
-	return ret;
+	return canon_rsc_sub_gen(q + 1, sb);
 }
 
-/*
- * https://msdn.microsoft.com/en-us/library/azure/dd179428.aspx
- * Shared Key for Blob, Queue, and File Services.
- */
 int
-sign_gen_shared_azure(const char *account,
-		    const uint8_t *key,
-		    int key_len,
-		    struct op *op,
-		    char **sig_src,
-		    char **sig_str)
+sign_gen_s3(const char *bkt_name,
+	    struct sign_key *skey,
+	    struct op *op,
+	    char **sig_str)
 {
 	int ret;
-	char *canon_hdrs;
-	char *content_type = NULL;
-	char *content_md5 = NULL;
-	char *content_len = NULL;
-	char *date = NULL;
-	char *range = NULL;
-	char *canon_rsc;
-	char *str_to_sign = NULL;
-	uint8_t *md;
-	int md_len;
-	char *md_b64;
+	struct canon_hdrs canon;
+	struct sign_buf sb;
 	const char *method_str;
 
+	assert(skey->alg == SIGN_KEY_HMAC_SHA1);
+
 	method_str = op_method_str(op->method);
 	if (method_str == NULL) {
-		ret = -EINVAL;
-		goto err_out;
+		return -EINVAL;
 	}
 
-	ret = canon_hdrs_gen(op->req.num_hdrs, &op->req.hdrs,
-			     HDR_PREFIX_AZ, false,
-			     &canon_hdrs, &content_type, &content_md5,
-			     &content_len, &date, &range);
+	ret = canon_hdrs_gather(op, HDR_PREFIX_S3, true, &canon);
 	if (ret < 0) {
-		goto err_out;
-	}
-
-	ret = canon_rsc_gen(account, op->url_path, &canon_rsc);
-	if (ret < 0) {
-		goto err_hdrs_free;
-	}
-
-	ret = asprintf(&str_to_sign,
-		       "%s\n"	/* VERB */
-		       "\n"	/* Content-Encoding (not supported) */
-		       "\n"	/* Content-Language (not supported) */
-		       "%s\n"	/* Content-Length - XXX empty if zero! */
-		       "%s\n"	/* Content-MD5 */
-		       "%s\n"	/* Content-Type */
-		       "%s\n"	/* Date */
-		       "\n"	/* If-Modified-Since */
-		       "\n"	/* If-Match */
-		       "\n"	/* If-None-Match */
-		       "\n"	/* If-Unmodified-Since */
-		       "%s\n"	/* Range */
-		       "%s"	/* CanonicalizedHeaders */
-		       "%s",	/* CanonicalizedResource */
-		       method_str,
-		       content_len && strcmp(content_len, "0") ? content_len : "",
-		       content_md5 ? content_md5 : "",
-		       content_type ? content_type : "",
-		       date ? date : "",
-		       range ? range : "",
-		       canon_hdrs, canon_rsc);
-	if (ret < 0) {
-		ret = -ENOMEM;
-		goto err_rsc_free;
+		dbg(0, "failed to generate canon hdrs: %s\n",
+		    strerror(-ret));
+		return ret;
 	}
 
-	ret = hmac_sha(EVP_sha256(), key, key_len,
-		       (uint8_t *)str_to_sign, strlen(str_to_sign),
-		       &md, &md_len);
+	sign_buf_init(&sb, op);
+	sign_buf_append_line(&sb, method_str);		/* VERB */
+	sign_buf_append_line(&sb, canon.content_md5);	/* Content-MD5 */
+	sign_buf_append_line(&sb, canon.content_type);	/* Content-Type */
+	sign_buf_append_line(&sb, canon.date);		/* Date */
+	canon_hdrs_emit(&canon, &sb);			/* CanonicalizedHeaders */
+	/* CanonicalizedResource */
+	ret = canon_rsc_gen_s3(bkt_name, op->url_host, op->url_path, &sb);
 	if (ret < 0) {
-		goto err_str_free;
+		dbg(0, "error generating resource string\n");
+		sign_buf_release(&sb, op);
+		return ret;
 	}
 
-	ret = base64_encode(md, md_len, &md_b64);
+	ret = sign_buf_finish(&sb, skey, op, sig_str);
 	if (ret < 0) {
-		ret = -EINVAL;
-		goto err_md_free;
+		return ret;
 	}
-	*sig_str = md_b64;
-	*sig_src = str_to_sign;
-	str_to_sign = NULL;
-
-err_md_free:
-	free(md);
-err_str_free:
-	free(str_to_sign);
-err_rsc_free:
-	free(canon_rsc);
-err_hdrs_free:
-	free(canon_hdrs);
-	free(content_len);
-	free(content_md5);
-	free(content_type);
-	free(date);
-	free(range);
-err_out:
-	return ret;
+	return 0;
 }
 
 /*
- * @slash_after_hostname points to the first forward slash after the hostname
+ * AWS Signature Version 4
+ * http://docs.aws.amazon.com/AmazonS3/latest/API/sig-v4-authenticating-requests.html
  */
-static char *
-canon_rsc_path_get(const char *slash_after_hostname)
+#define AWS4_ALG "AWS4-HMAC-SHA256"
+#define AWS4_TERM "aws4_request"
+#define AWS4_AMZ_DATE_LEN (sizeof("YYYYMMDDTHHMMSSZ") - 1)
+
+static void
+hex_encode(const uint8_t *in,
+	   size_t in_len,
+	   char *out)
 {
-	char *q;
-	char *path_part;
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
 
-	/* up-to but not including the query string. */
-	q = strchr(slash_after_hostname, '?');
-	if (q == NULL) {
-		path_part = strdup(slash_after_hostname);
-	} else {
-		path_part = strndup(slash_after_hostname,
-				    (q - slash_after_hostname));
+	for (i = 0; i < in_len; i++) {
+		out[i * 2] = hex[in[i] >> 4];
+		out[i * 2 + 1] = hex[in[i] & 0x0f];
 	}
-	return path_part;
+	out[i * 2] = '\0';
+}
+
+static void
+sha256_hex(const uint8_t *msg,
+	   size_t msg_len,
+	   char *hex)
+{
+	uint8_t md[SHA256_DIGEST_LENGTH];
+
+	SHA256(msg, msg_len, md);
+	hex_encode(md, sizeof(md), hex);
 }
 
 /*
- * @url_host points to the hostname after the protocol prefix
+ * kSigning = HMAC(HMAC(HMAC(HMAC("AWS4" + secret, date), region), service),
+ *		   "aws4_request")
+ * Only rederived if @amz_date falls on a different day to the cached key.
  */
-static char *
-canon_rsc_bucket_get(const char *bkt_name,
-		     const char *url_host)
+static int
+aws4_key_derive(struct sign_key *skey,
+		const char *amz_date)
 {
-	int buf_len;
-	char *buf;
-	char *d;
+	int ret;
+	uint8_t k[EVP_MAX_MD_SIZE];
+	unsigned int k_len;
 
-	if (bkt_name == NULL) {
-		/* assume base URL only */
-		return strdup("");
+	assert(skey->alg == SIGN_KEY_AWS4_HMAC_SHA256);
+	if (strlen(amz_date) != AWS4_AMZ_DATE_LEN) {
+		dbg(0, "invalid x-amz-date: %s\n", amz_date);
+		return -EINVAL;
 	}
 
-	/* add 2 for '/' prefix and zero-term */
-	buf_len = strlen(url_host) + 2;
-	buf = malloc(buf_len);
-	if (buf == NULL) {
-		return NULL;
+	if (memcmp(skey->v4.date, amz_date, AWS4_DATE_LEN) == 0) {
+		return 0;
 	}
-	buf[0] = '/';
 
-	/* find the first dot, up to which may be the bucket name */
-	d = strchr(url_host, '.');
-	if ((d != NULL)
-	 && (strncmp(url_host, bkt_name, d - url_host) == 0)) {
-		dbg(6, "bucket prefix in S3 host path\n");
-		/*
-		 * There is a bucket name before the aws hostname, ensure the
-		 * required '/' prefix is included in the bucket string.
-		 */
-		assert(1 + d - url_host < buf_len);
-		strncpy(buf + 1, url_host, d - url_host);
-		buf[1 + d - url_host] = '\0';
-		return buf;
-	} else {
-		const char *sep = NULL;
-		dbg(2, "non S3 host, assuming CNAME bucket alias\n");
-		/* copy up to port, path or query sep */
-		sep = strchr(url_host + 1, ':');
-		if (sep == NULL) {
-			strcpy(buf + 1, url_host);
-			return buf;
-		} else {
-			assert(1 + sep - url_host < buf_len);
-			strncpy(buf + 1, url_host, sep - url_host);
-			buf[1 + sep - url_host] = '\0';
-			return buf;
+	if (HMAC(EVP_sha256(), skey->v4.secret, skey->v4.secret_len,
+		 (const uint8_t *)amz_date, AWS4_DATE_LEN, k, &k_len) == NULL
+	 || HMAC(EVP_sha256(), k, k_len,
+		 (const uint8_t *)skey->v4.region, strlen(skey->v4.region),
+		 k, &k_len) == NULL
+	 || HMAC(EVP_sha256(), k, k_len,
+		 (const uint8_t *)skey->v4.service, strlen(skey->v4.service),
+		 k, &k_len) == NULL
+	 || HMAC(EVP_sha256(), k, k_len,
+		 (const uint8_t *)AWS4_TERM, sizeof(AWS4_TERM) - 1,
+		 k, &k_len) == NULL) {
+		dbg(0, "failed to derive signing key\n");
+		return -EINVAL;
+	}
+
+	ret = hmac_ctx_key(skey->ctx, EVP_sha256(), k, k_len);
+	if (ret < 0) {
+		return ret;
+	}
+	memcpy(skey->v4.date, amz_date, AWS4_DATE_LEN);
+	skey->v4.date[AWS4_DATE_LEN] = '\0';
+	dbg(4, "derived signing key for %s/%s/%s\n",
+	    skey->v4.date, skey->v4.region, skey->v4.service);
+
+	return 0;
+}
+
+/* sign @sts with the derived key, hex encoding the result in @sig_hex */
+static int
+aws4_sts_sign(struct sign_key *skey,
+	      const char *sts,
+	      char *sig_hex)
+{
+	int ret;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+
+	ret = hmac_sha(skey, (const uint8_t *)sts, strlen(sts), md, &md_len);
+	if (ret < 0) {
+		dbg(0, "failed to generate sha\n");
+		return ret;
+	}
+	assert(md_len * 2 == SIGN_S3_V4_SIG_LEN);
+	hex_encode(md, md_len, sig_hex);
+
+	return 0;
+}
+
+/* trim surrounding white space and collapse sequential spaces into one */
+static void
+sign_buf_append_hdr_val_trim(struct sign_buf *sb,
+			     const char *val)
+{
+	const char *s;
+	const char *end;
+
+	for (s = val; isspace(*s); s++);
+	for (end = s + strlen(s); (end > s) && isspace(end[-1]); end--);
+
+	if (!sign_buf_reserve(sb, end - s)) {
+		return;
+	}
+	for (; s < end; s++) {
+		if (isspace(*s)) {
+			while (isspace(s[1])) {
+				s++;
+			}
+			sb->s[sb->len++] = ' ';
+			continue;
 		}
+		sb->s[sb->len++] = *s;
 	}
-	dbg(0, "rsc bucket unhandled!\n");
-	return NULL;
+	sb->s[sb->len] = '\0';
 }
 
 /*
- * The list of sub-resources that must be included when constructing the
- * CanonicalizedResource Element are:
- */
-static char *s3_sub_resources[] = {"acl", "lifecycle",
-				   "location", "logging",
-				   "notification",
-				   "partNumber", "policy",
-				   "requestPayment", "torrent",
-				   "uploadId", "uploads",
-				   "versionId", "versioning",
-				   "versions", "website"};
-#define CANON_RSC_SUB_MAX ARRAY_SIZE(s3_sub_resources)
-/*
- * @sub_rsc may include trailing resources (after '&'), or values (after '=').
- * @sub_rsc_single_out: single resource string returned on success
- * @value_out: value for resource string, including '=' prefix
- *
- * @return: -ENOMEM on alloc failure
- *	    -ENOENT if sub-resource should not be considered for the signature
- *	    0 if sub-resource is valid for the signature calculation, fill _outs
+ * CanonicalHeaders and SignedHeaders. All request headers are signed, along
+ * with the Host header, which is only added to the request by the conn layer.
  */
 static int
-canon_rsc_sub_included(const char *sub_rsc,
-		       char **sub_rsc_single_out,
-		       char **value_out)
+aws4_canon_hdrs_gen(struct op *op,
+		    struct sign_buf *sb,
+		    struct sign_buf *signed_hdrs)
 {
-	int i;
-	char *eq = strchr(sub_rsc, '=');
-	char *amp = strchr(sub_rsc, '&');
-	char *sep = NULL;
-	char *sub_rsc_single;
-	char *value_str = NULL;
-
-	if (amp == NULL) {
-		/* no element afterwards, '=' is separator if present */
-		sep = eq;
-	} else {
-		/* element afterwards, '=' is separator only if before '&' */
-		if ((eq != NULL) && (eq < amp)) {
-			sep = eq;
-		} else {
-			sep = amp;
-		}
+	int ret;
+	const struct op_hdr **sorted;
+	struct op_hdr host_hdr = { .key = "host", .val = op->url_host };
+	struct op_hdr *hdr;
+	uint32_t num_hdrs = 0;
+	uint32_t i;
+	uint32_t j;
+
+	/* room for the Host header as well */
+	ret = sign_hdrs_reserve(op, 1);
+	if (ret < 0) {
+		return ret;
 	}
+	sorted = op->sig_hdrs;
 
-	if (sep == NULL) {
-		sub_rsc_single = strdup(sub_rsc);
-	} else {
-		if (sep == eq) {
-			/* save value for later */
-			if (amp == NULL) {
-				value_str = strdup(eq);
-			} else {
-				value_str = strndup(eq, amp - eq);
-			}
-			if (value_str == NULL) {
-				return -ENOMEM;
+	sorted[num_hdrs++] = &host_hdr;
+	list_for_each(&op->req.hdrs, hdr, list) {
+		if ((strcasecmp(hdr->key, "Host") == 0)
+		 || (strcasecmp(hdr->key, "Authorization") == 0)) {
+			continue;
+		}
+		assert(num_hdrs < op->sig_hdrs_size);
+		for (i = num_hdrs; i > 0; i--) {
+			if (strcasecmp(sorted[i - 1]->key, hdr->key) <= 0) {
+				break;
 			}
+			sorted[i] = sorted[i - 1];
 		}
-		sub_rsc_single = strndup(sub_rsc, sep - sub_rsc);
-	}
-	if (sub_rsc_single == NULL) {
-		free(value_str);
-		return -ENOMEM;
+		sorted[i] = hdr;
+		num_hdrs++;
 	}
 
-	for (i = 0; i < CANON_RSC_SUB_MAX; i++) {
-		if (strcmp(sub_rsc_single, s3_sub_resources[i]) == 0) {
-			dbg(4, "sub rsc \"%s\" valid for signature\n", sub_rsc_single);
-			*sub_rsc_single_out = sub_rsc_single;
-			*value_out = value_str;
-			return 0;
+	for (i = 0; i < num_hdrs; i = j) {
+		size_t key_len = strlen(sorted[i]->key);
+
+		sign_buf_append_lower(sb, sorted[i]->key, key_len);
+		sign_buf_append_c(sb, ':');
+		if (i > 0) {
+			sign_buf_append_c(signed_hdrs, ';');
+		}
+		sign_buf_append_lower(signed_hdrs, sorted[i]->key, key_len);
+
+		/* duplicate headers are combined into a comma separated list */
+		j = i;
+		while ((j < num_hdrs)
+		    && (strcasecmp(sorted[i]->key, sorted[j]->key) == 0)) {
+			if (j > i) {
+				sign_buf_append_c(sb, ',');
+			}
+			sign_buf_append_hdr_val_trim(sb, sorted[j]->val);
+			j++;
 		}
+		sign_buf_append_c(sb, '\n');
 	}
-	dbg(4, "sub rsc \"%s\" ignored for signature\n", sub_rsc_single);
-	free(sub_rsc_single);
-	free(value_str);
-	return -ENOENT;
+
+	return 0;
 }
 
 /*
- * @question_after_path points to the question mark after the hostname and path
+ * CanonicalQueryString: parameters sorted by name, then value. Names and
+ * values are expected to already be URI encoded by the request generator.
  */
-static char *
-canon_rsc_sub_get(const char *question_after_path)
+static int
+aws4_canon_query_gen(const char *query_params,
+		     struct sign_buf *sb)
 {
-	const char *a;
-	char *s;
+	struct canon_qp qps[CANON_QPS_MAX];
+	int count;
 	int i;
-	int j;
-	int total_bytes;
-	char *sub_rsc[CANON_RSC_SUB_MAX];
-	char *sub_rsc_sorted;
 	int ret;
 
-	total_bytes = 0;
-	i = 0;
-	a = question_after_path;
-	while (*(++a) != '\0') {
-		char *sub_rsc_key = NULL;
-		char *sub_rsc_value = NULL;
-
-		ret = canon_rsc_sub_included(a, &sub_rsc_key, &sub_rsc_value);
-		if (ret == -ENOMEM) {
-			goto err_cleanup;
-		} else if (ret == 0) {
-			ret = asprintf(&sub_rsc[i], "%s%s", sub_rsc_key,
-				       (sub_rsc_value ? sub_rsc_value : ""));
-			free(sub_rsc_key);
-			free(sub_rsc_value);
-			if (ret < 0) {
-				goto err_cleanup;
-			}
-			total_bytes += ret;
-			i++;
-		}
-		a = strchr(a, '&');
-		if (a == NULL)
-			break;
-	}
-
-	if (i == 0) {
-		return strdup("");
+	ret = canon_qps_split(query_params, true, qps, &count);
+	if (ret < 0) {
+		return ret;
 	}
 
-	/* +i for '&' separators, +2 for '?' prefix and nullterm */
-	sub_rsc_sorted = malloc(total_bytes + i + 2);
-	if (sub_rsc_sorted == NULL) {
-		goto err_cleanup;
-	}
+	qsort(qps, count, sizeof(struct canon_qp), qp_raw_cmp);
 
-	/* sub-resources must be lexicographically sorted by name... */
-	qsort(sub_rsc, i, sizeof(char *), str_cmp_lexi);
-	s = sub_rsc_sorted;
-	for (j = 0; j < i; j++) {
-		size_t len = strlen(sub_rsc[j]);
-		if (j == 0) {
-			*s = '?';
-			s++;
-		} else {
-			/* ...and separated by '&'. e.g. ?acl&versionId=value */
-			*s = '&';
-			s++;
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			sign_buf_append_c(sb, '&');
 		}
-		strncpy(s, sub_rsc[j], len);
-		free(sub_rsc[j]);
-		s += len;
+		sign_buf_append(sb, qps[i].key, qps[i].key_len);
+		sign_buf_append_c(sb, '=');
+		sign_buf_append(sb, qps[i].val, qps[i].val_len);
 	}
-	*s = '\0';
 
-	return sub_rsc_sorted;
+	return 0;
+}
+
+static const char *
+aws4_hdr_val(struct list_head *hdrs,
+	     const char *key)
+{
+	struct op_hdr *hdr;
 
-err_cleanup:
-	for (j = 0; j < i; j++) {
-		free(sub_rsc[j]);
+	list_for_each(hdrs, hdr, list) {
+		if (strcasecmp(hdr->key, key) == 0) {
+			return hdr->val;
+		}
 	}
 	return NULL;
 }
 
-static char *
-canon_rsc_gen_s3(const char *bkt_name,
-		 const char *url_host,
-		 const char *url_path)
+int
+sign_gen_s3_v4(const char *key_id,
+	       struct sign_key *skey,
+	       struct op *op,
+	       char **_auth_hdr,
+	       char *_sig_hex)
 {
 	int ret;
-	char *s;
-	char *bucket = NULL;
-	char *path_part = NULL;
-	char *sub_rsc_part = NULL;
-	char *rsc_str = NULL;
-
-	bucket = canon_rsc_bucket_get(bkt_name, url_host);
-	if (bucket == NULL) {
-		dbg(0, "error generating resource bucket string");
-		goto err_out;
+	struct sign_buf sb;
+	struct sign_buf signed_hdrs = { NULL, 0, 0, 0 };
+	const char *method_str;
+	const char *amz_date;
+	const char *payload_hash;
+	const char *path;
+	const char *q;
+	char creq_hash[SHA256_DIGEST_LENGTH * 2 + 1];
+	char sig_hex[SIGN_S3_V4_SIG_LEN + 1];
+	char *sts;
+	char *auth_hdr;
+
+	assert(skey->alg == SIGN_KEY_AWS4_HMAC_SHA256);
+
+	method_str = op_method_str(op->method);
+	if (method_str == NULL) {
+		return -EINVAL;
 	}
 
-	dbg(4, "got resource bucket: \"%s\"\n", bucket);
+	amz_date = aws4_hdr_val(&op->req.hdrs, "x-amz-date");
+	payload_hash = aws4_hdr_val(&op->req.hdrs, "x-amz-content-sha256");
+	if ((amz_date == NULL) || (payload_hash == NULL)) {
+		dbg(0, "x-amz-date and x-amz-content-sha256 required\n");
+		return -EINVAL;
+	}
 
-	/* find the first forward slash after the protocol */
-	s = strchrnul(url_path, '/');
-	if (s != NULL) {
-		path_part = canon_rsc_path_get(s);
-		if (path_part == NULL) {
-			dbg(0, "error generating resource path string\n");
-			goto err_bucket_free;
-		}
-		dbg(4, "got resource path: \"%s\"\n", path_part);
+	ret = aws4_key_derive(skey, amz_date);
+	if (ret < 0) {
+		return ret;
 	}
 
-	/* find the sub-resource */
-	s = strchr(url_path, '?');
-	if (s != NULL) {
-		sub_rsc_part = canon_rsc_sub_get(s);
-		if (sub_rsc_part == NULL) {
-			dbg(0, "error generating sub resource path string\n");
-			goto err_path_free;
+	path = strchrnul(op->url_path, '/');
+	q = strchrnul(path, '?');
+
+	/* CanonicalRequest */
+	sign_buf_init(&sb, op);
+	sign_buf_append_line(&sb, method_str);		/* HTTPMethod */
+	if (q == path) {				/* CanonicalURI */
+		sign_buf_append_c(&sb, '/');
+	} else {
+		sign_buf_append(&sb, path, q - path);
+	}
+	sign_buf_append_c(&sb, '\n');
+	if (*q == '?') {				/* CanonicalQueryString */
+		ret = aws4_canon_query_gen(q + 1, &sb);
+		if (ret < 0) {
+			goto err_sb_release;
 		}
-		dbg(4, "got sub-resource string: \"%s\"\n", sub_rsc_part);
 	}
+	sign_buf_append_c(&sb, '\n');
+	/* CanonicalHeaders */
+	ret = aws4_canon_hdrs_gen(op, &sb, &signed_hdrs);
+	if (ret < 0) {
+		goto err_sb_release;
+	}
+	sign_buf_append_c(&sb, '\n');
+	sign_buf_append_line(&sb, signed_hdrs.s);	/* SignedHeaders */
+	sign_buf_append_str(&sb, payload_hash);		/* HashedPayload */
 
-	/* TODO handle query string parameters! */
+	sign_buf_release(&sb, op);
+	if ((sb.err != 0) || (signed_hdrs.err != 0)) {
+		ret = -ENOMEM;
+		goto err_signed_hdrs_free;
+	}
+	dbg(4, "canonical request is: \"%s\"\n", sb.s);
+	sha256_hex((const uint8_t *)sb.s, sb.len, creq_hash);
 
-	ret = asprintf(&rsc_str, "%s%s%s", bucket,
-		       (path_part ? path_part : "/"),
-		       (sub_rsc_part ? sub_rsc_part : ""));
+	ret = asprintf(&sts, AWS4_ALG "\n%s\n%s/%s/%s/" AWS4_TERM "\n%s",
+		       amz_date, skey->v4.date, skey->v4.region,
+		       skey->v4.service, creq_hash);
 	if (ret < 0) {
-		rsc_str = NULL;
-		goto err_sub_rsc_free;
+		ret = -ENOMEM;
+		goto err_signed_hdrs_free;
 	}
-	dbg(3, "final signing resource string: \"%s\"\n", rsc_str);
+	dbg(4, "str to sign is: \"%s\"\n", sts);
 
-err_sub_rsc_free:
-	free(sub_rsc_part);
-err_path_free:
-	free(path_part);
-err_bucket_free:
-	free(bucket);
-err_out:
-	return rsc_str;
+	ret = aws4_sts_sign(skey, sts, sig_hex);
+	free(sts);
+	if (ret < 0) {
+		goto err_signed_hdrs_free;
+	}
+
+	ret = asprintf(&auth_hdr, AWS4_ALG " Credential=%s/%s/%s/%s/"
+		       AWS4_TERM ", SignedHeaders=%s, Signature=%s",
+		       key_id, skey->v4.date, skey->v4.region,
+		       skey->v4.service, signed_hdrs.s, sig_hex);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		goto err_signed_hdrs_free;
+	}
+
+	if (_sig_hex != NULL) {
+		memcpy(_sig_hex, sig_hex, sizeof(sig_hex));
+	}
+	*_auth_hdr = auth_hdr;
+	free(signed_hdrs.s);
+	return 0;
+
+err_sb_release:
+	sign_buf_release(&sb, op);
+err_signed_hdrs_free:
+	free(signed_hdrs.s);
+	return ret;
 }
 
-int
-sign_gen_s3(const char *bkt_name,
-	    const uint8_t *secret,
-	    int secret_len,
-	    struct op *op,
-	    char **sig_src,
-	    char **sig_str)
+/* chunks may be split across caller segments, so hash without a copy */
+static int
+sha256_iov_hex(const struct iovec *iov,
+	       int iovcnt,
+	       char *hex)
 {
+	EVP_MD_CTX *md_ctx;
+	uint8_t md[SHA256_DIGEST_LENGTH];
+	int i;
 	int ret;
-	char *canon_hdrs = NULL;
-	char *content_type = NULL;
-	char *content_md5 = NULL;
-	char *date = NULL;
-	char *canon_rsc;
-	char *str_to_sign = NULL;
-	size_t str_to_sign_len;
-	uint8_t *md;
-	int md_len;
-	char *md_b64;
-	const char *method_str;
 
-	method_str = op_method_str(op->method);
-	if (method_str == NULL) {
-		ret = -EINVAL;
-		goto err_out;
+	md_ctx = EVP_MD_CTX_new();
+	if (md_ctx == NULL) {
+		return -ENOMEM;
 	}
-
-	canon_rsc = canon_rsc_gen_s3(bkt_name, op->url_host, op->url_path);
-	if (canon_rsc == NULL) {
-		ret = -ENOMEM;
-		goto err_out;
+	ret = EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL);
+	for (i = 0; (ret == 1) && (i < iovcnt); i++) {
+		ret = EVP_DigestUpdate(md_ctx, iov[i].iov_base,
+				       iov[i].iov_len);
+	}
+	if (ret == 1) {
+		ret = EVP_DigestFinal_ex(md_ctx, md, NULL);
 	}
+	EVP_MD_CTX_free(md_ctx);
+	if (ret != 1) {
+		return -EIO;
+	}
+	hex_encode(md, sizeof(md), hex);
+
+	return 0;
+}
 
-	ret = canon_hdrs_gen(op->req.num_hdrs, &op->req.hdrs,
-			     HDR_PREFIX_S3, true,
-			     &canon_hdrs, &content_type, &content_md5, NULL,
-			     &date, NULL);
+int
+sign_gen_s3_v4_chunk(struct sign_key *skey,
+		     const char *amz_date,
+		     const char *prev_sig,
+		     const struct iovec *iov,
+		     int iovcnt,
+		     char *sig_hex)
+{
+	int ret;
+	char chunk_hash[SHA256_DIGEST_LENGTH * 2 + 1];
+	char sts[512];
+
+	ret = aws4_key_derive(skey, amz_date);
 	if (ret < 0) {
-		dbg(0, "failed to generate canon hdrs: %s\n",
-		    strerror(-ret));
-		goto err_rsc_free;
-	}
-
-	ret = asprintf(&str_to_sign,
-		       "%s\n"	/* VERB */
-		       "%s\n"	/* Content-MD5 */
-		       "%s\n"	/* Content-Type */
-		       "%s\n"	/* Date */
-		       "%s"	/* CanonicalizedHeaders */
-		       "%s",	/* CanonicalizedResource */
-		       method_str,
-		       content_md5 ? content_md5 : "",
-		       content_type ? content_type : "",
-		       date ? date : "",
-		       canon_hdrs, canon_rsc);
+		return ret;
+	}
+
+	ret = sha256_iov_hex(iov, iovcnt, chunk_hash);
 	if (ret < 0) {
-		ret = -ENOMEM;
-		goto err_hdrs_free;
+		return ret;
+	}
+	ret = snprintf(sts, sizeof(sts),
+		       AWS4_ALG "-PAYLOAD\n%s\n%s/%s/%s/" AWS4_TERM "\n%s\n%s\n%s",
+		       amz_date, skey->v4.date, skey->v4.region,
+		       skey->v4.service, prev_sig, SIGN_S3_V4_EMPTY_PAYLOAD,
+		       chunk_hash);
+	if ((ret < 0) || (ret >= sizeof(sts))) {
+		return -E2BIG;
 	}
-	dbg(4, "str to sign is: \"%s\"\n", str_to_sign);
 
-	str_to_sign_len = ret;
-	assert(ret == strlen(str_to_sign));
+	return aws4_sts_sign(skey, sts, sig_hex);
+}
 
-	ret = hmac_sha(EVP_sha1(), secret, secret_len,
-		       (uint8_t *)str_to_sign, str_to_sign_len,
-		       &md, &md_len);
-	if (ret < 0) {
-		dbg(0, "failed to generate sha\n");
-		goto err_str_free;
+#define AWS4_CHUNK_SIG_HDR ";chunk-signature="
+
+/* length of a single chunk, including its header and trailing CRLF */
+static uint64_t
+aws4_chunk_len(uint64_t data_len)
+{
+	int hex_digits = 1;
+	uint64_t l;
+
+	for (l = data_len; l >= 16; l /= 16) {
+		hex_digits++;
 	}
+	return hex_digits + sizeof(AWS4_CHUNK_SIG_HDR) - 1
+		+ SIGN_S3_V4_SIG_LEN + 2 + data_len + 2;
+}
 
-	ret = base64_encode(md, md_len, &md_b64);
-	if (ret < 0) {
-		dbg(0, "failed to encode digenst\n");
-		ret = -EINVAL;
-		goto err_md_free;
+int
+sign_s3_v4_chunk_hdr(uint64_t chunk_len,
+		     const char *sig_hex,
+		     char *hdr,
+		     size_t hdr_size)
+{
+	int ret;
+
+	ret = snprintf(hdr, hdr_size, "%" PRIx64 AWS4_CHUNK_SIG_HDR "%s\r\n",
+		       chunk_len, sig_hex);
+	if ((ret < 0) || (ret >= hdr_size)) {
+		return -E2BIG;
 	}
-	*sig_str = md_b64;
-	*sig_src = str_to_sign;
-	str_to_sign = NULL;
-	ret = 0;
-
-err_md_free:
-	free(md);
-err_str_free:
-	free(str_to_sign);
-err_hdrs_free:
-	free(canon_hdrs);
-	free(content_type);
-	free(content_md5);
-	free(date);
-err_rsc_free:
-	free(canon_rsc);
-err_out:
+
 	return ret;
 }
 
+uint64_t
+sign_s3_v4_chunked_len(uint64_t data_len,
+		       uint64_t chunk_size)
+{
+	uint64_t full_chunks = data_len / chunk_size;
+	uint64_t rem = data_len % chunk_size;
+	uint64_t len;
+
+	len = full_chunks * aws4_chunk_len(chunk_size);
+	if (rem > 0) {
+		len += aws4_chunk_len(rem);
+	}
+	/* terminating zero length chunk */
+	return len + aws4_chunk_len(0);
+}
+
+/* OpenSSL 3.0 uses providers, and deprecates the ENGINE API */
 void
 sign_init(void)
 {
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
 	ENGINE_load_builtin_engines();
 	ENGINE_register_all_complete();
+#endif
 }
 
 void
 sign_deinit(void)
 {
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
 	ENGINE_cleanup();
+#endif
 }
@@ -14,30 +14,111 @@
 #ifndef _SIGN_H_
 #define _SIGN_H_
 
+enum sign_key_alg {
+	SIGN_KEY_HMAC_SHA1 = 1,	/* S3 SigV2 */
+	SIGN_KEY_HMAC_SHA256,	/* Azure */
+	SIGN_KEY_AWS4_HMAC_SHA256,	/* S3 SigV4 */
+};
+
+struct sign_key;
+struct iovec;
+
+/* precompute keyed HMAC state, for reuse across requests */
+int
+sign_key_init(enum sign_key_alg alg,
+	      const uint8_t *key,
+	      int key_len,
+	      struct sign_key **_skey);
+
+/*
+ * SigV4 key for @region and @service (e.g. "s3"). The derived signing key is
+ * cached, and only recalculated when the request date changes.
+ */
+int
+sign_key_init_s3_v4(const uint8_t *secret,
+		    int secret_len,
+		    const char *region,
+		    const char *service,
+		    struct sign_key **_skey);
+
+enum sign_key_alg
+sign_key_alg_get(const struct sign_key *skey);
+
+void
+sign_key_free(struct sign_key *skey);
+
+/*
+ * The string-to-sign is generated in op->sig_src, reusing any existing buffer
+ * from a previous signing of @op. @sig_str is allocated on success.
+ */
 int
 sign_gen_lite_azure(const char *account,
-		    const uint8_t *key,
-		    int key_len,
+		    struct sign_key *skey,
 		    struct op *op,
-		    char **sig_src,
 		    char **sig_str);
 
 int
 sign_gen_shared_azure(const char *account,
-		      const uint8_t *key,
-		      int key_len,
+		      struct sign_key *skey,
 		      struct op *op,
-		      char **sig_src,
 		      char **sig_str);
 
 int
 sign_gen_s3(const char *bkt_name,
-	    const uint8_t *secret,
-	    int secret_len,
+	    struct sign_key *skey,
 	    struct op *op,
-	    char **sig_src,
 	    char **sig_str);
 
+/* hex encoded HMAC-SHA256 signature length */
+#define SIGN_S3_V4_SIG_LEN 64
+#define SIGN_S3_V4_UNSIGNED_PAYLOAD "UNSIGNED-PAYLOAD"
+#define SIGN_S3_V4_STREAMING_PAYLOAD "STREAMING-AWS4-HMAC-SHA256-PAYLOAD"
+/* SHA256 of an empty payload */
+#define SIGN_S3_V4_EMPTY_PAYLOAD \
+	"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/*
+ * Sign @op using AWS Signature Version 4. x-amz-date and x-amz-content-sha256
+ * request headers must already be present. The canonical request is generated
+ * in op->sig_src. On success @_auth_hdr is an allocated Authorization header
+ * value, and the hex signature is also copied to @sig_hex if non-NULL, for use
+ * as the seed of a streaming upload.
+ */
+int
+sign_gen_s3_v4(const char *key_id,
+	       struct sign_key *skey,
+	       struct op *op,
+	       char **_auth_hdr,
+	       char *sig_hex);
+
+/*
+ * Sign an aws-chunked payload chunk spanning @iov, chained from @prev_sig
+ * (the seed signature for the first chunk). @sig_hex and @prev_sig may be
+ * the same.
+ */
+int
+sign_gen_s3_v4_chunk(struct sign_key *skey,
+		     const char *amz_date,
+		     const char *prev_sig,
+		     const struct iovec *iov,
+		     int iovcnt,
+		     char *sig_hex);
+
+/*
+ * Write the header for a @chunk_len byte chunk signed with @sig_hex.
+ * @return: header length excluding nul, or -errno.
+ */
+int
+sign_s3_v4_chunk_hdr(uint64_t chunk_len,
+		     const char *sig_hex,
+		     char *hdr,
+		     size_t hdr_size);
+
+/* encoded length of @data_len bytes sent in @chunk_size aws-chunked chunks */
+uint64_t
+sign_s3_v4_chunked_len(uint64_t data_len,
+		       uint64_t chunk_size);
+
 void
 sign_init(void);
 
@@ -14,6 +14,7 @@
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
 #define BYTES_IN_KB (uint64_t)1024
 #define BYTES_IN_MB (uint64_t)(BYTES_IN_KB * 1024)
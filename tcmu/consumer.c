@@ -87,56 +87,48 @@ struct elasto_state {
   _a < _b ? _a : _b; \
 })
 
+/*
+ * Map the first @len bytes of @iovec into a new iovec array, trimming the
+ * final segment if needed. The caller's iovecs are left untouched.
+ */
 static int
-tcmu_elasto_fwritev_misaligned(struct elasto_state *estate,
-			       struct iovec *iovec,
-			       size_t iov_cnt,
-			       uint64_t off,
-			       uint64_t len)
+tcmu_elasto_iov_trim(struct iovec *iovec,
+		     size_t iov_cnt,
+		     uint64_t len,
+		     struct iovec **_iov,
+		     int *_iov_cnt)
 {
-	uint8_t *tmp_buf;
-	size_t copied = 0;
-	int ret;
+	struct iovec *iov;
+	int n = 0;
 
-	tmp_buf = malloc(len);
-	if (tmp_buf == NULL) {
-		return -ENOMEM;
+	if ((iov_cnt == 0) || (iov_cnt > INT_MAX)) {
+		return -EINVAL;
 	}
 
-#if 0
-	/* XXX similar to tcmu_memcpy_from_iovec, but doesn't change iovecs */
-	while (len && iov_cnt) {
-		size_t to_copy = min(iovec->iov_len, len);
-
-		if (to_copy) {
-			memcpy(iovec->iov_base, src + copied, to_copy);
+	iov = malloc(sizeof(*iov) * iov_cnt);
+	if (iov == NULL) {
+		return -ENOMEM;
+	}
 
-			len -= to_copy;
-			copied += to_copy;
-			iovec->iov_base += to_copy;
-			iovec->iov_len -= to_copy;
-		}
+	while ((len != 0) && (iov_cnt != 0)) {
+		uint64_t to_copy = min(len, (uint64_t)iovec->iov_len);
 
+		iov[n].iov_base = iovec->iov_base;
+		iov[n].iov_len = to_copy;
+		n++;
+		len -= to_copy;
 		iovec++;
 		iov_cnt--;
 	}
-#endif
 
-	/* XXX this removes the copied length from the iovec[s] */
-	copied = tcmu_memcpy_from_iovec(tmp_buf, len, iovec, iov_cnt);
-	if (copied != len) {
-		errp("failed to copy %lu bytes from iovec\n", len);
-		free(tmp_buf);
-		return -EBADF;
-	}
-
-	ret = elasto_fwrite(estate->efh, off, len, tmp_buf);
-	free(tmp_buf);
-	if (ret < 0) {
-		errp("Could not write: %s\n", strerror(-ret));
-		return ret;
+	if (len != 0) {
+		errp("iovec too short for IO, %lu bytes remaining\n", len);
+		free(iov);
+		return -EINVAL;
 	}
 
+	*_iov = iov;
+	*_iov_cnt = n;
 	return 0;
 }
 
@@ -147,66 +139,22 @@ tcmu_elasto_fwritev(struct elasto_state *estate,
 		    uint64_t off,
 		    uint64_t len)
 {
+	struct iovec *iov;
+	int n;
 	int ret;
-	uint64_t remaining = len;
-
-	while (remaining != 0) {
-		uint64_t to_copy;
-
-		to_copy = min(remaining, iovec->iov_len);
-		if (to_copy % estate->block_size) {
-			assert((remaining % estate->block_size) == 0);
-			errp("write iovec not block aligned (%lu) falling back "
-			     "to memcpy of %lu\n", iovec->iov_len, remaining);
-			return tcmu_elasto_fwritev_misaligned(estate, iovec,
-						iov_cnt, off, remaining);
-		}
-
-		ret = elasto_fwrite(estate->efh, off, to_copy, iovec->iov_base);
-		if (ret < 0) {
-			errp("Could not write: %s\n", strerror(-ret));
-			return ret;
-		}
-
-		remaining -= to_copy;
-		off += to_copy;
-		iovec++;
-		iov_cnt--;
-		assert(iov_cnt >= 0);
-	}
-
-	return 0;
-}
-
-static int
-tcmu_elasto_freadv_misaligned(struct elasto_state *estate,
-			      struct iovec *iovec,
-			      size_t iov_cnt,
-			      uint64_t off,
-			      uint64_t len)
-{
-	uint8_t *tmp_buf;
-	size_t copied;
-	int ret;
-
-	tmp_buf = malloc(len);
-	if (tmp_buf == NULL) {
-		return -ENOMEM;
-	}
 
-	ret = elasto_fread(estate->efh, off, len, tmp_buf);
+	ret = tcmu_elasto_iov_trim(iovec, iov_cnt, len, &iov, &n);
 	if (ret < 0) {
-		free(tmp_buf);
-		errp("Could not read: %s\n", strerror(-ret));
 		return ret;
 	}
 
-	/* XXX this removes the copied length from the iovec[s] */
-	copied = tcmu_memcpy_into_iovec(iovec, iov_cnt, tmp_buf, len);
-	free(tmp_buf);
-	if (copied != len) {
-		errp("failed to copy %lu bytes into iovec\n", len);
-		return -EBADF;
+	/* one backend request for the whole (possibly scattered) range */
+	ret = elasto_fwritev(estate->efh, off, iov, n);
+	free(iov);
+	if (ret < 0) {
+		errp("write(off=%lu,len=%lu) failed: %s\n",
+		     off, len, strerror(-ret));
+		return ret;
 	}
 
 	return 0;
@@ -219,32 +167,21 @@ tcmu_elasto_freadv(struct elasto_state *estate,
 		   uint64_t off,
 		   uint64_t len)
 {
+	struct iovec *iov;
+	int n;
 	int ret;
-	uint64_t remaining = len;
-
-	while (remaining != 0) {
-		uint64_t to_copy;
-
-		to_copy = min(remaining, iovec->iov_len);
-		if (to_copy % estate->block_size) {
-			assert((remaining % estate->block_size) == 0);
-			errp("read iovec not block aligned (%lu) falling back "
-			     "to memcpy of %lu\n", iovec->iov_len, remaining);
-			return tcmu_elasto_freadv_misaligned(estate, iovec,
-						iov_cnt, off, remaining);
-		}
 
-		ret = elasto_fread(estate->efh, off, to_copy, iovec->iov_base);
-		if (ret < 0) {
-			errp("read(off=%lu,len=%lu) failed: %s\n", off, to_copy, strerror(-ret));
-			return ret;
-		}
+	ret = tcmu_elasto_iov_trim(iovec, iov_cnt, len, &iov, &n);
+	if (ret < 0) {
+		return ret;
+	}
 
-		remaining -= to_copy;
-		off += to_copy;
-		iovec++;
-		iov_cnt--;
-		assert(iov_cnt >= 0);
+	ret = elasto_freadv(estate->efh, off, iov, n);
+	free(iov);
+	if (ret < 0) {
+		errp("read(off=%lu,len=%lu) failed: %s\n",
+		     off, len, strerror(-ret));
+		return ret;
 	}
 
 	return 0;
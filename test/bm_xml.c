@@ -0,0 +1,587 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+
+/*
+ * XML response processing benchmark. Synthetic list responses of increasing
+ * size are fed through the same request/response handlers used for real
+ * traffic, with throughput, allocations and peak RSS reported per handler.
+ * Each measurement runs in a forked child, so that peak RSS isn't skewed by
+ * previous runs.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ccan/list/list.h"
+#include "lib/dbg.h"
+#include "lib/util.h"
+#include "lib/exml.h"
+#include "lib/op.h"
+#include "lib/data.h"
+#include "lib/azure_req.h"
+#include "lib/azure_blob_path.h"
+#include "lib/azure_blob_req.h"
+#include "lib/azure_fs_path.h"
+#include "lib/azure_fs_req.h"
+#include "lib/azure_mgmt_req.h"
+#include "lib/s3_path.h"
+#include "lib/s3_req.h"
+
+/*
+ * Count heap allocations made by the handlers. glibc allows the malloc family
+ * to be interposed by the executable.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t bm_allocs;
+static uint64_t bm_alloc_bytes;
+
+void *
+malloc(size_t size)
+{
+	bm_allocs++;
+	bm_alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	bm_allocs++;
+	bm_alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	bm_allocs++;
+	bm_alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+/* roughly how much XML each measurement should process */
+#define BM_XML_TARGET_BYTES (64 * 1024 * 1024)
+#define BM_XML_MAX_ITERS 10000
+/* conn layer feeds streamed responses in evbuffer sized chunks */
+#define BM_XML_CHUNK_SIZE (16 * 1024)
+
+struct bm_xml_case {
+	const char *handler;
+	void (*gen)(FILE *f, int num_ents);
+	int (*op_new)(struct op **_op);
+	/* returns the number of entries processed */
+	int (*rsp_check)(struct op *op);
+	bool streamed;
+};
+
+static void
+bm_xml_gen_blob_list(FILE *f,
+		     int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		"<EnumerationResults ServiceEndpoint="
+		"\"https://bmacc.blob.core.windows.net/\" ContainerName=\"bm\">"
+		"<Blobs>");
+	for (i = 0; i < num_ents; i++) {
+		fprintf(f, "<Blob><Name>vm-images/disk%08d.vhd</Name>"
+			"<Properties>"
+			"<Last-Modified>Wed, 12 Aug 2009 20:39:39 GMT"
+			"</Last-Modified>"
+			"<Etag>0x8CB171BA9E94B0B</Etag>"
+			"<Content-Length>%" PRIu64 "</Content-Length>"
+			"<Content-Type>application/octet-stream</Content-Type>"
+			"<Content-Encoding /><Content-Language />"
+			"<Content-MD5>sQqNsWTgdUEFt6mb5y4/5Q==</Content-MD5>"
+			"<Cache-Control />"
+			"<BlobType>%s</BlobType>"
+			"<LeaseStatus>%s</LeaseStatus>"
+			"<LeaseState>available</LeaseState>"
+			"</Properties><Metadata /></Blob>",
+			i, (uint64_t)i * 512,
+			(i % 2 ? "PageBlob" : "BlockBlob"),
+			(i % 5 ? "unlocked" : "locked"));
+	}
+	fprintf(f, "</Blobs><NextMarker /></EnumerationResults>");
+}
+
+static int
+bm_xml_op_new_blob_list(struct op **_op)
+{
+	struct az_blob_path path = {
+		.type = AZ_BLOB_PATH_CTNR,
+		.acc = "bmacc",
+		.ctnr = "bm",
+	};
+
+	return az_req_blob_list(&path, _op);
+}
+
+static int
+bm_xml_rsp_check_blob_list(struct op *op)
+{
+	return az_rsp_blob_list(op)->num_blobs;
+}
+
+static void
+bm_xml_gen_ctnr_list(FILE *f,
+		     int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		"<EnumerationResults ServiceEndpoint="
+		"\"https://bmacc.blob.core.windows.net/\">"
+		"<Containers>");
+	for (i = 0; i < num_ents; i++) {
+		fprintf(f, "<Container><Name>container%08d</Name>"
+			"<Properties>"
+			"<Last-Modified>Wed, 12 Aug 2009 20:39:39 GMT"
+			"</Last-Modified>"
+			"<Etag>0x8CB171BA9E94B0B</Etag>"
+			"<LeaseStatus>%s</LeaseStatus>"
+			"<LeaseState>available</LeaseState>"
+			"</Properties><Metadata /></Container>",
+			i, (i % 5 ? "unlocked" : "locked"));
+	}
+	fprintf(f, "</Containers><NextMarker /></EnumerationResults>");
+}
+
+static int
+bm_xml_op_new_ctnr_list(struct op **_op)
+{
+	struct az_blob_path path = {
+		.type = AZ_BLOB_PATH_ACC,
+		.acc = "bmacc",
+	};
+
+	return az_req_ctnr_list(&path, _op);
+}
+
+static int
+bm_xml_rsp_check_ctnr_list(struct op *op)
+{
+	return az_rsp_ctnr_list(op)->num_ctnrs;
+}
+
+static void
+bm_xml_gen_dirs_files_list(FILE *f,
+			   int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		"<EnumerationResults ServiceEndpoint="
+		"\"https://bmacc.file.core.windows.net/\" ShareName=\"bm\""
+		" DirectoryPath=\"\">"
+		"<Entries>");
+	for (i = 0; i < num_ents; i++) {
+		if (i % 10 == 0) {
+			fprintf(f, "<Directory><Name>dir%08d</Name>"
+				"<Properties /></Directory>", i);
+			continue;
+		}
+		fprintf(f, "<File><Name>file%08d.dat</Name>"
+			"<Properties><Content-Length>%" PRIu64
+			"</Content-Length></Properties></File>",
+			i, (uint64_t)i * 4096);
+	}
+	fprintf(f, "</Entries><NextMarker /></EnumerationResults>");
+}
+
+static int
+bm_xml_op_new_dirs_files_list(struct op **_op)
+{
+	struct az_fs_path path = {
+		.type = AZ_FS_PATH_SHARE,
+		.acc = "bmacc",
+		.share = "bm",
+	};
+
+	return az_fs_req_dirs_files_list(&path, _op);
+}
+
+static int
+bm_xml_rsp_check_dirs_files_list(struct op *op)
+{
+	return az_fs_rsp_dirs_files_list(op)->num_ents;
+}
+
+static void
+bm_xml_gen_bkt_list(FILE *f,
+		    int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+		"<ListBucketResult"
+		" xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+		"<Name>bm</Name><Prefix></Prefix><Marker></Marker>"
+		"<MaxKeys>1000</MaxKeys><IsTruncated>false</IsTruncated>");
+	for (i = 0; i < num_ents; i++) {
+		fprintf(f, "<Contents><Key>logs/2016/01/obj%08d.gz</Key>"
+			"<LastModified>2009-10-12T17:50:30.000Z</LastModified>"
+			"<ETag>&quot;fba9dede5f27731c9771645a39863328&quot;"
+			"</ETag>"
+			"<Size>%" PRIu64 "</Size>"
+			"<Owner><ID>75aa57f09aa0c8caeab4f8c24e99d10f8e7faeeb"
+			"f76c078efc7c6caea54ba06a</ID>"
+			"<DisplayName>mtd@amazon.com</DisplayName></Owner>"
+			"<StorageClass>STANDARD</StorageClass></Contents>",
+			i, (uint64_t)i * 1000);
+	}
+	fprintf(f, "</ListBucketResult>");
+}
+
+static int
+bm_xml_op_new_bkt_list(struct op **_op)
+{
+	struct s3_path path = {
+		.type = S3_PATH_BKT,
+		.host = "s3.amazonaws.com",
+		.bkt = "bm",
+	};
+
+	return s3_req_bkt_list(&path, _op);
+}
+
+static int
+bm_xml_rsp_check_bkt_list(struct op *op)
+{
+	return s3_rsp_bkt_list(op)->num_objs;
+}
+
+static void
+bm_xml_gen_page_ranges(FILE *f,
+		       int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?><PageList>");
+	for (i = 0; i < num_ents; i++) {
+		fprintf(f, "<PageRange><Start>%" PRIu64 "</Start>"
+			"<End>%" PRIu64 "</End></PageRange>",
+			(uint64_t)i * 1024 * 1024,
+			(uint64_t)i * 1024 * 1024 + 511);
+	}
+	fprintf(f, "</PageList>");
+}
+
+static int
+bm_xml_op_new_page_ranges(struct op **_op)
+{
+	int ret;
+	struct az_blob_path path = {
+		.type = AZ_BLOB_PATH_BLOB,
+		.acc = "bmacc",
+		.ctnr = "bm",
+		.blob = "disk.vhd",
+	};
+
+	ret = az_req_page_ranges_get(&path, 0, BYTES_IN_TB, _op);
+	if (ret < 0) {
+		return ret;
+	}
+	return op_rsp_hdr_add(*_op, "x-ms-blob-content-length",
+			      "1099511627776");
+}
+
+static int
+bm_xml_rsp_check_page_ranges(struct op *op)
+{
+	return az_rsp_page_ranges_get(op)->num_ranges;
+}
+
+static void
+bm_xml_gen_acc_list(FILE *f,
+		    int num_ents)
+{
+	int i;
+
+	fprintf(f, "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		"<StorageServices"
+		" xmlns=\"http://schemas.microsoft.com/windowsazure\""
+		" xmlns:i=\"http://www.w3.org/2001/XMLSchema-instance\">");
+	for (i = 0; i < num_ents; i++) {
+		fprintf(f, "<StorageService>"
+			"<Url>https://management.core.windows.net/"
+			"0a1b2c3d-0a1b-2c3d-4e5f-0a1b2c3d4e5f/services/"
+			"storageservices/bmacc%08d</Url>"
+			"<ServiceName>bmacc%08d</ServiceName>"
+			"<StorageServiceProperties>"
+			"<Description>benchmark account</Description>"
+			"<Location>West Europe</Location>"
+			"<Label>Ym1hY2M=</Label>"
+			"<Status>Created</Status>"
+			"<Endpoints><Endpoint>https://bmacc.blob.core.windows.net/"
+			"</Endpoint></Endpoints>"
+			"<GeoReplicationEnabled>true</GeoReplicationEnabled>"
+			"</StorageServiceProperties>"
+			"</StorageService>", i, i);
+	}
+	fprintf(f, "</StorageServices>");
+}
+
+static int
+bm_xml_op_new_acc_list(struct op **_op)
+{
+	return az_mgmt_req_acc_list("0a1b2c3d-0a1b-2c3d-4e5f-0a1b2c3d4e5f",
+				    _op);
+}
+
+static int
+bm_xml_rsp_check_acc_list(struct op *op)
+{
+	return az_mgmt_rsp_acc_list(op)->num_accs;
+}
+
+static const struct bm_xml_case bm_xml_cases[] = {
+	{ "az_rsp_blob_list_stream", bm_xml_gen_blob_list,
+	  bm_xml_op_new_blob_list, bm_xml_rsp_check_blob_list, true },
+	{ "az_rsp_ctnr_list_stream", bm_xml_gen_ctnr_list,
+	  bm_xml_op_new_ctnr_list, bm_xml_rsp_check_ctnr_list, true },
+	{ "az_fs_rsp_dirs_files_list_stream", bm_xml_gen_dirs_files_list,
+	  bm_xml_op_new_dirs_files_list, bm_xml_rsp_check_dirs_files_list,
+	  true },
+	{ "s3_rsp_bkt_list_stream", bm_xml_gen_bkt_list,
+	  bm_xml_op_new_bkt_list, bm_xml_rsp_check_bkt_list, true },
+	{ "az_rsp_page_ranges_get_process", bm_xml_gen_page_ranges,
+	  bm_xml_op_new_page_ranges, bm_xml_rsp_check_page_ranges, false },
+	{ "az_mgmt_rsp_acc_list_process", bm_xml_gen_acc_list,
+	  bm_xml_op_new_acc_list, bm_xml_rsp_check_acc_list, false },
+};
+
+/* mimic the conn layer, feeding the response body as it would arrive */
+static int
+bm_xml_rsp_feed(const struct bm_xml_case *bc,
+		struct op *op,
+		char *doc,
+		size_t doc_len)
+{
+	int ret;
+	size_t off;
+
+	/* response headers are received before the body */
+	ret = op_rsp_hdr_add(op, "x-ms-request-id",
+			     "c6c4ee7e-0001-0035-1d1e-5a5e44000000");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = op_rsp_hdr_add(op, "x-amz-request-id", "318BC8BC148832E5");
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (!bc->streamed) {
+		ret = elasto_data_iov_new((uint8_t *)doc, doc_len, false,
+					  &op->rsp.data);
+		if (ret < 0) {
+			return ret;
+		}
+		op->rsp.data->off = doc_len;
+		return 0;
+	}
+
+	for (off = 0; off < doc_len; off += BM_XML_CHUNK_SIZE) {
+		size_t len = doc_len - off;
+
+		if (len > BM_XML_CHUNK_SIZE) {
+			len = BM_XML_CHUNK_SIZE;
+		}
+		ret = exml_parse_chunk(op->rsp.xdoc, doc + off, len);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int
+bm_xml_case_run(const struct bm_xml_case *bc,
+		int num_ents)
+{
+	int ret;
+	int i;
+	int iters;
+	char *doc = NULL;
+	size_t doc_len = 0;
+	FILE *f;
+	struct timespec start;
+	struct timespec end;
+	struct rusage ru;
+	double secs;
+	uint64_t allocs;
+	uint64_t alloc_bytes;
+
+	f = open_memstream(&doc, &doc_len);
+	if (f == NULL) {
+		return -ENOMEM;
+	}
+	bc->gen(f, num_ents);
+	fclose(f);
+
+	iters = BM_XML_TARGET_BYTES / doc_len;
+	if (iters < 1) {
+		iters = 1;
+	} else if (iters > BM_XML_MAX_ITERS) {
+		iters = BM_XML_MAX_ITERS;
+	}
+
+	allocs = bm_allocs;
+	alloc_bytes = bm_alloc_bytes;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iters; i++) {
+		struct op *op;
+
+		ret = bc->op_new(&op);
+		if (ret < 0) {
+			goto err_doc_free;
+		}
+
+		ret = bm_xml_rsp_feed(bc, op, doc, doc_len);
+		if (ret < 0) {
+			op_free(op);
+			goto err_doc_free;
+		}
+
+		ret = op_rsp_process(op);
+		if (ret < 0) {
+			op_free(op);
+			goto err_doc_free;
+		}
+
+		ret = bc->rsp_check(op);
+		op_free(op);
+		if (ret != num_ents) {
+			fprintf(stderr, "%s: processed %d of %d entries\n",
+				bc->handler, ret, num_ents);
+			ret = -EIO;
+			goto err_doc_free;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	allocs = bm_allocs - allocs;
+	alloc_bytes = bm_alloc_bytes - alloc_bytes;
+
+	getrusage(RUSAGE_SELF, &ru);
+	secs = (end.tv_sec - start.tv_sec)
+		+ (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+	printf("%-34s %7d %10zu %6d %9.1f %11.0f %11.1f %13.1f %9ld\n",
+	       bc->handler, num_ents, doc_len, iters,
+	       (doc_len * (double)iters) / (1024 * 1024) / secs,
+	       ((double)num_ents * iters) / secs,
+	       (double)allocs / iters,
+	       (double)alloc_bytes / iters / 1024,
+	       ru.ru_maxrss);
+	ret = 0;
+
+err_doc_free:
+	free(doc);
+	return ret;
+}
+
+static void
+bm_xml_usage(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s [-m max_entries] [-h handler_substring]\n",
+		progname);
+}
+
+int
+main(int argc,
+     char * const *argv)
+{
+	int opt;
+	int i;
+	int num_ents;
+	int max_ents = 100000;
+	const char *filter = NULL;
+	int failed = 0;
+
+	while ((opt = getopt(argc, argv, "m:h:")) != -1) {
+		switch (opt) {
+		case 'm':
+			max_ents = atoi(optarg);
+			break;
+		case 'h':
+			filter = optarg;
+			break;
+		default:
+			bm_xml_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (max_ents < 1) {
+		bm_xml_usage(argv[0]);
+		return 1;
+	}
+
+	dbg_level_set(0);
+
+	printf("%-34s %7s %10s %6s %9s %11s %11s %13s %9s\n",
+	       "handler", "entries", "doc_bytes", "iters", "MiB/s",
+	       "entries/s", "allocs/op", "alloc_KiB/op", "rss_KiB");
+
+	for (i = 0; i < ARRAY_SIZE(bm_xml_cases); i++) {
+		const struct bm_xml_case *bc = &bm_xml_cases[i];
+
+		if ((filter != NULL) && (strstr(bc->handler, filter) == NULL)) {
+			continue;
+		}
+
+		for (num_ents = 1; num_ents <= max_ents; num_ents *= 10) {
+			pid_t pid;
+			int status;
+
+			fflush(stdout);
+			pid = fork();
+			if (pid < 0) {
+				perror("fork");
+				return 1;
+			} else if (pid == 0) {
+				/* child: isolate peak RSS for this case */
+				int ret = bm_xml_case_run(bc, num_ents);
+				fflush(stdout);
+				_exit(ret < 0 ? 1 : 0);
+			}
+
+			if ((waitpid(pid, &status, 0) < 0)
+			 || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+				fprintf(stderr, "%s with %d entries failed\n",
+					bc->handler, num_ents);
+				failed++;
+			}
+		}
+	}
+
+	exml_subsys_deinit();
+
+	return (failed ? 1 : 0);
+}
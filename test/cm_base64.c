@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <cmocka.h>
+
+#include "util.h"
+#include "base64.h"
+
+#define CM_B64_MAX_LEN 600
+
+static const enum base64_impl cm_b64_impls[] = {
+	BASE64_IMPL_SCALAR,
+	BASE64_IMPL_SSSE3,
+	BASE64_IMPL_AVX2,
+};
+
+static void
+cm_base64_rfc4648(void **state)
+{
+	const char *vecs[][2] = {
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" },
+	};
+	int i;
+	int j;
+
+	for (j = 0; j < ARRAY_SIZE(cm_b64_impls); j++) {
+		if (base64_impl_set(cm_b64_impls[j]) < 0) {
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(vecs); i++) {
+			char *enc;
+			char dec[16];
+			int len;
+
+			len = base64_encode(vecs[i][0], strlen(vecs[i][0]),
+					    &enc);
+			assert_int_equal(len, strlen(vecs[i][1]));
+			assert_string_equal(enc, vecs[i][1]);
+			free(enc);
+
+			len = base64_decode(vecs[i][1], dec);
+			assert_int_equal(len, strlen(vecs[i][0]));
+			assert_memory_equal(dec, vecs[i][0], len);
+		}
+	}
+	assert_int_equal(base64_impl_set(BASE64_IMPL_AUTO), 0);
+}
+
+/*
+ * Every available implementation must produce the same output as the scalar
+ * one, for all lengths around the vector block sizes.
+ */
+static void
+cm_base64_impls_match(void **state)
+{
+	uint8_t *buf;
+	char *ref_enc;
+	char *enc;
+	uint8_t *dec;
+	int len;
+	int i;
+	int j;
+
+	buf = malloc(CM_B64_MAX_LEN);
+	assert_non_null(buf);
+	ref_enc = malloc(BASE64_ENCODE_LEN(CM_B64_MAX_LEN) + 1);
+	assert_non_null(ref_enc);
+	enc = malloc(BASE64_ENCODE_LEN(CM_B64_MAX_LEN) + 1);
+	assert_non_null(enc);
+	dec = malloc(BASE64_ENCODE_LEN(CM_B64_MAX_LEN));
+	assert_non_null(dec);
+
+	srandom(0x6264);
+	for (i = 0; i < CM_B64_MAX_LEN; i++) {
+		buf[i] = random();
+	}
+
+	for (len = 0; len <= CM_B64_MAX_LEN; len++) {
+		int ref_len;
+
+		assert_int_equal(base64_impl_set(BASE64_IMPL_SCALAR), 0);
+		ref_len = base64_encode_buf(buf, len, ref_enc);
+		assert_int_equal(ref_len, BASE64_ENCODE_LEN(len));
+		ref_enc[ref_len] = '\0';
+
+		for (j = 0; j < ARRAY_SIZE(cm_b64_impls); j++) {
+			int ret;
+
+			if (base64_impl_set(cm_b64_impls[j]) < 0) {
+				continue;
+			}
+			ret = base64_encode_buf(buf, len, enc);
+			assert_int_equal(ret, ref_len);
+			assert_memory_equal(enc, ref_enc, ref_len);
+
+			ret = base64_decode(ref_enc, dec);
+			assert_int_equal(ret, len);
+			assert_memory_equal(dec, buf, len);
+		}
+	}
+
+	assert_int_equal(base64_impl_set(BASE64_IMPL_AUTO), 0);
+	free(buf);
+	free(ref_enc);
+	free(enc);
+	free(dec);
+}
+
+/*
+ * Decode stops at the first character that can't start a token, and fails on
+ * bad characters or padding within a token, regardless of where they fall
+ * relative to vector block boundaries.
+ */
+static void
+cm_base64_decode_invalid(void **state)
+{
+	char enc[BASE64_ENCODE_LEN(96) + 1];
+	uint8_t buf[96];
+	uint8_t dec[sizeof(enc)];
+	int enc_len;
+	int i;
+	int j;
+
+	memset(buf, 0xa5, sizeof(buf));
+	enc_len = base64_encode_buf(buf, sizeof(buf), enc);
+	assert_int_equal(enc_len, 128);
+	enc[enc_len] = '\0';
+
+	for (j = 0; j < ARRAY_SIZE(cm_b64_impls); j++) {
+		if (base64_impl_set(cm_b64_impls[j]) < 0) {
+			continue;
+		}
+		for (i = 0; i < enc_len; i++) {
+			char saved = enc[i];
+			int ret;
+
+			/* token start: decode ends early */
+			if ((i % 4) == 0) {
+				enc[i] = '\n';
+				ret = base64_decode(enc, dec);
+				assert_int_equal(ret, (i / 4) * 3);
+				assert_memory_equal(dec, buf, ret);
+			}
+
+			/* within a token: error */
+			if ((i % 4) != 0) {
+				enc[i] = '*';
+				assert_int_equal(base64_decode(enc, dec), -1);
+			}
+
+			/* padding followed by data: error */
+			if ((i % 4) < 2) {
+				enc[i] = '=';
+				assert_int_equal(base64_decode(enc, dec), -1);
+			}
+			enc[i] = saved;
+		}
+		assert_int_equal(base64_decode(enc, dec), sizeof(buf));
+		assert_memory_equal(dec, buf, sizeof(buf));
+		assert_int_equal(base64_decode("Zg=A", dec), -1);
+		assert_int_equal(base64_decode("Z===", dec), -1);
+		assert_int_equal(base64_decode("Zm9", dec), -1);
+	}
+	assert_int_equal(base64_impl_set(BASE64_IMPL_AUTO), 0);
+}
+
+static const UnitTest cm_base64_tests[] = {
+	unit_test(cm_base64_rfc4648),
+	unit_test(cm_base64_impls_match),
+	unit_test(cm_base64_decode_invalid),
+};
+
+int
+cm_base64_run(void)
+{
+	return run_tests(cm_base64_tests);
+}
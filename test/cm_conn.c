@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include <openssl/engine.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "ccan/list/list.h"
+#include "lib/exml.h"
+#include "lib/op.h"
+#include "lib/conn.h"
+#include "lib/data.h"
+#include "lib/base64.h"
+#include "lib/s3_path.h"
+#include "lib/s3_req.h"
+#include "lib/azure_req.h"
+#include "lib/azure_blob_path.h"
+#include "lib/azure_blob_req.h"
+#include "lib/dbg.h"
+#include "lib/file/file_api.h"
+#include "cm_test.h"
+#include "cm_http_stub.h"
+
+/* base64 encoded key for signing, the stub doesn't check signatures */
+#define CM_CONN_AZ_KEY "c2VjcmV0"
+
+/*
+ * @rsp_md5: Content-MD5 returned with GET responses, the digest of @rsp_body
+ *	     if NULL
+ * @req_md5: Content-MD5 of the last request, if any
+ * @req_uri: path and query string of the last request
+ * @req_auth: whether the last request carried an Authorization header
+ */
+struct cm_conn_stub_state {
+	const uint8_t *rsp_body;
+	size_t rsp_len;
+	const char *rsp_md5;
+	uint32_t num_reqs;
+	char *req_md5;
+	uint8_t *req_body;
+	size_t req_len;
+	char *req_uri;
+	bool req_auth;
+};
+
+static char *
+cm_conn_md5_b64(const uint8_t *buf,
+		size_t len)
+{
+	int ret;
+	uint8_t md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	char *md_b64;
+
+	ret = EVP_Digest(buf, len, md, &md_len, EVP_md5(), NULL);
+	assert_int_equal(ret, 1);
+	ret = base64_encode(md, md_len, &md_b64);
+	assert_false(ret < 0);
+
+	return md_b64;
+}
+
+static void
+cm_conn_stub_req_cb(struct evhttp_request *req,
+		    void *priv)
+{
+	struct cm_conn_stub_state *st = priv;
+	struct evbuffer *in_buf = evhttp_request_get_input_buffer(req);
+	struct evkeyvalq *in_hdrs = evhttp_request_get_input_headers(req);
+	const struct evhttp_uri *uri;
+	int ret;
+	struct evbuffer *out_buf;
+	const char *md5;
+	char *md5_calc = NULL;
+
+	st->num_reqs++;
+	free(st->req_md5);
+	st->req_md5 = NULL;
+	md5 = evhttp_find_header(in_hdrs, "Content-MD5");
+	if (md5 != NULL) {
+		st->req_md5 = strdup(md5);
+	}
+	free(st->req_uri);
+	/* requests are sent with an absolute URI, keep only path and query */
+	uri = evhttp_request_get_evhttp_uri(req);
+	if (evhttp_uri_get_query(uri) != NULL) {
+		ret = asprintf(&st->req_uri, "%s?%s", evhttp_uri_get_path(uri),
+			       evhttp_uri_get_query(uri));
+	} else {
+		ret = asprintf(&st->req_uri, "%s", evhttp_uri_get_path(uri));
+	}
+	if (ret < 0) {
+		st->req_uri = NULL;
+	}
+	st->req_auth = (evhttp_find_header(in_hdrs, "Authorization") != NULL);
+	free(st->req_body);
+	st->req_len = evbuffer_get_length(in_buf);
+	st->req_body = malloc(st->req_len + 1);
+	evbuffer_remove(in_buf, st->req_body, st->req_len);
+
+	if ((evhttp_request_get_command(req) != EVHTTP_REQ_GET)
+	 || (st->rsp_body == NULL)) {
+		evhttp_send_reply(req, 200, "OK", NULL);
+		return;
+	}
+
+	if (st->rsp_md5 == NULL) {
+		md5_calc = cm_conn_md5_b64(st->rsp_body, st->rsp_len);
+	}
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-MD5",
+			  (md5_calc != NULL ? md5_calc : st->rsp_md5));
+	free(md5_calc);
+	out_buf = evbuffer_new();
+	evbuffer_add(out_buf, st->rsp_body, st->rsp_len);
+	evhttp_send_reply(req, 206, "Partial Content", out_buf);
+	evbuffer_free(out_buf);
+}
+
+static void
+cm_conn_req_md5(void **state)
+{
+	int ret;
+	struct cm_conn_stub_state st = { 0 };
+	struct cm_http_stub *stub;
+	struct elasto_conn *econn;
+	struct s3_path path = { 0 };
+	struct elasto_data *data;
+	struct op *op;
+	uint8_t buf[1000];
+	char *md5_calc;
+	int i;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = i;
+	}
+
+	ret = cm_http_stub_start(cm_conn_stub_req_cb, &st, &stub);
+	assert_false(ret < 0);
+
+	ret = elasto_conn_init_s3("id", "secret", NULL, true,
+				  cm_http_stub_host(stub), &econn);
+	assert_false(ret < 0);
+
+	path.type = S3_PATH_OBJ;
+	path.host = strdup(cm_http_stub_host(stub));
+	path.bkt = strdup("bkt");
+	path.obj = strdup("obj");
+	assert_non_null(path.obj);
+
+	ret = elasto_data_iov_new(buf, sizeof(buf), false, &data);
+	assert_false(ret < 0);
+	ret = s3_req_obj_put(&path, data, &op);
+	assert_false(ret < 0);
+
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_false(ret < 0);
+	assert_false(op->rsp.is_error);
+
+	/* digest of the body as it arrived */
+	assert_int_equal(st.req_len, sizeof(buf));
+	assert_memory_equal(st.req_body, buf, sizeof(buf));
+	md5_calc = cm_conn_md5_b64(buf, sizeof(buf));
+	assert_non_null(st.req_md5);
+	assert_string_equal(st.req_md5, md5_calc);
+	free(md5_calc);
+
+	op->req.data = NULL;
+	op_free(op);
+	elasto_data_free(data);
+	s3_path_free(&path);
+	elasto_conn_free(econn);
+	cm_http_stub_stop(stub);
+	free(st.req_md5);
+	free(st.req_body);
+	free(st.req_uri);
+}
+
+static int
+cm_conn_range_get(struct elasto_conn *econn,
+		  uint8_t *buf,
+		  size_t len)
+{
+	int ret;
+	struct az_blob_path path = { 0 };
+	struct elasto_data *data;
+	struct op *op;
+
+	ret = az_blob_path_parse("/acc/ctnr/blob", &path);
+	assert_false(ret < 0);
+	ret = elasto_data_iov_new(buf, len, false, &data);
+	assert_false(ret < 0);
+	ret = az_req_blob_get(&path, true, data, 0, len, &op);
+	assert_false(ret < 0);
+
+	/* redirect to the stub, the account host isn't resolved */
+	free(op->url_host);
+	op->url_host = strdup(econn->hostname);
+	assert_non_null(op->url_host);
+
+	ret = elasto_conn_op_txrx(econn, op);
+
+	op->rsp.data = NULL;
+	op_free(op);
+	elasto_data_free(data);
+	az_blob_path_free(&path);
+
+	return ret;
+}
+
+static void
+cm_conn_range_md5(void **state)
+{
+	int ret;
+	struct cm_conn_stub_state st = { 0 };
+	struct cm_http_stub *stub;
+	struct elasto_conn *econn;
+	uint8_t rsp_body[4096];
+	uint8_t buf[4096];
+	int i;
+
+	for (i = 0; i < sizeof(rsp_body); i++) {
+		rsp_body[i] = i * 7;
+	}
+	st.rsp_body = rsp_body;
+	st.rsp_len = sizeof(rsp_body);
+
+	ret = cm_http_stub_start(cm_conn_stub_req_cb, &st, &stub);
+	assert_false(ret < 0);
+
+	ret = elasto_conn_init_az(NULL, true, cm_http_stub_host(stub),
+				  &econn);
+	assert_false(ret < 0);
+	ret = elasto_conn_sign_setkey(econn, "acc", CM_CONN_AZ_KEY);
+	assert_false(ret < 0);
+
+	/* matching digest */
+	memset(buf, 0, sizeof(buf));
+	ret = cm_conn_range_get(econn, buf, sizeof(buf));
+	assert_int_equal(ret, 0);
+	assert_memory_equal(buf, rsp_body, sizeof(buf));
+
+	/* digest of a different body */
+	st.rsp_md5 = "1B2M2Y8AsgTpgAmY7PhCfg==";
+	ret = cm_conn_range_get(econn, buf, sizeof(buf));
+	assert_int_equal(ret, -EIO);
+
+	/* the connection remains usable */
+	st.rsp_md5 = NULL;
+	ret = cm_conn_range_get(econn, buf, sizeof(buf));
+	assert_int_equal(ret, 0);
+
+	elasto_conn_free(econn);
+	cm_http_stub_stop(stub);
+	free(st.req_md5);
+	free(st.req_body);
+	free(st.req_uri);
+}
+
+/* SAS token replaces signing, and is appended to any existing URL params */
+static void
+cm_conn_sas_query(void **state)
+{
+	int ret;
+	struct cm_conn_stub_state st = { 0 };
+	struct cm_http_stub *stub;
+	struct elasto_conn *econn;
+	struct az_blob_path path = { 0 };
+	struct op *op;
+
+	ret = cm_http_stub_start(cm_conn_stub_req_cb, &st, &stub);
+	assert_false(ret < 0);
+
+	ret = elasto_conn_init_az(NULL, true, cm_http_stub_host(stub),
+				  &econn);
+	assert_false(ret < 0);
+	ret = elasto_conn_sign_setquery(econn, "?sv=2015-12-11&sig=abc%3D");
+	assert_false(ret < 0);
+
+	ret = az_blob_path_parse("/acc/ctnr/blob", &path);
+	assert_false(ret < 0);
+
+	ret = az_req_blob_del(&path, &op);
+	assert_false(ret < 0);
+	free(op->url_host);
+	op->url_host = strdup(econn->hostname);
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_false(ret < 0);
+	assert_int_equal(st.num_reqs, 1);
+	assert_string_equal(st.req_uri, "/ctnr/blob?sv=2015-12-11&sig=abc%3D");
+	assert_false(st.req_auth);
+	op_free(op);
+
+	ret = az_req_blob_prop_set(&path, false, 0, &op);
+	assert_false(ret < 0);
+	free(op->url_host);
+	op->url_host = strdup(econn->hostname);
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_false(ret < 0);
+	assert_int_equal(st.num_reqs, 2);
+	assert_string_equal(st.req_uri,
+			    "/ctnr/blob?comp=properties&sv=2015-12-11&sig=abc%3D");
+	assert_false(st.req_auth);
+	op_free(op);
+
+	az_blob_path_free(&path);
+	elasto_conn_free(econn);
+	cm_http_stub_stop(stub);
+	free(st.req_md5);
+	free(st.req_body);
+	free(st.req_uri);
+}
+
+/* a pre-signed query only covers the method and object it was signed for */
+static void
+cm_conn_presign_scope(void **state)
+{
+	int ret;
+	struct cm_conn_stub_state st = { 0 };
+	struct cm_http_stub *stub;
+	struct elasto_conn *econn;
+	struct s3_path path = { 0 };
+	struct s3_path other_path = { 0 };
+	struct elasto_data *data;
+	struct op *op;
+	uint8_t buf[100];
+	const char *q = "X-Amz-Algorithm=AWS4-HMAC-SHA256&X-Amz-Signature=abc";
+	char *url_path;
+
+	memset(buf, 0, sizeof(buf));
+	ret = cm_http_stub_start(cm_conn_stub_req_cb, &st, &stub);
+	assert_false(ret < 0);
+
+	ret = elasto_conn_init_s3(NULL, NULL, NULL, true,
+				  cm_http_stub_host(stub), &econn);
+	assert_false(ret < 0);
+	ret = elasto_conn_sign_setquery(econn, q);
+	assert_false(ret < 0);
+
+	path.type = S3_PATH_OBJ;
+	path.host = strdup(cm_http_stub_host(stub));
+	path.bkt = strdup("bkt");
+	path.obj = strdup("obj");
+	assert_non_null(path.obj);
+	ret = s3_path_dup(&path, &other_path);
+	assert_false(ret < 0);
+	free(other_path.obj);
+	other_path.obj = strdup("other");
+
+	ret = s3_req_url_path_get(&path, &url_path);
+	assert_false(ret < 0);
+	ret = elasto_conn_sign_setquery_scope(econn, REQ_METHOD_DELETE,
+					      url_path);
+	free(url_path);
+	assert_false(ret < 0);
+
+	ret = s3_req_obj_del(&path, &op);
+	assert_false(ret < 0);
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_false(ret < 0);
+	assert_int_equal(st.num_reqs, 1);
+	assert_string_equal(st.req_uri,
+		"/bkt/obj?X-Amz-Algorithm=AWS4-HMAC-SHA256&X-Amz-Signature=abc");
+	assert_false(st.req_auth);
+	op_free(op);
+
+	/* same object, different method */
+	ret = elasto_data_iov_new(buf, sizeof(buf), false, &data);
+	assert_false(ret < 0);
+	ret = s3_req_obj_put(&path, data, &op);
+	assert_false(ret < 0);
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_int_equal(ret, -EACCES);
+	op->req.data = NULL;
+	op_free(op);
+	elasto_data_free(data);
+
+	/* same method, different object */
+	ret = s3_req_obj_del(&other_path, &op);
+	assert_false(ret < 0);
+	ret = elasto_conn_op_txrx(econn, op);
+	assert_int_equal(ret, -EACCES);
+	op_free(op);
+
+	/* nothing sent for the rejected requests */
+	assert_int_equal(st.num_reqs, 1);
+
+	s3_path_free(&other_path);
+	s3_path_free(&path);
+	elasto_conn_free(econn);
+	cm_http_stub_stop(stub);
+	free(st.req_md5);
+	free(st.req_body);
+	free(st.req_uri);
+}
+
+static const UnitTest cm_conn_tests[] = {
+	unit_test(cm_conn_req_md5),
+	unit_test(cm_conn_range_md5),
+	unit_test(cm_conn_sas_query),
+	unit_test(cm_conn_presign_scope),
+};
+
+int
+cm_conn_run(void)
+{
+	return run_tests(cm_conn_tests);
+}
@@ -25,7 +25,9 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <cmocka.h>
 
 #include "ccan/list/list.h"
@@ -81,8 +83,175 @@ cm_data_iovec(void **state)
 	elasto_data_free(data);
 }
 
+struct cm_data_cb_state {
+	uint8_t buf[100];
+	int out_free_calls;
+};
+
+static int
+cm_data_cb_out_cb(uint64_t stream_off,
+		  uint64_t need,
+		  uint8_t **_out_buf,
+		  uint64_t *buf_len,
+		  void *priv)
+{
+	struct cm_data_cb_state *cb_state = priv;
+
+	assert_true(stream_off + need <= ARRAY_SIZE(cb_state->buf));
+	*_out_buf = cb_state->buf + stream_off;
+	*buf_len = need;
+	return 0;
+}
+
+static void
+cm_data_cb_out_free_cb(uint8_t *out_buf,
+		       void *priv)
+{
+	struct cm_data_cb_state *cb_state = priv;
+
+	assert_true(out_buf >= cb_state->buf);
+	assert_true(out_buf < cb_state->buf + ARRAY_SIZE(cb_state->buf));
+	cb_state->out_free_calls++;
+}
+
+static void
+cm_data_cb_borrowed(void **state)
+{
+	int ret;
+	struct elasto_data *data;
+	struct cm_data_cb_state cb_state;
+	uint8_t *out_buf = NULL;
+	uint64_t buf_len = 0;
+
+	memset(&cb_state, 0, sizeof(cb_state));
+	ret = elasto_data_cb_new(ARRAY_SIZE(cb_state.buf), cm_data_cb_out_cb,
+				 0, NULL, &cb_state, &data);
+	assert_int_equal(ret, 0);
+	assert_true(data->type == ELASTO_DATA_CB);
+	assert_null(data->cb.out_free_cb);
+
+	ret = elasto_data_cb_out_free_set(data, cm_data_cb_out_free_cb);
+	assert_int_equal(ret, 0);
+
+	ret = data->cb.out_cb(10, 50, &out_buf, &buf_len, data->cb.priv);
+	assert_int_equal(ret, 0);
+	assert_true(out_buf == cb_state.buf + 10);
+	assert_true(buf_len == 50);
+
+	/* lent buffer is handed back, rather than freed */
+	elasto_data_cb_out_buf_put(data, out_buf);
+	assert_int_equal(cb_state.out_free_calls, 1);
+	elasto_data_cb_out_buf_put(data, NULL);
+	assert_int_equal(cb_state.out_free_calls, 1);
+	elasto_data_free(data);
+
+	/* only callback data can have a release callback */
+	ret = elasto_data_iov_new(cb_state.buf, ARRAY_SIZE(cb_state.buf),
+				  false, &data);
+	assert_int_equal(ret, 0);
+	ret = elasto_data_cb_out_free_set(data, cm_data_cb_out_free_cb);
+	assert_int_equal(ret, -EINVAL);
+	elasto_data_free(data);
+}
+
+static void
+cm_data_iovec_segs(void **state)
+{
+	int ret;
+	int i;
+	struct elasto_data *data;
+	struct elasto_data *slice_data;
+	uint8_t buf[100];
+	uint8_t out[100];
+	struct iovec iovs[4];
+	struct iovec *slice;
+	int slice_cnt;
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++) {
+		buf[i] = i;
+	}
+	/* non-contiguous segments, including an empty one */
+	iovs[0].iov_base = buf + 50;
+	iovs[0].iov_len = 10;
+	iovs[1].iov_base = buf;
+	iovs[1].iov_len = 30;
+	iovs[2].iov_base = buf + 90;
+	iovs[2].iov_len = 0;
+	iovs[3].iov_base = buf + 30;
+	iovs[3].iov_len = 20;
+
+	ret = elasto_data_iovec_new(iovs, ARRAY_SIZE(iovs), &data);
+	assert_int_equal(ret, 0);
+	assert_true(data->type == ELASTO_DATA_IOVEC);
+	assert_true(data->len == 60);
+	assert_true(data->off == 0);
+	assert_int_equal(data->iovec.iovcnt, ARRAY_SIZE(iovs));
+	/* array is copied */
+	assert_true(data->iovec.iovs != iovs);
+
+	/* range spanning the middle of the first and last segments */
+	ret = elasto_data_iovec_slice(data, 5, 50, &slice, &slice_cnt);
+	assert_int_equal(ret, 0);
+	assert_int_equal(slice_cnt, 4);
+	assert_true(slice[0].iov_base == buf + 55);
+	assert_int_equal(slice[0].iov_len, 5);
+	assert_true(slice[1].iov_base == buf);
+	assert_int_equal(slice[1].iov_len, 30);
+	assert_int_equal(slice[2].iov_len, 0);
+	assert_true(slice[3].iov_base == buf + 30);
+	assert_int_equal(slice[3].iov_len, 15);
+	free(slice);
+
+	/* range within a single segment */
+	ret = elasto_data_iovec_slice(data, 12, 8, &slice, &slice_cnt);
+	assert_int_equal(ret, 0);
+	assert_int_equal(slice_cnt, 1);
+	assert_true(slice[0].iov_base == buf + 2);
+	assert_int_equal(slice[0].iov_len, 8);
+	free(slice);
+
+	ret = elasto_data_iovec_slice(data, 30, 31, &slice, &slice_cnt);
+	assert_int_equal(ret, -EINVAL);
+
+	ret = elasto_data_iovec_copy_out(data, 0, data->len, out);
+	assert_int_equal(ret, 0);
+	assert_memory_equal(out, buf + 50, 10);
+	assert_memory_equal(out + 10, buf, 50);
+
+	ret = elasto_data_iovec_slice_new(data, 8, 4, &slice_data);
+	assert_int_equal(ret, 0);
+	assert_true(slice_data->type == ELASTO_DATA_IOVEC);
+	assert_true(slice_data->len == 4);
+	ret = elasto_data_iovec_copy_out(slice_data, 0, 4, out);
+	assert_int_equal(ret, 0);
+	assert_memory_equal(out, buf + 58, 2);
+	assert_memory_equal(out + 2, buf, 2);
+	elasto_data_free(slice_data);
+
+	/* scatter back in, across the first two segments */
+	memset(out, 0xee, 12);
+	ret = elasto_data_iovec_copy_in(data, 4, 12, out);
+	assert_int_equal(ret, 0);
+	assert_int_equal(buf[53], 53);
+	for (i = 0; i < 6; i++) {
+		assert_int_equal(buf[54 + i], 0xee);
+		assert_int_equal(buf[i], 0xee);
+	}
+	assert_int_equal(buf[6], 6);
+	elasto_data_free(data);
+
+	/* iovec functions only apply to scatter-gather data */
+	ret = elasto_data_iov_new(buf, ARRAY_SIZE(buf), false, &data);
+	assert_int_equal(ret, 0);
+	ret = elasto_data_iovec_slice(data, 0, 1, &slice, &slice_cnt);
+	assert_int_equal(ret, -EINVAL);
+	elasto_data_free(data);
+}
+
 static const UnitTest cm_data_tests[] = {
 	unit_test(cm_data_iovec),
+	unit_test(cm_data_iovec_segs),
+	unit_test(cm_data_cb_borrowed),
 };
 
 int
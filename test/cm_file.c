@@ -241,6 +241,65 @@ cm_file_io(void **state)
 	free(path);
 }
 
+/*
+ * Exceed the 4M Put Page limit, and the clear range split size, to check that
+ * page writes and punches are transparently split.
+ */
+static void
+cm_file_io_multi(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_ftoken_list *toks = NULL;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint64_t len = (9 * BYTES_IN_MB) + 512;
+	uint64_t punch_len = 130 * BYTES_IN_MB;
+
+	cm_us->az_auth.type = ELASTO_FILE_APB;
+
+	ret = asprintf(&path, "/%s/%s%d/io_multi_test",
+		       cm_us->acc, cm_us->ctnr, cm_us->ctnr_suffix);
+	assert_false(ret < 0);
+
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_IO_DEPTH, "3", &toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->az_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	ret = elasto_ftruncate(fh, punch_len);
+	assert_false(ret < 0);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 512, len, buf);
+	assert_false(ret < 0);
+
+	memset(buf, 0, len);
+	ret = elasto_fread(fh, 512, len, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check(buf, len, 0);
+
+	ret = elasto_fallocate(fh, ELASTO_FALLOC_PUNCH_HOLE, 0, punch_len);
+	assert_false(ret < 0);
+
+	ret = elasto_fread(fh, 512, len, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check_zero(buf, len);
+
+	ret = elasto_fclose(fh);
+	assert_false(ret < 0);
+	elasto_ftoken_list_free(toks);
+	free(buf);
+	free(path);
+}
+
 static void
 cm_file_lease_basic(void **state)
 {
@@ -995,6 +1054,63 @@ cm_file_abb_io(void **state)
 	free(path);
 }
 
+/*
+ * Block blob writes check the current length against a cached stat, which is
+ * updated by writes via the same handle.
+ */
+static void
+cm_file_abb_stat_cache(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_fstat fstat;
+	struct elasto_ftoken_list *toks = NULL;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t buf[1024];
+
+	cm_us->az_auth.type = ELASTO_FILE_ABB;
+
+	ret = asprintf(&path, "/%s/%s%d/abb_stat_cache_test",
+		       cm_us->acc, cm_us->ctnr, cm_us->ctnr_suffix);
+	assert_false(ret < 0);
+
+	/* long enough to outlast the test */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_STAT_TTL, "600000", &toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->az_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	ret = elasto_fstat(fh, &fstat);
+	assert_false(ret < 0);
+	assert_int_equal(fstat.size, 0);
+
+	cm_file_buf_fill(buf, ARRAY_SIZE(buf), 0);
+	ret = elasto_fwrite(fh, 0, ARRAY_SIZE(buf), buf);
+	assert_false(ret < 0);
+
+	ret = elasto_fstat(fh, &fstat);
+	assert_false(ret < 0);
+	assert_true(fstat.field_mask & ELASTO_FSTAT_FIELD_SIZE);
+	assert_int_equal(fstat.size, ARRAY_SIZE(buf));
+
+	/* shorter overwrites are still refused */
+	ret = elasto_fwrite(fh, 0, ARRAY_SIZE(buf) / 2, buf);
+	assert_int_equal(ret, -EINVAL);
+
+	ret = elasto_fwrite(fh, 0, ARRAY_SIZE(buf), buf);
+	assert_false(ret < 0);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	elasto_ftoken_list_free(toks);
+	free(path);
+}
+
 static int
 cm_file_data_out_cb(uint64_t stream_off,
 		    uint64_t need,
@@ -1016,6 +1132,11 @@ cm_file_data_out_cb(uint64_t stream_off,
 	return 0;
 }
 
+/* @next_off: stream offset at which the next in_cb data must start */
+struct cm_file_data_in_state {
+	uint64_t next_off;
+};
+
 static int
 cm_file_data_in_cb(uint64_t stream_off,
 		   uint64_t got,
@@ -1023,11 +1144,88 @@ cm_file_data_in_cb(uint64_t stream_off,
 		   uint64_t buf_len,
 		   void *priv)
 {
+	struct cm_file_data_in_state *in_state = priv;
+
+	assert_non_null(in_state);
+	/* no gaps, overlaps or reordering */
+	assert_int_equal(stream_off, in_state->next_off);
+	assert_int_equal(got, buf_len);
+	assert_true(buf_len > 0);
 	cm_file_buf_check(in_buf, buf_len, stream_off);
+	in_state->next_off += buf_len;
+	free(in_buf);
 
 	return 0;
 }
 
+/*
+ * Writes over the 2MB block size are split into blocks, uploaded in parallel.
+ */
+static void
+cm_file_abb_io_multi(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_ftoken_list *toks = NULL;
+	struct elasto_fstatfs fstatfs;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint64_t len = (5 * BYTES_IN_MB) + 512;
+	struct cm_file_data_in_state in_state = { 0 };
+
+	cm_us->az_auth.type = ELASTO_FILE_ABB;
+
+	ret = asprintf(&path, "/%s/%s%d/abb_io_multi_test",
+		       cm_us->acc, cm_us->ctnr, cm_us->ctnr_suffix);
+	assert_false(ret < 0);
+
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_IO_DEPTH, "3", &toks);
+	assert_false(ret < 0);
+	/* split reads into 1M ranges */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_IO_CHUNK_SIZE, "1048576",
+				&toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->az_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	ret = elasto_fstatfs(fh, &fstatfs);
+	assert_false(ret < 0);
+	assert_int_equal(fstatfs.iosize_optimal, 3 * BYTES_IN_MB);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 0, len, buf);
+	assert_false(ret < 0);
+
+	memset(buf, 0, len);
+	ret = elasto_fread(fh, 0, len, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check(buf, len, 0);
+
+	/* range which doesn't start or end on a chunk boundary */
+	memset(buf, 0, len);
+	ret = elasto_fread(fh, 512, (3 * BYTES_IN_MB) + 1, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check(buf, (3 * BYTES_IN_MB) + 1, 512);
+
+	/* in_cb data must arrive in order */
+	ret = elasto_fread_cb(fh, 0, len, &in_state, cm_file_data_in_cb);
+	assert_false(ret < 0);
+	assert_int_equal(in_state.next_off, len);
+
+	ret = elasto_fclose(fh);
+	assert_false(ret < 0);
+	elasto_ftoken_list_free(toks);
+	free(buf);
+	free(path);
+}
+
 static void
 cm_file_data_cb(void **state)
 {
@@ -1035,6 +1233,7 @@ cm_file_data_cb(void **state)
 	char *path = NULL;
 	struct elasto_fh *fh;
 	struct cm_unity_state *cm_us = cm_unity_state_get();
+	struct cm_file_data_in_state in_state = { 0 };
 
 	cm_us->az_auth.type = ELASTO_FILE_ABB;
 
@@ -1051,8 +1250,9 @@ cm_file_data_cb(void **state)
 	ret = elasto_fwrite_cb(fh, 0, 1024, NULL, cm_file_data_out_cb);
 	assert_false(ret < 0);
 
-	ret = elasto_fread_cb(fh, 0, 1024, NULL, cm_file_data_in_cb);
+	ret = elasto_fread_cb(fh, 0, 1024, &in_state, cm_file_data_in_cb);
 	assert_false(ret < 0);
+	assert_int_equal(in_state.next_off, 1024);
 
 	ret = elasto_fclose(fh);
 	assert_false(ret < 0);
@@ -1111,6 +1311,64 @@ cm_file_afs_io(void **state)
 	free(path);
 }
 
+/*
+ * Large writes and punches are split into ranges, issued in parallel.
+ */
+static void
+cm_file_afs_io_multi(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_ftoken_list *toks = NULL;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint64_t len = (5 * BYTES_IN_MB) + 512;
+	uint64_t punch_len = 130 * BYTES_IN_MB;
+
+	cm_us->az_auth.type = ELASTO_FILE_AFS;
+
+	ret = asprintf(&path, "/%s/%s%d/afs_io_multi_test",
+		       cm_us->acc, cm_us->share, cm_us->share_suffix);
+	assert_false(ret < 0);
+
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_IO_DEPTH, "3", &toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->az_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 512, len, buf);
+	assert_false(ret < 0);
+
+	memset(buf, 0, len);
+	ret = elasto_fread(fh, 512, len, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check(buf, len, 0);
+
+	ret = elasto_ftruncate(fh, punch_len);
+	assert_false(ret < 0);
+
+	ret = elasto_fallocate(fh, ELASTO_FALLOC_PUNCH_HOLE, 0, punch_len);
+	assert_false(ret < 0);
+
+	ret = elasto_fread(fh, 512, len, buf);
+	assert_false(ret < 0);
+	cm_file_buf_check_zero(buf, len);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	elasto_ftoken_list_free(toks);
+	free(buf);
+	free(path);
+}
+
 static int
 cm_file_afs_path_encoding_dent_cb(struct elasto_dent *dent,
 				  void *priv)
@@ -1272,6 +1530,8 @@ static const UnitTest cm_file_tests[] = {
 				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_io,
 				 cm_file_mkdir, cm_file_rmdir),
+	unit_test_setup_teardown(cm_file_io_multi,
+				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_lease_basic,
 				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_lease_multi,
@@ -1294,10 +1554,16 @@ static const UnitTest cm_file_tests[] = {
 				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_abb_io,
 				 cm_file_mkdir, cm_file_rmdir),
+	unit_test_setup_teardown(cm_file_abb_stat_cache,
+				 cm_file_mkdir, cm_file_rmdir),
+	unit_test_setup_teardown(cm_file_abb_io_multi,
+				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_data_cb,
 				 cm_file_mkdir, cm_file_rmdir),
 	unit_test_setup_teardown(cm_file_afs_io,
 				 cm_file_share_create, cm_file_share_del),
+	unit_test_setup_teardown(cm_file_afs_io_multi,
+				 cm_file_share_create, cm_file_share_del),
 	unit_test_setup_teardown(cm_file_afs_path_encoding,
 				 cm_file_share_create, cm_file_share_del),
 	unit_test_setup_teardown(cm_file_afs_list_ranges,
@@ -24,6 +24,10 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <cmocka.h>
 
 #include "lib/file/file_api.h"
@@ -161,6 +165,382 @@ cm_file_local_io(void **state)
 	free(path);
 }
 
+static void
+cm_file_local_iovec(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t buf[1024];
+	uint8_t chk[1024 + 512];
+	struct iovec iov[4];
+
+	ret = asprintf(&path, "%s/iovec_test", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   NULL, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	/* scattered, misaligned segments written out of buffer order */
+	cm_file_local_buf_fill(buf, ARRAY_SIZE(buf), 0);
+	iov[0].iov_base = buf + 1000;
+	iov[0].iov_len = 24;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = buf + 1;
+	iov[2].iov_len = 999;
+	iov[3].iov_base = buf;
+	iov[3].iov_len = 1;
+	ret = elasto_fwritev(fh, 512, iov, ARRAY_SIZE(iov));
+	assert_int_equal(ret, 0);
+
+	ret = elasto_fread(fh, 0, ARRAY_SIZE(chk), chk);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check_zero(chk, 512);
+	cm_file_local_buf_check(chk + 512, 24, 1000);
+	cm_file_local_buf_check(chk + 536, 999, 1);
+	assert_int_equal(chk[1535], 0);
+
+	/* read back into segments in reverse order */
+	memset(buf, 0, ARRAY_SIZE(buf));
+	iov[0].iov_base = buf + 512;
+	iov[0].iov_len = 512;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = 512;
+	ret = elasto_freadv(fh, 512, iov, 2);
+	assert_int_equal(ret, 0);
+	assert_memory_equal(buf + 512, chk + 512, 512);
+	assert_memory_equal(buf, chk + 1024, 512);
+
+	ret = elasto_freadv(fh, 0, NULL, 1);
+	assert_int_equal(ret, -EINVAL);
+	ret = elasto_fwritev(fh, 0, iov, 0);
+	assert_int_equal(ret, -EINVAL);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	free(path);
+}
+
+static void
+cm_file_local_readahead(void **state)
+{
+	int ret;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_ftoken_list *toks = NULL;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint8_t rbuf[16 * 1024];
+	struct iovec iov[2];
+	uint64_t len = BYTES_IN_MB;
+	uint64_t punch_off = (len / 2) + (64 * BYTES_IN_KB);
+	uint64_t punch_len = 128 * BYTES_IN_KB;
+	uint64_t off;
+
+	ret = asprintf(&path, "%s/readahead_test", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+
+	/* local files don't read ahead by default */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_READAHEAD_MAX, "262144",
+				&toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_local_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 0, len, buf);
+	assert_int_equal(ret, 0);
+
+	for (off = 0; off < len / 2; off += sizeof(rbuf)) {
+		ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+		assert_int_equal(ret, 0);
+		cm_file_local_buf_check(rbuf, sizeof(rbuf), off);
+	}
+
+	/* punch within the prefetched range, which must then be dropped */
+	ret = elasto_fallocate(fh, ELASTO_FALLOC_PUNCH_HOLE, punch_off,
+			       punch_len);
+	assert_int_equal(ret, 0);
+
+	/* continue the sequential run, via both read interfaces */
+	for (; off < len; off += sizeof(rbuf)) {
+		iov[0].iov_base = rbuf;
+		iov[0].iov_len = sizeof(rbuf) / 2;
+		iov[1].iov_base = rbuf + sizeof(rbuf) / 2;
+		iov[1].iov_len = sizeof(rbuf) / 2;
+		if ((off / sizeof(rbuf)) % 2) {
+			ret = elasto_freadv(fh, off, iov, ARRAY_SIZE(iov));
+		} else {
+			ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+		}
+		assert_int_equal(ret, 0);
+		if ((off >= punch_off) && (off < punch_off + punch_len)) {
+			cm_file_local_buf_check_zero(rbuf, sizeof(rbuf));
+		} else {
+			cm_file_local_buf_check(rbuf, sizeof(rbuf), off);
+		}
+	}
+
+	/* random access */
+	ret = elasto_fread(fh, 1000, 100, rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, 100, 1000);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	elasto_ftoken_list_free(toks);
+	free(buf);
+	free(path);
+}
+
+static void
+cm_file_local_cache(void **state)
+{
+	int ret;
+	int fd;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_fh *fh2;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint8_t rbuf[16 * 1024];
+	uint64_t len = BYTES_IN_MB;
+	uint64_t off = (300 * BYTES_IN_KB) + 100;
+
+	ret = asprintf(&path, "%s/cache_test", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+
+	ret = elasto_fcache_setup(4096, 0);
+	assert_int_equal(ret, -EINVAL);
+
+	/* outside changes are only checked for on open */
+	ret = elasto_fcache_setup(4 * BYTES_IN_MB, 3600);
+	assert_int_equal(ret, 0);
+
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   NULL, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_local_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 0, len, buf);
+	assert_int_equal(ret, 0);
+
+	/* miss spanning two blocks, then a hit */
+	ret = elasto_fread(fh, (256 * BYTES_IN_KB) - 100, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, sizeof(rbuf), (256 * BYTES_IN_KB) - 100);
+	ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, sizeof(rbuf), off);
+
+	/* overwrite part of a cached block */
+	cm_file_local_buf_fill(buf, 1000, 7);
+	ret = elasto_fwrite(fh, off + 10, 1000, buf);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, 10, off);
+	cm_file_local_buf_check(rbuf + 10, 1000, 7);
+	cm_file_local_buf_check(rbuf + 1010, sizeof(rbuf) - 1010, off + 1010);
+
+	/* shrink into the cached block, then grow again */
+	ret = elasto_ftruncate(fh, off + 100);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+	assert_true(ret < 0);
+	ret = elasto_ftruncate(fh, len);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, off, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, 10, off);
+	cm_file_local_buf_check(rbuf + 10, 90, 7);
+	cm_file_local_buf_check_zero(rbuf + 100, sizeof(rbuf) - 100);
+
+	/* blocks are shared between handles */
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   0,
+			   NULL, &fh2);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_EXISTED);
+	ret = elasto_fread(fh2, 0, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, sizeof(rbuf), 0);
+
+	/* modify and grow the file behind elasto's back */
+	fd = open(path, O_WRONLY);
+	assert_true(fd >= 0);
+	memset(rbuf, 0xff, sizeof(rbuf));
+	ret = pwrite(fd, rbuf, sizeof(rbuf), 0);
+	assert_int_equal(ret, sizeof(rbuf));
+	ret = ftruncate(fd, len + 512);
+	assert_int_equal(ret, 0);
+	close(fd);
+
+	/* stale within the revalidation interval */
+	ret = elasto_fread(fh, 0, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, sizeof(rbuf), 0);
+
+	/* the changed ETag is seen on open */
+	ret = elasto_fclose(fh2);
+	assert_false(ret < 0);
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   0,
+			   NULL, &fh2);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_EXISTED);
+	ret = elasto_fread(fh2, 0, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	assert_int_equal(rbuf[0], 0xff);
+	assert_int_equal(rbuf[sizeof(rbuf) - 1], 0xff);
+	ret = elasto_fclose(fh2);
+	assert_false(ret < 0);
+
+	/* an outside change mustn't be masked by a local one's new ETag */
+	ret = elasto_fread(fh, 256 * BYTES_IN_KB, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(rbuf, sizeof(rbuf), 256 * BYTES_IN_KB);
+	fd = open(path, O_WRONLY);
+	assert_true(fd >= 0);
+	memset(rbuf, 0xee, sizeof(rbuf));
+	ret = pwrite(fd, rbuf, sizeof(rbuf), 256 * BYTES_IN_KB);
+	assert_int_equal(ret, sizeof(rbuf));
+	close(fd);
+	ret = elasto_fwrite(fh, 0, 100, buf);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, 256 * BYTES_IN_KB, sizeof(rbuf), rbuf);
+	assert_int_equal(ret, 0);
+	assert_int_equal(rbuf[0], 0xee);
+	assert_int_equal(rbuf[sizeof(rbuf) - 1], 0xee);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	ret = elasto_fcache_setup(0, 0);
+	assert_int_equal(ret, 0);
+	free(buf);
+	free(path);
+}
+
+static void
+cm_file_local_writeback(void **state)
+{
+	int ret;
+	int fd;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct elasto_ftoken_list *toks = NULL;
+	struct elasto_fstat fstat;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	uint8_t *chk;
+	uint64_t len = 2 * BYTES_IN_MB;
+	uint64_t io_len = 4 * BYTES_IN_KB;
+	uint64_t off;
+
+	ret = asprintf(&path, "%s/writeback_test", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+
+	/* less than the file size, so writers must wait for flushes */
+	ret = elasto_ftoken_add(ELASTO_FOPEN_TOK_WRITEBACK_MAX, "1048576",
+				&toks);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	chk = malloc(len);
+	assert_non_null(chk);
+	cm_file_local_buf_fill(buf, len, 0);
+
+	/* small sequential writes, with every fourth written out of order */
+	for (off = 0; off < len; off += 4 * io_len) {
+		ret = elasto_fwrite(fh, off + io_len, 3 * io_len,
+				    buf + off + io_len);
+		assert_int_equal(ret, 0);
+		ret = elasto_fwrite(fh, off, io_len, buf + off);
+		assert_int_equal(ret, 0);
+	}
+
+	/* overwrite buffered data, which must then be visible to reads */
+	cm_file_local_buf_fill(buf + 1000, 100, 7);
+	ret = elasto_fwrite(fh, len - 1000, 100, buf + 1000);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, len - io_len, io_len, chk);
+	assert_int_equal(ret, 0);
+	cm_file_local_buf_check(chk, io_len - 1000, len - io_len);
+	cm_file_local_buf_check(chk + io_len - 1000, 100, 7);
+	cm_file_local_buf_check(chk + io_len - 900, 900, len - 900);
+
+	ret = elasto_fsync(fh);
+	assert_int_equal(ret, 0);
+
+	/* everything has reached the backend */
+	fd = open(path, O_RDONLY);
+	assert_true(fd >= 0);
+	ret = pread(fd, chk, len, 0);
+	assert_int_equal(ret, len);
+	close(fd);
+	cm_file_local_buf_check(chk, len - 1000, 0);
+	cm_file_local_buf_check(chk + len - 1000, 100, 7);
+
+	/* a buffered write beyond the truncation point mustn't reappear */
+	ret = elasto_fwrite(fh, len, io_len, buf);
+	assert_int_equal(ret, 0);
+	ret = elasto_ftruncate(fh, len / 2);
+	assert_int_equal(ret, 0);
+	ret = elasto_fstat(fh, &fstat);
+	assert_int_equal(ret, 0);
+	assert_int_equal(fstat.size, len / 2);
+
+	/* larger than the dirty limit, so written through */
+	ret = elasto_fwrite(fh, 0, 100, buf + 1000);
+	assert_int_equal(ret, 0);
+	ret = elasto_fwrite(fh, 0, len, buf);
+	assert_int_equal(ret, 0);
+	ret = elasto_fread(fh, 0, len, chk);
+	assert_int_equal(ret, 0);
+	assert_memory_equal(chk, buf, len);
+
+	ret = elasto_fclose(fh);
+	assert_int_equal(ret, 0);
+
+	/* dirty data is discarded on unlink */
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   0,
+			   toks, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_EXISTED);
+	ret = elasto_fwrite(fh, 0, io_len, buf);
+	assert_int_equal(ret, 0);
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+
+	elasto_ftoken_list_free(toks);
+	free(chk);
+	free(buf);
+	free(path);
+}
+
 static void
 cm_file_local_truncate_basic(void **state)
 {
@@ -476,15 +856,142 @@ cm_file_local_data_cb(void **state)
 	free(path);
 }
 
+#define CM_FILE_LOCAL_AIO_NUM 16
+#define CM_FILE_LOCAL_AIO_LEN 4096
+
+static void
+cm_file_local_aio(void **state)
+{
+	int ret;
+	int i;
+	int efd;
+	char *path = NULL;
+	struct elasto_fh *fh;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	uint8_t *buf;
+	struct elasto_fio fio;
+	struct elasto_fio_cmpl cmpls[CM_FILE_LOCAL_AIO_NUM];
+	struct elasto_fstat fstat;
+	bool seen[CM_FILE_LOCAL_AIO_NUM];
+	struct pollfd pfd;
+	int reaped;
+
+	ret = asprintf(&path, "%s/aio_test", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+
+	ret = elasto_fopen(&cm_us->local_auth,
+			   path,
+			   ELASTO_FOPEN_CREATE,
+			   NULL, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	ret = elasto_fio_setup(fh, 3, &efd);
+	assert_int_equal(ret, 0);
+	assert_true(efd >= 0);
+	ret = elasto_fio_setup(fh, 3, &efd);
+	assert_int_equal(ret, -EBUSY);
+
+	buf = malloc(CM_FILE_LOCAL_AIO_NUM * CM_FILE_LOCAL_AIO_LEN);
+	assert_non_null(buf);
+	cm_file_local_buf_fill(buf, CM_FILE_LOCAL_AIO_NUM
+					* CM_FILE_LOCAL_AIO_LEN, 0);
+
+	/* nothing pending */
+	ret = elasto_freap(fh, 1, 1, cmpls);
+	assert_int_equal(ret, -EINVAL);
+
+	memset(&fio, 0, sizeof(fio));
+	for (i = 0; i < CM_FILE_LOCAL_AIO_NUM; i++) {
+		fio.opcode = ELASTO_FIO_WRITE;
+		fio.off = i * CM_FILE_LOCAL_AIO_LEN;
+		fio.len = CM_FILE_LOCAL_AIO_LEN;
+		fio.buf = buf + fio.off;
+		ret = elasto_fsubmit(fh, &fio, &seen[i]);
+		assert_int_equal(ret, 0);
+	}
+
+	/* completions are signalled via the eventfd */
+	memset(seen, 0, sizeof(seen));
+	reaped = 0;
+	while (reaped < CM_FILE_LOCAL_AIO_NUM) {
+		pfd.fd = efd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, 10000);
+		assert_int_equal(ret, 1);
+
+		ret = elasto_freap(fh, 0, ARRAY_SIZE(cmpls), cmpls);
+		assert_false(ret < 0);
+		for (i = 0; i < ret; i++) {
+			bool *cmpl_seen = cmpls[i].tag;
+			assert_int_equal(cmpls[i].ret, 0);
+			assert_false(*cmpl_seen);
+			*cmpl_seen = true;
+		}
+		reaped += ret;
+	}
+	ret = elasto_freap(fh, 0, ARRAY_SIZE(cmpls), cmpls);
+	assert_int_equal(ret, 0);
+
+	/* read back into a zeroed buffer, blocking for all completions */
+	memset(buf, 0, CM_FILE_LOCAL_AIO_NUM * CM_FILE_LOCAL_AIO_LEN);
+	for (i = 0; i < CM_FILE_LOCAL_AIO_NUM; i++) {
+		fio.opcode = ELASTO_FIO_READ;
+		fio.off = i * CM_FILE_LOCAL_AIO_LEN;
+		fio.len = CM_FILE_LOCAL_AIO_LEN;
+		fio.buf = buf + fio.off;
+		ret = elasto_fsubmit(fh, &fio, NULL);
+		assert_int_equal(ret, 0);
+	}
+	ret = elasto_freap(fh, CM_FILE_LOCAL_AIO_NUM, ARRAY_SIZE(cmpls),
+			   cmpls);
+	assert_int_equal(ret, CM_FILE_LOCAL_AIO_NUM);
+	for (i = 0; i < ret; i++) {
+		assert_int_equal(cmpls[i].ret, 0);
+	}
+	cm_file_local_buf_check(buf, CM_FILE_LOCAL_AIO_NUM
+					* CM_FILE_LOCAL_AIO_LEN, 0);
+
+	memset(&fio, 0, sizeof(fio));
+	fio.opcode = ELASTO_FIO_STAT;
+	fio.fstat = &fstat;
+	ret = elasto_fsubmit(fh, &fio, &fstat);
+	assert_int_equal(ret, 0);
+	ret = elasto_freap(fh, 1, 1, cmpls);
+	assert_int_equal(ret, 1);
+	assert_true(cmpls[0].tag == &fstat);
+	assert_int_equal(cmpls[0].ret, 0);
+	assert_true(fstat.size == CM_FILE_LOCAL_AIO_NUM
+						* CM_FILE_LOCAL_AIO_LEN);
+
+	fio.opcode = 0;
+	ret = elasto_fsubmit(fh, &fio, NULL);
+	assert_int_equal(ret, -EINVAL);
+
+	/* close with an unreaped completion */
+	fio.opcode = ELASTO_FIO_STAT;
+	ret = elasto_fsubmit(fh, &fio, NULL);
+	assert_int_equal(ret, 0);
+
+	ret = elasto_funlink_close(fh);
+	assert_false(ret < 0);
+	free(buf);
+	free(path);
+}
+
 static const UnitTest cm_file_local_tests[] = {
 	unit_test_setup_teardown(cm_file_local_create, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_io, NULL, NULL),
+	unit_test_setup_teardown(cm_file_local_iovec, NULL, NULL),
+	unit_test_setup_teardown(cm_file_local_readahead, NULL, NULL),
+	unit_test_setup_teardown(cm_file_local_cache, NULL, NULL),
+	unit_test_setup_teardown(cm_file_local_writeback, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_truncate_basic, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_stat_basic, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_dir_open, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_dir_readdir, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_dir_stat, NULL, NULL),
 	unit_test_setup_teardown(cm_file_local_data_cb, NULL, NULL),
+	unit_test_setup_teardown(cm_file_local_aio, NULL, NULL),
 };
 
 int
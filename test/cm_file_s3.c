@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <cmocka.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "lib/file/file_api.h"
+#include "cm_test.h"
+#include "cm_http_stub.h"
+#include "lib/util.h"
+
+#define CM_FILE_S3_PART_LEN (5 * BYTES_IN_MB)
+#define CM_FILE_S3_NUM_PARTS 3
+#define CM_FILE_S3_UPLOAD_ID "cm-upload-id"
+
+/*
+ * Minimal S3 object store, serving a single multi-part upload.
+ * @part_reqs: number of PUTs received for each part number
+ * @part_lens: body length of the last successful PUT for each part number
+ * @done_order: part numbers, in the order their PUTs were acknowledged
+ * @held_req: part one PUT, acknowledged only once all other parts are
+ * @complete_body: CompleteMultipartUpload request body
+ */
+struct cm_file_s3_stub_state {
+	bool created;
+	uint32_t part_reqs[CM_FILE_S3_NUM_PARTS + 1];
+	size_t part_lens[CM_FILE_S3_NUM_PARTS + 1];
+	uint32_t done_order[CM_FILE_S3_NUM_PARTS];
+	uint32_t num_done;
+	struct evhttp_request *held_req;
+	struct event *held_ev;
+	char *complete_body;
+	bool aborted;
+};
+
+static void
+cm_file_s3_part_ack(struct cm_file_s3_stub_state *st,
+		    struct evhttp_request *req,
+		    uint32_t pnum)
+{
+	char etag[64];
+
+	snprintf(etag, sizeof(etag), "\"etag-%u\"", pnum);
+	evhttp_add_header(evhttp_request_get_output_headers(req), "ETag",
+			  etag);
+	evhttp_send_reply(req, 200, "OK", NULL);
+	if (st->num_done < CM_FILE_S3_NUM_PARTS) {
+		st->done_order[st->num_done++] = pnum;
+	}
+}
+
+static void
+cm_file_s3_held_release(struct cm_file_s3_stub_state *st)
+{
+	struct evhttp_request *req = st->held_req;
+
+	if (req == NULL) {
+		return;
+	}
+	st->held_req = NULL;
+	event_free(st->held_ev);
+	st->held_ev = NULL;
+	cm_file_s3_part_ack(st, req, 1);
+}
+
+/* don't leave the client hanging if parts are sent one at a time */
+static void
+cm_file_s3_held_timeout_cb(evutil_socket_t fd,
+			   short what,
+			   void *priv)
+{
+	cm_file_s3_held_release(priv);
+}
+
+static void
+cm_file_s3_part_put(struct cm_file_s3_stub_state *st,
+		    struct evhttp_request *req,
+		    uint32_t pnum)
+{
+	struct evbuffer *in_buf = evhttp_request_get_input_buffer(req);
+	struct event_base *ev_base;
+	struct timeval tv = { 5, 0 };
+
+	if ((pnum == 0) || (pnum > CM_FILE_S3_NUM_PARTS)) {
+		evhttp_send_reply(req, 400, "Bad Request", NULL);
+		return;
+	}
+	st->part_reqs[pnum]++;
+
+	if ((pnum == 2) && (st->part_reqs[pnum] == 1)) {
+		/* transient failure, should be resent */
+		evhttp_send_reply(req, 500, "Internal Server Error", NULL);
+		return;
+	}
+	st->part_lens[pnum] = evbuffer_get_length(in_buf);
+
+	if (pnum == 1) {
+		ev_base = evhttp_connection_get_base(
+					evhttp_request_get_connection(req));
+		st->held_req = req;
+		st->held_ev = evtimer_new(ev_base, cm_file_s3_held_timeout_cb,
+					  st);
+		evtimer_add(st->held_ev, &tv);
+		return;
+	}
+
+	cm_file_s3_part_ack(st, req, pnum);
+	if (st->num_done == CM_FILE_S3_NUM_PARTS - 1) {
+		cm_file_s3_held_release(st);
+	}
+}
+
+static void
+cm_file_s3_stub_req_cb(struct evhttp_request *req,
+		       void *priv)
+{
+	struct cm_file_s3_stub_state *st = priv;
+	const struct evhttp_uri *uri = evhttp_request_get_evhttp_uri(req);
+	const char *query = evhttp_uri_get_query(uri);
+	struct evbuffer *in_buf = evhttp_request_get_input_buffer(req);
+	struct evkeyvalq params;
+	struct evbuffer *out_buf;
+	const char *pnum;
+	size_t len;
+
+	if (strcmp(evhttp_uri_get_path(uri), "/bkt/obj") != 0) {
+		evhttp_send_reply(req, 404, "Not Found", NULL);
+		return;
+	}
+
+	TAILQ_INIT(&params);
+	if (query != NULL) {
+		evhttp_parse_query_str(query, &params);
+	}
+
+	switch (evhttp_request_get_command(req)) {
+	case EVHTTP_REQ_HEAD:
+		if (!st->created) {
+			evhttp_send_reply(req, 404, "Not Found", NULL);
+			break;
+		}
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+				  "Content-Type", "application/octet-stream");
+		/* multi-part upload is only done as a replacement */
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+				  "Content-Length", "0");
+		evhttp_send_reply(req, 200, "OK", NULL);
+		break;
+	case EVHTTP_REQ_PUT:
+		pnum = evhttp_find_header(&params, "partNumber");
+		if (pnum == NULL) {
+			st->created = true;
+			evhttp_send_reply(req, 200, "OK", NULL);
+			break;
+		}
+		cm_file_s3_part_put(st, req, strtoul(pnum, NULL, 10));
+		break;
+	case EVHTTP_REQ_POST:
+		out_buf = evbuffer_new();
+		/* value-less "uploads" param isn't handled by the parser */
+		if ((query != NULL) && (strcmp(query, "uploads") == 0)) {
+			evbuffer_add_printf(out_buf,
+				"<InitiateMultipartUploadResult>"
+				"<Bucket>bkt</Bucket><Key>obj</Key>"
+				"<UploadId>" CM_FILE_S3_UPLOAD_ID "</UploadId>"
+				"</InitiateMultipartUploadResult>");
+		} else {
+			len = evbuffer_get_length(in_buf);
+			free(st->complete_body);
+			st->complete_body = malloc(len + 1);
+			evbuffer_remove(in_buf, st->complete_body, len);
+			st->complete_body[len] = '\0';
+			evbuffer_add_printf(out_buf,
+				"<CompleteMultipartUploadResult>"
+				"<Bucket>bkt</Bucket><Key>obj</Key>"
+				"</CompleteMultipartUploadResult>");
+		}
+		evhttp_send_reply(req, 200, "OK", out_buf);
+		evbuffer_free(out_buf);
+		break;
+	case EVHTTP_REQ_DELETE:
+		st->aborted = true;
+		evhttp_send_reply(req, 204, "No Content", NULL);
+		break;
+	default:
+		evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+		break;
+	}
+	evhttp_clear_headers(&params);
+}
+
+/*
+ * Parts completing out of order, one after a resend, must still be listed in
+ * part number order on completion.
+ */
+static void
+cm_file_s3_mp_order(void **state)
+{
+	int ret;
+	struct cm_unity_state *cm_us = cm_unity_state_get();
+	struct cm_file_s3_stub_state st = { 0 };
+	struct cm_http_stub *stub;
+	struct elasto_fauth auth = { 0 };
+	struct elasto_fh *fh;
+	char *creds_path = NULL;
+	FILE *creds;
+	uint8_t *buf;
+	uint64_t len = (CM_FILE_S3_NUM_PARTS - 1) * CM_FILE_S3_PART_LEN
+							+ BYTES_IN_MB;
+	const char *pos;
+	uint32_t i;
+
+	ret = asprintf(&creds_path, "%s/s3_creds.csv", cm_us->local_tmpdir);
+	assert_false(ret < 0);
+	creds = fopen(creds_path, "w");
+	assert_non_null(creds);
+	fprintf(creds, "User Name,Access Key Id,Secret Access Key\n"
+		       "\"cm\",id,secret\n");
+	fclose(creds);
+
+	ret = cm_http_stub_start(cm_file_s3_stub_req_cb, &st, &stub);
+	assert_false(ret < 0);
+
+	auth.type = ELASTO_FILE_S3;
+	auth.insecure_http = true;
+	auth.s3.creds_path = creds_path;
+	auth.s3.endpoint = (char *)cm_http_stub_host(stub);
+
+	ret = elasto_fopen(&auth, "/bkt/obj", ELASTO_FOPEN_CREATE, NULL, &fh);
+	assert_int_equal(ret, ELASTO_FOPEN_RET_CREATED);
+
+	buf = malloc(len);
+	assert_non_null(buf);
+	cm_file_buf_fill(buf, len, 0);
+	ret = elasto_fwrite(fh, 0, len, buf);
+	assert_false(ret < 0);
+	free(buf);
+
+	ret = elasto_fclose(fh);
+	assert_false(ret < 0);
+	cm_http_stub_stop(stub);
+
+	assert_false(st.aborted);
+	assert_int_equal(st.part_reqs[1], 1);
+	assert_int_equal(st.part_reqs[2], 2);
+	assert_int_equal(st.part_reqs[3], 1);
+	assert_int_equal(st.part_lens[1], CM_FILE_S3_PART_LEN);
+	assert_int_equal(st.part_lens[2], CM_FILE_S3_PART_LEN);
+	assert_int_equal(st.part_lens[3], BYTES_IN_MB);
+
+	/* part one was held back until the others were acknowledged */
+	assert_int_equal(st.num_done, CM_FILE_S3_NUM_PARTS);
+	assert_int_equal(st.done_order[CM_FILE_S3_NUM_PARTS - 1], 1);
+
+	assert_non_null(st.complete_body);
+	pos = st.complete_body;
+	for (i = 1; i <= CM_FILE_S3_NUM_PARTS; i++) {
+		char part[128];
+
+		snprintf(part, sizeof(part), "<Part><PartNumber>%u</PartNumber>"
+			 "<ETag>\"etag-%u\"</ETag></Part>", i, i);
+		pos = strstr(pos, part);
+		assert_non_null(pos);
+	}
+
+	free(st.complete_body);
+	ret = unlink(creds_path);
+	assert_false(ret < 0);
+	free(creds_path);
+}
+
+static const UnitTest cm_file_s3_tests[] = {
+	unit_test(cm_file_s3_mp_order),
+};
+
+int
+cm_file_s3_run(void)
+{
+	return run_tests(cm_file_s3_tests);
+}
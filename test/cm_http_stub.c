@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "cm_http_stub.h"
+
+/*
+ * Plain HTTP server for offline tests, run on a loopback port with its own
+ * event loop thread. Requests are handed to the test's callback, which
+ * replies via the evhttp API from the same thread.
+ */
+struct cm_http_stub {
+	struct event_base *ev_base;
+	struct evhttp *ev_http;
+	struct event *stop_ev;
+	int stop_fds[2];
+	pthread_t thread;
+	char host[64];
+	cm_http_stub_cb_t req_cb;
+	void *cb_priv;
+};
+
+static void
+cm_http_stub_req_cb(struct evhttp_request *req,
+		    void *priv)
+{
+	struct cm_http_stub *stub = priv;
+
+	stub->req_cb(req, stub->cb_priv);
+}
+
+static void
+cm_http_stub_stop_cb(evutil_socket_t fd,
+		     short what,
+		     void *priv)
+{
+	struct cm_http_stub *stub = priv;
+
+	event_base_loopbreak(stub->ev_base);
+}
+
+static void *
+cm_http_stub_thread(void *priv)
+{
+	struct cm_http_stub *stub = priv;
+
+	event_base_dispatch(stub->ev_base);
+	return NULL;
+}
+
+int
+cm_http_stub_start(cm_http_stub_cb_t req_cb,
+		   void *cb_priv,
+		   struct cm_http_stub **_stub)
+{
+	int ret;
+	struct cm_http_stub *stub;
+	struct evhttp_bound_socket *bound;
+	struct sockaddr_in sin;
+	socklen_t sin_len = sizeof(sin);
+
+	stub = malloc(sizeof(*stub));
+	if (stub == NULL) {
+		ret = -ENOMEM;
+		goto err_out;
+	}
+	memset(stub, 0, sizeof(*stub));
+	stub->req_cb = req_cb;
+	stub->cb_priv = cb_priv;
+
+	stub->ev_base = event_base_new();
+	if (stub->ev_base == NULL) {
+		ret = -ENOMEM;
+		goto err_stub_free;
+	}
+
+	stub->ev_http = evhttp_new(stub->ev_base);
+	if (stub->ev_http == NULL) {
+		ret = -ENOMEM;
+		goto err_base_free;
+	}
+	evhttp_set_gencb(stub->ev_http, cm_http_stub_req_cb, stub);
+	evhttp_set_allowed_methods(stub->ev_http,
+				   EVHTTP_REQ_GET | EVHTTP_REQ_PUT
+				   | EVHTTP_REQ_POST | EVHTTP_REQ_HEAD
+				   | EVHTTP_REQ_DELETE);
+
+	bound = evhttp_bind_socket_with_handle(stub->ev_http, "127.0.0.1", 0);
+	if (bound == NULL) {
+		ret = -EADDRNOTAVAIL;
+		goto err_http_free;
+	}
+	ret = getsockname(evhttp_bound_socket_get_fd(bound),
+			  (struct sockaddr *)&sin, &sin_len);
+	if (ret < 0) {
+		ret = -errno;
+		goto err_http_free;
+	}
+	snprintf(stub->host, sizeof(stub->host), "127.0.0.1:%u",
+		 ntohs(sin.sin_port));
+
+	ret = pipe(stub->stop_fds);
+	if (ret < 0) {
+		ret = -errno;
+		goto err_http_free;
+	}
+	stub->stop_ev = event_new(stub->ev_base, stub->stop_fds[0], EV_READ,
+				  cm_http_stub_stop_cb, stub);
+	if (stub->stop_ev == NULL) {
+		ret = -ENOMEM;
+		goto err_pipe_close;
+	}
+	event_add(stub->stop_ev, NULL);
+
+	ret = pthread_create(&stub->thread, NULL, cm_http_stub_thread, stub);
+	if (ret != 0) {
+		ret = -ret;
+		goto err_ev_free;
+	}
+
+	*_stub = stub;
+	return 0;
+
+err_ev_free:
+	event_free(stub->stop_ev);
+err_pipe_close:
+	close(stub->stop_fds[0]);
+	close(stub->stop_fds[1]);
+err_http_free:
+	evhttp_free(stub->ev_http);
+err_base_free:
+	event_base_free(stub->ev_base);
+err_stub_free:
+	free(stub);
+err_out:
+	return ret;
+}
+
+const char *
+cm_http_stub_host(struct cm_http_stub *stub)
+{
+	return stub->host;
+}
+
+void
+cm_http_stub_stop(struct cm_http_stub *stub)
+{
+	ssize_t ret;
+
+	ret = write(stub->stop_fds[1], "x", 1);
+	if (ret == 1) {
+		pthread_join(stub->thread, NULL);
+	}
+	event_free(stub->stop_ev);
+	close(stub->stop_fds[0]);
+	close(stub->stop_fds[1]);
+	evhttp_free(stub->ev_http);
+	event_base_free(stub->ev_base);
+	free(stub);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) SUSE LINUX GmbH 2016, all rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) version 3.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ */
+#ifndef _CM_HTTP_STUB_H_
+#define _CM_HTTP_STUB_H_
+
+struct cm_http_stub;
+struct evhttp_request;
+
+/* called from the stub's thread, which must reply to @req */
+typedef void (*cm_http_stub_cb_t)(struct evhttp_request *req,
+				  void *priv);
+
+int
+cm_http_stub_start(cm_http_stub_cb_t req_cb,
+		   void *cb_priv,
+		   struct cm_http_stub **_stub);
+
+/* "127.0.0.1:<port>" of the listening stub */
+const char *
+cm_http_stub_host(struct cm_http_stub *stub);
+
+void
+cm_http_stub_stop(struct cm_http_stub *stub);
+
+#endif /* _CM_HTTP_STUB_H_ */
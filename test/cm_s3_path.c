@@ -27,7 +27,10 @@
 #include <cmocka.h>
 
 #include "ccan/list/list.h"
+#include "lib/exml.h"
+#include "lib/op.h"
 #include "s3_path.h"
+#include "lib/s3_req.h"
 #include "dbg.h"
 
 static void
@@ -157,11 +160,52 @@ cm_s3_path_dup(void **state)
 	s3_path_free(&path_dup);
 }
 
+static void
+cm_s3_path_req_url_check(const char *path_str,
+			 const char *url_host,
+			 const char *url_path)
+{
+	int ret;
+	struct s3_path path = { 0 };
+	struct s3_path *p = &path;
+	struct op *op;
+
+	ret = s3_path_parse(path_str, &path);
+	assert_true(ret >= 0);
+	if (S3_PATH_IS_SVC(p)) {
+		ret = s3_req_svc_list(&path, &op);
+	} else if (S3_PATH_IS_BKT(p)) {
+		ret = s3_req_bkt_list(&path, &op);
+	} else {
+		ret = s3_req_obj_head(&path, &op);
+	}
+	assert_true(ret >= 0);
+	assert_string_equal(op->url_host, url_host);
+	assert_string_equal(op->url_path, url_path);
+	op_free(op);
+	s3_path_free(&path);
+}
+
+static void
+cm_s3_path_req_url(void **state)
+{
+	/* AWS: virtual-hosted style, bkt as host prefix */
+	cm_s3_path_req_url_check("/", "s3.amazonaws.com", "/");
+	cm_s3_path_req_url_check("/bkt", "bkt.s3.amazonaws.com", "/");
+	cm_s3_path_req_url_check("/bkt/obj", "bkt.s3.amazonaws.com", "/obj");
+
+	/* any other endpoint: path-style, host untouched */
+	cm_s3_path_req_url_check("s3://hosty:9000/", "hosty:9000", "/");
+	cm_s3_path_req_url_check("s3://hosty:9000/bkt", "hosty:9000", "/bkt");
+	cm_s3_path_req_url_check("s3://hosty/bkt/obj", "hosty", "/bkt/obj");
+}
+
 static const UnitTest cm_s3_path_tests[] = {
 	unit_test(cm_s3_path_root),
 	unit_test(cm_s3_path_bkt),
 	unit_test(cm_s3_path_obj),
 	unit_test(cm_s3_path_dup),
+	unit_test(cm_s3_path_req_url),
 };
 
 int
@@ -44,8 +44,8 @@ cm_sign_az_list(void **state)
 {
 	int ret;
 	struct op op;
-	char *sig_src = NULL;
 	char *sig_str = NULL;
+	struct sign_key *skey;
 
 	memset(&op, 0, sizeof(op));
 	list_head_init(&op.req.hdrs);
@@ -60,22 +60,26 @@ cm_sign_az_list(void **state)
 	ret = op_req_hdr_add(&op, "x-ms-version", "2009-09-19");
 	assert_int_equal(ret, 0);
 
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)AZ_KEY,
+			    (sizeof(AZ_KEY) - 1), &skey);
+	assert_int_equal(ret, 0);
+
 	ret = sign_gen_lite_azure(AZ_ACC,
-				  (const uint8_t *)AZ_KEY,
-				  (sizeof(AZ_KEY) - 1),
+				  skey,
 				  &op,
-				  &sig_src,
 				  &sig_str);
 	assert_false(ret < 0);	/* returns strlen(sig_str) on success */
 
-	assert_string_equal(sig_src, "GET\n\n\n\n"
+	assert_string_equal(op.sig_src, "GET\n\n\n\n"
 			    "x-ms-date:Thu, 11 Apr 2013 11:28:15 GMT\n"
 			    "x-ms-version:2009-09-19\n"
 			    "/ddiss/test?comp=list");
 	assert_string_equal(sig_str,
 			    "UZqdIQCl+6/E/Ptp+q49bsKTtrXft2fHjvu9Qf+Ys+0=");
-	free(sig_src);
+	free(op.sig_src);
+	free(op.sig_hdrs);
 	free(sig_str);
+	sign_key_free(skey);
 	op_hdrs_free(&op.req.hdrs);
 	free(op.url_path);
 	free(op.url_host);
@@ -91,8 +95,8 @@ cm_sign_az_shared_key_head(void **state)
 {
 	int ret;
 	struct op op;
-	char *sig_src = NULL;
 	char *sig_str = NULL;
+	struct sign_key *skey;
 	char *key[sizeof(CM_SIGN_AZ_KEY_B64)];
 	int key_len;
 
@@ -111,23 +115,27 @@ cm_sign_az_shared_key_head(void **state)
 	key_len = base64_decode(CM_SIGN_AZ_KEY_B64, key);
 	assert_true(key_len > 0);
 
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)key,
+			    key_len, &skey);
+	assert_int_equal(ret, 0);
+
 	ret = sign_gen_shared_azure(CM_SIGN_AZ_ACC,
-				  (const uint8_t *)key,
-				  key_len,
+				  skey,
 				  &op,
-				  &sig_src,
 				  &sig_str);
 	assert_false(ret < 0);	/* returns strlen(sig_str) on success */
 
-	assert_string_equal(sig_src,
+	assert_string_equal(op.sig_src,
 			    "HEAD\n\n\n\n\n\n\n\n\n\n\n\n"
 			    "x-ms-date:Sun, 04 Sep 2016 20:55:01 GMT\n"
 			    "x-ms-version:2015-12-11\n"
 			    "/invalid/test-put-get-md5/zeros");
 	assert_string_equal(sig_str,
 			    "ZyZvE8Xw9sQlWahD9ItcPAl5+69gRvDiY1+SYFpM7uI=");
-	free(sig_src);
+	free(op.sig_src);
+	free(op.sig_hdrs);
 	free(sig_str);
+	sign_key_free(skey);
 	op_hdrs_free(&op.req.hdrs);
 	free(op.url_path);
 	free(op.url_host);
@@ -138,8 +146,8 @@ cm_sign_az_shared_key_put(void **state)
 {
 	int ret;
 	struct op op;
-	char *sig_src = NULL;
 	char *sig_str = NULL;
+	struct sign_key *skey;
 	char *key[sizeof(CM_SIGN_AZ_KEY_B64)];
 	int key_len;
 
@@ -162,15 +170,17 @@ cm_sign_az_shared_key_put(void **state)
 	key_len = base64_decode(CM_SIGN_AZ_KEY_B64, key);
 	assert_true(key_len > 0);
 
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)key,
+			    key_len, &skey);
+	assert_int_equal(ret, 0);
+
 	ret = sign_gen_shared_azure(CM_SIGN_AZ_ACC,
-				  (const uint8_t *)key,
-				  key_len,
+				  skey,
 				  &op,
-				  &sig_src,
 				  &sig_str);
 	assert_false(ret < 0);	/* returns strlen(sig_str) on success */
 
-	assert_string_equal(sig_src,
+	assert_string_equal(op.sig_src,
 			    "PUT\n\n\n\n\n\n\n\n\n\n\n\n"
 			    "x-ms-blob-content-length:0\n"
 			    "x-ms-blob-type:PageBlob\n"
@@ -179,8 +189,187 @@ cm_sign_az_shared_key_put(void **state)
 			    "/invalid/test-put-get-md5/zeros");
 	assert_string_equal(sig_str,
 			    "gcM/D9Bdk55e4ko5ZbFwQTHfbhKqLXabctbF53TOmBU=");
-	free(sig_src);
+	free(op.sig_src);
+	free(op.sig_hdrs);
+	free(sig_str);
+	sign_key_free(skey);
+	op_hdrs_free(&op.req.hdrs);
+	free(op.url_path);
+	free(op.url_host);
+}
+
+/*
+ * sign the same request multiple times with the same precomputed key state,
+ * as done for all requests on a connection. The sig_src buffer is reused.
+ */
+static void
+cm_sign_az_shared_key_reuse(void **state)
+{
+	int ret;
+	int i;
+	struct op op;
+	char *sig_str = NULL;
+	struct sign_key *skey;
+	char *key[sizeof(CM_SIGN_AZ_KEY_B64)];
+	int key_len;
+
+	memset(&op, 0, sizeof(op));
+	list_head_init(&op.req.hdrs);
+	op.method = REQ_METHOD_HEAD;
+	op.url_host = strdup("invalid.blob.core.windows.net");
+	op.url_path = strdup("/test-put-get-md5/zeros");
+	ret = op_req_hdr_add(&op, "x-ms-date", "Sun, 04 Sep 2016 20:55:01 GMT");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "x-ms-version", "2015-12-11");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "Content-Length", "0");
+	assert_int_equal(ret, 0);
+
+	key_len = base64_decode(CM_SIGN_AZ_KEY_B64, key);
+	assert_true(key_len > 0);
+
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)key,
+			    key_len, &skey);
+	assert_int_equal(ret, 0);
+
+	for (i = 0; i < 3; i++) {
+		ret = sign_gen_shared_azure(CM_SIGN_AZ_ACC,
+					    skey,
+					    &op,
+					    &sig_str);
+		assert_false(ret < 0);
+		assert_string_equal(op.sig_src,
+				    "HEAD\n\n\n\n\n\n\n\n\n\n\n\n"
+				    "x-ms-date:Sun, 04 Sep 2016 20:55:01 GMT\n"
+				    "x-ms-version:2015-12-11\n"
+				    "/invalid/test-put-get-md5/zeros");
+		assert_string_equal(sig_str,
+			    "ZyZvE8Xw9sQlWahD9ItcPAl5+69gRvDiY1+SYFpM7uI=");
+		free(sig_str);
+	}
+	free(op.sig_src);
+	free(op.sig_hdrs);
+	sign_key_free(skey);
+	op_hdrs_free(&op.req.hdrs);
+	free(op.url_path);
+	free(op.url_host);
+}
+
+/*
+ * query parameters are decoded, lowercased and sorted, with multi-value
+ * parameters collapsed. Folded header values are unfolded.
+ */
+static void
+cm_sign_az_shared_key_canon(void **state)
+{
+	int ret;
+	struct op op;
+	char *sig_str = NULL;
+	struct sign_key *skey;
+	char *key[sizeof(CM_SIGN_AZ_KEY_B64)];
+	int key_len;
+
+	memset(&op, 0, sizeof(op));
+	list_head_init(&op.req.hdrs);
+	op.method = REQ_METHOD_GET;
+	op.url_host = strdup("invalid.blob.core.windows.net");
+	op.url_path = strdup("/ctnr?restype=container&Comp=list"
+			     "&include=snapshots&include=metadata"
+			     "&prefix=a%2Fb");
+	ret = op_req_hdr_add(&op, "x-ms-version", "2015-12-11");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "X-MS-Date", "Sun, 04 Sep 2016 20:55:01 GMT");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "x-ms-meta-folded", " one\r\n\ttwo");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "x-ms-meta-dup", "a");
+	assert_int_equal(ret, 0);
+	ret = op_req_hdr_add(&op, "x-ms-meta-dup", "b");
+	assert_int_equal(ret, 0);
+
+	key_len = base64_decode(CM_SIGN_AZ_KEY_B64, key);
+	assert_true(key_len > 0);
+
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)key,
+			    key_len, &skey);
+	assert_int_equal(ret, 0);
+
+	ret = sign_gen_shared_azure(CM_SIGN_AZ_ACC,
+				    skey,
+				    &op,
+				    &sig_str);
+	assert_false(ret < 0);
+
+	assert_string_equal(op.sig_src,
+			    "GET\n\n\n\n\n\n\n\n\n\n\n\n"
+			    "x-ms-date:Sun, 04 Sep 2016 20:55:01 GMT\n"
+			    "x-ms-meta-dup:a,b\n"
+			    "x-ms-meta-folded:one two\n"
+			    "x-ms-version:2015-12-11\n"
+			    "/invalid/ctnr\n"
+			    "comp:list\n"
+			    "include:metadata,snapshots\n"
+			    "prefix:a/b\n"
+			    "restype:container");
+	free(op.sig_src);
+	free(op.sig_hdrs);
+	free(sig_str);
+	sign_key_free(skey);
+	op_hdrs_free(&op.req.hdrs);
+	free(op.url_path);
+	free(op.url_host);
+}
+
+/*
+ * More vendor headers than fit in the initial sorted header array. Added in
+ * reverse order, so that every insertion shifts the sorted entries.
+ */
+#define CM_SIGN_AZ_META_HDRS 100
+static void
+cm_sign_az_many_hdrs(void **state)
+{
+	int ret;
+	struct op op;
+	char *sig_str = NULL;
+	struct sign_key *skey;
+	char key[32];
+	char *expected;
+	size_t off;
+	int i;
+
+	memset(&op, 0, sizeof(op));
+	list_head_init(&op.req.hdrs);
+	op.method = REQ_METHOD_PUT;
+	op.url_host = strdup("ddiss.blob.core.windows.net");
+	op.url_path = strdup("/ctnr/blob");
+	for (i = CM_SIGN_AZ_META_HDRS - 1; i >= 0; i--) {
+		snprintf(key, sizeof(key), "x-ms-meta-m%03d", i);
+		ret = op_req_hdr_add(&op, key, "v");
+		assert_int_equal(ret, 0);
+	}
+
+	ret = sign_key_init(SIGN_KEY_HMAC_SHA256, (const uint8_t *)AZ_KEY,
+			    (sizeof(AZ_KEY) - 1), &skey);
+	assert_int_equal(ret, 0);
+
+	ret = sign_gen_lite_azure(AZ_ACC, skey, &op, &sig_str);
+	assert_false(ret < 0);
+	assert_true(op.sig_hdrs_size >= CM_SIGN_AZ_META_HDRS);
+
+	expected = malloc(CM_SIGN_AZ_META_HDRS * 32 + 64);
+	assert_non_null(expected);
+	off = sprintf(expected, "PUT\n\n\n\n");
+	for (i = 0; i < CM_SIGN_AZ_META_HDRS; i++) {
+		off += sprintf(expected + off, "x-ms-meta-m%03d:v\n", i);
+	}
+	sprintf(expected + off, "/ddiss/ctnr/blob");
+	assert_string_equal(op.sig_src, expected);
+
+	free(expected);
+	free(op.sig_src);
+	free(op.sig_hdrs);
 	free(sig_str);
+	sign_key_free(skey);
 	op_hdrs_free(&op.req.hdrs);
 	free(op.url_path);
 	free(op.url_host);
@@ -190,6 +379,9 @@ static const UnitTest cm_sign_azure_tests[] = {
 	unit_test(cm_sign_az_list),
 	unit_test(cm_sign_az_shared_key_head),
 	unit_test(cm_sign_az_shared_key_put),
+	unit_test(cm_sign_az_shared_key_reuse),
+	unit_test(cm_sign_az_shared_key_canon),
+	unit_test(cm_sign_az_many_hdrs),
 };
 
 int
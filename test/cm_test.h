@@ -51,6 +51,9 @@ cm_data_run(void);
 int
 cm_xml_run(void);
 
+int
+cm_base64_run(void);
+
 int
 cm_az_blob_path_run(void);
 
@@ -63,12 +66,18 @@ cm_s3_path_run(void);
 int
 cm_cli_path_run(void);
 
+int
+cm_conn_run(void);
+
 int
 cm_file_run(void);
 
 int
 cm_file_local_run(void);
 
+int
+cm_file_s3_run(void);
+
 void
 cm_file_buf_fill(uint8_t *buf,
 		 size_t len,
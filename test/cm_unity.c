@@ -226,11 +226,14 @@ main(int argc,
 	cm_sign_azure_run();
 	cm_data_run();
 	cm_xml_run();
+	cm_base64_run();
 	cm_az_blob_path_run();
 	cm_az_fs_path_run();
 	cm_s3_path_run();
 	cm_cli_path_run();
+	cm_conn_run();
 	cm_file_local_run();
+	cm_file_s3_run();
 	if ((cm_ustate->ps_file == NULL)
 					&& (cm_ustate->az_access_key == NULL)) {
 		printf("skipping Azure cloud IO tests, no credentials "
@@ -34,6 +34,7 @@
 #include "dbg.h"
 #include "util.h"
 #include "exml.h"
+#include "base64.h"
 
 static char cm_xml_data_str_basic[]
 	= "<outer><inner1><str>val</str></inner1><str>blah</str></outer>";
@@ -95,6 +96,11 @@ static char cm_xml_data_attr_key_val_match[]
 		"<foo key=\"okey\"\n"
 		     "okey=\"dokey\" />"
 	"</root>";
+static char cm_xml_data_str_entity[]
+	= "<outer><inner1><str>a &amp; b</str></inner1></outer>";
+static char cm_xml_data_str_sparse[]
+	= "<out><in><str>val0</str></in><in><opt>opt1</opt></in>"
+	  "<in><str>val2</str><opt>opt2</opt></in></out>";
 static char cm_xml_data_date_time_basic[]
 	= "<outer><Label1>Wed, 12 Aug 2009 20:39:39 GMT</Label1>"
 	  "<Label2>Mon, 27 Jan 2014 22:48:29 GMT</Label2></outer>";
@@ -1105,6 +1111,458 @@ cm_xml_date_time_basic(void **state)
 	assert_string_equal(val_str, "Mon, 27 Jan 2014 22:48:29 GMT");
 }
 
+struct cm_xml_scope_cb_data {
+	int cb_i;
+	char *str[3];
+	char *opt[3];
+};
+
+static int
+cm_xml_scope_cb(struct xml_doc *xdoc,
+		const char *path,
+		const char *val,
+		void *cb_data)
+{
+	int ret;
+	struct cm_xml_scope_cb_data *d = cb_data;
+
+	assert_true(d->cb_i < 3);
+	ret = exml_str_want(xdoc, "./str", false, &d->str[d->cb_i], NULL);
+	assert_int_equal(ret, 0);
+	ret = exml_str_want(xdoc, "./opt", false, &d->opt[d->cb_i], NULL);
+	assert_int_equal(ret, 0);
+	d->cb_i++;
+
+	return exml_path_cb_want(xdoc, "/out/in", false, cm_xml_scope_cb,
+				 cb_data, NULL);
+}
+
+/* relative finders must only match within the element in scope */
+static void
+cm_xml_xpath_relative_scope(void **state)
+{
+	int ret;
+	int i;
+	struct xml_doc *xdoc;
+	struct cm_xml_scope_cb_data cb_data;
+
+	memset(&cb_data, 0, sizeof(cb_data));
+	ret = exml_slurp(cm_xml_data_str_sparse,
+			strlen(cm_xml_data_str_sparse), &xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_path_cb_want(xdoc, "/out/in", false, cm_xml_scope_cb,
+				&cb_data, NULL);
+	assert_int_equal(ret, 0);
+
+	ret = exml_parse(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+
+	assert_int_equal(cb_data.cb_i, 3);
+	assert_string_equal(cb_data.str[0], "val0");
+	assert_null(cb_data.opt[0]);
+	assert_null(cb_data.str[1]);
+	assert_string_equal(cb_data.opt[1], "opt1");
+	assert_string_equal(cb_data.str[2], "val2");
+	assert_string_equal(cb_data.opt[2], "opt2");
+	for (i = 0; i < 3; i++) {
+		free(cb_data.str[i]);
+		free(cb_data.opt[i]);
+	}
+}
+
+static int
+cm_xml_sibling_cb(struct xml_doc *xdoc,
+		  const char *path,
+		  const char *val,
+		  void *cb_data)
+{
+	int *cb_i = cb_data;
+	char expected[64];
+
+	snprintf(expected, sizeof(expected), "/out[0]/in[%d]/", *cb_i);
+	assert_string_equal(path, expected);
+	(*cb_i)++;
+
+	return exml_path_cb_want(xdoc, "/out/in", false, cm_xml_sibling_cb,
+				 cb_data, NULL);
+}
+
+/* many siblings and deep nesting, leaf indices must remain consistent */
+static void
+cm_xml_many_siblings(void **state)
+{
+	int ret;
+	int i;
+	int cb_i = 0;
+	struct xml_doc *xdoc;
+	char *buf;
+	char *val = NULL;
+	size_t off = 0;
+	const int num_siblings = 2000;
+	const int depth = 100;
+
+	buf = malloc(num_siblings * 32 + depth * 16 + 64);
+	assert_non_null(buf);
+
+	off += sprintf(buf + off, "<out>");
+	for (i = 0; i < num_siblings; i++) {
+		off += sprintf(buf + off, "<in><str>%d</str></in>", i);
+	}
+	for (i = 0; i < depth; i++) {
+		off += sprintf(buf + off, "<d>");
+	}
+	off += sprintf(buf + off, "deep");
+	for (i = 0; i < depth; i++) {
+		off += sprintf(buf + off, "</d>");
+	}
+	off += sprintf(buf + off, "</out>");
+
+	ret = exml_slurp(buf, off, &xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_path_cb_want(xdoc, "/out/in", false, cm_xml_sibling_cb,
+				&cb_i, NULL);
+	assert_int_equal(ret, 0);
+
+	ret = exml_str_want(xdoc, "/out/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d"
+				  "/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d"
+				  "/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d"
+				  "/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d"
+				  "/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d/d",
+			    true, &val, NULL);
+	assert_int_equal(ret, 0);
+
+	ret = exml_parse(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+
+	assert_int_equal(cb_i, num_siblings);
+	assert_string_equal(val, "deep");
+	free(val);
+	free(buf);
+}
+
+/* feed data in via exml_parse_chunk(), one byte at a time */
+static void
+cm_xml_parse_chunked(void **state)
+{
+	int ret;
+	int i;
+	struct xml_doc *xdoc;
+	char *val = NULL;
+	bool called = false;
+	struct cm_xml_path_multi_cb_data cb_data;
+
+	memset(&cb_data, 0, sizeof(cb_data));
+	ret = exml_stream_new(&xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_path_cb_want(xdoc,
+			   "/out/in",
+			   false,
+			   cm_xml_path_multi_cb,
+			   &cb_data,
+			   &called);
+	assert_int_equal(ret, 0);
+
+	for (i = 0; i < strlen(cm_xml_data_str_multi); i++) {
+		ret = exml_parse_chunk(xdoc, &cm_xml_data_str_multi[i], 1);
+		assert_int_equal(ret, 0);
+		if (i == strlen("<out><in><str>val0</str></in>")) {
+			/* finders fire before the document is complete */
+			assert_int_equal(cb_data.cb_i, 1);
+			assert_string_equal(cb_data.val0, "val0");
+		}
+	}
+	ret = exml_parse_finish(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+
+	assert_true(called);
+	assert_int_equal(cb_data.cb_i, 3);
+	assert_string_equal(cb_data.val0, "val0");
+	assert_string_equal(cb_data.val1, "val1");
+	assert_string_equal(cb_data.val2, "val2");
+
+	free(cb_data.val0);
+	free(cb_data.val1);
+	free(cb_data.val2);
+
+	/* values split by expat at entity references */
+	ret = exml_stream_new(&xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_str_want(xdoc,
+			   "/outer/inner1/str",
+			   true,
+			   &val,
+			   NULL);
+	assert_int_equal(ret, 0);
+
+	for (i = 0; i < strlen(cm_xml_data_str_entity); i++) {
+		ret = exml_parse_chunk(xdoc, &cm_xml_data_str_entity[i], 1);
+		assert_int_equal(ret, 0);
+	}
+	ret = exml_parse_finish(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+
+	assert_string_equal(val, "a & b");
+	free(val);
+
+	/* truncated document */
+	ret = exml_stream_new(&xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_parse_chunk(xdoc, cm_xml_data_str_basic, 10);
+	assert_int_equal(ret, 0);
+	ret = exml_parse_finish(xdoc);
+	assert_int_not_equal(ret, 0);
+	exml_free(xdoc);
+}
+
+struct cm_xml_end_cb_data {
+	int cb_i;
+	int end_i;
+	bool str_required;
+	char *str;
+	char *opt;
+	char *last_opt;
+};
+
+static int
+cm_xml_end_cb(struct xml_doc *xdoc,
+	      const char *path,
+	      const char *val,
+	      void *cb_data)
+{
+	struct cm_xml_end_cb_data *d = cb_data;
+	char expected[64];
+
+	snprintf(expected, sizeof(expected), "/out[0]/in[%d]/", d->end_i);
+	assert_string_equal(path, expected);
+	assert_null(val);
+	assert_int_equal(d->end_i + 1, d->cb_i);
+
+	/* values are complete, and owned by the end callback */
+	if (d->end_i == 1) {
+		assert_null(d->str);
+	} else {
+		assert_non_null(d->str);
+	}
+	free(d->str);
+	d->str = NULL;
+	free(d->last_opt);
+	d->last_opt = d->opt;
+	d->opt = NULL;
+	d->end_i++;
+
+	return 0;
+}
+
+static int
+cm_xml_end_path_cb(struct xml_doc *xdoc,
+		   const char *path,
+		   const char *val,
+		   void *cb_data)
+{
+	int ret;
+	struct cm_xml_end_cb_data *d = cb_data;
+
+	ret = exml_str_want(xdoc, "./str", d->str_required, &d->str, NULL);
+	assert_int_equal(ret, 0);
+	ret = exml_str_want(xdoc, "./opt", false, &d->opt, NULL);
+	assert_int_equal(ret, 0);
+	ret = exml_scope_end_cb_want(xdoc, cm_xml_end_cb, cb_data);
+	assert_int_equal(ret, 0);
+	d->cb_i++;
+
+	return exml_path_cb_want(xdoc, "/out/in", false, cm_xml_end_path_cb,
+				 cb_data, NULL);
+}
+
+/* entries consumed by an end callback as each element closes */
+static void
+cm_xml_scope_end_cb(void **state)
+{
+	int ret;
+	int i;
+	struct xml_doc *xdoc;
+	struct cm_xml_end_cb_data cb_data;
+
+	memset(&cb_data, 0, sizeof(cb_data));
+	ret = exml_stream_new(&xdoc);
+	assert_int_equal(ret, 0);
+
+	/* outside of a path callback */
+	ret = exml_scope_end_cb_want(xdoc, cm_xml_end_cb, &cb_data);
+	assert_int_equal(ret, -EINVAL);
+
+	ret = exml_path_cb_want(xdoc, "/out/in", false, cm_xml_end_path_cb,
+				&cb_data, NULL);
+	assert_int_equal(ret, 0);
+
+	for (i = 0; i < strlen(cm_xml_data_str_sparse); i++) {
+		ret = exml_parse_chunk(xdoc, &cm_xml_data_str_sparse[i], 1);
+		assert_int_equal(ret, 0);
+	}
+	ret = exml_parse_finish(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+
+	assert_int_equal(cb_data.cb_i, 3);
+	assert_int_equal(cb_data.end_i, 3);
+	assert_string_equal(cb_data.last_opt, "opt2");
+	free(cb_data.last_opt);
+
+	/* required relative value absent from the second entry */
+	memset(&cb_data, 0, sizeof(cb_data));
+	cb_data.str_required = true;
+	ret = exml_slurp(cm_xml_data_str_sparse,
+			strlen(cm_xml_data_str_sparse), &xdoc);
+	assert_int_equal(ret, 0);
+
+	ret = exml_path_cb_want(xdoc, "/out/in", false, cm_xml_end_path_cb,
+				&cb_data, NULL);
+	assert_int_equal(ret, 0);
+
+	ret = exml_parse(xdoc);
+	assert_int_equal(ret, -ENOENT);
+	exml_free(xdoc);
+
+	/* first entry consumed before failure, second not */
+	assert_int_equal(cb_data.cb_i, 2);
+	assert_int_equal(cb_data.end_i, 1);
+	assert_null(cb_data.str);
+	free(cb_data.opt);
+	free(cb_data.last_opt);
+}
+
+static int
+cm_xml_writer_doc(struct xml_writer *xw,
+		  const char *id)
+{
+	int ret;
+	int i;
+
+	ret = exml_decl_write(xw);
+	assert_int_equal(ret, 0);
+	ret = exml_el_open(xw, "BlockList");
+	assert_int_equal(ret, 0);
+	for (i = 0; i < 100; i++) {
+		ret = exml_base64_write(xw, "Latest", id, strlen(id));
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	ret = exml_el_open(xw, "Part");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_uint64_write(xw, "PartNumber", 10000);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_str_write(xw, "ETag", "\"a&b<c>\"");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_el_close(xw, "Part");
+	if (ret < 0) {
+		return ret;
+	}
+	ret = exml_el_close(xw, "BlockList");
+	if (ret < 0) {
+		return ret;
+	}
+	return 0;
+}
+
+/* serialize via length only and pre-sized buffer sinks */
+static void
+cm_xml_writer_basic(void **state)
+{
+	int ret;
+	struct xml_writer *xw;
+	uint64_t len;
+	char *buf;
+	char *b64_id;
+	char *expected;
+	char *p;
+	int i;
+	const char *id = "block id with 48 chars, so encodes to 64 chars..";
+	struct xml_doc *xdoc;
+	char *val = NULL;
+
+	ret = exml_writer_buf_new(NULL, 0, &xw);
+	assert_int_equal(ret, 0);
+	ret = cm_xml_writer_doc(xw, id);
+	assert_int_equal(ret, 0);
+	ret = exml_writer_finish(xw, &len);
+	assert_int_equal(ret, 0);
+	exml_writer_free(xw);
+
+	buf = malloc(len + 1);
+	assert_non_null(buf);
+	ret = exml_writer_buf_new((uint8_t *)buf, len, &xw);
+	assert_int_equal(ret, 0);
+	ret = cm_xml_writer_doc(xw, id);
+	assert_int_equal(ret, 0);
+	ret = exml_writer_finish(xw, NULL);
+	assert_int_equal(ret, 0);
+	exml_writer_free(xw);
+	buf[len] = '\0';
+
+	ret = base64_encode(id, strlen(id), &b64_id);
+	assert_true(ret > 0);
+	expected = malloc(len + 1);
+	assert_non_null(expected);
+	p = expected;
+	p += sprintf(p, "<?xml version=\"1.0\" encoding=\"utf-8\"?><BlockList>");
+	for (i = 0; i < 100; i++) {
+		p += sprintf(p, "<Latest>%s</Latest>", b64_id);
+	}
+	p += sprintf(p, "<Part><PartNumber>10000</PartNumber>"
+			"<ETag>\"a&amp;b&lt;c&gt;\"</ETag></Part></BlockList>");
+	assert_int_equal(p - expected, len);
+	assert_string_equal(buf, expected);
+
+	/* values are unescaped by the parser */
+	ret = exml_slurp(buf, len, &xdoc);
+	assert_int_equal(ret, 0);
+	ret = exml_str_want(xdoc, "/BlockList/Part/ETag", true, &val, NULL);
+	assert_int_equal(ret, 0);
+	ret = exml_parse(xdoc);
+	assert_int_equal(ret, 0);
+	exml_free(xdoc);
+	assert_string_equal(val, "\"a&b<c>\"");
+	free(val);
+
+	/* undersized buffer */
+	ret = exml_writer_buf_new((uint8_t *)buf, len - 1, &xw);
+	assert_int_equal(ret, 0);
+	ret = cm_xml_writer_doc(xw, id);
+	assert_int_equal(ret, -E2BIG);
+	ret = exml_writer_finish(xw, NULL);
+	assert_int_equal(ret, -E2BIG);
+	exml_writer_free(xw);
+
+	/* unbalanced */
+	ret = exml_writer_buf_new(NULL, 0, &xw);
+	assert_int_equal(ret, 0);
+	ret = exml_el_open(xw, "a");
+	assert_int_equal(ret, 0);
+	ret = exml_writer_finish(xw, NULL);
+	assert_int_equal(ret, -EINVAL);
+	exml_writer_free(xw);
+
+	free(expected);
+	free(b64_id);
+	free(buf);
+}
+
 static const UnitTest cm_xml_tests[] = {
 	unit_test(cm_xml_str_basic),
 	unit_test(cm_xml_str_dup),
@@ -1126,6 +1584,11 @@ static const UnitTest cm_xml_tests[] = {
 	unit_test(cm_xml_parse_multi),
 	unit_test(cm_xml_attr_find_partial),
 	unit_test(cm_xml_date_time_basic),
+	unit_test(cm_xml_parse_chunked),
+	unit_test(cm_xml_xpath_relative_scope),
+	unit_test(cm_xml_many_siblings),
+	unit_test(cm_xml_scope_end_cb),
+	unit_test(cm_xml_writer_basic),
 };
 
 int